@@ -0,0 +1,974 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Measures the host side of nvdec: the element runs on the stand-in
+// backend of gstnvdecfake.c, which does no decoding, so what's left
+// is parsing, the decode queue, frame bookkeeping and downloads.
+// Streams are generated with the shape of a broadcast IBBP stream,
+// headers at every key frame and frame sizes of a typical bitrate.
+// Seek latency is the time from a flushing seek to a key frame until
+// that frame comes out of the decoder. Seeks are made with the stream
+// still flowing, and in PAUSED with the sink holding the previous
+// target frame like when scrubbing.
+// allocs/frame counts every malloc, calloc and realloc made in the
+// process while the streams run, GStreamer's and the sinks' included.
+// ctxlocks/frame counts cuvidCtxLock calls, not the element's own locks
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <gst/app/gstapp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gstnvdecfake.h"
+
+#define DEFAULT_FRAMES 300
+#define DEFAULT_INSTANCES "1,2,4,8"
+#define DEFAULT_SIZES "1280x720,1920x1080,3840x2160,7680x4320"
+#define DEFAULT_CODECS "h264,h265"
+#define DEFAULT_MODES "pipelined,sync,multi"
+#define DEFAULT_SEEKS 20
+// How long a seek may take before the run counts as failed
+#define SEEK_TIMEOUT (10 * G_TIME_SPAN_SECOND)
+// Key frame interval in frames, a multiple of the anchor distance
+#define GOP_LENGTH 60
+// Pictures between an anchor and the next, IBBP has two B frames
+#define ANCHOR_DISTANCE 3
+#define FRAME_DURATION (GST_SECOND / 30)
+
+GST_PLUGIN_STATIC_DECLARE (nvidia);
+
+// glibc lets the binary replace malloc and still reach its own, the
+// definitions here interpose on every library in the process
+#ifdef __GLIBC__
+#define HAVE_ALLOC_COUNT 1
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gint alloc_count;
+
+void *
+malloc (size_t size)
+{
+  g_atomic_int_inc (&alloc_count);
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  g_atomic_int_inc (&alloc_count);
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  g_atomic_int_inc (&alloc_count);
+  return __libc_realloc (ptr, size);
+}
+#endif
+
+static guint
+get_alloc_count (void)
+{
+#ifdef HAVE_ALLOC_COUNT
+  return (guint) g_atomic_int_get (&alloc_count);
+#else
+  return 0;
+#endif
+}
+
+typedef enum
+{
+  CODEC_H264,
+  CODEC_H265
+} Codec;
+
+// Separate pipelined or synchronous nvdecs, or all the
+// streams through one nvmultidec
+typedef enum
+{
+  MODE_PIPELINED,
+  MODE_SYNC,
+  MODE_MULTI
+} Mode;
+
+typedef enum
+{
+  FRAME_I,
+  FRAME_P,
+  FRAME_B
+} FrameType;
+
+typedef struct
+{
+  GByteArray *bytes;
+  guint value;
+  guint num_bits;
+} BitWriter;
+
+typedef struct
+{
+  GstElement *pipeline;
+  GstElement *src;
+  GstElement *dec;
+  GThread *feeder;
+  GPtrArray *stream;
+  guint64 displayed;
+  gboolean failed;
+} Instance;
+
+typedef struct
+{
+  guint64 frames;
+  gdouble seconds;
+  guint64 cpu_ns;
+  guint64 allocations;
+  guint64 locks;
+  gboolean failed;
+} Result;
+
+// Feeds the stream from where the last seek went. Everything
+// below is under lock, the probe on the decoder's output only
+// counts the target frame once the seek's flush has gone by
+typedef struct
+{
+  GMutex lock;
+  GCond cond;
+  GPtrArray *stream;
+  guint next;
+  GstClockTime target;
+  gboolean flushed;
+  gint64 reached_time;
+} Seeker;
+
+typedef struct
+{
+  guint seeks;
+  gdouble mean_ms;
+  gdouble max_ms;
+  gboolean failed;
+} SeekResult;
+
+static gint num_frames = DEFAULT_FRAMES;
+static gchar *instances_arg;
+static gchar *sizes_arg;
+static gchar *codecs_arg;
+static gchar *modes_arg;
+static gboolean no_copy;
+static gint num_seeks = DEFAULT_SEEKS;
+
+static GOptionEntry entries[] = {
+  {"frames", 'f', 0, G_OPTION_ARG_INT, &num_frames,
+      "Frames per stream", "N"},
+  {"instances", 'n', 0, G_OPTION_ARG_STRING, &instances_arg,
+      "Concurrent decoders to run (default " DEFAULT_INSTANCES ")", "N,..."},
+  {"sizes", 's', 0, G_OPTION_ARG_STRING, &sizes_arg,
+      "Resolutions (default " DEFAULT_SIZES ")", "WxH,..."},
+  {"codecs", 'c', 0, G_OPTION_ARG_STRING, &codecs_arg,
+      "Codecs (default " DEFAULT_CODECS ")", "h264|h265,..."},
+  {"modes", 'm', 0, G_OPTION_ARG_STRING, &modes_arg,
+      "Element modes (default " DEFAULT_MODES ")",
+      "pipelined|sync|multi,..."},
+  {"no-copy", 0, 0, G_OPTION_ARG_NONE, &no_copy,
+      "Leave out the cost of copying frames", NULL},
+  {"seeks", 0, 0, G_OPTION_ARG_INT, &num_seeks,
+      "Flushing seeks per configuration, 0 for none (default 20)", "N"},
+  {NULL}
+};
+
+static guint64
+get_cpu_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (guint64) ts.tv_sec * GST_SECOND + ts.tv_nsec;
+}
+
+static void
+put_bits (BitWriter * writer, guint value, guint n)
+{
+  while (n--) {
+    writer->value = (writer->value << 1) | ((value >> n) & 1);
+    if (++writer->num_bits == 8) {
+      guint8 byte = writer->value;
+
+      g_byte_array_append (writer->bytes, &byte, 1);
+      writer->value = 0;
+      writer->num_bits = 0;
+    }
+  }
+}
+
+static void
+put_ue (BitWriter * writer, guint value)
+{
+  guint len = g_bit_storage (value + 1);
+
+  put_bits (writer, 0, len - 1);
+  put_bits (writer, value + 1, len);
+}
+
+static void
+put_trailing_bits (BitWriter * writer)
+{
+  put_bits (writer, 1, 1);
+  if (writer->num_bits)
+    put_bits (writer, 0, 8 - writer->num_bits);
+}
+
+// Adds the start code and the emulation prevention bytes
+static void
+append_nal (GByteArray * au, BitWriter * writer)
+{
+  static const guint8 start_code[] = { 0, 0, 0, 1 };
+  static const guint8 escape = 3;
+  guint i, zeros = 0;
+
+  put_trailing_bits (writer);
+  g_byte_array_append (au, start_code, sizeof (start_code));
+  for (i = 0; i < writer->bytes->len; i++) {
+    if (zeros >= 2 && writer->bytes->data[i] <= 3) {
+      g_byte_array_append (au, &escape, 1);
+      zeros = 0;
+    }
+    zeros = writer->bytes->data[i] ? 0 : zeros + 1;
+    g_byte_array_append (au, &writer->bytes->data[i], 1);
+  }
+  g_byte_array_set_size (writer->bytes, 0);
+}
+
+static void
+append_h264_sps (GByteArray * au, BitWriter * w, guint width, guint height)
+{
+  guint padded_height = GST_ROUND_UP_16 (height);
+
+  put_bits (w, 0x67, 8);
+  // High profile, level 4.1, 5.1 or 6.1 depending on the size
+  put_bits (w, 100, 8);
+  put_bits (w, 0, 8);
+  put_bits (w, width * height > 4096 * 2304 ? 61
+      : width * height > 1920 * 1088 ? 51 : 41, 8);
+  put_ue (w, 0);
+  put_ue (w, 1);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_bits (w, 0, 2);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_ue (w, 2);
+  put_ue (w, 2);
+  put_bits (w, 0, 1);
+  put_ue (w, GST_ROUND_UP_16 (width) / 16 - 1);
+  put_ue (w, padded_height / 16 - 1);
+  put_bits (w, 1, 1);
+  put_bits (w, 1, 1);
+  put_bits (w, padded_height != height, 1);
+  if (padded_height != height) {
+    put_ue (w, 0);
+    put_ue (w, 0);
+    put_ue (w, 0);
+    put_ue (w, (padded_height - height) / 2);
+  }
+  put_bits (w, 0, 1);
+  append_nal (au, w);
+}
+
+// Only as much of the SPS as the fake parser reads
+static void
+append_h265_sps (GByteArray * au, BitWriter * w, guint width, guint height)
+{
+  guint padded_height = GST_ROUND_UP_8 (height);
+
+  put_bits (w, 33 << 1, 8);
+  put_bits (w, 1, 8);
+  put_bits (w, 0, 4);
+  put_bits (w, 0, 3);
+  put_bits (w, 1, 1);
+  // Main profile, progressive frames, level 4.1, 5.1 or 6.1
+  put_bits (w, 1, 8);
+  put_bits (w, 0x60000000, 32);
+  put_bits (w, 0x9, 4);
+  put_bits (w, 0, 32);
+  put_bits (w, 0, 12);
+  put_bits (w, width * height > 4096 * 2304 ? 183
+      : width * height > 1920 * 1088 ? 153 : 123, 8);
+  put_ue (w, 0);
+  put_ue (w, 1);
+  put_ue (w, GST_ROUND_UP_8 (width));
+  put_ue (w, padded_height);
+  put_bits (w, padded_height != height, 1);
+  if (padded_height != height) {
+    put_ue (w, 0);
+    put_ue (w, 0);
+    put_ue (w, 0);
+    put_ue (w, (padded_height - height) / 2);
+  }
+  put_ue (w, 0);
+  put_ue (w, 0);
+  append_nal (au, w);
+}
+
+// Slice header and then filler standing in for the coded picture,
+// 0x55 never makes a start code
+static void
+append_slice (GByteArray * au, BitWriter * w, Codec codec, FrameType type,
+    gboolean idr, gsize size)
+{
+  static const guint h264_slice_types[] = { 7, 5, 6 };
+  guint nal_type;
+  gsize start;
+
+  if (codec == CODEC_H264) {
+    put_bits (w, (type == FRAME_B ? 0 : 0x60) | (idr ? 5 : 1), 8);
+    put_ue (w, 0);
+    put_ue (w, h264_slice_types[type]);
+    put_ue (w, 0);
+  } else {
+    // IDR_W_RADL, CRA, TRAIL_R or TRAIL_N
+    nal_type = idr ? 19 : type == FRAME_I ? 21 : type == FRAME_P ? 1 : 0;
+    put_bits (w, nal_type << 1, 8);
+    put_bits (w, 1, 8);
+    put_bits (w, 1, 1);
+    if (type == FRAME_I)
+      put_bits (w, 0, 1);
+    put_ue (w, 0);
+  }
+  append_nal (au, w);
+
+  start = au->len;
+  g_byte_array_set_size (au, start + size);
+  memset (au->data + start, 0x55, size);
+}
+
+static FrameType
+get_frame_type (guint index, guint count)
+{
+  if (index % GOP_LENGTH == 0)
+    return FRAME_I;
+  // The last frame can't be a B frame, there's nothing after it
+  if (index % ANCHOR_DISTANCE == 0 || index == count - 1)
+    return FRAME_P;
+  return FRAME_B;
+}
+
+static GstBuffer *
+make_access_unit (Codec codec, guint width, guint height, guint index,
+    FrameType type, BitWriter * writer)
+{
+  GByteArray *au = g_byte_array_new ();
+  GstBuffer *buffer;
+  gsize pixels = (gsize) width * height, size;
+
+  if (type == FRAME_I) {
+    if (codec == CODEC_H264)
+      append_h264_sps (au, writer, width, height);
+    else
+      append_h265_sps (au, writer, width, height);
+  }
+
+  // Roughly 6 Mbit/s for 1080p30
+  size = type == FRAME_I ? pixels / 16 : type == FRAME_P ? pixels / 48
+      : pixels / 128;
+  append_slice (au, writer, codec, type, index == 0, size);
+
+  buffer = gst_buffer_new_wrapped (au->data, au->len);
+  g_byte_array_free (au, FALSE);
+  GST_BUFFER_PTS (buffer) = index * FRAME_DURATION;
+  GST_BUFFER_DURATION (buffer) = FRAME_DURATION;
+  if (type != FRAME_I)
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  return buffer;
+}
+
+// Access units in decode order, the B frames come
+// after the anchor that follows them in display order
+static GPtrArray *
+make_stream (Codec codec, guint width, guint height, guint count)
+{
+  GPtrArray *stream = g_ptr_array_new_with_free_func (
+      (GDestroyNotify) gst_buffer_unref);
+  BitWriter writer = { g_byte_array_new (), 0, 0 };
+  guint i, first_b = 1, j;
+  FrameType type;
+
+  for (i = 0; i < count; i++) {
+    type = get_frame_type (i, count);
+    if (type == FRAME_B)
+      continue;
+
+    g_ptr_array_add (stream, make_access_unit (codec, width, height, i,
+            type, &writer));
+    for (j = first_b; j < i; j++)
+      g_ptr_array_add (stream, make_access_unit (codec, width, height, j,
+              FRAME_B, &writer));
+    first_b = i + 1;
+  }
+
+  g_byte_array_free (writer.bytes, TRUE);
+  return stream;
+}
+
+static gpointer
+feed (Instance * instance)
+{
+  guint i;
+
+  for (i = 0; i < instance->stream->len; i++) {
+    if (gst_app_src_push_buffer (GST_APP_SRC (instance->src),
+            gst_buffer_ref (g_ptr_array_index (instance->stream, i)))
+        != GST_FLOW_OK)
+      break;
+  }
+  gst_app_src_end_of_stream (GST_APP_SRC (instance->src));
+
+  return NULL;
+}
+
+static GstElement *
+make_pipeline (Mode mode, guint num_streams)
+{
+  GString *description = g_string_new (NULL);
+  GstElement *pipeline;
+  GError *error = NULL;
+  guint i;
+
+  if (mode == MODE_MULTI) {
+    g_string_append (description, "nvmultidec name=multi");
+    for (i = 0; i < num_streams; i++)
+      g_string_append_printf (description, " appsrc name=src_%u format=time "
+          "block=true max-bytes=16000000 ! multi.sink_%u multi.src_%u ! "
+          "video/x-raw,format=NV12 ! fakesink sync=false", i, i, i);
+  } else {
+    g_string_append (description, "appsrc name=src_0 format=time "
+        "block=true max-bytes=16000000 ! nvdec name=nvdec_0 ! "
+        "video/x-raw,format=NV12 ! fakesink sync=false");
+  }
+
+  pipeline = gst_parse_launch (description->str, &error);
+  if (!pipeline) {
+    g_printerr ("failed to create pipeline: %s\n", error->message);
+    g_clear_error (&error);
+  }
+  g_string_free (description, TRUE);
+
+  return pipeline;
+}
+
+// With nvmultidec every instance is a stream of the same pipeline
+static gboolean
+setup_instance (Instance * instance, Codec codec, guint width,
+    guint height, Mode mode, GstElement * pipeline, guint index,
+    GPtrArray * stream)
+{
+  GstCaps *caps;
+  gchar *name;
+
+  instance->pipeline = pipeline;
+
+  name = g_strdup_printf ("src_%u", index);
+  instance->src = gst_bin_get_by_name (GST_BIN (pipeline), name);
+  g_free (name);
+  name = g_strdup_printf ("nvdec_%u", index);
+  instance->dec = gst_bin_get_by_name (GST_BIN (pipeline), name);
+  g_free (name);
+  instance->stream = stream;
+
+  caps = gst_caps_new_simple (codec == CODEC_H264 ? "video/x-h264"
+      : "video/x-h265", "stream-format", G_TYPE_STRING, "byte-stream",
+      "alignment", G_TYPE_STRING, "au", "width", G_TYPE_INT, width,
+      "height", G_TYPE_INT, height, "framerate", GST_TYPE_FRACTION, 30, 1,
+      NULL);
+  gst_app_src_set_caps (GST_APP_SRC (instance->src), caps);
+  gst_caps_unref (caps);
+  if (mode != MODE_MULTI)
+    g_object_set (instance->dec, "pipelined", mode == MODE_PIPELINED, NULL);
+
+  return TRUE;
+}
+
+// EOS is posted once every stream of the pipeline is done
+static gboolean
+wait_pipeline (GstElement * pipeline)
+{
+  GstBus *bus = gst_element_get_bus (pipeline);
+  GstMessage *message;
+  gboolean ret = TRUE;
+
+  message = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR) {
+    GError *error = NULL;
+
+    gst_message_parse_error (message, &error, NULL);
+    g_printerr ("decoding failed: %s\n", error->message);
+    g_clear_error (&error);
+    ret = FALSE;
+    // Unblocks the feeders
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+  }
+  gst_message_unref (message);
+  gst_object_unref (bus);
+
+  return ret;
+}
+
+static void
+finish_instance (Instance * instance, Result * result)
+{
+  GstStructure *stats = NULL;
+
+  g_thread_join (instance->feeder);
+
+  g_object_get (instance->dec, "stats", &stats, NULL);
+  if (stats) {
+    gst_structure_get_uint64 (stats, "displayed", &instance->displayed);
+    gst_structure_free (stats);
+  }
+  result->frames += instance->displayed;
+}
+
+static void
+free_instance (Instance * instance)
+{
+  if (!instance->pipeline)
+    return;
+
+  if (instance->src)
+    gst_object_unref (instance->src);
+  if (instance->dec)
+    gst_object_unref (instance->dec);
+}
+
+static void
+run (Codec codec, guint width, guint height, guint num_instances,
+    Mode mode, GPtrArray * stream, Result * result)
+{
+  Instance *instances = g_new0 (Instance, num_instances);
+  guint num_pipelines = mode == MODE_MULTI ? 1 : num_instances;
+  GstElement **pipelines = g_new0 (GstElement *, num_pipelines);
+  guint64 start_time, start_cpu;
+  guint start_locks, start_allocs, i;
+
+  memset (result, 0, sizeof (Result));
+
+  for (i = 0; i < num_pipelines; i++) {
+    pipelines[i] = make_pipeline (mode, num_instances);
+    if (!pipelines[i]) {
+      result->failed = TRUE;
+      goto done;
+    }
+  }
+
+  // Decoders are created when the first frame comes, so
+  // creating them is part of the time but not the pipelines
+  for (i = 0; i < num_instances; i++) {
+    if (!setup_instance (&instances[i], codec, width, height, mode,
+            pipelines[mode == MODE_MULTI ? 0 : i],
+            mode == MODE_MULTI ? i : 0, stream)) {
+      result->failed = TRUE;
+      goto done;
+    }
+  }
+
+  for (i = 0; i < num_pipelines; i++) {
+    if (gst_element_set_state (pipelines[i], GST_STATE_PLAYING)
+        == GST_STATE_CHANGE_FAILURE) {
+      result->failed = TRUE;
+      goto done;
+    }
+  }
+
+  start_locks = gst_nvdec_fake_get_lock_count ();
+  start_allocs = get_alloc_count ();
+  start_cpu = get_cpu_time ();
+  start_time = g_get_monotonic_time ();
+
+  for (i = 0; i < num_instances; i++)
+    instances[i].feeder = g_thread_new ("feeder", (GThreadFunc) feed,
+        &instances[i]);
+  for (i = 0; i < num_pipelines; i++) {
+    if (!wait_pipeline (pipelines[i]))
+      result->failed = TRUE;
+  }
+  for (i = 0; i < num_instances; i++)
+    finish_instance (&instances[i], result);
+
+  result->seconds = (g_get_monotonic_time () - start_time) / 1e6;
+  result->cpu_ns = get_cpu_time () - start_cpu;
+  result->locks = gst_nvdec_fake_get_lock_count () - start_locks;
+  result->allocations = get_alloc_count () - start_allocs;
+
+done:
+  for (i = 0; i < num_pipelines; i++) {
+    if (pipelines[i])
+      gst_element_set_state (pipelines[i], GST_STATE_NULL);
+  }
+  for (i = 0; i < num_instances; i++)
+    free_instance (&instances[i]);
+  for (i = 0; i < num_pipelines; i++) {
+    if (pipelines[i])
+      gst_object_unref (pipelines[i]);
+  }
+  g_free (pipelines);
+  g_free (instances);
+}
+
+static void
+seek_need_data (GstAppSrc * src, guint length, gpointer user_data)
+{
+  Seeker *seeker = user_data;
+  GstBuffer *buffer = NULL;
+
+  g_mutex_lock (&seeker->lock);
+  if (seeker->next < seeker->stream->len)
+    buffer = gst_buffer_ref (g_ptr_array_index (seeker->stream,
+            seeker->next++));
+  g_mutex_unlock (&seeker->lock);
+
+  if (buffer)
+    gst_app_src_push_buffer (src, buffer);
+  else
+    gst_app_src_end_of_stream (src);
+}
+
+// Seeks only go to key frames, so feeding starts there
+static gboolean
+seek_data (GstAppSrc * src, guint64 offset, gpointer user_data)
+{
+  Seeker *seeker = user_data;
+  GstBuffer *buffer;
+  guint i;
+
+  g_mutex_lock (&seeker->lock);
+  for (i = 0; i < seeker->stream->len; i++) {
+    buffer = g_ptr_array_index (seeker->stream, i);
+    if (GST_BUFFER_PTS (buffer) == offset
+        && !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+      break;
+  }
+  seeker->next = i;
+  g_mutex_unlock (&seeker->lock);
+
+  return i < seeker->stream->len;
+}
+
+static GstPadProbeReturn
+seek_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  Seeker *seeker = user_data;
+  GstEvent *event;
+  GstBuffer *buffer;
+
+  g_mutex_lock (&seeker->lock);
+  if (info->type & GST_PAD_PROBE_TYPE_BUFFER) {
+    buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+    if (seeker->flushed && !seeker->reached_time
+        && GST_BUFFER_PTS (buffer) == seeker->target) {
+      seeker->reached_time = g_get_monotonic_time ();
+      g_cond_signal (&seeker->cond);
+    }
+  } else {
+    event = GST_PAD_PROBE_INFO_EVENT (info);
+    if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP)
+      seeker->flushed = TRUE;
+  }
+  g_mutex_unlock (&seeker->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+// Waits for the target frame, FALSE if it never came
+static gboolean
+wait_seek (Seeker * seeker, gint64 * reached_time)
+{
+  gint64 end_time = g_get_monotonic_time () + SEEK_TIMEOUT;
+
+  g_mutex_lock (&seeker->lock);
+  while (!seeker->reached_time)
+    if (!g_cond_wait_until (&seeker->cond, &seeker->lock, end_time))
+      break;
+  *reached_time = seeker->reached_time;
+  g_mutex_unlock (&seeker->lock);
+
+  return *reached_time != 0;
+}
+
+// Seeks hop back and forth between the key frames of the stream,
+// each as soon as the frame of the previous one came out. In PAUSED
+// that frame is prerolled and the decoder is blocked pushing the next
+static void
+run_seeks (Codec codec, guint width, guint height, Mode mode,
+    gboolean paused, GPtrArray * stream, SeekResult * result)
+{
+  GstAppSrcCallbacks callbacks = { seek_need_data, NULL, seek_data };
+  Instance instance = { 0, };
+  GstElement *pipeline;
+  Seeker seeker;
+  GstPad *pad = NULL;
+  guint num_gops = (MAX (num_frames, 1) + GOP_LENGTH - 1) / GOP_LENGTH;
+  gint64 start_time, reached_time;
+  gdouble total_ms = 0, ms;
+  guint i;
+
+  memset (result, 0, sizeof (SeekResult));
+  memset (&seeker, 0, sizeof (Seeker));
+  g_mutex_init (&seeker.lock);
+  g_cond_init (&seeker.cond);
+  seeker.stream = stream;
+  seeker.flushed = TRUE;
+  seeker.target = 0;
+
+  pipeline = make_pipeline (mode, 1);
+  if (!pipeline || !setup_instance (&instance, codec, width, height, mode,
+          pipeline, 0, stream)) {
+    result->failed = TRUE;
+    goto done;
+  }
+
+  g_object_set (instance.src, "stream-type", GST_APP_STREAM_TYPE_SEEKABLE,
+      NULL);
+  gst_app_src_set_callbacks (GST_APP_SRC (instance.src), &callbacks,
+      &seeker, NULL);
+  pad = gst_element_get_static_pad (instance.dec, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER
+      | GST_PAD_PROBE_TYPE_EVENT_FLUSH, seek_probe, &seeker, NULL);
+
+  if (gst_element_set_state (pipeline, paused ? GST_STATE_PAUSED
+          : GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE
+      || !wait_seek (&seeker, &reached_time)) {
+    result->failed = TRUE;
+    goto done;
+  }
+
+  for (i = 0; i < (guint) num_seeks; i++) {
+    g_mutex_lock (&seeker.lock);
+    seeker.target = (i * 2 + 1) % num_gops * GOP_LENGTH * FRAME_DURATION;
+    seeker.flushed = FALSE;
+    seeker.reached_time = 0;
+    g_mutex_unlock (&seeker.lock);
+
+    start_time = g_get_monotonic_time ();
+    if (!gst_element_seek_simple (pipeline, GST_FORMAT_TIME,
+            GST_SEEK_FLAG_FLUSH, seeker.target)
+        || !wait_seek (&seeker, &reached_time)) {
+      g_printerr ("seek to %" GST_TIME_FORMAT " failed\n",
+          GST_TIME_ARGS (seeker.target));
+      result->failed = TRUE;
+      break;
+    }
+
+    ms = (reached_time - start_time) / 1e3;
+    total_ms += ms;
+    result->max_ms = MAX (result->max_ms, ms);
+    result->seeks++;
+  }
+  if (result->seeks)
+    result->mean_ms = total_ms / result->seeks;
+
+done:
+  if (pad)
+    gst_object_unref (pad);
+  if (pipeline) {
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+    free_instance (&instance);
+    gst_object_unref (pipeline);
+  }
+  g_mutex_clear (&seeker.lock);
+  g_cond_clear (&seeker.cond);
+}
+
+static void
+print_result (const gchar * codec, guint width, guint height,
+    guint num_instances, const gchar * mode, const Result * result)
+{
+  gchar *size = g_strdup_printf ("%ux%u", width, height);
+
+  if (result->failed || !result->frames) {
+    g_print ("%-6s %-10s %4u  %-10s failed\n", codec, size, num_instances,
+        mode);
+  } else {
+    gchar *allocs;
+
+#ifdef HAVE_ALLOC_COUNT
+    allocs = g_strdup_printf ("%.2f",
+        (gdouble) result->allocations / result->frames);
+#else
+    allocs = g_strdup ("n/a");
+#endif
+    g_print ("%-6s %-10s %4u  %-10s %10.1f %12.0f %14s %14.2f\n", codec,
+        size, num_instances, mode, result->frames / result->seconds,
+        (gdouble) result->cpu_ns / result->frames, allocs,
+        (gdouble) result->locks / result->frames);
+    g_free (allocs);
+  }
+  g_free (size);
+}
+
+static void
+append_seek_result (GString * out, const gchar * codec, guint width,
+    guint height, const gchar * mode, gboolean paused,
+    const SeekResult * result)
+{
+  gchar *size = g_strdup_printf ("%ux%u", width, height);
+  const gchar *state = paused ? "paused" : "playing";
+
+  if (result->failed || !result->seeks) {
+    g_string_append_printf (out, "%-6s %-10s %-10s %-8s failed\n", codec,
+        size, mode, state);
+  } else {
+    g_string_append_printf (out, "%-6s %-10s %-10s %-8s %6u %12.2f %12.2f\n",
+        codec, size, mode, state, result->seeks, result->mean_ms,
+        result->max_ms);
+  }
+  g_free (size);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  gchar **codecs, **sizes, **instances, **modes;
+  guint c, s, n, m, p, width, height, num_instances;
+  GPtrArray *stream;
+  Codec codec;
+  Mode mode;
+  Result result;
+  SeekResult seek_result;
+  GString *seek_results = g_string_new (NULL);
+  gboolean failed = FALSE;
+
+  // Read when the first CUDA call is made
+  g_setenv ("GST_NVDEC_BACKEND", "fake", TRUE);
+
+  context = g_option_context_new ("- benchmark nvdec without a GPU");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+  g_option_context_free (context);
+
+  GST_PLUGIN_STATIC_REGISTER (nvidia);
+  gst_nvdec_fake_set_copy_frames (!no_copy);
+
+  codecs = g_strsplit (codecs_arg ? codecs_arg : DEFAULT_CODECS, ",", -1);
+  sizes = g_strsplit (sizes_arg ? sizes_arg : DEFAULT_SIZES, ",", -1);
+  instances = g_strsplit (instances_arg ? instances_arg
+      : DEFAULT_INSTANCES, ",", -1);
+  modes = g_strsplit (modes_arg ? modes_arg : DEFAULT_MODES, ",", -1);
+  for (m = 0; modes[m]; m++) {
+    if (strcmp (modes[m], "pipelined") && strcmp (modes[m], "sync")
+        && strcmp (modes[m], "multi")) {
+      g_printerr ("unknown mode %s\n", modes[m]);
+      return 1;
+    }
+  }
+
+  g_print ("%-6s %-10s %4s  %-10s %10s %12s %14s %14s\n", "codec", "size",
+      "inst", "mode", "fps", "cpu ns/frame", "allocs/frame",
+      "ctxlocks/frame");
+
+  for (c = 0; codecs[c]; c++) {
+    if (!strcmp (codecs[c], "h264"))
+      codec = CODEC_H264;
+    else if (!strcmp (codecs[c], "h265"))
+      codec = CODEC_H265;
+    else {
+      g_printerr ("unknown codec %s\n", codecs[c]);
+      return 1;
+    }
+
+    for (s = 0; sizes[s]; s++) {
+      if (sscanf (sizes[s], "%ux%u", &width, &height) != 2 || width < 64
+          || height < 64 || width > 8192 || height > 8192) {
+        g_printerr ("bad size %s\n", sizes[s]);
+        return 1;
+      }
+
+      // Generated once and shared by all instances
+      stream = make_stream (codec, width, height, MAX (num_frames, 1));
+
+      for (n = 0; instances[n]; n++) {
+        num_instances = MAX (1, atoi (instances[n]));
+        for (m = 0; modes[m]; m++) {
+          if (!strcmp (modes[m], "multi"))
+            mode = MODE_MULTI;
+          else if (!strcmp (modes[m], "sync"))
+            mode = MODE_SYNC;
+          else
+            mode = MODE_PIPELINED;
+          run (codec, width, height, num_instances, mode, stream, &result);
+          print_result (codecs[c], width, height, num_instances, modes[m],
+              &result);
+          failed |= result.failed;
+        }
+      }
+
+      // One decoder per run, nvmultidec is left out
+      for (m = 0; num_seeks > 0 && modes[m]; m++) {
+        if (!strcmp (modes[m], "multi"))
+          continue;
+        mode = strcmp (modes[m], "sync") ? MODE_PIPELINED : MODE_SYNC;
+        for (p = 0; p < 2; p++) {
+          run_seeks (codec, width, height, mode, p, stream, &seek_result);
+          append_seek_result (seek_results, codecs[c], width, height,
+              modes[m], p, &seek_result);
+          failed |= seek_result.failed;
+        }
+      }
+
+      g_ptr_array_unref (stream);
+    }
+  }
+
+  if (seek_results->len) {
+    g_print ("\n%-6s %-10s %-10s %-8s %6s %12s %12s\n", "codec", "size",
+        "mode", "state", "seeks", "mean ms", "max ms");
+    g_print ("%s", seek_results->str);
+  }
+  g_string_free (seek_results, TRUE);
+
+  g_strfreev (codecs);
+  g_strfreev (sizes);
+  g_strfreev (instances);
+  g_strfreev (modes);
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,406 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstcudacontext.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_nvdec_cuda_context_debug_category);
+#define GST_CAT_DEFAULT gst_nvdec_cuda_context_debug_category
+
+G_DEFINE_TYPE_WITH_CODE (GstNvDecCudaContext, gst_nvdec_cuda_context,
+    G_TYPE_OBJECT,
+    GST_DEBUG_CATEGORY_INIT (gst_nvdec_cuda_context_debug_category,
+        "nvdeccudacontext", 0, "Debug category for the shared CUDA context"));
+
+// More than any host we know of has
+#define MAX_DEVICES 64
+
+// One context per device for the whole process, held weakly
+// so it goes away with the last element using it
+static GMutex contexts_lock;
+static GWeakRef contexts[MAX_DEVICES];
+
+// gstnvdeckernels.cu built by nvcc --fatbin, embedded by bin2c
+extern const unsigned long long gst_nvdec_kernels_fatbin[];
+
+static const gchar *kernel_names[] = { GST_NVDEC_KERNEL_NAMES };
+G_STATIC_ASSERT (G_N_ELEMENTS (kernel_names) == GST_NVDEC_KERNEL_COUNT);
+
+static void gst_nvdec_cuda_context_finalize (GObject * object);
+
+static void
+gst_nvdec_cuda_context_class_init (GstNvDecCudaContextClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = gst_nvdec_cuda_context_finalize;
+}
+
+static void
+gst_nvdec_cuda_context_init (GstNvDecCudaContext * cuda_context)
+{
+  cuda_context->device = -1;
+  g_mutex_init (&cuda_context->module_lock);
+}
+
+static void
+gst_nvdec_cuda_context_finalize (GObject * object)
+{
+  GstNvDecCudaContext *cuda_context = GST_NVDEC_CUDA_CONTEXT (object);
+
+  GST_DEBUG ("destroying CUDA context %p of device %d", cuda_context->context,
+      cuda_context->device);
+
+  // Destroying the context would unload it, wrapped ones live on
+  if (cuda_context->module) {
+    if (cuda_OK (CuCtxPushCurrent (cuda_context->context))) {
+      CuModuleUnload (cuda_context->module);
+      CuCtxPopCurrent (NULL);
+    }
+  }
+  g_mutex_clear (&cuda_context->module_lock);
+
+  if (cuda_context->lock && cuda_context->owns_lock
+      && !cuda_OK (CuvidCtxLockDestroy (cuda_context->lock)))
+    GST_ERROR ("failed to destroy CUDA context lock");
+
+  if (cuda_context->context && cuda_context->owns_context
+      && !cuda_OK (CuCtxDestroy (cuda_context->context)))
+    GST_ERROR ("failed to destroy CUDA context");
+
+  G_OBJECT_CLASS (gst_nvdec_cuda_context_parent_class)->finalize (object);
+}
+
+static GstNvDecCudaContext *
+gst_nvdec_cuda_context_new (CUdevice device)
+{
+  GstNvDecCudaContext *cuda_context;
+
+  cuda_context = g_object_new (GST_TYPE_NVDEC_CUDA_CONTEXT, NULL);
+  cuda_context->device = device;
+
+  if (!cuda_OK (CuCtxCreate (&cuda_context->context, CU_CTX_SCHED_AUTO,
+              device))) {
+    GST_ERROR ("failed to create CUDA context on device %d", device);
+    g_object_unref (cuda_context);
+    return NULL;
+  }
+  cuda_context->owns_context = TRUE;
+  // cuCtxCreate left it current on this thread
+  CuCtxPopCurrent (NULL);
+
+  if (!cuda_OK (CuvidCtxLockCreate (&cuda_context->lock,
+              cuda_context->context))) {
+    GST_ERROR ("failed to create CUDA context lock");
+    g_object_unref (cuda_context);
+    return NULL;
+  }
+  cuda_context->owns_lock = TRUE;
+
+  GST_INFO ("created CUDA context %p on device %d", cuda_context->context,
+      device);
+
+  return cuda_context;
+}
+
+// Called with the context current
+gboolean
+gst_nvdec_cuda_context_get_kernel (GstNvDecCudaContext * cuda_context,
+    GstNvDecKernel kernel, CUfunction * function)
+{
+  gboolean ret = TRUE;
+  guint i;
+
+  g_return_val_if_fail (kernel < GST_NVDEC_KERNEL_COUNT, FALSE);
+
+  g_mutex_lock (&cuda_context->module_lock);
+  if (!cuda_context->module) {
+    if (!cuda_OK (CuModuleLoadData (&cuda_context->module,
+                gst_nvdec_kernels_fatbin))) {
+      GST_ERROR ("failed to load the conversion kernels");
+      cuda_context->module = NULL;
+      ret = FALSE;
+    }
+    for (i = 0; ret && i < GST_NVDEC_KERNEL_COUNT; i++) {
+      if (!cuda_OK (CuModuleGetFunction (&cuda_context->kernels[i],
+                  cuda_context->module, kernel_names[i]))) {
+        GST_ERROR ("no kernel %s", kernel_names[i]);
+        CuModuleUnload (cuda_context->module);
+        cuda_context->module = NULL;
+        ret = FALSE;
+      }
+    }
+    if (ret)
+      GST_DEBUG ("loaded the conversion kernels on device %d",
+          cuda_context->device);
+  }
+  *function = cuda_context->kernels[kernel];
+  g_mutex_unlock (&cuda_context->module_lock);
+
+  return ret;
+}
+
+// Returns the context every element on the device shares,
+// creating it on first use
+GstNvDecCudaContext *
+gst_nvdec_cuda_context_get (CUdevice device)
+{
+  GstNvDecCudaContext *cuda_context;
+
+  if (device < 0 || device >= MAX_DEVICES)
+    return NULL;
+
+  if (!cuda_OK (CuInit (0))) {
+    GST_ERROR ("failed to init CUDA");
+    return NULL;
+  }
+
+  g_mutex_lock (&contexts_lock);
+  cuda_context = g_weak_ref_get (&contexts[device]);
+  if (!cuda_context) {
+    cuda_context = gst_nvdec_cuda_context_new (device);
+    g_weak_ref_set (&contexts[device], cuda_context);
+  }
+  g_mutex_unlock (&contexts_lock);
+
+  return cuda_context;
+}
+
+// The shared context of the device if something is using it, never
+// creates one
+GstNvDecCudaContext *
+gst_nvdec_cuda_context_peek (CUdevice device)
+{
+  GstNvDecCudaContext *cuda_context;
+
+  if (device < 0 || device >= MAX_DEVICES)
+    return NULL;
+
+  g_mutex_lock (&contexts_lock);
+  cuda_context = g_weak_ref_get (&contexts[device]);
+  g_mutex_unlock (&contexts_lock);
+
+  return cuda_context;
+}
+
+// For handles set through the deprecated context/lock properties,
+// a lock is still made if only the context was given
+GstNvDecCudaContext *
+gst_nvdec_cuda_context_new_wrapped (CUcontext context, CUvideoctxlock lock)
+{
+  GstNvDecCudaContext *cuda_context;
+
+  g_return_val_if_fail (context != NULL, NULL);
+
+  cuda_context = g_object_new (GST_TYPE_NVDEC_CUDA_CONTEXT, NULL);
+  cuda_context->context = context;
+  cuda_context->lock = lock;
+
+  if (cuda_OK (CuCtxPushCurrent (context))) {
+    if (!cuda_OK (CuCtxGetDevice (&cuda_context->device)))
+      cuda_context->device = -1;
+    CuCtxPopCurrent (NULL);
+  }
+
+  if (!cuda_context->lock) {
+    if (!cuda_OK (CuvidCtxLockCreate (&cuda_context->lock, context))) {
+      GST_ERROR ("failed to create CUDA context lock");
+      g_object_unref (cuda_context);
+      return NULL;
+    }
+    cuda_context->owns_lock = TRUE;
+  }
+
+  return cuda_context;
+}
+
+GstContext *
+gst_context_new_nvdec_cuda_context (GstNvDecCudaContext * cuda_context)
+{
+  GstContext *context;
+  GstStructure *s;
+
+  context = gst_context_new (GST_NVDEC_CUDA_CONTEXT_TYPE, TRUE);
+  s = gst_context_writable_structure (context);
+  gst_structure_set (s,
+      "context", GST_TYPE_NVDEC_CUDA_CONTEXT, cuda_context,
+      "cuda-device-id", G_TYPE_INT, cuda_context->device,
+      "cuda-context", G_TYPE_POINTER, cuda_context->context,
+      "cuda-lock", G_TYPE_POINTER, cuda_context->lock, NULL);
+
+  return context;
+}
+
+gboolean
+gst_context_get_nvdec_cuda_context (GstContext * context,
+    GstNvDecCudaContext ** cuda_context)
+{
+  const GstStructure *s;
+
+  if (!gst_context_has_context_type (context, GST_NVDEC_CUDA_CONTEXT_TYPE))
+    return FALSE;
+
+  s = gst_context_get_structure (context);
+  return gst_structure_get (s, "context", GST_TYPE_NVDEC_CUDA_CONTEXT,
+      cuda_context, NULL) && *cuda_context;
+}
+
+// Takes the context if it's on the device the element wants,
+// any device will do when device_id is -1
+gboolean
+gst_nvdec_cuda_context_handle_set_context (GstElement * element,
+    GstContext * context, gint device_id, GstNvDecCudaContext ** cuda_context)
+{
+  GstNvDecCudaContext *new_context = NULL, *old_context;
+
+  if (!gst_context_get_nvdec_cuda_context (context, &new_context))
+    return FALSE;
+
+  if (device_id >= 0 && new_context->device != device_id) {
+    GST_DEBUG_OBJECT (element, "ignoring context of device %d, want %d",
+        new_context->device, device_id);
+    g_object_unref (new_context);
+    return FALSE;
+  }
+
+  GST_OBJECT_LOCK (element);
+  old_context = *cuda_context;
+  *cuda_context = new_context;
+  GST_OBJECT_UNLOCK (element);
+
+  if (old_context)
+    g_object_unref (old_context);
+
+  GST_DEBUG_OBJECT (element, "using shared CUDA context %p of device %d",
+      new_context->context, new_context->device);
+
+  return TRUE;
+}
+
+gboolean
+gst_nvdec_cuda_context_handle_context_query (GstElement * element,
+    GstQuery * query, GstNvDecCudaContext * cuda_context)
+{
+  const gchar *context_type;
+  GstContext *context;
+
+  gst_query_parse_context_type (query, &context_type);
+  if (!cuda_context || g_strcmp0 (context_type, GST_NVDEC_CUDA_CONTEXT_TYPE))
+    return FALSE;
+
+  context = gst_context_new_nvdec_cuda_context (cuda_context);
+  gst_query_set_context (query, context);
+  gst_context_unref (context);
+
+  GST_DEBUG_OBJECT (element, "answered context query with %p",
+      cuda_context->context);
+
+  return TRUE;
+}
+
+static gboolean
+context_pad_query (const GValue * item, GValue * value, gpointer user_data)
+{
+  GstPad *pad = g_value_get_object (item);
+  GstQuery *query = user_data;
+
+  if (gst_pad_peer_query (pad, query)) {
+    g_value_set_boolean (value, TRUE);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+run_context_query (GstElement * element, GstQuery * query,
+    GstPadDirection direction)
+{
+  GstIterator *it;
+  GValue res = G_VALUE_INIT;
+
+  g_value_init (&res, G_TYPE_BOOLEAN);
+  g_value_set_boolean (&res, FALSE);
+
+  if (direction == GST_PAD_SRC)
+    it = gst_element_iterate_src_pads (element);
+  else
+    it = gst_element_iterate_sink_pads (element);
+
+  while (gst_iterator_fold (it, context_pad_query, &res, query)
+      == GST_ITERATOR_RESYNC)
+    gst_iterator_resync (it);
+  gst_iterator_free (it);
+
+  return g_value_get_boolean (&res);
+}
+
+// Asks downstream, then upstream, then the application for a
+// context, the usual GstContext dance. The answer ends up in
+// cuda_context through the element's set_context
+gboolean
+gst_nvdec_cuda_context_find (GstElement * element, gint device_id,
+    GstNvDecCudaContext ** cuda_context)
+{
+  GstQuery *query;
+  GstContext *context = NULL;
+
+  if (*cuda_context)
+    return TRUE;
+
+  query = gst_query_new_context (GST_NVDEC_CUDA_CONTEXT_TYPE);
+  if (run_context_query (element, query, GST_PAD_SRC)
+      || run_context_query (element, query, GST_PAD_SINK)) {
+    gst_query_parse_context (query, &context);
+    if (context)
+      gst_element_set_context (element, context);
+  }
+  gst_query_unref (query);
+
+  if (!*cuda_context)
+    gst_element_post_message (element,
+        gst_message_new_need_context (GST_OBJECT_CAST (element),
+            GST_NVDEC_CUDA_CONTEXT_TYPE));
+
+  return *cuda_context != NULL;
+}
+
+// Lets the rest of the pipeline know about a context we made
+void
+gst_nvdec_cuda_context_propagate (GstElement * element,
+    GstNvDecCudaContext * cuda_context)
+{
+  GstContext *context;
+
+  context = gst_context_new_nvdec_cuda_context (cuda_context);
+  gst_element_set_context (element, context);
+  gst_element_post_message (element,
+      gst_message_new_have_context (GST_OBJECT_CAST (element), context));
+}
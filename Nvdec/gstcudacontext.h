@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_CUDA_CONTEXT_H__
+#define __GST_CUDA_CONTEXT_H__
+
+#include <gst/gst.h>
+#include <cuda.h>
+#include "gstnvdecloader.h"
+#include "gstnvdeckernels.h"
+#include <nvcuvid.h>
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_NVDEC_CUDA_CONTEXT         (gst_nvdec_cuda_context_get_type())
+#define GST_NVDEC_CUDA_CONTEXT(obj)         (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_NVDEC_CUDA_CONTEXT, GstNvDecCudaContext))
+#define GST_IS_NVDEC_CUDA_CONTEXT(obj)      (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_NVDEC_CUDA_CONTEXT))
+
+// GstContext type the shared context is passed around with, private
+// so libgstcuda elements never get handed our structure. The
+// structure has the object in "context", and the raw handles in
+// "cuda-context" and "cuda-lock" for elements that don't link to us
+#define GST_NVDEC_CUDA_CONTEXT_TYPE "gst.nvdec.cuda.context"
+
+typedef struct _GstNvDecCudaContext GstNvDecCudaContext;
+typedef struct _GstNvDecCudaContextClass GstNvDecCudaContextClass;
+
+struct _GstNvDecCudaContext
+{
+  GObject parent;
+
+  CUdevice device;
+  CUcontext context;
+  CUvideoctxlock lock;
+  // FALSE when the handles were given to us by the application
+  gboolean owns_context;
+  gboolean owns_lock;
+
+  // The conversion kernels, loaded the first time one is needed
+  GMutex module_lock;
+  CUmodule module;
+  CUfunction kernels[GST_NVDEC_KERNEL_COUNT];
+};
+
+struct _GstNvDecCudaContextClass
+{
+  GObjectClass parent_class;
+};
+
+GType gst_nvdec_cuda_context_get_type (void);
+
+GstNvDecCudaContext * gst_nvdec_cuda_context_get (CUdevice device);
+GstNvDecCudaContext * gst_nvdec_cuda_context_peek (CUdevice device);
+GstNvDecCudaContext * gst_nvdec_cuda_context_new_wrapped (CUcontext context,
+    CUvideoctxlock lock);
+
+gboolean gst_nvdec_cuda_context_get_kernel (GstNvDecCudaContext *
+    cuda_context, GstNvDecKernel kernel, CUfunction * function);
+
+GstContext * gst_context_new_nvdec_cuda_context (GstNvDecCudaContext *
+    cuda_context);
+gboolean gst_context_get_nvdec_cuda_context (GstContext * context,
+    GstNvDecCudaContext ** cuda_context);
+
+gboolean gst_nvdec_cuda_context_handle_set_context (GstElement * element,
+    GstContext * context, gint device_id, GstNvDecCudaContext ** cuda_context);
+gboolean gst_nvdec_cuda_context_handle_context_query (GstElement * element,
+    GstQuery * query, GstNvDecCudaContext * cuda_context);
+gboolean gst_nvdec_cuda_context_find (GstElement * element, gint device_id,
+    GstNvDecCudaContext ** cuda_context);
+void gst_nvdec_cuda_context_propagate (GstElement * element,
+    GstNvDecCudaContext * cuda_context);
+
+G_END_DECLS
+
+#endif /* __GST_CUDA_CONTEXT_H__ */
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstcudadevice.h"
+#include "gstcudacontext.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_cuda_device_debug_category);
+#define GST_CAT_DEFAULT gst_cuda_device_debug_category
+
+// More than any host we know of has
+#define MAX_DEVICES 64
+
+static GMutex sessions_lock;
+static guint sessions[MAX_DEVICES];
+
+static void
+init_debug_category (void)
+{
+  static gsize done = 0;
+
+  if (g_once_init_enter (&done)) {
+    GST_DEBUG_CATEGORY_INIT (gst_cuda_device_debug_category, "cudadevice",
+        0, "Debug category for CUDA device selection");
+    g_once_init_leave (&done, 1);
+  }
+}
+
+GType
+gst_cuda_device_policy_get_type (void)
+{
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    {GST_CUDA_DEVICE_POLICY_FEWEST_SESSIONS,
+        "Device with the fewest decoding sessions", "fewest-sessions"},
+    {GST_CUDA_DEVICE_POLICY_MOST_FREE_MEMORY,
+        "Device with the most free memory", "most-free-memory"},
+    {0, NULL, NULL}
+  };
+
+  if (g_once_init_enter (&type)) {
+    GType tmp = g_enum_register_static ("GstCudaDevicePolicy", values);
+    g_once_init_leave (&type, tmp);
+  }
+
+  return (GType) type;
+}
+
+// NVML counts what every process uses and needs no context. Without
+// it, only a device that already has our shared context is asked,
+// any other has nothing of ours on it and is taken to be all free,
+// making a context just to look would cost more than the decode
+static gboolean
+get_free_memory (CUdevice device, gsize * free_memory)
+{
+  GstNvDecCudaContext *cuda_context;
+  GstNvmlDevice nvml_device;
+  GstNvmlMemory memory;
+  gchar bus_id[16] = { 0, };
+  size_t free_bytes = 0, total_bytes = 0;
+  gboolean ret;
+
+  if (cuda_OK (CuDeviceGetPCIBusId (bus_id, sizeof (bus_id), device))
+      && NvmlDeviceGetHandleByPciBusId (bus_id, &nvml_device)
+      == GST_NVML_SUCCESS
+      && NvmlDeviceGetMemoryInfo (nvml_device, &memory) == GST_NVML_SUCCESS) {
+    *free_memory = memory.free;
+    return TRUE;
+  }
+
+  cuda_context = gst_nvdec_cuda_context_peek (device);
+  if (!cuda_context) {
+    ret = cuda_OK (CuDeviceTotalMem (&total_bytes, device));
+    *free_memory = total_bytes;
+    return ret;
+  }
+
+  ret = cuda_OK (CuCtxPushCurrent (cuda_context->context));
+  if (ret) {
+    ret = cuda_OK (CuMemGetInfo (&free_bytes, &total_bytes));
+    CuCtxPopCurrent (NULL);
+  }
+  g_object_unref (cuda_context);
+
+  *free_memory = free_bytes;
+  return ret;
+}
+
+// Picks a device and counts a session on it before anyone
+// else can pick, the caller has to remove the session again
+gboolean
+gst_cuda_device_choose (GstCudaDevicePolicy policy, CUdevice * device)
+{
+  gsize free_memory[MAX_DEVICES] = { 0, };
+  gint count = 0, i, best = -1;
+
+  init_debug_category ();
+
+  if (!cuda_OK (CuDeviceGetCount (&count)) || count <= 0) {
+    GST_ERROR ("no CUDA devices");
+    return FALSE;
+  }
+  count = MIN (count, MAX_DEVICES);
+
+  if (policy == GST_CUDA_DEVICE_POLICY_MOST_FREE_MEMORY) {
+    for (i = 0; i < count; i++) {
+      if (!get_free_memory (i, &free_memory[i]))
+        GST_WARNING ("failed to get the free memory of device %d", i);
+      GST_DEBUG ("device %d has %" G_GSIZE_FORMAT " bytes free", i,
+          free_memory[i]);
+    }
+  }
+
+  g_mutex_lock (&sessions_lock);
+  for (i = 0; i < count; i++) {
+    if (best < 0)
+      best = i;
+    else if (policy == GST_CUDA_DEVICE_POLICY_MOST_FREE_MEMORY
+        && free_memory[i] != free_memory[best])
+      best = free_memory[i] > free_memory[best] ? i : best;
+    else if (sessions[i] < sessions[best])
+      best = i;
+  }
+  sessions[best]++;
+  g_mutex_unlock (&sessions_lock);
+
+  GST_INFO ("chose device %d of %d, it has %u sessions now", best, count,
+      gst_cuda_device_get_num_sessions (best));
+
+  *device = best;
+  return TRUE;
+}
+
+void
+gst_cuda_device_add_session (CUdevice device)
+{
+  if (device < 0 || device >= MAX_DEVICES)
+    return;
+
+  g_mutex_lock (&sessions_lock);
+  sessions[device]++;
+  g_mutex_unlock (&sessions_lock);
+}
+
+void
+gst_cuda_device_remove_session (CUdevice device)
+{
+  if (device < 0 || device >= MAX_DEVICES)
+    return;
+
+  g_mutex_lock (&sessions_lock);
+  if (sessions[device] > 0)
+    sessions[device]--;
+  g_mutex_unlock (&sessions_lock);
+}
+
+guint
+gst_cuda_device_get_num_sessions (CUdevice device)
+{
+  guint ret;
+
+  if (device < 0 || device >= MAX_DEVICES)
+    return 0;
+
+  g_mutex_lock (&sessions_lock);
+  ret = sessions[device];
+  g_mutex_unlock (&sessions_lock);
+
+  return ret;
+}
+
+gint
+gst_cuda_device_get_numa_node (CUdevice device)
+{
+#ifdef G_OS_WIN32
+  // There's no cheap way to map a PCI device to a node on Windows,
+  // the numa-node property has to be used there
+  return -1;
+#else
+  gchar bus_id[16] = { 0, };
+  gchar *path, *contents = NULL, *lower;
+  gint node = -1;
+
+  init_debug_category ();
+
+  if (!cuda_OK (CuDeviceGetPCIBusId (bus_id, sizeof (bus_id), device)))
+    return -1;
+
+  lower = g_ascii_strdown (bus_id, -1);
+  path = g_strdup_printf ("/sys/bus/pci/devices/%s/numa_node", lower);
+  if (g_file_get_contents (path, &contents, NULL, NULL))
+    node = (gint) g_ascii_strtoll (contents, NULL, 10);
+
+  GST_DEBUG ("device %d (%s) is on NUMA node %d", device, bus_id, node);
+
+  g_free (contents);
+  g_free (path);
+  g_free (lower);
+
+  // Single node machines report -1
+  return node;
+#endif
+}
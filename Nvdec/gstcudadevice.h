@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_CUDA_DEVICE_H__
+#define __GST_CUDA_DEVICE_H__
+
+#include <gst/gst.h>
+#include <cuda.h>
+#include "gstnvdecloader.h"
+
+G_BEGIN_DECLS
+
+// How a device is picked when none is set
+typedef enum
+{
+  GST_CUDA_DEVICE_POLICY_FEWEST_SESSIONS,
+  GST_CUDA_DEVICE_POLICY_MOST_FREE_MEMORY
+} GstCudaDevicePolicy;
+
+#define GST_TYPE_CUDA_DEVICE_POLICY (gst_cuda_device_policy_get_type())
+GType gst_cuda_device_policy_get_type (void);
+
+gboolean gst_cuda_device_choose (GstCudaDevicePolicy policy,
+    CUdevice * device);
+
+// Process-wide count of decoding sessions on each device
+void gst_cuda_device_add_session (CUdevice device);
+void gst_cuda_device_remove_session (CUdevice device);
+guint gst_cuda_device_get_num_sessions (CUdevice device);
+
+// NUMA node the device is attached to, -1 if unknown
+gint gst_cuda_device_get_numa_node (CUdevice device);
+
+G_END_DECLS
+
+#endif /* __GST_CUDA_DEVICE_H__ */
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstcudahostpool.h"
+
+#ifdef G_OS_WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+GST_DEBUG_CATEGORY_STATIC (gst_cuda_host_pool_debug_category);
+#define GST_CAT_DEFAULT gst_cuda_host_pool_debug_category
+
+G_DEFINE_TYPE_WITH_CODE (GstCudaHostBufferPool, gst_cuda_host_buffer_pool,
+    GST_TYPE_BUFFER_POOL,
+    GST_DEBUG_CATEGORY_INIT (gst_cuda_host_pool_debug_category, "cudahostpool",
+        0, "Debug category for the pinned host memory pool"));
+
+typedef struct _GstCudaHostBlock
+{
+  // Keeps the context alive until the memory is freed, buffers
+  // can outlive the pool and the element
+  GstNvDecCudaContext *cuda_context;
+  gpointer data;
+  gsize size;
+  // TRUE if the memory was allocated on a NUMA node by us
+  // and registered with CUDA, FALSE if it came from cuMemHostAlloc
+  gboolean registered;
+} GstCudaHostBlock;
+
+static gpointer
+numa_alloc (gsize size, gint node)
+{
+#ifdef G_OS_WIN32
+  return VirtualAllocExNuma (GetCurrentProcess (), NULL, size,
+      MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD) node);
+#else
+  // MPOL_BIND, without pulling in libnuma for a single call
+  const gint mpol_bind = 2;
+  gulong nodemask[4] = { 0, };
+  gpointer data;
+
+  if (node >= (gint) (sizeof (nodemask) * 8))
+    return NULL;
+
+  data = mmap (NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  nodemask[node / (sizeof (gulong) * 8)] |= 1UL << (node % (sizeof (gulong) * 8));
+  if (syscall (SYS_mbind, data, size, mpol_bind, nodemask,
+          sizeof (nodemask) * 8, 0) != 0)
+    GST_WARNING ("failed to bind %" G_GSIZE_FORMAT " bytes to node %d",
+        size, node);
+
+  return data;
+#endif
+}
+
+static void
+numa_free (gpointer data, gsize size)
+{
+#ifdef G_OS_WIN32
+  VirtualFree (data, 0, MEM_RELEASE);
+#else
+  munmap (data, size);
+#endif
+}
+
+static void
+gst_cuda_host_block_free (GstCudaHostBlock * block)
+{
+  if (cuda_OK (CuCtxPushCurrent (block->cuda_context->context))) {
+    if (block->registered) {
+      if (!cuda_OK (CuMemHostUnregister (block->data)))
+        GST_WARNING ("failed to unregister host memory");
+    } else if (!cuda_OK (CuMemFreeHost (block->data))) {
+      GST_WARNING ("failed to free host memory");
+    }
+    CuCtxPopCurrent (NULL);
+  }
+
+  if (block->registered)
+    numa_free (block->data, block->size);
+
+  g_object_unref (block->cuda_context);
+  g_slice_free (GstCudaHostBlock, block);
+}
+
+static GstCudaHostBlock *
+gst_cuda_host_block_new (GstCudaHostBufferPool * pool, gsize size)
+{
+  GstCudaHostBlock *block;
+  gpointer data = NULL;
+  gboolean registered = FALSE;
+
+  if (!cuda_OK (CuCtxPushCurrent (pool->cuda_context->context)))
+    return NULL;
+
+  if (pool->numa_node >= 0) {
+    data = numa_alloc (size, pool->numa_node);
+    if (data && !cuda_OK (CuMemHostRegister (data, size,
+                CU_MEMHOSTREGISTER_PORTABLE))) {
+      GST_WARNING_OBJECT (pool, "failed to register host memory");
+      numa_free (data, size);
+      data = NULL;
+    }
+    registered = data != NULL;
+  }
+
+  // No node or binding failed, let the driver place it
+  if (!data && !cuda_OK (CuMemHostAlloc (&data, size,
+              CU_MEMHOSTALLOC_PORTABLE))) {
+    GST_ERROR_OBJECT (pool, "failed to allocate %" G_GSIZE_FORMAT
+        " bytes of pinned memory", size);
+    data = NULL;
+  }
+
+  CuCtxPopCurrent (NULL);
+
+  if (!data)
+    return NULL;
+
+  block = g_slice_new (GstCudaHostBlock);
+  block->cuda_context = g_object_ref (pool->cuda_context);
+  block->data = data;
+  block->size = size;
+  block->registered = registered;
+
+  return block;
+}
+
+static const gchar **
+gst_cuda_host_buffer_pool_get_options (GstBufferPool * pool)
+{
+  static const gchar *options[] = { GST_BUFFER_POOL_OPTION_VIDEO_META, NULL };
+
+  return options;
+}
+
+static gboolean
+gst_cuda_host_buffer_pool_set_config (GstBufferPool * pool,
+    GstStructure * config)
+{
+  GstCudaHostBufferPool *host_pool = GST_CUDA_HOST_BUFFER_POOL (pool);
+  GstCaps *caps = NULL;
+  guint size, min, max;
+
+  if (!gst_buffer_pool_config_get_params (config, &caps, &size, &min, &max)
+      || !caps) {
+    GST_WARNING_OBJECT (pool, "invalid config");
+    return FALSE;
+  }
+
+  if (!gst_video_info_from_caps (&host_pool->info, caps)) {
+    GST_WARNING_OBJECT (pool, "failed to parse caps %" GST_PTR_FORMAT, caps);
+    return FALSE;
+  }
+
+  host_pool->add_video_meta = gst_buffer_pool_config_has_option (config,
+      GST_BUFFER_POOL_OPTION_VIDEO_META);
+
+  size = MAX (size, (guint) host_pool->info.size);
+  gst_buffer_pool_config_set_params (config, caps, size, min, max);
+
+  return GST_BUFFER_POOL_CLASS (gst_cuda_host_buffer_pool_parent_class)
+      ->set_config (pool, config);
+}
+
+static GstFlowReturn
+gst_cuda_host_buffer_pool_alloc_buffer (GstBufferPool * pool,
+    GstBuffer ** buffer, GstBufferPoolAcquireParams * params)
+{
+  GstCudaHostBufferPool *host_pool = GST_CUDA_HOST_BUFFER_POOL (pool);
+  GstVideoInfo *info = &host_pool->info;
+  GstCudaHostBlock *block;
+  GstBuffer *buf;
+
+  block = gst_cuda_host_block_new (host_pool, info->size);
+  if (!block)
+    return GST_FLOW_ERROR;
+
+  buf = gst_buffer_new ();
+  gst_buffer_append_memory (buf, gst_memory_new_wrapped (0, block->data,
+          block->size, 0, info->size, block,
+          (GDestroyNotify) gst_cuda_host_block_free));
+
+  if (host_pool->add_video_meta) {
+    gst_buffer_add_video_meta_full (buf, GST_VIDEO_FRAME_FLAG_NONE,
+        GST_VIDEO_INFO_FORMAT (info), GST_VIDEO_INFO_WIDTH (info),
+        GST_VIDEO_INFO_HEIGHT (info), GST_VIDEO_INFO_N_PLANES (info),
+        info->offset, info->stride);
+  }
+
+  GST_LOG_OBJECT (pool, "allocated pinned buffer of %" G_GSIZE_FORMAT
+      " bytes", info->size);
+
+  *buffer = buf;
+  return GST_FLOW_OK;
+}
+
+static void
+gst_cuda_host_buffer_pool_finalize (GObject * object)
+{
+  GstCudaHostBufferPool *pool = GST_CUDA_HOST_BUFFER_POOL (object);
+
+  g_clear_object (&pool->cuda_context);
+
+  G_OBJECT_CLASS (gst_cuda_host_buffer_pool_parent_class)->finalize (object);
+}
+
+static void
+gst_cuda_host_buffer_pool_class_init (GstCudaHostBufferPoolClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstBufferPoolClass *pool_class = GST_BUFFER_POOL_CLASS (klass);
+
+  gobject_class->finalize = gst_cuda_host_buffer_pool_finalize;
+
+  pool_class->get_options = gst_cuda_host_buffer_pool_get_options;
+  pool_class->set_config = gst_cuda_host_buffer_pool_set_config;
+  pool_class->alloc_buffer = gst_cuda_host_buffer_pool_alloc_buffer;
+}
+
+static void
+gst_cuda_host_buffer_pool_init (GstCudaHostBufferPool * pool)
+{
+  pool->numa_node = -1;
+}
+
+GstBufferPool *
+gst_cuda_host_buffer_pool_new (GstNvDecCudaContext * cuda_context,
+    gint numa_node)
+{
+  GstCudaHostBufferPool *pool;
+
+  pool = g_object_new (GST_TYPE_CUDA_HOST_BUFFER_POOL, NULL);
+  gst_object_ref_sink (pool);
+  pool->cuda_context = g_object_ref (cuda_context);
+  pool->numa_node = numa_node;
+
+  GST_DEBUG_OBJECT (pool, "new pinned pool, NUMA node %d", numa_node);
+
+  return GST_BUFFER_POOL_CAST (pool);
+}
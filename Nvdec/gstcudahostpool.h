@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_CUDA_HOST_POOL_H__
+#define __GST_CUDA_HOST_POOL_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <cuda.h>
+#include "gstcudacontext.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_CUDA_HOST_BUFFER_POOL          (gst_cuda_host_buffer_pool_get_type())
+#define GST_CUDA_HOST_BUFFER_POOL(obj)          (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_CUDA_HOST_BUFFER_POOL, GstCudaHostBufferPool))
+#define GST_CUDA_HOST_BUFFER_POOL_CLASS(klass)  (G_TYPE_CHECK_CLASS_CAST((klass), GST_TYPE_CUDA_HOST_BUFFER_POOL, GstCudaHostBufferPoolClass))
+#define GST_IS_CUDA_HOST_BUFFER_POOL(obj)       (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_CUDA_HOST_BUFFER_POOL))
+
+typedef struct _GstCudaHostBufferPool GstCudaHostBufferPool;
+typedef struct _GstCudaHostBufferPoolClass GstCudaHostBufferPoolClass;
+
+struct _GstCudaHostBufferPool
+{
+  GstBufferPool parent;
+
+  GstNvDecCudaContext *cuda_context;
+  // NUMA node the host memory is bound to, -1 to let the OS decide
+  gint numa_node;
+
+  GstVideoInfo info;
+  gboolean add_video_meta;
+};
+
+struct _GstCudaHostBufferPoolClass
+{
+  GstBufferPoolClass parent_class;
+};
+
+GType gst_cuda_host_buffer_pool_get_type (void);
+
+GstBufferPool * gst_cuda_host_buffer_pool_new (
+    GstNvDecCudaContext * cuda_context, gint numa_node);
+
+G_END_DECLS
+
+#endif /* __GST_CUDA_HOST_POOL_H__ */
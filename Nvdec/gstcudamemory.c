@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstcudamemory.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_cuda_memory_debug_category);
+#define GST_CAT_DEFAULT gst_cuda_memory_debug_category
+
+G_DEFINE_TYPE_WITH_CODE (GstNvDecCudaAllocator, gst_nvdec_cuda_allocator,
+    GST_TYPE_ALLOCATOR,
+    GST_DEBUG_CATEGORY_INIT (gst_cuda_memory_debug_category, "cudamemory", 0,
+        "Debug category for CUDA device memory"));
+
+static GstMemory *
+gst_nvdec_cuda_allocator_alloc (GstAllocator * allocator, gsize size,
+    GstAllocationParams * params)
+{
+  GstNvDecCudaAllocator *cuda_allocator = GST_NVDEC_CUDA_ALLOCATOR (allocator);
+  GstNvDecCudaMemory *mem;
+  CUdeviceptr data = 0;
+
+  if (!cuda_OK (CuCtxPushCurrent (cuda_allocator->cuda_context->context))) {
+    GST_ERROR_OBJECT (allocator, "failed to push CUDA context");
+    return NULL;
+  }
+
+  if (!cuda_OK (CuMemAlloc (&data, size)))
+    GST_ERROR_OBJECT (allocator, "failed to allocate %" G_GSIZE_FORMAT
+        " bytes of device memory", size);
+
+  CuCtxPopCurrent (NULL);
+
+  if (!data)
+    return NULL;
+
+  mem = g_slice_new0 (GstNvDecCudaMemory);
+  gst_memory_init (GST_MEMORY_CAST (mem), GST_MEMORY_FLAG_NO_SHARE, allocator,
+      NULL, size, 0, 0, size);
+  mem->context = cuda_allocator->cuda_context->context;
+  mem->data = data;
+
+  GST_LOG_OBJECT (allocator, "allocated %" G_GSIZE_FORMAT " bytes", size);
+
+  return GST_MEMORY_CAST (mem);
+}
+
+static void
+gst_nvdec_cuda_allocator_free (GstAllocator * allocator, GstMemory * memory)
+{
+  GstNvDecCudaMemory *mem = (GstNvDecCudaMemory *) memory;
+
+  if (cuda_OK (CuCtxPushCurrent (mem->context))) {
+    if (!cuda_OK (CuMemFree (mem->data)))
+      GST_WARNING_OBJECT (allocator, "failed to free device memory");
+    CuCtxPopCurrent (NULL);
+  }
+
+  g_free (mem->host_data);
+  g_slice_free (GstNvDecCudaMemory, mem);
+}
+
+static void
+gst_nvdec_cuda_allocator_finalize (GObject * object)
+{
+  GstNvDecCudaAllocator *allocator = GST_NVDEC_CUDA_ALLOCATOR (object);
+
+  g_clear_object (&allocator->cuda_context);
+
+  G_OBJECT_CLASS (gst_nvdec_cuda_allocator_parent_class)->finalize (object);
+}
+
+static gpointer
+gst_nvdec_cuda_memory_map (GstMemory * memory, gsize maxsize, GstMapFlags flags)
+{
+  GstNvDecCudaMemory *mem = (GstNvDecCudaMemory *) memory;
+  gboolean ret = TRUE;
+
+  // Mapping is only here so that CPU elements still work,
+  // GPU consumers should use the device pointer directly
+  if (!mem->host_data)
+    mem->host_data = g_malloc (memory->maxsize);
+
+  if (flags & GST_MAP_READ) {
+    if (!cuda_OK (CuCtxPushCurrent (mem->context)))
+      return NULL;
+    ret = cuda_OK (CuMemcpyDtoH (mem->host_data, mem->data, memory->maxsize));
+    CuCtxPopCurrent (NULL);
+  }
+
+  if (!ret) {
+    GST_WARNING ("failed to download device memory");
+    return NULL;
+  }
+
+  mem->map_flags = flags;
+  return mem->host_data;
+}
+
+static void
+gst_nvdec_cuda_memory_unmap (GstMemory * memory)
+{
+  GstNvDecCudaMemory *mem = (GstNvDecCudaMemory *) memory;
+
+  if (!(mem->map_flags & GST_MAP_WRITE))
+    return;
+
+  if (!cuda_OK (CuCtxPushCurrent (mem->context)))
+    return;
+  if (!cuda_OK (CuMemcpyHtoD (mem->data, mem->host_data, memory->maxsize)))
+    GST_WARNING ("failed to upload device memory");
+  CuCtxPopCurrent (NULL);
+}
+
+static GstMemory *
+gst_nvdec_cuda_memory_share (GstMemory * memory, gssize offset, gssize size)
+{
+  return NULL;
+}
+
+static void
+gst_nvdec_cuda_allocator_class_init (GstNvDecCudaAllocatorClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+
+  gobject_class->finalize = gst_nvdec_cuda_allocator_finalize;
+  allocator_class->alloc = GST_DEBUG_FUNCPTR (gst_nvdec_cuda_allocator_alloc);
+  allocator_class->free = GST_DEBUG_FUNCPTR (gst_nvdec_cuda_allocator_free);
+}
+
+static void
+gst_nvdec_cuda_allocator_init (GstNvDecCudaAllocator * allocator)
+{
+  GstAllocator *alloc = GST_ALLOCATOR_CAST (allocator);
+
+  alloc->mem_type = GST_NVDEC_CUDA_MEMORY_TYPE_NAME;
+  alloc->mem_map = gst_nvdec_cuda_memory_map;
+  alloc->mem_unmap = gst_nvdec_cuda_memory_unmap;
+  alloc->mem_share = gst_nvdec_cuda_memory_share;
+
+  GST_OBJECT_FLAG_SET (allocator, GST_ALLOCATOR_FLAG_CUSTOM_ALLOC);
+}
+
+GstAllocator *
+gst_nvdec_cuda_allocator_new (GstNvDecCudaContext * cuda_context)
+{
+  GstNvDecCudaAllocator *allocator;
+
+  allocator = g_object_new (GST_TYPE_NVDEC_CUDA_ALLOCATOR, NULL);
+  gst_object_ref_sink (allocator);
+  allocator->cuda_context = g_object_ref (cuda_context);
+
+  return GST_ALLOCATOR_CAST (allocator);
+}
+
+gboolean
+gst_is_nvdec_cuda_memory (GstMemory * mem)
+{
+  return mem != NULL && mem->allocator != NULL
+      && GST_IS_NVDEC_CUDA_ALLOCATOR (mem->allocator);
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_CUDA_MEMORY_H__
+#define __GST_CUDA_MEMORY_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include <cuda.h>
+#include "gstnvdecloader.h"
+#include "gstcudacontext.h"
+
+G_BEGIN_DECLS
+
+// Private to this plugin, libgstcuda's memory:CUDAMemory
+// is a different memory with a different layout
+#define GST_NVDEC_CUDA_MEMORY_TYPE_NAME "gst.nvdec.cuda.memory"
+#define GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY "memory:NvDecCUDAMemory"
+
+#define GST_TYPE_NVDEC_CUDA_ALLOCATOR          (gst_nvdec_cuda_allocator_get_type())
+#define GST_NVDEC_CUDA_ALLOCATOR(obj)          (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_NVDEC_CUDA_ALLOCATOR, GstNvDecCudaAllocator))
+#define GST_NVDEC_CUDA_ALLOCATOR_CLASS(klass)  (G_TYPE_CHECK_CLASS_CAST((klass), GST_TYPE_NVDEC_CUDA_ALLOCATOR, GstNvDecCudaAllocatorClass))
+#define GST_IS_NVDEC_CUDA_ALLOCATOR(obj)       (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_NVDEC_CUDA_ALLOCATOR))
+
+typedef struct _GstNvDecCudaAllocator GstNvDecCudaAllocator;
+typedef struct _GstNvDecCudaAllocatorClass GstNvDecCudaAllocatorClass;
+typedef struct _GstNvDecCudaMemory GstNvDecCudaMemory;
+
+struct _GstNvDecCudaMemory
+{
+  GstMemory mem;
+
+  // Kept alive by the allocator, which the memory holds
+  CUcontext context;
+  CUdeviceptr data;
+
+  // Host copy of the device memory, only used when
+  // something maps the memory for CPU access
+  gpointer host_data;
+  GstMapFlags map_flags;
+};
+
+struct _GstNvDecCudaAllocator
+{
+  GstAllocator parent;
+
+  // Held until finalize, buffers can outlive the elements
+  // and the shared context goes with the last of them
+  GstNvDecCudaContext *cuda_context;
+};
+
+struct _GstNvDecCudaAllocatorClass
+{
+  GstAllocatorClass parent_class;
+};
+
+GType gst_nvdec_cuda_allocator_get_type (void);
+
+GstAllocator * gst_nvdec_cuda_allocator_new (GstNvDecCudaContext *
+    cuda_context);
+
+gboolean gst_is_nvdec_cuda_memory (GstMemory * mem);
+
+G_END_DECLS
+
+#endif /* __GST_CUDA_MEMORY_H__ */
@@ -30,35 +30,160 @@
 #endif
 
 #include "gstnvdec.h"
+#include "gstcudamemory.h"
+#include "gstcudahostpool.h"
+#include "gstcudadevice.h"
+#include "gstnvdecconvert.h"
+#include "gstnvmultidec.h"
+#include "gstnvtensorbatch.h"
 
 #include <gst/gl/gstglfuncs.h>
 #include <cudaGL.h>
 
-// According to the NVCodec sample, 20 is the min for h264
+// Used until the stream reports how many surfaces it needs,
+// according to the NVCodec sample, 20 is the min for h264
 #define NUM_SURFACES_H264 20
 #define NUM_SURFACES_H265 20
 #define NUM_SURFACES_MPEG 20
 #define NUM_SURFACES_JPEG 1
+#define NUM_SURFACES_VP8 8
+// VP9 and AV1 keep 8 reference frames, plus the one being decoded
+// and some room for the parser's lookahead
+#define NUM_SURFACES_VP9 12
+#define NUM_SURFACES_AV1 12
+// Upper limit of the hardware
+#define MAX_DECODE_SURFACES 32
+#define DEFAULT_SURFACE_HEADROOM 2
+#define DEFAULT_LOW_LATENCY FALSE
+#define DEFAULT_MAX_DISPLAY_DELAY 0
+// Largest display delay the parser accepts
+#define MAX_DISPLAY_DELAY 16
+#define DEFAULT_SKIP_FRAMES GST_NVDEC_SKIP_FRAMES_NONE
 
 typedef enum
 {
   GST_NVDEC_QUEUE_ITEM_TYPE_SEQUENCE,
   GST_NVDEC_QUEUE_ITEM_TYPE_DECODE,
-  GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY
+  GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY,
+  GST_NVDEC_QUEUE_ITEM_TYPE_DRAIN
 } GstNvDecQueueItemType;
 
+// Maximum number of frames that can be mapped for download at once
+#define MAX_OUTPUT_SURFACES 8
+// Frames upstream can queue before handle_frame blocks
+#define INPUT_QUEUE_SIZE 4
+// Finished frames the push thread may fall behind by before the
+// scheduler's workers stop taking input. The queue has room for what
+// one more input frame can finish on top, a drain of every surface
+// and download with the frames displayed before a sequence change
+#define FINISHED_QUEUE_LIMIT 4
+#define FINISHED_QUEUE_SIZE (FINISHED_QUEUE_LIMIT \
+    + 2 * MAX_DECODE_SURFACES + MAX_OUTPUT_SURFACES + 1)
+#define DEFAULT_PIPELINED FALSE
+
 enum
 {
     PROP_0,
     PROP_CTX,
-    PROP_LOCK
+    PROP_LOCK,
+    PROP_NUMA_NODE,
+    PROP_NUM_OUTPUT_SURFACES,
+    PROP_ALLOCATIONS,
+    PROP_MAX_WIDTH,
+    PROP_MAX_HEIGHT,
+    PROP_SURFACE_HEADROOM,
+    PROP_SURFACE_MEMORY,
+    PROP_CUDA_DEVICE_ID,
+    PROP_DEVICE_POLICY,
+    PROP_LOW_LATENCY,
+    PROP_MAX_DISPLAY_DELAY,
+    PROP_SKIP_FRAMES,
+    PROP_PIPELINED,
+    PROP_STATS
+};
+
+// Must be a power of two. The parser produces a handful of items per
+// packet (more when it flushes its reorder queue), so this is never
+// close to full as the queue is drained after every packet
+#define DECODE_QUEUE_SIZE 256
+
+// A frame waiting to be decoded or displayed. Frames of an older
+// generation were flushed, the base class has forgotten them
+struct _GstNvDecFrameSlot
+{
+  GstVideoCodecFrame *frame;
+  guint generation;
+  // Never decoded, the picture is only there for the parser
+  gboolean skip;
+  // Skipped because it was late, dropped with a QoS message
+  gboolean late;
+  // Monotonic time handle_frame got the frame
+  GstClockTime receive_time;
 };
 
-typedef struct _GstNvDecQueueItem
+// Only what handle_pending_frames needs from the parser callbacks,
+// copied by value so the queue never allocates
+struct _GstNvDecQueueItem
 {
   GstNvDecQueueItemType type;
-  gpointer data;
-} GstNvDecQueueItem;
+  // Stamped when queued, items from before a flush are thrown away
+  guint generation;
+  union
+  {
+    struct
+    {
+      guint width;
+      guint height;
+      // Before scaling, streams that don't signal a
+      // matrix get the one for their own height
+      guint display_height;
+      guint fps_n;
+      guint fps_d;
+      gint par_n;
+      gint par_d;
+      gboolean progressive;
+      guint matrix_coefficients;
+      gboolean full_range;
+      guint bit_depth_minus8;
+      guint num_decode_surfaces;
+    } sequence;
+    struct
+    {
+      GstNvDecFrameSlot slot;
+      gint picture_index;
+      gboolean intra;
+      gboolean ref;
+    } decode;
+    CUVIDPARSERDISPINFO display;
+  };
+};
+
+// Most displays copied under one lock, the parser can't be further
+// ahead than the surface headroom so batches are rarely this big
+#define MAX_DISPLAY_BATCH 8
+
+// A displayed frame waiting to be copied out with the rest of the batch
+struct _GstNvDecDisplay
+{
+  CUVIDPARSERDISPINFO dispinfo;
+  GstVideoCodecFrame *frame;
+  GstMapInfo map;
+  gboolean mapped;
+  CUdeviceptr dst_device;
+  gboolean copied;
+};
+
+// A frame whose surface is mapped and is being copied out
+// on the CUDA stream, done once the event has completed
+struct _GstNvDecDownload
+{
+  GstVideoCodecFrame *frame;
+  CUdeviceptr dptr;
+  CUevent event;
+  // System memory output buffers stay mapped until the copy is done
+  GstMapInfo map;
+  gboolean mapped;
+};
 
 #if USE_GL
 typedef struct _GstNvDecCudaGraphicsResourceInfo
@@ -72,8 +197,6 @@ typedef struct _GstNvDecCudaGraphicsResourceInfo
 GST_DEBUG_CATEGORY_STATIC (gst_nvdec_debug_category);
 #define GST_CAT_DEFAULT gst_nvdec_debug_category
 
-//G_DEFINE_TYPE (GstNvDecCudaContext, gst_nvdec_cuda_context, G_TYPE_OBJECT);
-
 static gboolean gst_nvdec_start (GstVideoDecoder * decoder);
 static gboolean gst_nvdec_stop (GstVideoDecoder * decoder);
 static gboolean gst_nvdec_set_format (GstVideoDecoder * decoder,
@@ -81,33 +204,77 @@ static gboolean gst_nvdec_set_format (GstVideoDecoder * decoder,
 static GstFlowReturn gst_nvdec_handle_frame (GstVideoDecoder * decoder,
     GstVideoCodecFrame * frame);
 static void gst_nvdec_set_context (GstElement * element, GstContext * context);
-#if USE_GL
 static gboolean gst_nvdec_decide_allocation (GstVideoDecoder * decoder,
     GstQuery * query);
 static gboolean gst_nvdec_src_query (GstVideoDecoder * decoder,
     GstQuery * query);
-#endif
+static gboolean gst_nvdec_sink_query (GstVideoDecoder * decoder,
+    GstQuery * query);
+static GstCaps *gst_nvdec_getcaps (GstVideoDecoder * decoder,
+    GstCaps * filter);
+static void gst_nvdec_finalize (GObject * object);
 static gboolean gst_nvdec_flush (GstVideoDecoder * decoder);
 static GstFlowReturn gst_nvdec_drain (GstVideoDecoder * decoder);
+static GstFlowReturn gst_nvdec_finish (GstVideoDecoder * decoder);
+static gboolean gst_nvdec_sink_event (GstVideoDecoder * decoder,
+    GstEvent * event);
+static GstFlowReturn handle_pending_frames (GstNvDec * nvdec);
+static gboolean parse_frame (GstNvDec * nvdec, GstVideoCodecFrame * frame);
+static GstFlowReturn queue_input_frame (GstNvDec * nvdec,
+    GstVideoCodecFrame * frame);
+static void schedule_task (GstNvDec * nvdec);
+static void start_threads (GstNvDec * nvdec);
+static void stop_threads (GstNvDec * nvdec);
+static void pause_threads (GstNvDec * nvdec, gboolean stream_locked);
+static void resume_threads (GstNvDec * nvdec);
 static void gst_nvdec_set_property (GObject * object,
     guint prop_id, const GValue * value, GParamSpec * pspec);
 static void gst_nvdec_get_property (GObject * object,
     guint prop_id, GValue * value, GParamSpec * pspec);
+static GstFlowReturn finish_downloads (GstNvDec * nvdec, gboolean wait);
+static void drop_downloads (GstNvDec * nvdec);
 
-static GstStaticPadTemplate gst_nvdec_sink_template =
-    GST_STATIC_PAD_TEMPLATE (GST_VIDEO_DECODER_SINK_NAME,
-    GST_PAD_SINK, GST_PAD_ALWAYS,
-    GST_STATIC_CAPS ("video/x-h264, stream-format=byte-stream, alignment=au; "
-        "video/x-h265, stream-format=byte-stream, alignment=au; "
-        "video/mpeg, mpegversion={ 1, 2, 4 }, systemstream=false; "
-        "image/jpeg")
-    );
+typedef struct
+{
+  const gchar *caps;
+  cudaVideoCodec codec;
+  guint num_decode_surfaces;
+} GstNvDecCodecMap;
+
+// Sink caps are built from the codecs the GPUs in the system can
+// decode, see gst_nvdec_get_sink_caps()
+static const GstNvDecCodecMap gst_nvdec_codec_map[] = {
+  {"video/x-h264, stream-format={ byte-stream, avc, avc3 }, alignment=au",
+      cudaVideoCodec_H264, NUM_SURFACES_H264},
+  {"video/x-h265, stream-format={ byte-stream, hvc1, hev1 }, alignment=au",
+      cudaVideoCodec_HEVC, NUM_SURFACES_H265},
+  {"video/mpeg, mpegversion=1, systemstream=false",
+      cudaVideoCodec_MPEG1, NUM_SURFACES_MPEG},
+  {"video/mpeg, mpegversion=2, systemstream=false",
+      cudaVideoCodec_MPEG2, NUM_SURFACES_MPEG},
+  {"video/mpeg, mpegversion=4, systemstream=false",
+      cudaVideoCodec_MPEG4, NUM_SURFACES_MPEG},
+  {"image/jpeg", cudaVideoCodec_JPEG, NUM_SURFACES_JPEG},
+  {"video/x-vp8", cudaVideoCodec_VP8, NUM_SURFACES_VP8},
+  {"video/x-vp9", cudaVideoCodec_VP9, NUM_SURFACES_VP9},
+#if NVDECAPI_MAJOR_VERSION >= 11
+  {"video/x-av1, stream-format=obu-stream, alignment=tu",
+      cudaVideoCodec_AV1, NUM_SURFACES_AV1},
+#endif
+};
 
 #if !USE_GL
+// Anything but NV12 is converted on the GPU before download
+// High bit depth streams are output as P010_10LE or P016_LE only
+#define OUTPUT_FORMATS "{ NV12, I420, BGRx, RGBA, GBR, P010_10LE, P016_LE }"
+
 static GstStaticPadTemplate gst_nvdec_src_template =
 GST_STATIC_PAD_TEMPLATE (GST_VIDEO_DECODER_SRC_NAME,
     GST_PAD_SRC, GST_PAD_ALWAYS,
-    GST_STATIC_CAPS (GST_VIDEO_CAPS_MAKE("NV12"))
+    GST_STATIC_CAPS (
+        GST_VIDEO_CAPS_MAKE_WITH_FEATURES
+        (GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY, OUTPUT_FORMATS) ";"
+        GST_VIDEO_CAPS_MAKE(OUTPUT_FORMATS))
     );
 #else
 static GstStaticPadTemplate gst_nvdec_src_template =
@@ -120,25 +287,88 @@ GST_STATIC_PAD_TEMPLATE (GST_VIDEO_DECODER_SRC_NAME,
     );
 #endif
 
+GType
+gst_nvdec_skip_frames_get_type (void)
+{
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    {GST_NVDEC_SKIP_FRAMES_NONE, "Decode all frames", "none"},
+    {GST_NVDEC_SKIP_FRAMES_NON_REF,
+        "Skip frames that aren't used as a reference", "non-ref"},
+    {GST_NVDEC_SKIP_FRAMES_NON_KEY,
+        "Skip everything but intra frames", "non-key"},
+    {0, NULL, NULL}
+  };
+
+  if (g_once_init_enter (&type)) {
+    GType tmp = g_enum_register_static ("GstNvDecSkipFrames", values);
+    g_once_init_leave (&type, tmp);
+  }
+
+  return (GType) type;
+}
+
 G_DEFINE_TYPE_WITH_CODE (GstNvDec, gst_nvdec, GST_TYPE_VIDEO_DECODER,
     GST_DEBUG_CATEGORY_INIT (gst_nvdec_debug_category, "nvdec", 0,
         "Debug category for the nvdec element"));
 
-
-static inline gboolean
-cuda_OK (CUresult result)
+// The lock is shared with every element on the device,
+// waiting for it shows up as its own stage
+static gboolean
+lock_context (GstNvDec * nvdec)
 {
-  const gchar *error_name, *error_text;
+  GstClockTime start = GST_NVDEC_TRACE_BEGIN (GST_NVDEC_STAGE_LOCK_WAIT);
+  GstClockTime wait_start = gst_util_get_timestamp ();
+  gboolean ret = cuda_OK (CuvidCtxLock (nvdec->lock, 0));
 
-  if (result != CUDA_SUCCESS) {
-    cuGetErrorName (result, &error_name);
-    cuGetErrorString (result, &error_text);
-    GST_WARNING ("CUDA call failed: %s, %s", error_name, error_text);
-    return FALSE;
+  GST_NVDEC_TRACE_END (nvdec, GST_NVDEC_STAGE_LOCK_WAIT, start);
+
+  if (ret) {
+    nvdec->lock_time = gst_util_get_timestamp ();
+    nvdec->lock_wait_time += nvdec->lock_time - wait_start;
+    nvdec->num_locks++;
   }
 
-  return TRUE;
+  return ret;
+}
+
+static gboolean
+unlock_context (GstNvDec * nvdec)
+{
+  nvdec->lock_hold_time += gst_util_get_timestamp () - nvdec->lock_time;
+
+  return cuda_OK (CuvidCtxUnlock (nvdec->lock, 0));
+}
+
+// The context each thread has made current for good. The parse,
+// output and scheduler threads are ours and bind it once, on any
+// other thread it's pushed and popped around each use
+static GPrivate bound_context;
+
+static void
+bind_context (GstNvDec * nvdec)
+{
+  if (!nvdec->context || g_private_get (&bound_context) == nvdec->context)
+    return;
+
+  if (cuda_OK (CuCtxSetCurrent (nvdec->context)))
+    g_private_set (&bound_context, nvdec->context);
+}
+
+static inline void
+push_context (GstNvDec * nvdec)
+{
+  if (g_private_get (&bound_context) != nvdec->context)
+    CuCtxPushCurrent (nvdec->context);
+}
+
+static inline void
+pop_context (GstNvDec * nvdec)
+{
+  if (g_private_get (&bound_context) != nvdec->context)
+    CuCtxPopCurrent (NULL);
 }
+
 static const char * GetVideoChromaFormatString(cudaVideoChromaFormat eChromaFormat) {
   static struct {
     cudaVideoChromaFormat eChromaFormat;
@@ -171,6 +401,9 @@ static const char * GetVideoCodecString(cudaVideoCodec eCodec) {
   { cudaVideoCodec_HEVC,      "H.265/HEVC" },
   { cudaVideoCodec_VP8,       "VP8" },
   { cudaVideoCodec_VP9,       "VP9" },
+#if NVDECAPI_MAJOR_VERSION >= 11
+  { cudaVideoCodec_AV1,       "AV1" },
+#endif
   { cudaVideoCodec_NumCodecs, "Invalid" },
   { cudaVideoCodec_YUV420,    "YUV  4:2:0" },
   { cudaVideoCodec_YV12,      "YV12 4:2:0" },
@@ -200,13 +433,13 @@ register_cuda_resource (GstGLContext * context, gpointer * args)
   GstMapInfo map_info = GST_MAP_INFO_INIT;
   guint texture_id;
 
-  if (!cuda_OK (cuvidCtxLock (cgr_info->cuda_context->lock, 0)))
+  if (!cuda_OK (CuvidCtxLock (cgr_info->cuda_context->lock, 0)))
     GST_WARNING ("failed to lock CUDA context");
 
   if (gst_memory_map (mem, &map_info, GST_MAP_READ | GST_MAP_GL)) {
     texture_id = *(guint *) map_info.data;
 
-    if (!cuda_OK (cuGraphicsGLRegisterImage (&cgr_info->resource, texture_id,
+    if (!cuda_OK (CuGraphicsGLRegisterImage (&cgr_info->resource, texture_id,
                 GL_TEXTURE_2D, CU_GRAPHICS_REGISTER_FLAGS_WRITE_DISCARD)))
       GST_WARNING ("failed to register texture with CUDA");
 
@@ -214,7 +447,7 @@ register_cuda_resource (GstGLContext * context, gpointer * args)
   } else
     GST_WARNING ("failed to map memory");
 
-  if (!cuda_OK (cuvidCtxUnlock (cgr_info->cuda_context->lock, 0)))
+  if (!cuda_OK (CuvidCtxUnlock (cgr_info->cuda_context->lock, 0)))
     GST_WARNING ("failed to unlock CUDA context");
 }
 
@@ -222,14 +455,14 @@ static void
 unregister_cuda_resource (GstGLContext * context,
     GstNvDecCudaGraphicsResourceInfo * cgr_info)
 {
-  if (!cuda_OK (cuvidCtxLock (cgr_info->cuda_context->lock, 0)))
+  if (!cuda_OK (CuvidCtxLock (cgr_info->cuda_context->lock, 0)))
     GST_WARNING ("failed to lock CUDA context");
 
-  if (!cuda_OK (cuGraphicsUnregisterResource ((const CUgraphicsResource)
+  if (!cuda_OK (CuGraphicsUnregisterResource ((const CUgraphicsResource)
               cgr_info->resource)))
     GST_WARNING ("failed to unregister resource");
 
-  if (!cuda_OK (cuvidCtxUnlock (cgr_info->cuda_context->lock, 0)))
+  if (!cuda_OK (CuvidCtxUnlock (cgr_info->cuda_context->lock, 0)))
     GST_WARNING ("failed to unlock CUDA context");
 }
 
@@ -277,15 +510,120 @@ ensure_cuda_graphics_resource (GstMemory * mem,
 }
 #endif
 
+static gboolean
+probe_codec (cudaVideoCodec codec)
+{
+  CUVIDDECODECAPS decodecaps;
+
+  memset (&decodecaps, 0, sizeof (decodecaps));
+  decodecaps.eCodecType = codec;
+  decodecaps.eChromaFormat = cudaVideoChromaFormat_420;
+  decodecaps.nBitDepthMinus8 = 0;
+
+  return cuda_OK (CuvidGetDecoderCaps (&decodecaps))
+      && decodecaps.bIsSupported;
+}
+
+// Caps for every codec at least one of the GPUs can decode, or every
+// codec there is without probe. If CUDA can't be initialized all codecs
+// are advertised and the error is reported when the element starts
+static GstCaps *
+gst_nvdec_probe_sink_caps (gboolean probe)
+{
+  gboolean supported[G_N_ELEMENTS (gst_nvdec_codec_map)] = { FALSE, };
+  GstCaps *caps;
+  CUdevice device;
+  CUcontext context;
+  gint num_devices = 0;
+  gint i;
+  guint j;
+
+  if (!probe) {
+    for (j = 0; j < G_N_ELEMENTS (gst_nvdec_codec_map); j++)
+      supported[j] = TRUE;
+  } else if (!cuda_OK (CuInit (0))
+      || !cuda_OK (CuDeviceGetCount (&num_devices)) || num_devices == 0) {
+    GST_WARNING ("no CUDA devices, not probing codecs");
+    for (j = 0; j < G_N_ELEMENTS (gst_nvdec_codec_map); j++)
+      supported[j] = TRUE;
+  }
+
+  for (i = 0; i < num_devices; i++) {
+    if (!cuda_OK (CuDeviceGet (&device, i))
+        || !cuda_OK (CuDevicePrimaryCtxRetain (&context, device)))
+      continue;
+
+    if (cuda_OK (CuCtxPushCurrent (context))) {
+      for (j = 0; j < G_N_ELEMENTS (gst_nvdec_codec_map); j++) {
+        if (!supported[j] && probe_codec (gst_nvdec_codec_map[j].codec)) {
+          GST_INFO ("device %d can decode %s", i,
+              GetVideoCodecString (gst_nvdec_codec_map[j].codec));
+          supported[j] = TRUE;
+        }
+      }
+      CuCtxPopCurrent (NULL);
+    }
+
+    CuDevicePrimaryCtxRelease (device);
+  }
+
+  caps = gst_caps_new_empty ();
+  for (j = 0; j < G_N_ELEMENTS (gst_nvdec_codec_map); j++) {
+    if (supported[j])
+      gst_caps_append (caps, gst_caps_from_string (gst_nvdec_codec_map[j].caps));
+  }
+
+  return caps;
+}
+
+// Probing loads the driver and touches every device, that's kept out
+// of plugin registration and done the first time caps are queried
+static GstCaps *
+gst_nvdec_get_sink_caps (void)
+{
+  static gsize caps = 0;
+
+  if (g_once_init_enter (&caps)) {
+    GstCaps *probed = gst_nvdec_probe_sink_caps (TRUE);
+
+    GST_MINI_OBJECT_FLAG_SET (probed, GST_MINI_OBJECT_FLAG_MAY_BE_LEAKED);
+    g_once_init_leave (&caps, (gsize) probed);
+  }
+
+  return (GstCaps *) caps;
+}
+
+static const GstNvDecCodecMap *
+find_codec (GstCaps * caps)
+{
+  GstCaps *codec_caps;
+  gboolean found;
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (gst_nvdec_codec_map); i++) {
+    codec_caps = gst_caps_from_string (gst_nvdec_codec_map[i].caps);
+    found = gst_caps_can_intersect (caps, codec_caps);
+    gst_caps_unref (codec_caps);
+    if (found)
+      return &gst_nvdec_codec_map[i];
+  }
+
+  return NULL;
+}
+
 static void
 gst_nvdec_class_init (GstNvDecClass * klass)
 {
   GstVideoDecoderClass *video_decoder_class = GST_VIDEO_DECODER_CLASS (klass);
   GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstCaps *sink_caps;
 
-  gst_element_class_add_static_pad_template (element_class,
-      &gst_nvdec_sink_template);
+  sink_caps = gst_nvdec_probe_sink_caps (FALSE);
+  gst_element_class_add_pad_template (element_class,
+      gst_pad_template_new (GST_VIDEO_DECODER_SINK_NAME, GST_PAD_SINK,
+          GST_PAD_ALWAYS, sink_caps));
+  gst_caps_unref (sink_caps);
   gst_element_class_add_static_pad_template (element_class,
       &gst_nvdec_src_template);
 
@@ -301,27 +639,121 @@ gst_nvdec_class_init (GstNvDecClass * klass)
   video_decoder_class->set_format = GST_DEBUG_FUNCPTR (gst_nvdec_set_format);
   video_decoder_class->handle_frame =
       GST_DEBUG_FUNCPTR (gst_nvdec_handle_frame);
-#if USE_GL
   video_decoder_class->decide_allocation =
       GST_DEBUG_FUNCPTR (gst_nvdec_decide_allocation);
   video_decoder_class->src_query = GST_DEBUG_FUNCPTR (gst_nvdec_src_query);
-#endif
+  video_decoder_class->sink_query = GST_DEBUG_FUNCPTR (gst_nvdec_sink_query);
+  video_decoder_class->getcaps = GST_DEBUG_FUNCPTR (gst_nvdec_getcaps);
   video_decoder_class->drain = GST_DEBUG_FUNCPTR (gst_nvdec_drain);
+  video_decoder_class->finish = GST_DEBUG_FUNCPTR (gst_nvdec_finish);
+  video_decoder_class->sink_event = GST_DEBUG_FUNCPTR (gst_nvdec_sink_event);
   video_decoder_class->flush = GST_DEBUG_FUNCPTR (gst_nvdec_flush);
 
-#if USE_GL
   element_class->set_context = GST_DEBUG_FUNCPTR (gst_nvdec_set_context);
-#endif
+  gobject_class->finalize = gst_nvdec_finalize;
 
   g_object_class_install_property (gobject_class, PROP_CTX,
       g_param_spec_uint64 ("context", "context",
-          "Cuda Context", 0, G_MAXUINT64, 0,
+          "Cuda Context (deprecated, share one through GstContext instead)",
+          0, G_MAXUINT64, 0,
           (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
   g_object_class_install_property (gobject_class, PROP_LOCK,
       g_param_spec_uint64 ("lock", "lock",
-          "Cuda Context Lock", 0, G_MAXUINT64, 0,
+          "Cuda Context Lock (deprecated, share one through GstContext "
+          "instead)", 0, G_MAXUINT64, 0,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_NUMA_NODE,
+      g_param_spec_int ("numa-node", "NUMA node",
+          "NUMA node for the pinned download buffers "
+          "(-1 = the node closest to the GPU)", -1, G_MAXINT, -1,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_NUM_OUTPUT_SURFACES,
+      g_param_spec_uint ("num-output-surfaces", "Number of output surfaces",
+          "Number of frames that can be downloaded at the same time, "
+          "more than 1 overlaps downloads with decoding", 1,
+          MAX_OUTPUT_SURFACES, 1,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_ALLOCATIONS,
+      g_param_spec_uint ("allocations", "Allocations",
+          "Number of heap allocations made by the decode path", 0,
+          G_MAXUINT, 0,
+          (GParamFlags)(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_WIDTH,
+      g_param_spec_uint ("max-width", "Maximum width",
+          "Largest width the decoder is created for, resolution changes "
+          "up to this size don't recreate the decoder (0 = stream width)",
+          0, G_MAXUINT, 0,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_HEIGHT,
+      g_param_spec_uint ("max-height", "Maximum height",
+          "Largest height the decoder is created for, resolution changes "
+          "up to this size don't recreate the decoder (0 = stream height)",
+          0, G_MAXUINT, 0,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_SURFACE_HEADROOM,
+      g_param_spec_uint ("surface-headroom", "Surface headroom",
+          "Decode surfaces allocated on top of what the stream needs",
+          0, MAX_DECODE_SURFACES, DEFAULT_SURFACE_HEADROOM,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_SURFACE_MEMORY,
+      g_param_spec_uint64 ("surface-memory", "Surface memory",
+          "Approximate GPU memory used by the decode and output surfaces, "
+          "in bytes", 0, G_MAXUINT64, 0,
+          (GParamFlags)(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_CUDA_DEVICE_ID,
+      g_param_spec_int ("cuda-device-id", "CUDA device ID",
+          "Device to decode on when no context is set "
+          "(-1 = pick one with device-policy)", -1, G_MAXINT, 0,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_DEVICE_POLICY,
+      g_param_spec_enum ("device-policy", "Device policy",
+          "How the device is picked when cuda-device-id is -1",
+          GST_TYPE_CUDA_DEVICE_POLICY, GST_CUDA_DEVICE_POLICY_FEWEST_SESSIONS,
           (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_LOW_LATENCY,
+      g_param_spec_boolean ("low-latency", "Low latency",
+          "Tell the parser each input buffer is a whole picture so it's "
+          "decoded right away instead of when the next buffer arrives",
+          DEFAULT_LOW_LATENCY,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_MAX_DISPLAY_DELAY,
+      g_param_spec_uint ("max-display-delay", "Maximum display delay",
+          "Pictures the parser may hold back before displaying them, more "
+          "lets decoding run ahead of the output at the cost of latency. "
+          "Applies from the next caps",
+          0, MAX_DISPLAY_DELAY, DEFAULT_MAX_DISPLAY_DELAY,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_SKIP_FRAMES,
+      g_param_spec_enum ("skip-frames", "Skip frames",
+          "Pictures that aren't decoded, a key unit trick mode seek "
+          "skips everything but intra frames as well",
+          GST_TYPE_NVDEC_SKIP_FRAMES, DEFAULT_SKIP_FRAMES,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_PIPELINED,
+      g_param_spec_boolean ("pipelined", "Pipelined",
+          "Parse and submit pictures on one thread and download them on "
+          "another so parsing, decoding and downloads overlap. Applies "
+          "when the element starts", DEFAULT_PIPELINED,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics", "Decoder statistics",
+          GST_TYPE_STRUCTURE,
+          (GParamFlags)(G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
 }
 
 static void
@@ -329,279 +761,1010 @@ gst_nvdec_init (GstNvDec * nvdec)
 {
   gst_video_decoder_set_packetized (GST_VIDEO_DECODER (nvdec), TRUE);
   gst_video_decoder_set_needs_format (GST_VIDEO_DECODER (nvdec), TRUE);
-  nvdec->did_make_context = FALSE;
+  nvdec->numa_node = -1;
+  nvdec->num_output_surfaces = 1;
+  nvdec->surface_headroom = DEFAULT_SURFACE_HEADROOM;
+  nvdec->device_policy = GST_CUDA_DEVICE_POLICY_FEWEST_SESSIONS;
+  nvdec->device = -1;
+  nvdec->low_latency = DEFAULT_LOW_LATENCY;
+  nvdec->max_display_delay = DEFAULT_MAX_DISPLAY_DELAY;
+  nvdec->skip_frames = DEFAULT_SKIP_FRAMES;
+  nvdec->pipelined = DEFAULT_PIPELINED;
+  g_mutex_init (&nvdec->queue_lock);
+  g_cond_init (&nvdec->queue_cond);
 }
 
-static gboolean
-parser_sequence_callback (GstNvDec * nvdec, CUVIDEOFORMAT * format)
+// Waiters count themselves in ring_waiters before checking the ring,
+// so a change they didn't see is made by someone who sees the count
+static void
+wake_ring_waiters (GstNvDec * nvdec)
 {
-  GstNvDecQueueItem *item;
-  guint width, height;
-  CUVIDDECODECREATEINFO create_info = { 0, };
-  gboolean ret = TRUE;
-
-  width = format->display_area.right - format->display_area.left;
-  height = format->display_area.bottom - format->display_area.top;
-  //GST_DEBUG ("Parser callback");
-  GST_DEBUG_OBJECT (nvdec, "width: %u, height: %u", width, height);
+  if (g_atomic_int_get (&nvdec->ring_waiters)) {
+    g_mutex_lock (&nvdec->queue_lock);
+    g_cond_broadcast (&nvdec->queue_cond);
+    g_mutex_unlock (&nvdec->queue_lock);
+  }
+}
 
-  if (!nvdec->decoder || (nvdec->width != width || nvdec->height != height)) {
-    if (!cuda_OK (cuvidCtxLock (nvdec->lock, 0))) {
-      GST_ERROR_OBJECT (nvdec, "failed to lock CUDA context");
-      return FALSE;
-    }
+static gboolean
+decode_queue_empty (GstNvDec * nvdec)
+{
+  return g_atomic_int_get (&nvdec->decode_queue_head)
+      == g_atomic_int_get (&nvdec->decode_queue_tail);
+}
 
-    if (nvdec->decoder) {
-      GST_DEBUG_OBJECT (nvdec, "destroying decoder");
-      if (!cuda_OK (cuvidDestroyDecoder (nvdec->decoder))) {
-        GST_ERROR_OBJECT (nvdec, "failed to destroy decoder");
-        ret = FALSE;
-      } else
-        nvdec->decoder = NULL;
-    }
+static gboolean
+decode_queue_full (GstNvDec * nvdec, const GstNvDecQueueItem * item)
+{
+  if ((guint) (g_atomic_int_get (&nvdec->decode_queue_tail)
+          - g_atomic_int_get (&nvdec->decode_queue_head))
+      == DECODE_QUEUE_SIZE)
+    return TRUE;
+
+  // The parser reuses a surface as soon as it has been displayed,
+  // the output thread must not fall further behind than the headroom
+  return item->type == GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY
+      && g_atomic_int_get (&nvdec->num_pending_displays)
+      >= (gint) MAX (1, nvdec->surface_headroom);
+}
 
-    GST_DEBUG_OBJECT (nvdec, "creating decoder");
-    create_info.ulWidth = width;
-    create_info.ulHeight = height;
-    create_info.ulNumDecodeSurfaces = nvdec->num_decode_surfaces;
-    create_info.CodecType = format->codec;
-    create_info.ChromaFormat = format->chroma_format;
-    //create_info.ulCreationFlags = cudaVideoCreate_Default;
-    create_info.ulCreationFlags = cudaVideoCreate_PreferCUVID;
-    create_info.display_area.left = format->display_area.left;
-    create_info.display_area.top = format->display_area.top;
-    create_info.display_area.right = format->display_area.right;
-    create_info.display_area.bottom = format->display_area.bottom;
-    create_info.OutputFormat = cudaVideoSurfaceFormat_NV12;
-    create_info.DeinterlaceMode = cudaVideoDeinterlaceMode_Weave;
-    create_info.ulTargetWidth = width;
-    create_info.ulTargetHeight = height;
-    create_info.ulNumOutputSurfaces = 1;
-    create_info.vidLock = nvdec->lock;
-    create_info.target_rect.left = 0;
-    create_info.target_rect.top = 0;
-    create_info.target_rect.right = width;
-    create_info.target_rect.bottom = height;
-
-    if (nvdec->decoder)
-      GST_WARNING_OBJECT(nvdec, "Already have decoder?");
-
-    cuCtxPushCurrent(nvdec->context);
-    if (nvdec->decoder
-        || !cuda_OK (cuvidCreateDecoder (&nvdec->decoder, &create_info))) {
-      GST_ERROR_OBJECT (nvdec, "failed to create decoder");
-      ret = FALSE;
-    }
-    else {
-        GST_DEBUG_OBJECT (nvdec, "created decoder");
-    }
-    cuCtxPopCurrent(NULL);
+// The parser callbacks are the only producer and handle_pending_frames
+// the only consumer, so the queue needs no lock. In pipelined mode
+// the parse thread waits here while the output thread catches up
+static gboolean
+decode_queue_push (GstNvDec * nvdec, const GstNvDecQueueItem * item)
+{
+  gint tail = nvdec->decode_queue_tail;
+  GstNvDecQueueItem *queued;
+
+  if (nvdec->parse_thread && decode_queue_full (nvdec, item)) {
+    g_mutex_lock (&nvdec->queue_lock);
+    g_atomic_int_inc (&nvdec->ring_waiters);
+    while (!nvdec->paused && !nvdec->stopping
+        && decode_queue_full (nvdec, item))
+      g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
+    g_atomic_int_add (&nvdec->ring_waiters, -1);
+    g_mutex_unlock (&nvdec->queue_lock);
+  }
 
-    if (!cuda_OK (cuvidCtxUnlock (nvdec->lock, 0))) {
-      GST_ERROR_OBJECT (nvdec, "failed to unlock CUDA context");
-      ret = FALSE;
-    }
+  if ((guint) (tail - g_atomic_int_get (&nvdec->decode_queue_head))
+      == DECODE_QUEUE_SIZE) {
+    GST_ERROR_OBJECT (nvdec, "decode queue is full");
+    return FALSE;
   }
 
-  item = g_slice_new (GstNvDecQueueItem);
-  item->type = GST_NVDEC_QUEUE_ITEM_TYPE_SEQUENCE;
-  item->data = g_memdup (format, sizeof (CUVIDEOFORMAT));
-  g_async_queue_push (nvdec->decode_queue, item);
+  queued = &nvdec->decode_queue[(guint) tail & (DECODE_QUEUE_SIZE - 1)];
+  *queued = *item;
+  queued->generation = nvdec->generation;
+  if (item->type == GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY)
+    g_atomic_int_inc (&nvdec->num_pending_displays);
+  g_atomic_int_set (&nvdec->decode_queue_tail, tail + 1);
+  wake_ring_waiters (nvdec);
 
-  return ret;
+  return TRUE;
 }
 
 static gboolean
-parser_decode_callback (GstNvDec * nvdec, CUVIDPICPARAMS * params)
+decode_queue_pop (GstNvDec * nvdec, GstNvDecQueueItem * item)
 {
-  GstNvDecQueueItem *item;
-  //GST_DEBUG ("decode callback");
-
-  GST_DEBUG_OBJECT (nvdec, "decoded picture index: %u", params->CurrPicIdx);
+  gint head = nvdec->decode_queue_head;
 
-  if (!cuda_OK (cuvidCtxLock (nvdec->lock, 0)))
-    GST_WARNING_OBJECT (nvdec, "failed to lock CUDA context");
-
-  if (!cuda_OK (cuvidDecodePicture (nvdec->decoder, params)))
-    GST_WARNING_OBJECT (nvdec, "failed to decode picture");
-
-  if (!cuda_OK (cuvidCtxUnlock (nvdec->lock, 0)))
-    GST_WARNING_OBJECT (nvdec, "failed to unlock CUDA context");
+  if (head == g_atomic_int_get (&nvdec->decode_queue_tail))
+    return FALSE;
 
-  item = g_slice_new (GstNvDecQueueItem);
-  item->type = GST_NVDEC_QUEUE_ITEM_TYPE_DECODE;
-  item->data = g_memdup (params, sizeof (CUVIDPICPARAMS));
-  ((CUVIDPICPARAMS *) item->data)->pBitstreamData = NULL;
-  ((CUVIDPICPARAMS *) item->data)->pSliceDataOffsets = NULL;
-  g_async_queue_push (nvdec->decode_queue, item);
+  *item = nvdec->decode_queue[(guint) head & (DECODE_QUEUE_SIZE - 1)];
+  g_atomic_int_set (&nvdec->decode_queue_head, head + 1);
+  wake_ring_waiters (nvdec);
 
   return TRUE;
 }
 
 static gboolean
-parser_display_callback (GstNvDec * nvdec, CUVIDPARSERDISPINFO * dispinfo)
+decode_queue_next_is_display (GstNvDec * nvdec)
 {
-  GstNvDecQueueItem *item;
-  //GST_DEBUG ("display callback");
-
-  GST_DEBUG_OBJECT (nvdec, "display picture index: %u", dispinfo->picture_index);
+  gint head = nvdec->decode_queue_head;
 
-  item = g_slice_new (GstNvDecQueueItem);
-  item->type = GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY;
-  item->data = g_memdup (dispinfo, sizeof (CUVIDPARSERDISPINFO));
-  g_async_queue_push (nvdec->decode_queue, item);
+  return head != g_atomic_int_get (&nvdec->decode_queue_tail)
+      && nvdec->decode_queue[(guint) head & (DECODE_QUEUE_SIZE - 1)].type
+      == GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY;
+}
 
-  return TRUE;
+// The surface of a displayed picture has been copied or mapped,
+// the parser may have it back
+static void
+display_done (GstNvDec * nvdec)
+{
+  g_atomic_int_add (&nvdec->num_pending_displays, -1);
+  wake_ring_waiters (nvdec);
 }
 
-static gboolean
-gst_nvdec_start (GstVideoDecoder * decoder)
+static GstFlowReturn
+push_frame (GstNvDec * nvdec, GstVideoCodecFrame * frame)
 {
-  GstNvDec *nvdec = GST_NVDEC (decoder);
-  g_print("Start\n");
+  GstClockTime start = GST_NVDEC_TRACE_BEGIN (GST_NVDEC_STAGE_FINISH);
+  GstFlowReturn ret;
 
-  if (nvdec->context == NULL) {
+  ret = gst_video_decoder_finish_frame (GST_VIDEO_DECODER (nvdec), frame);
+  GST_NVDEC_TRACE_END (nvdec, GST_NVDEC_STAGE_FINISH, start);
+  if (ret != GST_FLOW_OK)
+    GST_INFO_OBJECT (nvdec, "failed to finish frame");
 
-      GST_DEBUG_OBJECT (nvdec, "creating CUDA context");
-      if (!cuda_OK (cuInit (0))) {
-          GST_ERROR ("failed to init CUDA");
-          return FALSE;
-      }
+  return ret;
+}
 
-      CUdevice cuDevice;
-      if (!cuda_OK (cuDeviceGet (&cuDevice, 0)))
-          GST_ERROR ("Failed to get device");
+// Pushes a frame that has been copied out. On the scheduler's workers
+// it's handed to the push thread instead, which reports what
+// downstream returned through output_flow. A NULL frame completes
+// a drain once everything in front of it has been pushed
+static GstFlowReturn
+finish_frame (GstNvDec * nvdec, GstVideoCodecFrame * frame)
+{
+  gboolean queued = FALSE;
+
+  if (!nvdec->finished_queue)
+    return frame ? push_frame (nvdec, frame) : GST_FLOW_OK;
+
+  g_mutex_lock (&nvdec->queue_lock);
+  if (nvdec->finished_queue_len < FINISHED_QUEUE_SIZE) {
+    nvdec->finished_queue[(nvdec->finished_queue_head
+            + nvdec->finished_queue_len) % FINISHED_QUEUE_SIZE] = frame;
+    nvdec->finished_queue_len++;
+    g_cond_broadcast (&nvdec->queue_cond);
+    queued = TRUE;
+  }
+  g_mutex_unlock (&nvdec->queue_lock);
 
-      // Uses 0th device
-      if (!cuda_OK (cuCtxCreate (&nvdec->context, CU_CTX_SCHED_AUTO, cuDevice)))
-          GST_ERROR ("failed to create CUDA context");
-      nvdec->did_make_context = TRUE;
-      GST_DEBUG ("Made ctx, size %i %" G_GUINT64_FORMAT " device #%i", sizeof (CUcontext), nvdec->context, cuDevice);
+  // Workers stop taking input well before this
+  if (!queued && frame) {
+    GST_WARNING_OBJECT (nvdec, "finished queue is full, dropping frame");
+    gst_video_decoder_drop_frame (GST_VIDEO_DECODER (nvdec), frame);
   }
-  else {
-      CUcontext current;
-      cuCtxGetCurrent (&current);
 
-      if (current == nvdec->context)
-          GST_DEBUG ("Ctx is current");
-      else
-          GST_DEBUG ("Ctx is not current we have %" G_GUINT64_FORMAT, current);
+  return GST_FLOW_OK;
+}
 
-      if (!cuda_OK (cuCtxPushCurrent (nvdec->context))) {
-          GST_ERROR ("Failed pushing provided context");
-          return FALSE;
-      }
-      GST_DEBUG ("Using provided context of %" G_GUINT64_FORMAT, nvdec->context);
-      cuCtxGetCurrent (&current);
-      if (current == nvdec->context)
-          GST_DEBUG ("Ctx is current");
-      else
-          GST_WARNING ("Ctx is still not current we have " G_GUINT64_FORMAT, current);
+static void
+decode_fifo_push (GstNvDec * nvdec, GstVideoCodecFrame * frame)
+{
+  GstNvDecFrameSlot *fifo;
+  guint i, size;
+
+  if (nvdec->decode_fifo_len == nvdec->decode_fifo_size) {
+    size = MAX (16, nvdec->decode_fifo_size * 2);
+    fifo = g_new0 (GstNvDecFrameSlot, size);
+    g_atomic_int_inc (&nvdec->num_allocations);
+    for (i = 0; i < nvdec->decode_fifo_len; i++)
+      fifo[i] = nvdec->decode_fifo[(nvdec->decode_fifo_head + i)
+          % nvdec->decode_fifo_size];
+    g_free (nvdec->decode_fifo);
+    nvdec->decode_fifo = fifo;
+    nvdec->decode_fifo_size = size;
+    nvdec->decode_fifo_head = 0;
   }
 
-  //if (!cuda_OK (cuStreamCreate (&(nvdec->cudaStream), CU_STREAM_NON_BLOCKING)))
-  if (!cuda_OK (cuStreamCreate (&(nvdec->cudaStream), CU_STREAM_DEFAULT)))
-      GST_ERROR ("Failed to create the cuda stream");
-  GST_DEBUG ("Made cuda stream");
+  fifo = &nvdec->decode_fifo[(nvdec->decode_fifo_head + nvdec->decode_fifo_len)
+      % nvdec->decode_fifo_size];
+  fifo->frame = frame;
+  fifo->generation = nvdec->generation;
+  fifo->skip = FALSE;
+  fifo->late = FALSE;
+  fifo->receive_time = gst_util_get_timestamp ();
+  nvdec->decode_fifo_len++;
+}
 
-  unsigned int version = 0;
-  cuCtxGetApiVersion (nvdec->context, &version);
-  GST_DEBUG ("Using version %u", version);
+static gboolean
+decode_fifo_pop (GstNvDec * nvdec, GstNvDecFrameSlot * slot)
+{
+  if (nvdec->decode_fifo_len == 0)
+    return FALSE;
 
-  if (!cuda_OK (cuCtxPopCurrent (NULL)))
-      GST_ERROR ("failed to pop current CUDA context");
+  *slot = nvdec->decode_fifo[nvdec->decode_fifo_head];
+  nvdec->decode_fifo[nvdec->decode_fifo_head].frame = NULL;
+  nvdec->decode_fifo_head = (nvdec->decode_fifo_head + 1)
+      % nvdec->decode_fifo_size;
+  nvdec->decode_fifo_len--;
 
+  return TRUE;
+}
 
-  if (nvdec->lock == NULL) {
-      if (!cuda_OK (cuvidCtxLockCreate (&nvdec->lock, nvdec->context)))
-          GST_ERROR ("failed to create CUDA context lock");
-      GST_DEBUG ("Made lock with size %i", sizeof (nvdec->lock));
-      nvdec->did_make_lock = TRUE;
-  }
-  else {
-      GST_DEBUG ("Using provided lock");
+static void
+ensure_display_table (GstNvDec * nvdec, guint size)
+{
+  if (size <= nvdec->display_table_size)
+    return;
+
+  nvdec->display_table = g_renew (GstNvDecFrameSlot, nvdec->display_table,
+      size);
+  g_atomic_int_inc (&nvdec->num_allocations);
+  memset (nvdec->display_table + nvdec->display_table_size, 0,
+      (size - nvdec->display_table_size) * sizeof (GstNvDecFrameSlot));
+  nvdec->display_table_size = size;
+}
+
+// Gives up on a frame we hold, either because it was flushed
+// earlier or because it will never be displayed
+static void
+release_frame_slot (GstNvDec * nvdec, GstNvDecFrameSlot * slot)
+{
+  if (!slot->frame)
+    return;
+
+  // Only our reference is left of a flushed frame
+  if (slot->generation != nvdec->generation) {
+    gst_video_codec_frame_unref (slot->frame);
+  } else {
+    nvdec->latency -= MIN (nvdec->latency, slot->frame->duration);
+    gst_video_decoder_drop_frame (GST_VIDEO_DECODER (nvdec), slot->frame);
   }
+  slot->frame = NULL;
+}
+
+// Gives up on every frame still waiting for the parser,
+// used when the parser they were submitted to goes away
+static void
+release_frame_slots (GstNvDec * nvdec)
+{
+  GstNvDecFrameSlot slot;
+  guint i;
 
-  nvdec->decode_queue = g_async_queue_new ();
+  while (decode_fifo_pop (nvdec, &slot))
+    release_frame_slot (nvdec, &slot);
 
-  if (!nvdec->context || !nvdec->lock) {
-    GST_ERROR_OBJECT (nvdec, "failed to create CUDA context or lock");
-    return FALSE;
+  for (i = 0; i < nvdec->display_table_size; i++)
+    release_frame_slot (nvdec, &nvdec->display_table[i]);
+  nvdec->latency = 0;
+}
+
+static void
+clear_frame_slots (GstNvDec * nvdec)
+{
+  GstNvDecFrameSlot slot;
+  guint i;
+
+  while (decode_fifo_pop (nvdec, &slot))
+    gst_video_codec_frame_unref (slot.frame);
+  g_free (nvdec->decode_fifo);
+  nvdec->decode_fifo = NULL;
+  nvdec->decode_fifo_size = 0;
+  nvdec->decode_fifo_head = 0;
+
+  for (i = 0; i < nvdec->display_table_size; i++) {
+    if (nvdec->display_table[i].frame)
+      gst_video_codec_frame_unref (nvdec->display_table[i].frame);
   }
-  return TRUE;
+  g_free (nvdec->display_table);
+  nvdec->display_table = NULL;
+  nvdec->display_table_size = 0;
+  nvdec->latency = 0;
 }
 
-static gboolean
-maybe_destroy_decoder_and_parser (GstNvDec * nvdec)
+// Lets downstream ask for a smaller size, which the decoder's scaler
+// produces so only the small frame is downloaded. The height is kept
+// unless downstream asks for another, the pixel aspect ratio carries
+// the display aspect ratio of anamorphic streams. Only when downstream
+// changes the width and leaves the height open does the height follow
+// the display aspect ratio
+static void
+choose_output_size (GstNvDec * nvdec, CUVIDEOFORMAT * format, guint width,
+    guint height, guint * out_width, guint * out_height, gint * par_n,
+    gint * par_d)
 {
-  gboolean ret = TRUE;
+  GstPad *srcpad = GST_VIDEO_DECODER_SRC_PAD (nvdec);
+  GstCaps *template_caps, *peer_caps;
+  GstStructure *s;
+  gint dar_n, dar_d, w = width, h = height, gcd;
 
-  if (!cuda_OK (cuvidCtxLock (nvdec->lock, 0))) {
-    GST_ERROR_OBJECT (nvdec, "failed to lock CUDA context");
-    return FALSE;
+  dar_n = format->display_aspect_ratio.x;
+  dar_d = format->display_aspect_ratio.y;
+  if (dar_n <= 0 || dar_d <= 0) {
+    dar_n = width;
+    dar_d = height;
   }
 
-  if (nvdec->decoder) {
-    GST_DEBUG_OBJECT (nvdec, "destroying decoder");
-    ret = cuda_OK (cuvidDestroyDecoder (nvdec->decoder));
-    if (ret)
-      nvdec->decoder = NULL;
-    else
-      GST_ERROR_OBJECT (nvdec, "failed to destroy decoder");
+  template_caps = gst_pad_get_pad_template_caps (srcpad);
+  peer_caps = gst_pad_peer_query_caps (srcpad, template_caps);
+  gst_caps_unref (template_caps);
+
+  if (peer_caps && !gst_caps_is_empty (peer_caps)
+      && !gst_caps_is_any (peer_caps)) {
+    peer_caps = gst_caps_truncate (peer_caps);
+    peer_caps = gst_caps_make_writable (peer_caps);
+    s = gst_caps_get_structure (peer_caps, 0);
+
+    if (gst_structure_has_field (s, "width")) {
+      gst_structure_fixate_field_nearest_int (s, "width", width);
+      gst_structure_get_int (s, "width", &w);
+    }
+    if (gst_structure_has_field (s, "height")) {
+      gst_structure_fixate_field_nearest_int (s, "height", (guint) w == width
+          ? (gint) height : (gint) gst_util_uint64_scale_int (w, dar_d, dar_n));
+      gst_structure_get_int (s, "height", &h);
+    }
   }
+  if (peer_caps)
+    gst_caps_unref (peer_caps);
 
-  if (!cuda_OK (cuvidCtxUnlock (nvdec->lock, 0))) {
-    GST_ERROR_OBJECT (nvdec, "failed to unlock CUDA context");
-    return FALSE;
+  // The scaler only scales down
+  if (w <= 0 || h <= 0 || (guint) w > width || (guint) h > height) {
+    w = width;
+    h = height;
+  }
+  *out_width = w & ~1;
+  *out_height = h & ~1;
+  if (*out_width == 0 || *out_height == 0) {
+    *out_width = width;
+    *out_height = height;
   }
 
-  if (nvdec->parser) {
-    GST_DEBUG_OBJECT (nvdec, "destroying parser");
-    if (!cuda_OK (cuvidDestroyVideoParser (nvdec->parser))) {
-      GST_ERROR_OBJECT (nvdec, "failed to destroy parser");
-      return FALSE;
-    }
-    nvdec->parser = NULL;
+  // Keep the picture's display aspect ratio
+  *par_n = dar_n * *out_height;
+  *par_d = dar_d * *out_width;
+  gcd = gst_util_greatest_common_divisor (*par_n, *par_d);
+  if (gcd > 0) {
+    *par_n /= gcd;
+    *par_d /= gcd;
   }
 
-  return ret;
+  if (*out_width != width || *out_height != height)
+    GST_INFO_OBJECT (nvdec, "scaling %ux%u to %ux%u, par %d/%d", width,
+        height, *out_width, *out_height, *par_n, *par_d);
 }
 
+// Whether the GPU can decode this at all. Must be called with the
+// context lock held or the context pushed
 static gboolean
-gst_nvdec_stop (GstVideoDecoder * decoder)
+check_decoder_caps (GstNvDec * nvdec, cudaVideoCodec codec,
+    cudaVideoChromaFormat chroma_format, guint bit_depth_minus8, guint width,
+    guint height)
 {
-  GstNvDec *nvdec = GST_NVDEC (decoder);
-  GstNvDecQueueItem *item;
+  CUVIDDECODECAPS decodecaps;
+  gboolean ret;
+
+  memset (&decodecaps, 0, sizeof (decodecaps));
+  decodecaps.eCodecType = codec;
+  decodecaps.eChromaFormat = chroma_format;
+  decodecaps.nBitDepthMinus8 = bit_depth_minus8;
+
+  CuCtxPushCurrent (nvdec->context);
+  ret = cuda_OK (CuvidGetDecoderCaps (&decodecaps));
+  CuCtxPopCurrent (NULL);
+
+  if (!ret) {
+    GST_ERROR_OBJECT (nvdec, "Failed to get decode caps");
+    return FALSE;
+  }
+
+  if (!decodecaps.bIsSupported) {
+    GST_ERROR_OBJECT (nvdec, "Format not supported! chroma: %s codec: %s "
+        "bit depth: %u", GetVideoChromaFormatString (chroma_format),
+        GetVideoCodecString (codec), bit_depth_minus8 + 8);
+    return FALSE;
+  }
+
+  if (width > decodecaps.nMaxWidth || height > decodecaps.nMaxHeight) {
+    GST_ERROR_OBJECT (nvdec, "%ux%u is larger than the supported %ux%u",
+        width, height, decodecaps.nMaxWidth, decodecaps.nMaxHeight);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Resolution changes that fit in the surfaces the decoder was created
+// with don't need a new decoder, which avoids a stall on every switch
+static gboolean
+can_reconfigure_decoder (GstNvDec * nvdec, CUVIDEOFORMAT * format,
+    guint num_decode_surfaces)
+{
+  if (!nvdec->decoder)
+    return FALSE;
+
+  // Only these support cuvidReconfigureDecoder
+  if (format->codec != cudaVideoCodec_H264
+      && format->codec != cudaVideoCodec_HEVC
+      && format->codec != cudaVideoCodec_VP9
+#if NVDECAPI_MAJOR_VERSION >= 11
+      && format->codec != cudaVideoCodec_AV1
+#endif
+      )
+    return FALSE;
+
+  return format->codec == nvdec->decoder_codec
+      && format->chroma_format == nvdec->decoder_chroma_format
+      && format->bit_depth_luma_minus8 == nvdec->decoder_bit_depth_minus8
+      && format->coded_width <= nvdec->decoder_max_width
+      && format->coded_height <= nvdec->decoder_max_height
+      && num_decode_surfaces <= nvdec->decoder_max_decode_surfaces;
+}
+
+// NV12 or P016 surfaces, rounded up to the macroblock size
+static guint64
+surface_memory_size (guint width, guint height, guint bit_depth_minus8,
+    guint num_surfaces)
+{
+  return (guint64) GST_ROUND_UP_16 (width) * GST_ROUND_UP_16 (height) * 3 / 2
+      * (bit_depth_minus8 ? 2 : 1) * num_surfaces;
+}
+
+// The decoder is about to be replaced or reconfigured. Displays queued
+// before have to be copied out of the old one and its downloads done
+// first, by whichever thread does the output. With the output thread
+// running this waits until it has nothing left, it then stays idle
+// because the parser is the only one queueing. Returns FALSE if the
+// element is stopping
+static gboolean
+finish_output (GstNvDec * nvdec)
+{
+  GstFlowReturn ret;
+  gboolean paused;
+
+  if (!nvdec->output_thread) {
+    ret = handle_pending_frames (nvdec);
+    if (ret == GST_FLOW_OK)
+      ret = finish_downloads (nvdec, TRUE);
+    if (ret != GST_FLOW_OK)
+      GST_INFO_OBJECT (nvdec, "failed to output pending frames");
+    return TRUE;
+  }
+
+  g_mutex_lock (&nvdec->queue_lock);
+  while (!nvdec->stopping && !(nvdec->paused && nvdec->output_paused)
+      && (!decode_queue_empty (nvdec) || !nvdec->output_idle))
+    g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
+  paused = nvdec->paused;
+  g_mutex_unlock (&nvdec->queue_lock);
+
+  if (nvdec->stopping)
+    return FALSE;
+
+  // Flushing, the output thread waits for the flush and what it
+  // left behind is dropped with it. The downloads can't wait, their
+  // surfaces belong to the old decoder
+  if (paused)
+    drop_downloads (nvdec);
+
+  return TRUE;
+}
+
+// Returns the number of decode surfaces the parser should use, 0 on error
+static gint
+parser_sequence_callback (GstNvDec * nvdec, CUVIDEOFORMAT * format)
+{
+  GstNvDecQueueItem item;
+  guint width, height, num_decode_surfaces;
+  guint target_width, target_height;
+  gint par_n, par_d;
+  CUVIDDECODECREATEINFO create_info = { 0, };
+  CUVIDRECONFIGUREDECODERINFO reconfigure_info = { 0, };
+  gboolean reconfigured = FALSE;
+  gint64 start_time;
+  gboolean ret = TRUE;
+
+  width = format->display_area.right - format->display_area.left;
+  height = format->display_area.bottom - format->display_area.top;
+  //GST_DEBUG ("Parser callback");
+  GST_DEBUG_OBJECT (nvdec, "width: %u, height: %u", width, height);
+
+  choose_output_size (nvdec, format, width, height, &target_width,
+      &target_height, &par_n, &par_d);
+
+  // Older parsers don't report what the stream needs,
+  // keep the default for the codec then
+  num_decode_surfaces = nvdec->num_decode_surfaces;
+  if (format->min_num_decode_surfaces)
+    num_decode_surfaces = MIN (MAX_DECODE_SURFACES,
+        format->min_num_decode_surfaces + nvdec->surface_headroom);
+  GST_DEBUG_OBJECT (nvdec, "stream needs %u decode surfaces, using %u",
+      format->min_num_decode_surfaces, num_decode_surfaces);
+
+  if (!nvdec->decoder || (nvdec->decoder_width != width
+          || nvdec->decoder_height != height
+          || nvdec->decoder_coded_width != format->coded_width
+          || nvdec->decoder_coded_height != format->coded_height
+          || nvdec->decoder_target_width != target_width
+          || nvdec->decoder_target_height != target_height
+          || nvdec->num_decode_surfaces != num_decode_surfaces)) {
+    start_time = g_get_monotonic_time ();
+
+    // Frames still mapped from the old decoder have to be done first
+    if (!finish_output (nvdec))
+      return 0;
+
+    if (!lock_context (nvdec)) {
+      GST_ERROR_OBJECT (nvdec, "failed to lock CUDA context");
+      return 0;
+    }
+
+    if (can_reconfigure_decoder (nvdec, format, num_decode_surfaces)) {
+      GST_DEBUG_OBJECT (nvdec, "reconfiguring decoder");
+      reconfigure_info.ulWidth = format->coded_width;
+      reconfigure_info.ulHeight = format->coded_height;
+      reconfigure_info.ulTargetWidth = target_width;
+      reconfigure_info.ulTargetHeight = target_height;
+      reconfigure_info.ulNumDecodeSurfaces = num_decode_surfaces;
+      reconfigure_info.display_area.left = format->display_area.left;
+      reconfigure_info.display_area.top = format->display_area.top;
+      reconfigure_info.display_area.right = format->display_area.right;
+      reconfigure_info.display_area.bottom = format->display_area.bottom;
+      reconfigure_info.target_rect.left = 0;
+      reconfigure_info.target_rect.top = 0;
+      reconfigure_info.target_rect.right = target_width;
+      reconfigure_info.target_rect.bottom = target_height;
+
+      CuCtxPushCurrent(nvdec->context);
+      reconfigured = cuda_OK (CuvidReconfigureDecoder (nvdec->decoder,
+              &reconfigure_info));
+      CuCtxPopCurrent(NULL);
+
+      if (!reconfigured)
+        GST_WARNING_OBJECT (nvdec, "failed to reconfigure decoder, "
+            "recreating it");
+    }
+
+    if (!reconfigured && nvdec->decoder) {
+      GST_DEBUG_OBJECT (nvdec, "destroying decoder");
+      if (!cuda_OK (CuvidDestroyDecoder (nvdec->decoder))) {
+        GST_ERROR_OBJECT (nvdec, "failed to destroy decoder");
+        ret = FALSE;
+      } else
+        nvdec->decoder = NULL;
+    }
+
+    if (!reconfigured && !check_decoder_caps (nvdec, format->codec,
+            format->chroma_format, format->bit_depth_luma_minus8,
+            format->coded_width, format->coded_height))
+      ret = FALSE;
+    else if (!reconfigured) {
+      GST_DEBUG_OBJECT (nvdec, "creating decoder");
+      create_info.ulWidth = format->coded_width;
+      create_info.ulHeight = format->coded_height;
+      create_info.ulNumDecodeSurfaces = num_decode_surfaces;
+      create_info.CodecType = format->codec;
+      create_info.ChromaFormat = format->chroma_format;
+      //create_info.ulCreationFlags = cudaVideoCreate_Default;
+      create_info.ulCreationFlags = cudaVideoCreate_PreferCUVID;
+      create_info.ulMaxWidth = MAX (format->coded_width, nvdec->max_width);
+      create_info.ulMaxHeight = MAX (format->coded_height, nvdec->max_height);
+      create_info.display_area.left = format->display_area.left;
+      create_info.display_area.top = format->display_area.top;
+      create_info.display_area.right = format->display_area.right;
+      create_info.display_area.bottom = format->display_area.bottom;
+      create_info.bitDepthMinus8 = format->bit_depth_luma_minus8;
+      // More than 8 bits come out in the high bits of 16 bit samples
+      create_info.OutputFormat = format->bit_depth_luma_minus8
+          ? cudaVideoSurfaceFormat_P016 : cudaVideoSurfaceFormat_NV12;
+      create_info.DeinterlaceMode = cudaVideoDeinterlaceMode_Weave;
+      create_info.ulTargetWidth = target_width;
+      create_info.ulTargetHeight = target_height;
+      create_info.ulNumOutputSurfaces = nvdec->num_output_surfaces;
+      create_info.vidLock = nvdec->lock;
+      create_info.target_rect.left = 0;
+      create_info.target_rect.top = 0;
+      create_info.target_rect.right = target_width;
+      create_info.target_rect.bottom = target_height;
+
+      if (nvdec->decoder)
+        GST_WARNING_OBJECT(nvdec, "Already have decoder?");
+
+      CuCtxPushCurrent(nvdec->context);
+      if (nvdec->decoder
+          || !cuda_OK (CuvidCreateDecoder (&nvdec->decoder, &create_info))) {
+        GST_ERROR_OBJECT (nvdec, "failed to create decoder");
+        ret = FALSE;
+      }
+      else {
+          GST_DEBUG_OBJECT (nvdec, "created decoder");
+          nvdec->decoder_codec = format->codec;
+          nvdec->decoder_chroma_format = format->chroma_format;
+          nvdec->decoder_bit_depth_minus8 = format->bit_depth_luma_minus8;
+          nvdec->decoder_max_width = create_info.ulMaxWidth;
+          nvdec->decoder_max_height = create_info.ulMaxHeight;
+          nvdec->decoder_max_decode_surfaces = num_decode_surfaces;
+          // Decode surfaces are allocated for the maximum size
+          // up front, output surfaces for the scaled size
+          nvdec->surface_memory = surface_memory_size (
+              nvdec->decoder_max_width, nvdec->decoder_max_height,
+              format->bit_depth_luma_minus8, num_decode_surfaces)
+              + surface_memory_size (target_width, target_height,
+              format->bit_depth_luma_minus8, nvdec->num_output_surfaces);
+      }
+      CuCtxPopCurrent(NULL);
+    }
+
+    if (!unlock_context (nvdec)) {
+      GST_ERROR_OBJECT (nvdec, "failed to unlock CUDA context");
+      ret = FALSE;
+    }
+
+    if (ret) {
+      GST_INFO_OBJECT (nvdec, "%s decoder for %ux%u -> %ux%u in %"
+          G_GINT64_FORMAT " us", reconfigured ? "reconfigured" : "created",
+          nvdec->decoder_width, nvdec->decoder_height, width, height,
+          g_get_monotonic_time () - start_time);
+      nvdec->decoder_width = width;
+      nvdec->decoder_height = height;
+      nvdec->decoder_coded_width = format->coded_width;
+      nvdec->decoder_coded_height = format->coded_height;
+      nvdec->decoder_target_width = target_width;
+      nvdec->decoder_target_height = target_height;
+      nvdec->num_decode_surfaces = num_decode_surfaces;
+    }
+  }
+
+  item.type = GST_NVDEC_QUEUE_ITEM_TYPE_SEQUENCE;
+  item.sequence.width = target_width;
+  item.sequence.height = target_height;
+  item.sequence.display_height = height;
+  item.sequence.par_n = par_n;
+  item.sequence.par_d = par_d;
+  item.sequence.fps_n = format->frame_rate.numerator;
+  item.sequence.fps_d = MAX (1, format->frame_rate.denominator);
+  item.sequence.progressive = format->progressive_sequence;
+  item.sequence.matrix_coefficients =
+      format->video_signal_description.matrix_coefficients;
+  item.sequence.full_range =
+      format->video_signal_description.video_full_range_flag;
+  item.sequence.bit_depth_minus8 = format->bit_depth_luma_minus8;
+  item.sequence.num_decode_surfaces = nvdec->num_decode_surfaces;
+  if (!decode_queue_push (nvdec, &item))
+    ret = FALSE;
+
+  return ret ? nvdec->num_decode_surfaces : 0;
+}
+
+// Key unit trick mode seeks only want intra frames whatever
+// skip-frames says
+static GstNvDecSkipFrames
+get_skip_frames (GstNvDec * nvdec)
+{
+  GstVideoDecoder *decoder = GST_VIDEO_DECODER (nvdec);
+
+  if (decoder->input_segment.flags & GST_SEGMENT_FLAG_TRICKMODE_KEY_UNITS)
+    return GST_NVDEC_SKIP_FRAMES_NON_KEY;
+  return nvdec->skip_frames;
+}
+
+static gboolean
+skip_picture (GstNvDec * nvdec, CUVIDPICPARAMS * params)
+{
+  switch (get_skip_frames (nvdec)) {
+    case GST_NVDEC_SKIP_FRAMES_NON_REF:
+      return !params->ref_pic_flag;
+    case GST_NVDEC_SKIP_FRAMES_NON_KEY:
+      return !params->intra_pic_flag;
+    default:
+      return FALSE;
+  }
+}
+
+// Nothing needs a non-reference picture that's past its deadline
+static gboolean
+late_picture (GstNvDec * nvdec, CUVIDPICPARAMS * params,
+    GstVideoCodecFrame * frame)
+{
+  if (!frame || params->ref_pic_flag)
+    return FALSE;
+
+  return gst_video_decoder_get_max_decode_time (GST_VIDEO_DECODER (nvdec),
+      frame) < 0;
+}
+
+static gboolean
+parser_decode_callback (GstNvDec * nvdec, CUVIDPICPARAMS * params)
+{
+  GstNvDecQueueItem item;
+  GstClockTime start;
+  //GST_DEBUG ("decode callback");
+
+  GST_DEBUG_OBJECT (nvdec, "decoded picture index: %u", params->CurrPicIdx);
+
+  // What the parser still held when it was flushed,
+  // nobody wants it so it isn't decoded
+  if (nvdec->resetting_parser) {
+    if (decode_fifo_pop (nvdec, &item.decode.slot))
+      release_frame_slot (nvdec, &item.decode.slot);
+    return TRUE;
+  }
+
+  // The picture belongs to the oldest frame
+  // that hasn't been decoded yet
+  item.type = GST_NVDEC_QUEUE_ITEM_TYPE_DECODE;
+  item.decode.picture_index = params->CurrPicIdx;
+  item.decode.intra = params->intra_pic_flag;
+  item.decode.ref = params->ref_pic_flag;
+  if (!decode_fifo_pop (nvdec, &item.decode.slot)) {
+    GST_WARNING_OBJECT (nvdec, "no frame for decoded picture %d",
+        params->CurrPicIdx);
+    item.decode.slot.frame = NULL;
+    item.decode.slot.generation = nvdec->generation;
+  }
+
+  // The parser still displays skipped pictures,
+  // the frame is dropped when that happens
+  item.decode.slot.skip = skip_picture (nvdec, params);
+  item.decode.slot.late = !item.decode.slot.skip
+      && late_picture (nvdec, params, item.decode.slot.frame);
+  if (item.decode.slot.skip) {
+    GST_LOG_OBJECT (nvdec, "skipping picture %d", params->CurrPicIdx);
+    nvdec->num_skipped++;
+  } else if (item.decode.slot.late) {
+    GST_LOG_OBJECT (nvdec, "skipping late picture %d", params->CurrPicIdx);
+    nvdec->num_qos_skipped++;
+  } else {
+    if (!lock_context (nvdec))
+      GST_WARNING_OBJECT (nvdec, "failed to lock CUDA context");
+
+    start = GST_NVDEC_TRACE_BEGIN (GST_NVDEC_STAGE_DECODE);
+    if (!cuda_OK (CuvidDecodePicture (nvdec->decoder, params)))
+      GST_WARNING_OBJECT (nvdec, "failed to decode picture");
+    GST_NVDEC_TRACE_END (nvdec, GST_NVDEC_STAGE_DECODE, start);
+
+    if (!unlock_context (nvdec))
+      GST_WARNING_OBJECT (nvdec, "failed to unlock CUDA context");
+  }
+
+  if (!decode_queue_push (nvdec, &item)) {
+    release_frame_slot (nvdec, &item.decode.slot);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+parser_display_callback (GstNvDec * nvdec, CUVIDPARSERDISPINFO * dispinfo)
+{
+  GstNvDecQueueItem item;
+  //GST_DEBUG ("display callback");
+
+  GST_DEBUG_OBJECT (nvdec, "display picture index: %u", dispinfo->picture_index);
+
+  if (nvdec->resetting_parser)
+    return TRUE;
+
+  item.type = GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY;
+  item.display = *dispinfo;
+
+  return decode_queue_push (nvdec, &item);
+}
+
+// Uses the handles from the context/lock properties if they were set,
+// otherwise a context shared with the rest of the pipeline or, failing
+// that, the process-wide one of the chosen device
+static gboolean
+gst_nvdec_ensure_cuda_context (GstNvDec * nvdec)
+{
+  GstElement *element = GST_ELEMENT (nvdec);
+  CUdevice device;
+
+  // The scheduler's workers and download streams are in its context,
+  // nothing else will do
+  if (nvdec->scheduler
+      && nvdec->cuda_context != nvdec->scheduler->cuda_context) {
+    if (nvdec->cuda_context)
+      g_object_unref (nvdec->cuda_context);
+    nvdec->cuda_context = g_object_ref (nvdec->scheduler->cuda_context);
+  }
+
+  if (nvdec->user_context && !nvdec->cuda_context) {
+    GST_DEBUG_OBJECT (nvdec, "using provided context %p", nvdec->user_context);
+    nvdec->cuda_context = gst_nvdec_cuda_context_new_wrapped (
+        nvdec->user_context, nvdec->user_lock);
+    if (!nvdec->cuda_context)
+      return FALSE;
+  }
+
+  // With automatic placement we pick the device ourselves,
+  // the context is still shared by everyone on that device
+  if (nvdec->cuda_context || (nvdec->cuda_device_id >= 0
+          && gst_nvdec_cuda_context_find (element, nvdec->cuda_device_id,
+              &nvdec->cuda_context))) {
+    nvdec->device = nvdec->cuda_context->device;
+    gst_cuda_device_add_session (nvdec->device);
+    return TRUE;
+  }
+
+  if (!cuda_OK (CuInit (0))) {
+    GST_ERROR_OBJECT (nvdec, "failed to init CUDA");
+    return FALSE;
+  }
+
+  if (nvdec->cuda_device_id < 0) {
+    if (!gst_cuda_device_choose (nvdec->device_policy, &device)) {
+      GST_ERROR_OBJECT (nvdec, "failed to choose a device");
+      return FALSE;
+    }
+  } else {
+    if (!cuda_OK (CuDeviceGet (&device, nvdec->cuda_device_id))) {
+      GST_ERROR_OBJECT (nvdec, "failed to get device %d",
+          nvdec->cuda_device_id);
+      return FALSE;
+    }
+    gst_cuda_device_add_session (device);
+  }
+  nvdec->device = device;
+
+  nvdec->cuda_context = gst_nvdec_cuda_context_get (device);
+  if (!nvdec->cuda_context) {
+    GST_ERROR_OBJECT (nvdec, "failed to get a CUDA context for device %d",
+        device);
+    return FALSE;
+  }
+  gst_nvdec_cuda_context_propagate (element, nvdec->cuda_context);
+
+  return TRUE;
+}
+
+static gboolean
+gst_nvdec_start (GstVideoDecoder * decoder)
+{
+  GstNvDec *nvdec = GST_NVDEC (decoder);
+
+  if (!gst_nvdec_ensure_cuda_context (nvdec))
+      return FALSE;
+  nvdec->context = nvdec->cuda_context->context;
+  nvdec->lock = nvdec->cuda_context->lock;
+  GST_INFO_OBJECT (nvdec, "decoding on device %d", nvdec->device);
+
+  nvdec->num_displayed = 0;
+  nvdec->num_skipped = 0;
+  nvdec->num_qos_skipped = 0;
+  nvdec->num_dropped = 0;
+  nvdec->decode_latency_last = 0;
+  nvdec->decode_latency_max = 0;
+  nvdec->decode_latency_total = 0;
+  nvdec->num_locks = 0;
+  nvdec->lock_wait_time = 0;
+  nvdec->lock_hold_time = 0;
+
+  if (!cuda_OK (CuCtxPushCurrent (nvdec->context))) {
+      GST_ERROR ("Failed pushing CUDA context");
+      return FALSE;
+  }
+
+  //if (!cuda_OK (CuStreamCreate (&(nvdec->cudaStream), CU_STREAM_NON_BLOCKING)))
+  if (nvdec->scheduler)
+      nvdec->cudaStream =
+          gst_nvdec_scheduler_acquire_stream (nvdec->scheduler);
+  else if (!cuda_OK (CuStreamCreate (&(nvdec->cudaStream), CU_STREAM_DEFAULT)))
+      GST_ERROR ("Failed to create the cuda stream");
+  GST_DEBUG ("Made cuda stream");
+
+  if (!cuda_OK (CuEventCreate (&nvdec->copy_event, CU_EVENT_DISABLE_TIMING)))
+      GST_ERROR ("Failed to create copy event");
+
+  nvdec->downloads = g_new0 (GstNvDecDownload, nvdec->num_output_surfaces);
+  nvdec->download_head = 0;
+  nvdec->num_downloads = 0;
+  for (guint i = 0; i < nvdec->num_output_surfaces; i++) {
+      if (!cuda_OK (CuEventCreate (&nvdec->downloads[i].event,
+                  CU_EVENT_DISABLE_TIMING)))
+          GST_ERROR ("Failed to create download event");
+  }
+
+  unsigned int version = 0;
+  CuCtxGetApiVersion (nvdec->context, &version);
+  GST_DEBUG ("Using version %u", version);
+
+  if (!cuda_OK (CuCtxPopCurrent (NULL)))
+      GST_ERROR ("failed to pop current CUDA context");
+
+  nvdec->decode_queue = g_new0 (GstNvDecQueueItem, DECODE_QUEUE_SIZE);
+  nvdec->decode_queue_head = nvdec->decode_queue_tail = 0;
+  nvdec->num_pending_displays = 0;
+  nvdec->display_batch = g_new0 (GstNvDecDisplay, MAX_DISPLAY_BATCH);
+  nvdec->display_batch_len = 0;
+
+  if (nvdec->pipelined || nvdec->scheduler)
+    start_threads (nvdec);
+
+  return TRUE;
+}
+
+static gboolean
+maybe_destroy_decoder_and_parser (GstNvDec * nvdec)
+{
+  gboolean ret = TRUE;
+
+  if (!lock_context (nvdec)) {
+    GST_ERROR_OBJECT (nvdec, "failed to lock CUDA context");
+    return FALSE;
+  }
+
+  if (nvdec->decoder) {
+    GST_DEBUG_OBJECT (nvdec, "destroying decoder");
+    ret = cuda_OK (CuvidDestroyDecoder (nvdec->decoder));
+    if (ret) {
+      nvdec->decoder = NULL;
+      nvdec->surface_memory = 0;
+    }
+    else
+      GST_ERROR_OBJECT (nvdec, "failed to destroy decoder");
+  }
+
+  if (!unlock_context (nvdec)) {
+    GST_ERROR_OBJECT (nvdec, "failed to unlock CUDA context");
+    return FALSE;
+  }
+
+  if (nvdec->parser) {
+    GST_DEBUG_OBJECT (nvdec, "destroying parser");
+    if (!cuda_OK (CuvidDestroyVideoParser (nvdec->parser))) {
+      GST_ERROR_OBJECT (nvdec, "failed to destroy parser");
+      return FALSE;
+    }
+    nvdec->parser = NULL;
+  }
+
+  return ret;
+}
+
+static gboolean
+gst_nvdec_stop (GstVideoDecoder * decoder)
+{
+  GstNvDec *nvdec = GST_NVDEC (decoder);
+  GstNvDecQueueItem item;
 
   GST_DEBUG_OBJECT (nvdec, "stop");
 
+  stop_threads (nvdec);
+  drop_downloads (nvdec);
+
   if (!maybe_destroy_decoder_and_parser (nvdec))
     return FALSE;
 
-  if (nvdec->lock && nvdec->did_make_lock) {
-    GST_DEBUG ("destroying CUDA context lock");
-    if (cuda_OK (cuvidCtxLockDestroy (nvdec->lock)))
-      nvdec->lock = NULL;
-    else
-      GST_ERROR ("failed to destroy CUDA context lock");
-    nvdec->did_make_lock = FALSE;
+  if (nvdec->downloads) {
+    CuCtxPushCurrent (nvdec->context);
+    for (guint i = 0; i < nvdec->num_output_surfaces; i++) {
+      if (nvdec->downloads[i].event
+          && !cuda_OK (CuEventDestroy (nvdec->downloads[i].event)))
+        GST_ERROR ("Failed to destroy download event");
+    }
+    CuCtxPopCurrent (NULL);
+    g_free (nvdec->downloads);
+    nvdec->downloads = NULL;
+  }
+
+  if (nvdec->copy_event) {
+    CuCtxPushCurrent (nvdec->context);
+    if (!cuda_OK (CuEventDestroy (nvdec->copy_event)))
+      GST_ERROR ("Failed to destroy copy event");
+    CuCtxPopCurrent (NULL);
+    nvdec->copy_event = NULL;
   }
 
-  if (nvdec->cudaStream) {
+  if (nvdec->convert_buffer) {
+    CuCtxPushCurrent (nvdec->context);
+    if (!cuda_OK (CuMemFree (nvdec->convert_buffer)))
+      GST_ERROR ("Failed to free the convert buffer");
+    CuCtxPopCurrent (NULL);
+    nvdec->convert_buffer = 0;
+    nvdec->convert_buffer_size = 0;
+  }
+
+  if (nvdec->cudaStream && nvdec->scheduler) {
+      gst_nvdec_scheduler_release_stream (nvdec->scheduler,
+          nvdec->cudaStream);
+      nvdec->cudaStream = NULL;
+  } else if (nvdec->cudaStream) {
       GST_DEBUG ("Destroying cuda stream");
-      if (cuda_OK (cuStreamDestroy (nvdec->cudaStream)))
+      if (cuda_OK (CuStreamDestroy (nvdec->cudaStream)))
           nvdec->cudaStream = NULL;
       else
           GST_ERROR ("Failed to destroy the cuda stream");
   }
 
-  if (nvdec->context && nvdec->did_make_context) {
-    GST_DEBUG ("destroying CUDA context");
-    if (cuda_OK (cuCtxDestroy (nvdec->context))) {
-        nvdec->context = NULL;
-        nvdec->did_make_context = FALSE;
-    } else
-      GST_ERROR ("failed to destroy CUDA context");
+  if (nvdec->device >= 0) {
+    gst_cuda_device_remove_session (nvdec->device);
+    nvdec->device = -1;
+  }
+
+  // The context goes away with the last element using it
+  nvdec->context = NULL;
+  nvdec->lock = NULL;
+  if (nvdec->cuda_context) {
+    g_object_unref (nvdec->cuda_context);
+    nvdec->cuda_context = NULL;
   }
 
 #if USE_GL
@@ -625,20 +1788,160 @@ gst_nvdec_stop (GstVideoDecoder * decoder)
     nvdec->input_state = NULL;
   }
 
+  g_clear_pointer (&nvdec->codec_header, g_free);
+  nvdec->codec_header_size = 0;
+  nvdec->nal_length_size = 0;
+  g_clear_pointer (&nvdec->scratch, g_free);
+  nvdec->scratch_size = 0;
+
   if (nvdec->decode_queue) {
-    if (g_async_queue_length (nvdec->decode_queue) > 0) {
+    while (decode_queue_pop (nvdec, &item)) {
       GST_INFO_OBJECT (nvdec, "decode queue not empty");
-
-      while ((item = g_async_queue_try_pop (nvdec->decode_queue))) {
-        g_free (item->data);
-        g_slice_free (GstNvDecQueueItem, item);
-      }
+      if (item.type == GST_NVDEC_QUEUE_ITEM_TYPE_DECODE
+          && item.decode.slot.frame)
+        gst_video_codec_frame_unref (item.decode.slot.frame);
     }
-    g_async_queue_unref (nvdec->decode_queue);
+    g_free (nvdec->decode_queue);
     nvdec->decode_queue = NULL;
   }
-  g_list_free_full (nvdec->decode_frames_pending_drop, (GDestroyNotify) gst_video_codec_frame_unref);
-  g_list_free_full (nvdec->display_frames_pending_drop, (GDestroyNotify) gst_video_codec_frame_unref);
+  g_free (nvdec->display_batch);
+  nvdec->display_batch = NULL;
+  clear_frame_slots (nvdec);
+
+  return TRUE;
+}
+
+static guint
+get_bit_depth_minus8 (const GstStructure * s)
+{
+  const gchar *profile = gst_structure_get_string (s, "profile");
+
+  if (!profile)
+    return 0;
+  if (g_strrstr (profile, "-12"))
+    return 4;
+  if (g_strrstr (profile, "-10"))
+    return 2;
+  return 0;
+}
+
+// Appends count parameter sets from codec_data, each with a 16-bit
+// length in front, as NALs with start codes
+static gboolean
+append_parameter_sets (GByteArray * header, const guint8 * data, gsize size,
+    gsize * pos, guint count)
+{
+  static const guint8 start_code[] = { 0, 0, 0, 1 };
+  gsize len;
+
+  while (count--) {
+    if (*pos + 2 > size)
+      return FALSE;
+    len = GST_READ_UINT16_BE (data + *pos);
+    *pos += 2;
+    if (len > size - *pos)
+      return FALSE;
+    g_byte_array_append (header, start_code, sizeof (start_code));
+    g_byte_array_append (header, data + *pos, len);
+    *pos += len;
+  }
+
+  return TRUE;
+}
+
+// AVCDecoderConfigurationRecord, SPS and then PPS
+static gboolean
+parse_avcc (GstNvDec * nvdec, const guint8 * data, gsize size,
+    GByteArray * header)
+{
+  gsize pos = 6;
+
+  if (size < 7 || data[0] != 1)
+    return FALSE;
+
+  nvdec->nal_length_size = (data[4] & 0x03) + 1;
+  if (!append_parameter_sets (header, data, size, &pos, data[5] & 0x1f)
+      || pos >= size)
+    return FALSE;
+  pos++;
+  return append_parameter_sets (header, data, size, &pos, data[pos - 1]);
+}
+
+// HEVCDecoderConfigurationRecord, arrays of VPS, SPS, PPS and SEI
+static gboolean
+parse_hvcc (GstNvDec * nvdec, const guint8 * data, gsize size,
+    GByteArray * header)
+{
+  gsize pos = 23;
+  guint num_arrays, i;
+
+  if (size < 23)
+    return FALSE;
+
+  nvdec->nal_length_size = (data[21] & 0x03) + 1;
+  num_arrays = data[22];
+  for (i = 0; i < num_arrays; i++) {
+    if (pos + 3 > size)
+      return FALSE;
+    pos += 3;
+    if (!append_parameter_sets (header, data, size, &pos,
+            GST_READ_UINT16_BE (data + pos - 2)))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+// avc and hvc1 input has the parameter sets in codec_data and a length
+// in front of each NAL instead of a start code, avc3 and hev1 may also
+// have them in band. The parser only takes byte-stream, the parameter
+// sets are sent ahead of the first frame and the frames rewritten
+static gboolean
+parse_codec_data (GstNvDec * nvdec, cudaVideoCodec codec, GstStructure * s)
+{
+  const gchar *stream_format = gst_structure_get_string (s, "stream-format");
+  const GValue *value;
+  GByteArray *header;
+  GstMapInfo map;
+  gboolean ret;
+
+  g_clear_pointer (&nvdec->codec_header, g_free);
+  nvdec->codec_header_size = 0;
+  nvdec->nal_length_size = 0;
+
+  if ((codec != cudaVideoCodec_H264 && codec != cudaVideoCodec_HEVC)
+      || !stream_format || !strcmp (stream_format, "byte-stream"))
+    return TRUE;
+
+  value = gst_structure_get_value (s, "codec_data");
+  if (!value || !GST_VALUE_HOLDS_BUFFER (value)) {
+    GST_ERROR_OBJECT (nvdec, "%s input without codec_data", stream_format);
+    return FALSE;
+  }
+
+  if (!gst_buffer_map (gst_value_get_buffer (value), &map, GST_MAP_READ)) {
+    GST_ERROR_OBJECT (nvdec, "failed to map codec_data");
+    return FALSE;
+  }
+  header = g_byte_array_new ();
+  if (codec == cudaVideoCodec_H264)
+    ret = parse_avcc (nvdec, map.data, map.size, header);
+  else
+    ret = parse_hvcc (nvdec, map.data, map.size, header);
+  gst_buffer_unmap (gst_value_get_buffer (value), &map);
+
+  if (!ret) {
+    GST_ERROR_OBJECT (nvdec, "invalid codec_data");
+    g_byte_array_free (header, TRUE);
+    nvdec->nal_length_size = 0;
+    return FALSE;
+  }
+
+  GST_DEBUG_OBJECT (nvdec, "%s input, %u byte NAL lengths, %u bytes of "
+      "parameter sets", stream_format, nvdec->nal_length_size, header->len);
+  nvdec->codec_header_size = header->len;
+  nvdec->codec_header = g_byte_array_free (header, FALSE);
+  nvdec->need_codec_header = TRUE;
 
   return TRUE;
 }
@@ -649,13 +1952,19 @@ gst_nvdec_set_format (GstVideoDecoder * decoder, GstVideoCodecState * state)
   GstNvDec *nvdec = GST_NVDEC (decoder);
 
   GstStructure *s;
-  const gchar *caps_name;
-  gint mpegversion = 0;
+  const GstNvDecCodecMap *codec;
   CUVIDPARSERPARAMS parser_params = { 0, };
 
   GST_DEBUG_OBJECT (nvdec, "set format");
   //g_print("Set format\n");
 
+  // Output what the old parser still holds before it's destroyed,
+  // the old input state is still used when negotiating for it
+  if (gst_nvdec_drain (decoder) != GST_FLOW_OK)
+    GST_INFO_OBJECT (nvdec, "failed to drain the decoder");
+
+  pause_threads (nvdec, TRUE);
+
   if (nvdec->input_state)
     gst_video_codec_state_unref (nvdec->input_state);
 
@@ -663,49 +1972,45 @@ gst_nvdec_set_format (GstVideoDecoder * decoder, GstVideoCodecState * state)
 
   if (!maybe_destroy_decoder_and_parser(nvdec)) {
     GST_WARNING_OBJECT(nvdec, "maybe destroy failed\n");
+    resume_threads (nvdec);
     return FALSE;
   }
+  release_frame_slots (nvdec);
+  resume_threads (nvdec);
 
   s = gst_caps_get_structure (state->caps, 0);
-  caps_name = gst_structure_get_name (s);
-  GST_DEBUG_OBJECT (nvdec, "codec is %s", caps_name);
-
-  if (!g_strcmp0 (caps_name, "video/mpeg")) {
-    if (gst_structure_get_int (s, "mpegversion", &mpegversion)) {
-      switch (mpegversion) {
-        case 1:
-          parser_params.CodecType = cudaVideoCodec_MPEG1;
-          break;
-        case 2:
-          parser_params.CodecType = cudaVideoCodec_MPEG2;
-          break;
-        case 4:
-          parser_params.CodecType = cudaVideoCodec_MPEG4;
-          break;
-      }
-    }
-    nvdec->num_decode_surfaces = NUM_SURFACES_MPEG;
-    if (!mpegversion) {
-      GST_ERROR_OBJECT (nvdec, "could not get MPEG version");
-      return FALSE;
-    }
-  } else if (!g_strcmp0 (caps_name, "video/x-h264")) {
-    parser_params.CodecType = cudaVideoCodec_H264;
-    nvdec->num_decode_surfaces = NUM_SURFACES_H264;
-  } else if (!g_strcmp0 (caps_name, "image/jpeg")) {
-    parser_params.CodecType = cudaVideoCodec_JPEG;
-    nvdec->num_decode_surfaces = NUM_SURFACES_JPEG;
-  } else if (!g_strcmp0 (caps_name, "video/x-h265")) {
-    parser_params.CodecType = cudaVideoCodec_HEVC;
-    nvdec->num_decode_surfaces = NUM_SURFACES_H265;
-  } else {
-    GST_ERROR_OBJECT (nvdec, "failed to determine codec type");
+  codec = find_codec (state->caps);
+  if (!codec) {
+    GST_ERROR_OBJECT (nvdec, "failed to determine codec type from %"
+        GST_PTR_FORMAT, state->caps);
+    return FALSE;
+  }
+
+  GST_DEBUG_OBJECT (nvdec, "codec is %s", GetVideoCodecString (codec->codec));
+  if (!parse_codec_data (nvdec, codec->codec, s))
     return FALSE;
+  parser_params.CodecType = codec->codec;
+  nvdec->num_decode_surfaces = codec->num_decode_surfaces;
+
+  // Everything in the sink caps is a whole picture per buffer,
+  // except MPEG that needs to have gone through a parser first
+  nvdec->end_of_picture = nvdec->low_latency;
+  if (codec->codec == cudaVideoCodec_MPEG1
+      || codec->codec == cudaVideoCodec_MPEG2
+      || codec->codec == cudaVideoCodec_MPEG4) {
+    gboolean parsed = FALSE;
+    gst_structure_get_boolean (s, "parsed", &parsed);
+    nvdec->end_of_picture = nvdec->end_of_picture && parsed;
   }
+  if (nvdec->low_latency && !nvdec->end_of_picture)
+    GST_WARNING_OBJECT (nvdec, "input isn't picture aligned, "
+        "can't signal end of picture");
+
+  ensure_display_table (nvdec, nvdec->num_decode_surfaces);
 
   parser_params.ulMaxNumDecodeSurfaces = nvdec->num_decode_surfaces;
   parser_params.ulErrorThreshold = 100;
-  parser_params.ulMaxDisplayDelay = 0;
+  parser_params.ulMaxDisplayDelay = nvdec->max_display_delay;
   parser_params.ulClockRate = GST_SECOND;
   parser_params.pUserData = nvdec;
   parser_params.pfnSequenceCallback =
@@ -715,34 +2020,18 @@ gst_nvdec_set_format (GstVideoDecoder * decoder, GstVideoCodecState * state)
   parser_params.pfnDisplayPicture =
       (PFNVIDDISPLAYCALLBACK) parser_display_callback;
 
-  CUVIDDECODECAPS decodecaps;
-  memset(&decodecaps, 0, sizeof(decodecaps));
-  decodecaps.eCodecType = parser_params.CodecType;
-  decodecaps.eChromaFormat = cudaVideoChromaFormat_420; // TODO support 4:4:4 output for jpeg 
-  decodecaps.nBitDepthMinus8 = 0; //TODO support 10 bit
-
-  if (!cuda_OK (cuCtxPushCurrent (nvdec->context))) {
-      return FALSE;
-  }
-  if (!cuda_OK (cuvidGetDecoderCaps (&decodecaps))) {
-      GST_ERROR_OBJECT (nvdec, "Failed to get decode caps");
-      return FALSE;
-  }
-  if (!cuda_OK (cuCtxPopCurrent (NULL)))
-      return FALSE;
-
-  if (!decodecaps.bIsSupported) {
-    GST_ERROR_OBJECT(nvdec, "Format not supported! chroma: %s codec: %s",
-      GetVideoChromaFormatString(decodecaps.eChromaFormat), GetVideoCodecString(decodecaps.eCodecType));
+  // The real bit depth is only known once the parser has seen the
+  // stream, the profile tells us early if it's more than 8 bits.
+  // The sequence callback checks again with what the stream says
+  // TODO support 4:4:4 output for jpeg
+  if (!check_decoder_caps (nvdec, parser_params.CodecType,
+          cudaVideoChromaFormat_420, get_bit_depth_minus8 (s), 0, 0))
     return FALSE;
-  }
-  else {
-      GST_DEBUG_OBJECT (nvdec, "Format is supported");
-  }
+  GST_DEBUG_OBJECT (nvdec, "Format is supported");
 
 
   GST_DEBUG_OBJECT (nvdec, "creating parser");
-  if (!cuda_OK (cuvidCreateVideoParser (&nvdec->parser, &parser_params))) {
+  if (!cuda_OK (CuvidCreateVideoParser (&nvdec->parser, &parser_params))) {
     GST_ERROR_OBJECT (nvdec, "failed to create parser");
     return FALSE;
   }
@@ -774,18 +2063,18 @@ copy_video_frame_to_gl_textures (GstGLContext * context, gpointer * args)
   proc_params.top_field_first = dispinfo->top_field_first;
   proc_params.unpaired_field = dispinfo->repeat_first_field == -1;
 
-  if (!cuda_OK (cuvidCtxLock (nvdec->cuda_context->lock, 0))) {
+  if (!lock_context (nvdec)) {
     GST_WARNING_OBJECT (nvdec, "failed to lock CUDA context");
     return;
   }
 
-  if (!cuda_OK (cuvidMapVideoFrame (nvdec->decoder, dispinfo->picture_index,
+  if (!cuda_OK (CuvidMapVideoFrame (nvdec->decoder, dispinfo->picture_index,
               &dptr, &pitch, &proc_params))) {
     GST_WARNING_OBJECT (nvdec, "failed to map CUDA video frame");
     goto unlock_cuda_context;
   }
 
-  if (!cuda_OK (cuGraphicsMapResources (num_resources, resources, NULL))) {
+  if (!cuda_OK (CuGraphicsMapResources (num_resources, resources, NULL))) {
     GST_WARNING_OBJECT (nvdec, "failed to map CUDA resources");
     goto unmap_video_frame;
   }
@@ -797,7 +2086,7 @@ copy_video_frame_to_gl_textures (GstGLContext * context, gpointer * args)
   mcpy2d.WidthInBytes = nvdec->width;
 
   for (i = 0; i < num_resources; i++) {
-    if (!cuda_OK (cuGraphicsSubResourceGetMappedArray (&array, resources[i], 0,
+    if (!cuda_OK (CuGraphicsSubResourceGetMappedArray (&array, resources[i], 0,
                 0))) {
       GST_WARNING_OBJECT (nvdec, "failed to map CUDA array");
       break;
@@ -807,196 +2096,688 @@ copy_video_frame_to_gl_textures (GstGLContext * context, gpointer * args)
     mcpy2d.dstArray = array;
     mcpy2d.Height = nvdec->height / (i + 1);
 
-    if (!cuda_OK (cuMemcpy2D (&mcpy2d)))
+    if (!cuda_OK (CuMemcpy2D (&mcpy2d)))
       GST_WARNING_OBJECT (nvdec, "memcpy to mapped array failed");
   }
 
-  if (!cuda_OK (cuGraphicsUnmapResources (num_resources, resources, NULL)))
+  if (!cuda_OK (CuGraphicsUnmapResources (num_resources, resources, NULL)))
     GST_WARNING_OBJECT (nvdec, "failed to unmap CUDA resources");
 
 unmap_video_frame:
-  if (!cuda_OK (cuvidUnmapVideoFrame (nvdec->decoder, dptr)))
+  if (!cuda_OK (CuvidUnmapVideoFrame (nvdec->decoder, dptr)))
     GST_WARNING_OBJECT (nvdec, "failed to unmap CUDA video frame");
 
 unlock_cuda_context:
-  if (!cuda_OK (cuvidCtxUnlock (nvdec->cuda_context->lock, 0)))
+  if (!unlock_context (nvdec))
     GST_WARNING_OBJECT (nvdec, "failed to unlock CUDA context");
 }
 #endif
 
-static void
-copy_video_frame_to_system (GstNvDec * nvdec, CUVIDPARSERDISPINFO * dispinfo, guint8 * dst_host) {
+static gboolean
+get_convert_format (GstVideoFormat format, GstNvDecConvertFormat *
+    convert_format)
+{
+  switch (format) {
+    case GST_VIDEO_FORMAT_I420:
+      *convert_format = GST_NVDEC_CONVERT_I420;
+      return TRUE;
+    case GST_VIDEO_FORMAT_BGRx:
+      *convert_format = GST_NVDEC_CONVERT_BGRX;
+      return TRUE;
+    case GST_VIDEO_FORMAT_RGBA:
+      *convert_format = GST_NVDEC_CONVERT_RGBA;
+      return TRUE;
+    case GST_VIDEO_FORMAT_GBR:
+      *convert_format = GST_NVDEC_CONVERT_GBR;
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+// Device memory the frame is converted into before it's downloaded,
+// laid out like the output buffers. Must be called with the context pushed
+static gboolean
+ensure_convert_buffer (GstNvDec * nvdec)
+{
+  gsize size = GST_VIDEO_INFO_SIZE (&nvdec->output_info);
+
+  if (nvdec->convert_buffer && nvdec->convert_buffer_size >= size)
+    return TRUE;
+
+  if (nvdec->convert_buffer && !cuda_OK (CuMemFree (nvdec->convert_buffer)))
+    GST_WARNING_OBJECT (nvdec, "failed to free convert buffer");
+  nvdec->convert_buffer = 0;
+  nvdec->convert_buffer_size = 0;
+
+  if (!cuda_OK (CuMemAlloc (&nvdec->convert_buffer, size))) {
+    GST_ERROR_OBJECT (nvdec, "failed to allocate convert buffer");
+    return FALSE;
+  }
+  g_atomic_int_inc (&nvdec->num_allocations);
+  nvdec->convert_buffer_size = size;
+
+  return TRUE;
+}
+
+// Queues the copy of a mapped surface into an output buffer on the
+// decoder's stream, converting it on the way if downstream didn't
+// want NV12. Must be called with the context pushed, waits for nothing
+static gboolean
+output_mapped_surface (GstNvDec * nvdec, CUdeviceptr src, guint src_pitch,
+    guint8 * dst_host, CUdeviceptr dst_device)
+{
+  GstNvDecConvertFormat convert_format;
+  CUDA_MEMCPY2D mcpy2d = { 0, };
+  CUdeviceptr target;
+  gsize offset[3] = { 0, };
+  gint stride[3] = { 0, };
+  guint i;
+
+  if (!get_convert_format (GST_VIDEO_INFO_FORMAT (&nvdec->output_info),
+          &convert_format)) {
+    // Both planes in one go
+    mcpy2d.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+    mcpy2d.srcDevice = src;
+    mcpy2d.srcPitch = src_pitch;
+    if (dst_host) {
+      mcpy2d.dstMemoryType = CU_MEMORYTYPE_HOST;
+      mcpy2d.dstHost = dst_host;
+    } else {
+      mcpy2d.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+      mcpy2d.dstDevice = dst_device;
+    }
+    mcpy2d.dstPitch = nvdec->stride;
+    // 2 bytes per sample for P010/P016
+    mcpy2d.WidthInBytes = nvdec->width
+        * GST_VIDEO_INFO_COMP_PSTRIDE (&nvdec->output_info, 0);
+    mcpy2d.Height = nvdec->height + nvdec->height / 2;
+    GST_LOG ("Copying %i pitch to %i pitch", mcpy2d.srcPitch, mcpy2d.dstPitch);
+
+    if (!cuda_OK (CuMemcpy2DAsync (&mcpy2d, nvdec->cudaStream))) {
+      GST_WARNING_OBJECT (nvdec, "memcpy of the video frame failed");
+      return FALSE;
+    }
+    return TRUE;
+  }
+
+  // Device memory output is converted in place
+  target = dst_device;
+  if (!target) {
+    if (!ensure_convert_buffer (nvdec))
+      return FALSE;
+    target = nvdec->convert_buffer;
+  }
+
+  for (i = 0; i < GST_VIDEO_INFO_N_PLANES (&nvdec->output_info); i++) {
+    offset[i] = GST_VIDEO_INFO_PLANE_OFFSET (&nvdec->output_info, i);
+    stride[i] = GST_VIDEO_INFO_PLANE_STRIDE (&nvdec->output_info, i);
+  }
+
+  if (!gst_nvdec_convert_nv12 (nvdec->cuda_context, convert_format, src,
+          src_pitch, nvdec->height, nvdec->width, nvdec->height, target,
+          offset, stride, &nvdec->color_matrix, nvdec->cudaStream)) {
+    GST_WARNING_OBJECT (nvdec, "failed to convert the video frame");
+    return FALSE;
+  }
+
+  if (dst_host && !cuda_OK (CuMemcpyDtoHAsync (dst_host, target,
+              GST_VIDEO_INFO_SIZE (&nvdec->output_info), nvdec->cudaStream))) {
+    GST_WARNING_OBJECT (nvdec, "download of the converted frame failed");
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Called with the lock held and the context current. The surface
+// is unmapped right after, so the copy has to be done
+static gboolean
+copy_display (GstNvDec * nvdec, GstNvDecDisplay * display)
+{
+  CUVIDPARSERDISPINFO *dispinfo = &display->dispinfo;
   CUVIDPROCPARAMS proc_params = { 0, };
   CUdeviceptr dptr;
   guint pitch;
-  CUDA_MEMCPY2D mcpy2d = { 0, };
+  gboolean mapped, ret;
+  GstClockTime start;
 
-  GST_LOG_OBJECT (nvdec, "copying picture index: %u", dispinfo->picture_index);
+  GST_LOG_OBJECT (nvdec, "copying picture index: %u%s",
+      dispinfo->picture_index, display->dst_device ? " to device memory" : "");
 
   proc_params.progressive_frame = dispinfo->progressive_frame;
   proc_params.top_field_first = dispinfo->top_field_first;
   proc_params.unpaired_field = dispinfo->repeat_first_field == -1;
   proc_params.output_stream = nvdec->cudaStream;
 
-  if (!cuda_OK (cuvidCtxLock (nvdec->lock, 0))) {
+  start = GST_NVDEC_TRACE_BEGIN (GST_NVDEC_STAGE_MAP);
+  mapped = cuda_OK (CuvidMapVideoFrame (nvdec->decoder,
+          dispinfo->picture_index, &dptr, &pitch, &proc_params));
+  GST_NVDEC_TRACE_END (nvdec, GST_NVDEC_STAGE_MAP, start);
+  if (!mapped) {
+    GST_WARNING_OBJECT (nvdec, "failed to map CUDA video frame");
+    return FALSE;
+  }
+
+  // Device memory output has the same layout as the system
+  // memory copy, but the frame never leaves the GPU
+  start = GST_NVDEC_TRACE_BEGIN (GST_NVDEC_STAGE_DOWNLOAD);
+  ret = output_mapped_surface (nvdec, dptr, pitch,
+      display->mapped ? display->map.data : NULL, display->dst_device);
+  // The stream can be shared with other decoders,
+  // only our own copy is waited for
+  if (!cuda_OK (CuEventRecord (nvdec->copy_event, nvdec->cudaStream))
+      || !cuda_OK (CuEventSynchronize (nvdec->copy_event))) {
+    GST_WARNING_OBJECT (nvdec, "Failed to wait for the copy");
+    ret = FALSE;
+  }
+  GST_NVDEC_TRACE_END (nvdec, GST_NVDEC_STAGE_DOWNLOAD, start);
+
+  if (!cuda_OK (CuvidUnmapVideoFrame (nvdec->decoder, dptr)))
+    GST_WARNING_OBJECT (nvdec, "failed to unmap CUDA video frame");
+
+  return ret;
+}
+
+// Copies every batched display out of its surface holding the lock
+// once, instead of once per frame. The frames are finished after it's
+// released, downstream never runs while other instances wait for it
+static GstFlowReturn
+output_display_batch (GstNvDec * nvdec)
+{
+  GstVideoDecoder *decoder = GST_VIDEO_DECODER (nvdec);
+  GstNvDecDisplay *display;
+  GstMemory *mem;
+  GstFlowReturn ret = GST_FLOW_OK, flow;
+  gboolean locked;
+  guint num_displays = nvdec->display_batch_len, i;
+
+  // Mapping an output buffer can wait for the pool,
+  // that's done before taking the lock
+  for (i = 0; i < num_displays; i++) {
+    display = &nvdec->display_batch[i];
+    display->mapped = FALSE;
+    display->dst_device = 0;
+    display->copied = FALSE;
+
+    mem = gst_buffer_peek_memory (display->frame->output_buffer, 0);
+    if (nvdec->use_cuda_output && gst_is_nvdec_cuda_memory (mem)) {
+      display->dst_device = ((GstNvDecCudaMemory *) mem)->data;
+    } else if (gst_buffer_map (display->frame->output_buffer, &display->map,
+            GST_MAP_WRITE)) {
+      GST_DEBUG ("Copying %d bytes to system", (int) display->map.size);
+      display->mapped = TRUE;
+    } else {
+      GST_WARNING_OBJECT (nvdec, "Failed to map for display!");
+    }
+  }
+
+  locked = lock_context (nvdec);
+  if (!locked)
     GST_WARNING_OBJECT (nvdec, "failed to lock CUDA context");
-    return;
+  else {
+    push_context (nvdec);
+    for (i = 0; i < num_displays; i++) {
+      display = &nvdec->display_batch[i];
+      if (display->mapped || display->dst_device)
+        display->copied = copy_display (nvdec, display);
+    }
+    pop_context (nvdec);
+    if (!unlock_context (nvdec))
+      GST_WARNING_OBJECT (nvdec, "failed to unlock CUDA context");
   }
 
-  if (!cuda_OK (cuvidMapVideoFrame (nvdec->decoder, dispinfo->picture_index,
-              &dptr, &pitch, &proc_params))) {
+  // The parser may have the surfaces back
+  for (i = 0; i < num_displays; i++)
+    display_done (nvdec);
+
+  for (i = 0; i < num_displays; i++) {
+    display = &nvdec->display_batch[i];
+    if (display->mapped)
+      gst_buffer_unmap (display->frame->output_buffer, &display->map);
+
+    if (!display->copied) {
+      gst_video_decoder_drop_frame (decoder, display->frame);
+    } else {
+      flow = finish_frame (nvdec, display->frame);
+      if (ret == GST_FLOW_OK)
+        ret = flow;
+    }
+    display->frame = NULL;
+  }
+  nvdec->display_batch_len = 0;
+
+  return ret;
+}
+
+static gboolean
+start_video_frame_download (GstNvDec * nvdec, CUVIDPARSERDISPINFO * dispinfo,
+    GstNvDecDownload * download, guint8 * dst_host, CUdeviceptr dst_device)
+{
+  CUVIDPROCPARAMS proc_params = { 0, };
+  guint pitch;
+  gboolean ret = FALSE;
+  gboolean mapped;
+  GstClockTime start;
+
+  GST_LOG_OBJECT (nvdec, "starting download of picture index: %u",
+      dispinfo->picture_index);
+
+  proc_params.progressive_frame = dispinfo->progressive_frame;
+  proc_params.top_field_first = dispinfo->top_field_first;
+  proc_params.unpaired_field = dispinfo->repeat_first_field == -1;
+  proc_params.output_stream = nvdec->cudaStream;
+
+  if (!lock_context (nvdec)) {
+    GST_WARNING_OBJECT (nvdec, "failed to lock CUDA context");
+    return FALSE;
+  }
+
+  start = GST_NVDEC_TRACE_BEGIN (GST_NVDEC_STAGE_MAP);
+  mapped = cuda_OK (CuvidMapVideoFrame (nvdec->decoder,
+          dispinfo->picture_index, &download->dptr, &pitch, &proc_params));
+  GST_NVDEC_TRACE_END (nvdec, GST_NVDEC_STAGE_MAP, start);
+  if (!mapped) {
     GST_WARNING_OBJECT (nvdec, "failed to map CUDA video frame");
     goto unlock_cuda_context;
   }
 
-  mcpy2d.srcMemoryType = CU_MEMORYTYPE_DEVICE;
-  mcpy2d.srcDevice = dptr;
-  mcpy2d.srcPitch = pitch;
-  mcpy2d.dstMemoryType = CU_MEMORYTYPE_HOST;
-  mcpy2d.dstPitch = nvdec->stride;
-  mcpy2d.dstHost = dst_host;
-  mcpy2d.WidthInBytes = nvdec->width;
-  //mcpy2d.Height = nvdec->height;
-  mcpy2d.Height = nvdec->height + nvdec->height / 2;
-  GST_DEBUG ("Copying %i pitch to %i pitch", mcpy2d.srcPitch, mcpy2d.dstPitch);
-
-  cuCtxPushCurrent (nvdec->context);
-  //if (!cuda_OK (cuStreamSynchronize (nvdec->cudaStream))) {
-      //GST_WARNING_OBJECT (nvdec, "Failed to syncronize the cuda stream");
-  //}
-  // Copy the Y and UV planes
-  //if (!cuda_OK (cuMemcpy2D(&mcpy2d))){
-  if (!cuda_OK (cuMemcpy2DAsync (&mcpy2d, nvdec->cudaStream))){
-    GST_WARNING_OBJECT (nvdec, "memcpy to mapped array failed Y");
-  }
-  if (!cuda_OK (cuStreamSynchronize (nvdec->cudaStream))) {
-      GST_WARNING_OBJECT (nvdec, "Failed to syncronize the cuda stream");
-  }
-  /*
-  CUDA_MEMCPY2D v2 = mcpy2d;
-  // Copy the UV
-  v2.dstPitch = nvdec->uv_stride;
-  v2.srcDevice = (CUdeviceptr)(dptr + mcpy2d.srcPitch * mcpy2d.Height);
-  v2.dstHost = (void*)(dst_host + mcpy2d.dstPitch * mcpy2d.Height);
-  v2.Height = nvdec->height / 2; //TODO this assumes 420, which might not be the case for jpeg!
-
-  //if (!cuda_OK (cuMemcpy2D(&mcpy2d))) {
-  if (!cuda_OK (cuMemcpy2DAsync (&v2, nvdec->cudaStream))) {
-    GST_WARNING_OBJECT (nvdec, "memcpy to mapped array failed UV");
-  }
-
-  if (!cuda_OK (cuStreamSynchronize (nvdec->cudaStream))) {
-      GST_WARNING_OBJECT (nvdec, "Failed to syncronize the cuda stream");
-  }
-  */
-  cuCtxPopCurrent (NULL);
-
-  if (!cuda_OK (cuvidUnmapVideoFrame (nvdec->decoder, dptr)))
+  // No synchronize here, the event tells us when the copy is done
+  push_context (nvdec);
+  if (!output_mapped_surface (nvdec, download->dptr, pitch, dst_host,
+          dst_device))
+    GST_WARNING_OBJECT (nvdec, "async download failed");
+  else if (!cuda_OK (CuEventRecord (download->event, nvdec->cudaStream)))
+    GST_WARNING_OBJECT (nvdec, "failed to record download event");
+  else
+    ret = TRUE;
+  pop_context (nvdec);
+
+  if (!ret && !cuda_OK (CuvidUnmapVideoFrame (nvdec->decoder, download->dptr)))
     GST_WARNING_OBJECT (nvdec, "failed to unmap CUDA video frame");
 
 unlock_cuda_context:
-  if (!cuda_OK (cuvidCtxUnlock (nvdec->lock, 0)))
+  if (!unlock_context (nvdec))
     GST_WARNING_OBJECT (nvdec, "failed to unlock CUDA context");
+
+  return ret;
+}
+
+static void
+complete_video_frame_download (GstNvDec * nvdec, GstNvDecDownload * download)
+{
+  // Only the part of the copy that didn't overlap with anything else
+  GstClockTime start = GST_NVDEC_TRACE_BEGIN (GST_NVDEC_STAGE_DOWNLOAD);
+
+  push_context (nvdec);
+  if (!cuda_OK (CuEventSynchronize (download->event)))
+    GST_WARNING_OBJECT (nvdec, "Failed to wait for the download");
+  pop_context (nvdec);
+  GST_NVDEC_TRACE_END (nvdec, GST_NVDEC_STAGE_DOWNLOAD, start);
+
+  if (!lock_context (nvdec))
+    GST_WARNING_OBJECT (nvdec, "failed to lock CUDA context");
+  if (!cuda_OK (CuvidUnmapVideoFrame (nvdec->decoder, download->dptr)))
+    GST_WARNING_OBJECT (nvdec, "failed to unmap CUDA video frame");
+  if (!unlock_context (nvdec))
+    GST_WARNING_OBJECT (nvdec, "failed to unlock CUDA context");
+
+  if (download->mapped) {
+    gst_buffer_unmap (download->frame->output_buffer, &download->map);
+    download->mapped = FALSE;
+  }
+}
+
+// Completes the oldest download, pushing the frame downstream
+// or releasing it if it was flushed
+static GstFlowReturn
+finish_oldest_download (GstNvDec * nvdec, gboolean push)
+{
+  GstNvDecDownload *download = &nvdec->downloads[nvdec->download_head];
+  GstVideoCodecFrame *frame;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  complete_video_frame_download (nvdec, download);
+
+  frame = download->frame;
+  download->frame = NULL;
+  nvdec->download_head = (nvdec->download_head + 1)
+      % nvdec->num_output_surfaces;
+  nvdec->num_downloads--;
+
+  if (push) {
+    ret = finish_frame (nvdec, frame);
+  } else {
+    gst_video_decoder_release_frame (GST_VIDEO_DECODER (nvdec), frame);
+  }
+
+  return ret;
+}
+
+// Pushes every download that has completed, in display order.
+// If wait is set, blocks until all of them are done
+static GstFlowReturn
+finish_downloads (GstNvDec * nvdec, gboolean wait)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  CUresult status;
+
+  while (ret == GST_FLOW_OK && nvdec->num_downloads > 0) {
+    if (!wait) {
+      push_context (nvdec);
+      status = CuEventQuery (nvdec->downloads[nvdec->download_head].event);
+      pop_context (nvdec);
+      if (status == CUDA_ERROR_NOT_READY)
+        break;
+    }
+    ret = finish_oldest_download (nvdec, TRUE);
+  }
+
+  return ret;
+}
+
+static void
+drop_downloads (GstNvDec * nvdec)
+{
+  while (nvdec->num_downloads > 0)
+    finish_oldest_download (nvdec, FALSE);
+}
+
+static GstFlowReturn
+queue_video_frame_download (GstNvDec * nvdec, CUVIDPARSERDISPINFO * dispinfo,
+    GstVideoCodecFrame * frame)
+{
+  GstNvDecDownload *download;
+  GstMemory *mem;
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint8 *dst_host = NULL;
+  CUdeviceptr dst_device = 0;
+
+  // Each download holds an output surface, so when they're all
+  // in use we have to wait for the oldest one
+  if (nvdec->num_downloads == nvdec->num_output_surfaces)
+    ret = finish_oldest_download (nvdec, TRUE);
+
+  download = &nvdec->downloads[(nvdec->download_head + nvdec->num_downloads)
+      % nvdec->num_output_surfaces];
+  download->frame = frame;
+
+  mem = gst_buffer_peek_memory (frame->output_buffer, 0);
+  if (nvdec->use_cuda_output && gst_is_nvdec_cuda_memory (mem)) {
+    dst_device = ((GstNvDecCudaMemory *) mem)->data;
+  } else {
+    if (!gst_buffer_map (frame->output_buffer, &download->map,
+            GST_MAP_WRITE)) {
+      GST_WARNING_OBJECT (nvdec, "Failed to map for display!");
+      download->frame = NULL;
+      gst_video_decoder_drop_frame (GST_VIDEO_DECODER (nvdec), frame);
+      return ret;
+    }
+    download->mapped = TRUE;
+    dst_host = download->map.data;
+  }
+
+  if (!start_video_frame_download (nvdec, dispinfo, download, dst_host,
+          dst_device)) {
+    if (download->mapped) {
+      gst_buffer_unmap (frame->output_buffer, &download->map);
+      download->mapped = FALSE;
+    }
+    download->frame = NULL;
+    gst_video_decoder_drop_frame (GST_VIDEO_DECODER (nvdec), frame);
+    return ret;
+  }
+  nvdec->num_downloads++;
+
+  if (ret == GST_FLOW_OK)
+    ret = finish_downloads (nvdec, FALSE);
+
+  return ret;
+}
+
+#if !USE_GL
+static gboolean
+downstream_supports_cuda_memory (GstNvDec * nvdec)
+{
+  GstCaps *peer_caps;
+  GstCapsFeatures *features;
+  gboolean ret = FALSE;
+  guint i;
+
+  peer_caps = gst_pad_peer_query_caps (GST_VIDEO_DECODER_SRC_PAD (nvdec),
+      NULL);
+  if (!peer_caps)
+    return FALSE;
+
+  // ANY caps have no structures, so we only pick device memory
+  // when downstream explicitly asks for it
+  for (i = 0; !ret && i < gst_caps_get_size (peer_caps); i++) {
+    features = gst_caps_get_features (peer_caps, i);
+    if (features && gst_caps_features_contains (features,
+            GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY))
+      ret = TRUE;
+  }
+  gst_caps_unref (peer_caps);
+
+  return ret;
+}
+#endif
+
+#if !USE_GL
+static gboolean
+is_output_format (const GValue * value, gboolean high_bit_depth,
+    GstVideoFormat * format)
+{
+  GstNvDecConvertFormat convert_format;
+
+  if (!G_VALUE_HOLDS_STRING (value))
+    return FALSE;
+
+  *format = gst_video_format_from_string (g_value_get_string (value));
+  // Same memory layout, P010 just says only 10 of the bits are used
+  if (high_bit_depth)
+    return *format == GST_VIDEO_FORMAT_P010_10LE
+        || *format == GST_VIDEO_FORMAT_P016_LE;
+
+  return *format == GST_VIDEO_FORMAT_NV12
+      || get_convert_format (*format, &convert_format);
+}
+
+// The first format downstream lists for the kind of memory we
+// output, so its order of preference is kept
+static GstVideoFormat
+choose_output_format (GstNvDec * nvdec, gboolean cuda_output,
+    guint bit_depth_minus8)
+{
+  GstVideoFormat default_format = bit_depth_minus8 > 2
+      ? GST_VIDEO_FORMAT_P016_LE : bit_depth_minus8
+      ? GST_VIDEO_FORMAT_P010_10LE : GST_VIDEO_FORMAT_NV12;
+  GstPad *srcpad = GST_VIDEO_DECODER_SRC_PAD (nvdec);
+  GstCaps *template_caps, *peer_caps;
+  GstCapsFeatures *features;
+  const GValue *value;
+  GstVideoFormat format = GST_VIDEO_FORMAT_UNKNOWN;
+  guint i, j;
+
+  template_caps = gst_pad_get_pad_template_caps (srcpad);
+  peer_caps = gst_pad_peer_query_caps (srcpad, template_caps);
+  gst_caps_unref (template_caps);
+  if (!peer_caps)
+    return default_format;
+
+  for (i = 0; format == GST_VIDEO_FORMAT_UNKNOWN
+      && i < gst_caps_get_size (peer_caps); i++) {
+    features = gst_caps_get_features (peer_caps, i);
+    if (cuda_output != (features && gst_caps_features_contains (features,
+                GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY)))
+      continue;
+
+    value = gst_structure_get_value (gst_caps_get_structure (peer_caps, i),
+        "format");
+    if (!value)
+      continue;
+
+    if (GST_VALUE_HOLDS_LIST (value)) {
+      for (j = 0; j < gst_value_list_get_size (value); j++) {
+        if (is_output_format (gst_value_list_get_value (value, j),
+                bit_depth_minus8 > 0, &format))
+          break;
+        format = GST_VIDEO_FORMAT_UNKNOWN;
+      }
+    } else if (!is_output_format (value, bit_depth_minus8 > 0, &format)) {
+      format = GST_VIDEO_FORMAT_UNKNOWN;
+    }
+  }
+  gst_caps_unref (peer_caps);
+
+  if (format == GST_VIDEO_FORMAT_UNKNOWN)
+    format = default_format;
+
+  return format;
+}
+#endif
+
+// Time from handle_frame to the picture coming out of the parser,
+// which includes the reordering and display delay
+static void
+record_decode_latency (GstNvDec * nvdec, GstNvDecFrameSlot * slot)
+{
+  GstClockTime latency = gst_util_get_timestamp () - slot->receive_time;
+
+  nvdec->decode_latency_last = latency;
+  nvdec->decode_latency_max = MAX (nvdec->decode_latency_max, latency);
+  nvdec->decode_latency_total += latency;
+  nvdec->num_displayed++;
+
+  GST_LOG_OBJECT (nvdec, "decode latency %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (latency));
 }
 
 static GstFlowReturn
 handle_pending_frames (GstNvDec * nvdec)
 {
   GstVideoDecoder *decoder = GST_VIDEO_DECODER (nvdec);
-  GList *pending_frames, *list, *tmp;
   GstVideoCodecFrame *pending_frame;
-  guint frame_number;
-  GstClockTime latency = 0;
-  GstNvDecQueueItem *item;
-  CUVIDEOFORMAT *format;
+  GstNvDecFrameSlot slot;
+  GstNvDecQueueItem item;
   GstVideoCodecState *state;
   guint width, height, fps_n, fps_d;
-  CUVIDPICPARAMS *decode_params;
+  GstVideoFormat format;
+  gboolean cuda_output = FALSE;
   CUVIDPARSERDISPINFO *dispinfo;
 #if USE_GL
+  GstMemory *mem;
   CUgraphicsResource *resources;
   gpointer args[4];
   guint i, num_resources;
-  GstMemory *mem;
 #endif
-  GstFlowReturn ret = GST_FLOW_OK;
+  GstFlowReturn ret = GST_FLOW_OK, flow;
+  gboolean batched;
   GST_DEBUG ("In pending frames");
 
-  /* find the oldest unused, unfinished frame */
-  pending_frames = list = gst_video_decoder_get_frames (decoder);
-
-  /* Print all waiting frames
-  for (GList *pnd = list; pnd != NULL; pnd = pnd->next) {
-    GstVideoCodecFrame *frame = pnd->data;
-    guint num =
-        GPOINTER_TO_UINT (gst_video_codec_frame_get_user_data (frame));
-    GST_DEBUG ("%" G_GUINT32_FORMAT ": %" GST_TIME_FORMAT,
-        num, GST_TIME_ARGS(frame->pts));
-  }
-  */
-
-  // Get the first frame with a 0 frame number
-  // Also measure the latency
-  for (; pending_frames; pending_frames = pending_frames->next) {
-    pending_frame = pending_frames->data;
-    frame_number =
-        GPOINTER_TO_UINT (gst_video_codec_frame_get_user_data (pending_frame));
-    if (!frame_number)
-        break;
-    latency += pending_frame->duration;
-  }
-  // TODO currently we won't iterate if there are no pending
-  // frames waiting for decode. Even if there are
-  // frames waiting to be displayed or frames
-  // that are ready to be dropped
-
-  // Keep iterating until we error, or have no more pending frames
-  while (ret == GST_FLOW_OK && pending_frames
-      && (item =
-          (GstNvDecQueueItem *) g_async_queue_try_pop (nvdec->decode_queue))) {
-    switch (item->type) {
+  // Push out whatever finished downloading since the last buffer
+  ret = finish_downloads (nvdec, FALSE);
+
+  // Keep iterating until we error, or have no more queued items
+  while (ret == GST_FLOW_OK) {
+    // Consecutive displays are copied together, the batch goes
+    // out before anything that isn't a display is handled
+    if (nvdec->display_batch_len
+        && (nvdec->display_batch_len == MAX_DISPLAY_BATCH
+            || !decode_queue_next_is_display (nvdec))) {
+      ret = output_display_batch (nvdec);
+      continue;
+    }
+
+    if (!decode_queue_pop (nvdec, &item))
+      break;
+    batched = FALSE;
+
+    // Queued before the last flush. A sequence still
+    // describes the decoder, the rest is thrown away
+    if (item.generation != nvdec->generation
+        && item.type != GST_NVDEC_QUEUE_ITEM_TYPE_SEQUENCE) {
+      if (item.type == GST_NVDEC_QUEUE_ITEM_TYPE_DECODE)
+        release_frame_slot (nvdec, &item.decode.slot);
+      else if (item.type == GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY)
+        display_done (nvdec);
+      continue;
+    }
+
+    switch (item.type) {
       case GST_NVDEC_QUEUE_ITEM_TYPE_SEQUENCE:
         GST_DEBUG ("Sequence");
+        // Picture indices go up to the new number of surfaces
+        ensure_display_table (nvdec, item.sequence.num_decode_surfaces);
+
         if (!nvdec->decoder) {
           GST_ERROR_OBJECT (nvdec, "no decoder");
           ret = GST_FLOW_ERROR;
           break;
         }
 
-        format = (CUVIDEOFORMAT *) item->data;
-        width = format->display_area.right - format->display_area.left;
-        height = format->display_area.bottom - format->display_area.top;
-        fps_n = format->frame_rate.numerator;
-        fps_d = MAX (1, format->frame_rate.denominator);
+        width = item.sequence.width;
+        height = item.sequence.height;
+        fps_n = item.sequence.fps_n;
+        fps_d = item.sequence.fps_d;
         GST_DEBUG ("Sequence A");
 
+        gst_nvdec_color_matrix_init (&nvdec->color_matrix,
+            item.sequence.matrix_coefficients, item.sequence.full_range,
+            item.sequence.display_height);
+#if USE_GL
+        format = GST_VIDEO_FORMAT_NV12;
+#else
+        cuda_output = downstream_supports_cuda_memory (nvdec);
+        format = choose_output_format (nvdec, cuda_output,
+            item.sequence.bit_depth_minus8);
+#endif
+
         if (!gst_pad_has_current_caps (GST_VIDEO_DECODER_SRC_PAD (decoder))
+            || format != GST_VIDEO_INFO_FORMAT (&nvdec->output_info)
+            || cuda_output != nvdec->use_cuda_output
             || width != nvdec->width || height != nvdec->height
+            || item.sequence.par_n != nvdec->par_n
+            || item.sequence.par_d != nvdec->par_d
             || fps_n != nvdec->fps_n || fps_d != nvdec->fps_d) {
           GST_DEBUG ("Sequence B");
           nvdec->width = width;
           nvdec->height = height;
           nvdec->fps_n = fps_n;
           nvdec->fps_d = fps_d;
+          nvdec->par_n = item.sequence.par_n;
+          nvdec->par_d = item.sequence.par_d;
 
           state = gst_video_decoder_set_output_state (decoder,
-              GST_VIDEO_FORMAT_NV12, nvdec->width, nvdec->height,
-              nvdec->input_state);
+              format, nvdec->width, nvdec->height, nvdec->input_state);
+          state->info.par_n = nvdec->par_n;
+          state->info.par_d = nvdec->par_d;
           GST_DEBUG ("Sequence C");
           state->caps = gst_caps_new_simple ("video/x-raw",
-              "format", G_TYPE_STRING, "NV12",
+              "format", G_TYPE_STRING, gst_video_format_to_string (format),
               "width", G_TYPE_INT, nvdec->width,
               "height", G_TYPE_INT, nvdec->height,
               "framerate", GST_TYPE_FRACTION, nvdec->fps_n, nvdec->fps_d,
-              "interlace-mode", G_TYPE_STRING, format->progressive_sequence
+              "pixel-aspect-ratio", GST_TYPE_FRACTION, nvdec->par_n,
+              nvdec->par_d,
+              "interlace-mode", G_TYPE_STRING, item.sequence.progressive
               ? "progressive" : "interleaved",
               "texture-target", G_TYPE_STRING, "2D", NULL);
+          nvdec->output_info = state->info;
           nvdec->stride = state->info.stride[0];
           GST_DEBUG ("Stride is %i", nvdec->stride);
           GST_DEBUG ("Sequence D");
 #if USE_GL
           gst_caps_set_features (state->caps, 0,
               gst_caps_features_new (GST_CAPS_FEATURE_MEMORY_GL_MEMORY, NULL));
+#else
+          nvdec->use_cuda_output = cuda_output;
+          if (nvdec->use_cuda_output) {
+            GST_DEBUG_OBJECT (nvdec, "downstream supports CUDA memory");
+            gst_caps_set_features (state->caps, 0,
+                gst_caps_features_new (GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY,
+                    NULL));
+          }
 #endif
           gst_video_codec_state_unref (state);
 
@@ -1014,300 +2795,948 @@ handle_pending_frames (GstNvDec * nvdec)
         break;
 
       case GST_NVDEC_QUEUE_ITEM_TYPE_DECODE:
-        // If we have a decode item, then use the oldest
-        // frame without a frame number
-        decode_params = (CUVIDPICPARAMS *) item->data;
-
-        // First check if this is a frame that needs to be dropped
-        if (nvdec->decode_frames_pending_drop != NULL) {
-            //guint len = g_list_length (nvdec->decode_frames_pending_drop);
-            pending_frame = nvdec->decode_frames_pending_drop->data;
-            nvdec->decode_frames_pending_drop = g_list_remove (nvdec->decode_frames_pending_drop, pending_frame);
-            //GST_DEBUG_OBJECT (nvdec, "Will drop decode frame, len: %" G_GUINT32_FORMAT, len);
-            // Add this frame to the list of display frames ready to be dropped
-            nvdec->display_frames_pending_drop = g_list_append (nvdec->display_frames_pending_drop, pending_frame);
-        }
-        else {
-            pending_frame = pending_frames->data;
-            pending_frames = pending_frames->next;
-        }
-
-        frame_number = decode_params->CurrPicIdx + 1;
-        GST_DEBUG ("Decode %" G_GUINT32_FORMAT, frame_number);
+        // A picture was submitted, remember its frame
+        // until the picture gets displayed
+        slot = item.decode.slot;
+        GST_DEBUG ("Decode %d", item.decode.picture_index);
 
-        gst_video_codec_frame_set_user_data (pending_frame,
-            GUINT_TO_POINTER (frame_number), NULL);
-
-        if (decode_params->intra_pic_flag)
-          GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (pending_frame);
+        if (!slot.frame)
+          break;
+        pending_frame = slot.frame;
 
         if (!GST_CLOCK_TIME_IS_VALID (pending_frame->duration)) {
           pending_frame->duration =
               nvdec->fps_n ? GST_SECOND * nvdec->fps_d / nvdec->fps_n : 0;
         }
-        latency += pending_frame->duration;
+        nvdec->latency += pending_frame->duration;
+
+        if (item.decode.picture_index < 0 || (guint) item.decode.picture_index
+            >= nvdec->display_table_size) {
+          GST_WARNING_OBJECT (nvdec, "picture index %d out of range",
+              item.decode.picture_index);
+          release_frame_slot (nvdec, &slot);
+          break;
+        }
+
+        if (item.decode.intra)
+          GST_VIDEO_CODEC_FRAME_SET_SYNC_POINT (pending_frame);
+
+        // The surface is being reused before the last frame
+        // on it was displayed, that frame is never coming out
+        if (nvdec->display_table[item.decode.picture_index].frame) {
+          GST_DEBUG_OBJECT (nvdec, "picture %d was never displayed",
+              item.decode.picture_index);
+          release_frame_slot (nvdec,
+              &nvdec->display_table[item.decode.picture_index]);
+        }
+        nvdec->display_table[item.decode.picture_index] = slot;
         GST_DEBUG_OBJECT (nvdec, "Done with decode");
 
         break;
 
       case GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY:
-          // If we get a display item, find the previously
-          // set pending frame using the frame number
-        dispinfo = (CUVIDPARSERDISPINFO *) item->data;
-        GST_DEBUG ("Display %" G_GUINT32_FORMAT, dispinfo->picture_index + 1);
-        pending_frame = NULL;
-
-        // First, try to find the display frame in the display frames ready to be dropped
-        for (tmp = nvdec->display_frames_pending_drop;
-            !pending_frame && tmp;
-            tmp = tmp->next) {
-            frame_number =
-                GPOINTER_TO_UINT (gst_video_codec_frame_get_user_data
-                (tmp->data));
-            //GST_DEBUG ("drop display #%" G_GUINT32_FORMAT, frame_number);
-            if (frame_number == dispinfo->picture_index + 1)
-                pending_frame = tmp->data;
+        // The display item refers to the picture index the
+        // frame was stored under when it was decoded
+        dispinfo = &item.display;
+        GST_DEBUG ("Display %d", dispinfo->picture_index);
+
+        if (dispinfo->picture_index < 0 || (guint) dispinfo->picture_index
+            >= nvdec->display_table_size
+            || !nvdec->display_table[dispinfo->picture_index].frame) {
+          GST_WARNING_OBJECT (nvdec, "no frame with picture index %d",
+              dispinfo->picture_index);
+          break;
         }
-        // If we found the frame, remove it from the list
-        if (pending_frame) {
-            GST_DEBUG_OBJECT (nvdec, "Using dropped frame");
-            nvdec->display_frames_pending_drop = g_list_remove (nvdec->display_frames_pending_drop, pending_frame);
-            // We're now done with this frame, so just unref
-            gst_video_codec_frame_unref (pending_frame);
-            break;
+
+        slot = nvdec->display_table[dispinfo->picture_index];
+        nvdec->display_table[dispinfo->picture_index].frame = NULL;
+        pending_frame = slot.frame;
+
+        // Flushed while it was in flight, nobody wants it anymore
+        if (slot.generation != nvdec->generation) {
+          GST_DEBUG_OBJECT (nvdec, "Using dropped frame");
+          release_frame_slot (nvdec, &slot);
+          break;
+        }
+
+        // Nothing was decoded to the surface
+        if (slot.skip || slot.late) {
+          nvdec->latency -= MIN (nvdec->latency, pending_frame->duration);
+          if (slot.late)
+            gst_video_decoder_drop_frame (decoder, pending_frame);
+          else
+            gst_video_decoder_release_frame (decoder, pending_frame);
+          break;
+        }
+
+        record_decode_latency (nvdec, &slot);
+
+        // Make sure the timestamps are the same
+        if (dispinfo->timestamp != pending_frame->pts) {
+            GST_WARNING_OBJECT (nvdec,
+                "timestamp mismatch, frame: %" GST_TIME_FORMAT
+                " nvdisp: %" GST_TIME_FORMAT,
+                GST_TIME_ARGS (pending_frame->pts),
+                GST_TIME_ARGS (dispinfo->timestamp));
+          //pending_frame->pts = dispinfo->timestamp;
+        }
+          GST_DEBUG_OBJECT (nvdec,
+              "displaying ts: %" GST_TIME_FORMAT,
+              GST_TIME_ARGS (pending_frame->pts));
+
+        if (nvdec->latency > nvdec->min_latency) {
+          nvdec->min_latency = nvdec->latency;
+          gst_video_decoder_set_latency (decoder, nvdec->min_latency,
+              nvdec->min_latency);
+          GST_DEBUG_OBJECT (nvdec, "latency: %" GST_TIME_FORMAT,
+              GST_TIME_ARGS (nvdec->latency));
+        }
+        nvdec->latency -= pending_frame->duration;
+
+        // Had to be decoded for the frames referring to it,
+        // but downstream would only throw it away
+        if (gst_video_decoder_get_max_decode_time (decoder,
+                pending_frame) < 0) {
+          GST_LOG_OBJECT (nvdec, "dropping late frame %" GST_TIME_FORMAT,
+              GST_TIME_ARGS (pending_frame->pts));
+          nvdec->num_dropped++;
+          gst_video_decoder_drop_frame (decoder, pending_frame);
+          break;
+        }
+
+        ret = gst_video_decoder_allocate_output_frame (decoder, pending_frame);
+        if (ret != GST_FLOW_OK) {
+          GST_WARNING_OBJECT (nvdec, "failed to allocate output frame");
+          gst_video_decoder_drop_frame (decoder, pending_frame);
+          break;
+        }
+
+        if (!dispinfo->progressive_frame) {
+          GST_BUFFER_FLAG_SET (pending_frame->output_buffer,
+              GST_VIDEO_BUFFER_FLAG_INTERLACED);
+
+          if (dispinfo->top_field_first) {
+            GST_BUFFER_FLAG_SET (pending_frame->output_buffer,
+                GST_VIDEO_BUFFER_FLAG_TFF);
+          }
+          if (dispinfo->repeat_first_field == -1) {
+            GST_BUFFER_FLAG_SET (pending_frame->output_buffer,
+                GST_VIDEO_BUFFER_FLAG_ONEFIELD);
+          } else {
+            GST_BUFFER_FLAG_SET (pending_frame->output_buffer,
+                GST_VIDEO_BUFFER_FLAG_RFF);
+          }
+        }
+
+#if USE_GL
+        num_resources = gst_buffer_n_memory (pending_frame->output_buffer);
+        resources = g_new (CUgraphicsResource, num_resources);
+
+        for (i = 0; i < num_resources; i++) {
+          mem = gst_buffer_get_memory (pending_frame->output_buffer, i);
+          resources[i] =
+              ensure_cuda_graphics_resource (mem, nvdec->cuda_context);
+          GST_MINI_OBJECT_FLAG_SET (mem,
+              GST_GL_BASE_MEMORY_TRANSFER_NEED_DOWNLOAD);
+          gst_memory_unref (mem);
+        }
+
+        args[0] = nvdec;
+        args[1] = dispinfo;
+        args[2] = resources;
+        args[3] = GUINT_TO_POINTER (num_resources);
+        gst_gl_context_thread_add (nvdec->gl_context,
+            (GstGLContextThreadFunc) copy_video_frame_to_gl_textures, args);
+        g_free (resources);
+#endif
+        // With several output surfaces the frame is finished
+        // later, once its download has completed
+        if (nvdec->num_output_surfaces > 1) {
+          ret = queue_video_frame_download (nvdec, dispinfo, pending_frame);
+          break;
+        }
+
+        // The surface stays held until the batch is copied
+        nvdec->display_batch[nvdec->display_batch_len].dispinfo = *dispinfo;
+        nvdec->display_batch[nvdec->display_batch_len].frame = pending_frame;
+        nvdec->display_batch_len++;
+        batched = TRUE;
+        break;
+
+      case GST_NVDEC_QUEUE_ITEM_TYPE_DRAIN:
+        // Everything the parser held before the drain has been handled,
+        // on a worker it's done once the push thread gets this far
+        ret = finish_downloads (nvdec, TRUE);
+        if (nvdec->finished_queue) {
+          finish_frame (nvdec, NULL);
+          break;
         }
+        g_mutex_lock (&nvdec->queue_lock);
+        nvdec->drains_done++;
+        g_cond_broadcast (&nvdec->queue_cond);
+        g_mutex_unlock (&nvdec->queue_lock);
+        break;
+
+      default:
+        g_assert_not_reached ();
+    }
+
+    if (item.type == GST_NVDEC_QUEUE_ITEM_TYPE_DISPLAY && !batched)
+      display_done (nvdec);
+  }
+
+  // The queue ran dry, or an error stopped the loop
+  if (nvdec->display_batch_len) {
+    flow = output_display_batch (nvdec);
+    if (ret == GST_FLOW_OK)
+      ret = flow;
+  }
+
+  //g_print("Done handling frame %s\n", gst_flow_get_name(ret));
+  GST_DEBUG ("pending frames done");
+  return ret;
+}
+
+static GstFlowReturn
+gst_nvdec_handle_frame (GstVideoDecoder * decoder, GstVideoCodecFrame * frame)
+{
+  GstNvDec *nvdec = GST_NVDEC (decoder);
+
+  GST_LOG_OBJECT (nvdec,
+      "handling frame ts: %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (frame->pts));
+
+  // Cheapest when upstream flags its delta units, the parser never
+  // sees them. Otherwise the decode callback skips them
+  if (get_skip_frames (nvdec) == GST_NVDEC_SKIP_FRAMES_NON_KEY
+      && GST_BUFFER_FLAG_IS_SET (frame->input_buffer,
+          GST_BUFFER_FLAG_DELTA_UNIT)) {
+    GST_LOG_OBJECT (nvdec, "skipping delta unit");
+    nvdec->num_skipped++;
+    gst_video_decoder_release_frame (decoder, frame);
+    return nvdec->input_queue ? nvdec->output_flow
+        : handle_pending_frames (nvdec);
+  }
+
+  if (nvdec->input_queue)
+    return queue_input_frame (nvdec, frame);
+
+  if (!parse_frame (nvdec, frame))
+    return GST_FLOW_ERROR;
+
+  return handle_pending_frames (nvdec);
+}
+
+// Rewrites length prefixed NALs with start codes into scratch, which
+// is kept for the next frame so this doesn't allocate once it has
+// grown to the largest frame. A length running past the end of the
+// buffer ends the frame there, the parser sees it as corrupt
+static gsize
+convert_to_byte_stream (GstNvDec * nvdec, const guint8 * data, gsize size)
+{
+  guint n = nvdec->nal_length_size, i;
+  gsize pos = 0, out = 0, len;
+
+  while (pos + n <= size) {
+    for (i = 0, len = 0; i < n; i++)
+      len = len << 8 | data[pos + i];
+    pos += n;
+    if (len > size - pos) {
+      GST_WARNING_OBJECT (nvdec, "NAL length %" G_GSIZE_FORMAT " past the "
+          "end of the frame", len);
+      break;
+    }
+
+    if (out + 4 + len > nvdec->scratch_size) {
+      nvdec->scratch_size = MAX (out + 4 + len, nvdec->scratch_size * 2);
+      nvdec->scratch = g_realloc (nvdec->scratch, nvdec->scratch_size);
+      g_atomic_int_inc (&nvdec->num_allocations);
+    }
+    nvdec->scratch[out] = 0;
+    nvdec->scratch[out + 1] = 0;
+    nvdec->scratch[out + 2] = 0;
+    nvdec->scratch[out + 3] = 1;
+    memcpy (nvdec->scratch + out + 4, data + pos, len);
+    out += 4 + len;
+    pos += len;
+  }
+
+  return out;
+}
+
+// The parameter sets from codec_data, before the first frame
+// and whenever the parser has been drained or reset
+static void
+send_codec_header (GstNvDec * nvdec)
+{
+  CUVIDSOURCEDATAPACKET packet = { 0, };
+
+  nvdec->need_codec_header = FALSE;
+  if (!nvdec->codec_header_size)
+    return;
+
+  packet.payload_size = (gulong) nvdec->codec_header_size;
+  packet.payload = nvdec->codec_header;
+  if (!cuda_OK (CuvidParseVideoData (nvdec->parser, &packet)))
+    GST_WARNING_OBJECT (nvdec, "parser failed on codec_data");
+}
+
+// Runs on the streaming thread when not pipelined,
+// otherwise on the parse thread
+static gboolean
+parse_frame (GstNvDec * nvdec, GstVideoCodecFrame * frame)
+{
+  GstMapInfo map_info = GST_MAP_INFO_INIT;
+  CUVIDSOURCEDATAPACKET packet = { 0, };
+  GstClockTime start;
+
+  if (!gst_buffer_map (frame->input_buffer, &map_info, GST_MAP_READ)) {
+    GST_ERROR_OBJECT (nvdec, "failed to map input buffer");
+    gst_video_codec_frame_unref (frame);
+    return FALSE;
+  }
+
+  if (nvdec->need_codec_header)
+    send_codec_header (nvdec);
+
+  if (nvdec->nal_length_size) {
+    packet.payload_size = (gulong) convert_to_byte_stream (nvdec,
+        map_info.data, map_info.size);
+    packet.payload = nvdec->scratch;
+  } else {
+    packet.payload_size = (gulong) map_info.size;
+    packet.payload = map_info.data;
+  }
+  packet.timestamp = frame->pts;
+  packet.flags = CUVID_PKT_TIMESTAMP;
+
+  if (GST_BUFFER_IS_DISCONT (frame->input_buffer)) {
+      GST_DEBUG_OBJECT (nvdec, "Adding discontinuity");
+      packet.flags |= CUVID_PKT_DISCONTINUITY;
+  }
+
+  // Otherwise the parser only knows the picture is complete
+  // once the start of the next one arrives
+  if (nvdec->end_of_picture)
+      packet.flags |= CUVID_PKT_ENDOFPICTURE;
+
+  // The frame waits here until the parser submits its picture,
+  // we keep the reference the base class gave us until then
+  decode_fifo_push (nvdec, frame);
+
+  // Includes the decode callbacks the parser makes
+  start = GST_NVDEC_TRACE_BEGIN (GST_NVDEC_STAGE_PARSE);
+  if (!cuda_OK (CuvidParseVideoData (nvdec->parser, &packet)))
+    GST_WARNING_OBJECT (nvdec, "parser failed");
+  GST_NVDEC_TRACE_END (nvdec, GST_NVDEC_STAGE_PARSE, start);
+
+  gst_buffer_unmap (frame->input_buffer, &map_info);
+
+  return TRUE;
+}
+
+// Makes the parser forget what it holds without decoding any of it,
+// the decoder and its surfaces are kept for what comes after a flush
+static void
+reset_parser (GstNvDec * nvdec)
+{
+  CUVIDSOURCEDATAPACKET packet = { 0, };
+
+  if (!nvdec->parser)
+    return;
+
+  packet.flags = CUVID_PKT_ENDOFSTREAM | CUVID_PKT_DISCONTINUITY;
+  nvdec->resetting_parser = TRUE;
+  if (!cuda_OK (CuvidParseVideoData (nvdec->parser, &packet)))
+    GST_WARNING_OBJECT (nvdec, "failed to reset parser");
+  nvdec->resetting_parser = FALSE;
+  nvdec->need_codec_header = TRUE;
+}
+
+// Makes the parser decode and display everything it still holds,
+// it starts over with the next buffer
+static void
+drain_parser (GstNvDec * nvdec)
+{
+  CUVIDSOURCEDATAPACKET packet = { 0, };
+
+  packet.payload_size = 0;
+  packet.payload = NULL;
+  packet.flags = CUVID_PKT_ENDOFSTREAM;
+
+  if (nvdec->parser && !cuda_OK (CuvidParseVideoData (nvdec->parser, &packet)))
+    GST_WARNING_OBJECT (nvdec, "parser failed");
+  nvdec->need_codec_header = TRUE;
+}
+
+static gpointer
+parse_thread_func (gpointer data)
+{
+  GstNvDec *nvdec = GST_NVDEC (data);
+  GstNvDecQueueItem item;
+  GstVideoCodecFrame *frame;
+
+  g_mutex_lock (&nvdec->queue_lock);
+  while (!nvdec->stopping) {
+    if (nvdec->paused || !nvdec->input_queue_len) {
+      nvdec->parse_paused = nvdec->paused;
+      g_cond_broadcast (&nvdec->queue_cond);
+      g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
+      continue;
+    }
+    nvdec->parse_paused = FALSE;
+
+    frame = nvdec->input_queue[nvdec->input_queue_head];
+    nvdec->input_queue_head = (nvdec->input_queue_head + 1) % INPUT_QUEUE_SIZE;
+    nvdec->input_queue_len--;
+    g_cond_broadcast (&nvdec->queue_cond);
+    g_mutex_unlock (&nvdec->queue_lock);
+
+    bind_context (nvdec);
+    if (frame) {
+      parse_frame (nvdec, frame);
+    } else {
+      // The output thread finishes the drain once
+      // it gets to this item
+      drain_parser (nvdec);
+      item.type = GST_NVDEC_QUEUE_ITEM_TYPE_DRAIN;
+      decode_queue_push (nvdec, &item);
+    }
+
+    g_mutex_lock (&nvdec->queue_lock);
+  }
+  nvdec->parse_paused = TRUE;
+  g_cond_broadcast (&nvdec->queue_cond);
+  g_mutex_unlock (&nvdec->queue_lock);
+
+  return NULL;
+}
+
+static gpointer
+output_thread_func (gpointer data)
+{
+  GstNvDec *nvdec = GST_NVDEC (data);
+  GstFlowReturn ret;
+  gboolean idle;
+
+  g_mutex_lock (&nvdec->queue_lock);
+  while (!nvdec->stopping) {
+    idle = decode_queue_empty (nvdec);
+    if (nvdec->paused || (idle && !nvdec->num_downloads)) {
+      nvdec->output_paused = nvdec->paused;
+      nvdec->output_idle = idle && !nvdec->num_downloads;
+      g_cond_broadcast (&nvdec->queue_cond);
+      // Counted before looking again, see wake_ring_waiters()
+      g_atomic_int_inc (&nvdec->ring_waiters);
+      if (nvdec->paused || decode_queue_empty (nvdec))
+        g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
+      g_atomic_int_add (&nvdec->ring_waiters, -1);
+      continue;
+    }
+    nvdec->output_paused = FALSE;
+    nvdec->output_idle = FALSE;
+    g_mutex_unlock (&nvdec->queue_lock);
+
+    bind_context (nvdec);
+
+    // Nothing else to do until the downloads in flight complete
+    if (idle)
+      ret = finish_downloads (nvdec, TRUE);
+    else
+      ret = handle_pending_frames (nvdec);
+
+    g_mutex_lock (&nvdec->queue_lock);
+    if (ret != GST_FLOW_OK && nvdec->output_flow == GST_FLOW_OK) {
+      GST_DEBUG_OBJECT (nvdec, "output flow %s", gst_flow_get_name (ret));
+      nvdec->output_flow = ret;
+    }
+  }
+  nvdec->output_paused = TRUE;
+  g_cond_broadcast (&nvdec->queue_cond);
+  g_mutex_unlock (&nvdec->queue_lock);
+
+  return NULL;
+}
+
+// Runs on a worker of the shared scheduler and does what the parse
+// and output threads do, one after the other like without pipelined,
+// except pushing. Requeued whenever there is input again, or the push
+// thread has caught up
+static void
+task_func (gpointer data)
+{
+  GstNvDec *nvdec = GST_NVDEC (data);
+  GstNvDecQueueItem item;
+  GstVideoCodecFrame *frame;
+  GstFlowReturn ret;
+
+  // Workers are shared between decoders, this rebinds
+  // only if another decoder's context was current
+  bind_context (nvdec);
+
+  g_mutex_lock (&nvdec->queue_lock);
+  while (!nvdec->stopping && !nvdec->paused
+      && nvdec->finished_queue_len < FINISHED_QUEUE_LIMIT
+      && (nvdec->input_queue_len || nvdec->num_downloads)) {
+    if (!nvdec->input_queue_len) {
+      g_mutex_unlock (&nvdec->queue_lock);
+      ret = finish_downloads (nvdec, TRUE);
+    } else {
+      frame = nvdec->input_queue[nvdec->input_queue_head];
+      nvdec->input_queue_head =
+          (nvdec->input_queue_head + 1) % INPUT_QUEUE_SIZE;
+      nvdec->input_queue_len--;
+      g_cond_broadcast (&nvdec->queue_cond);
+      g_mutex_unlock (&nvdec->queue_lock);
+
+      if (frame) {
+        ret = parse_frame (nvdec, frame) ? handle_pending_frames (nvdec)
+            : GST_FLOW_ERROR;
+      } else {
+        drain_parser (nvdec);
+        item.type = GST_NVDEC_QUEUE_ITEM_TYPE_DRAIN;
+        decode_queue_push (nvdec, &item);
+        ret = handle_pending_frames (nvdec);
+      }
+    }
+
+    g_mutex_lock (&nvdec->queue_lock);
+    if (ret != GST_FLOW_OK && nvdec->output_flow == GST_FLOW_OK) {
+      GST_DEBUG_OBJECT (nvdec, "output flow %s", gst_flow_get_name (ret));
+      nvdec->output_flow = ret;
+    }
+  }
+  nvdec->task_queued = FALSE;
+  nvdec->parse_paused = TRUE;
+  nvdec->output_paused = TRUE;
+  g_cond_broadcast (&nvdec->queue_cond);
+  g_mutex_unlock (&nvdec->queue_lock);
+}
+
+// With a scheduler, pushes what the workers have finished. Downstream
+// can block in preroll or on the clock for as long as it likes without
+// holding a worker other decoders need
+static gpointer
+push_thread_func (gpointer data)
+{
+  GstNvDec *nvdec = GST_NVDEC (data);
+  GstVideoCodecFrame *frame;
+  GstFlowReturn ret;
+
+  g_mutex_lock (&nvdec->queue_lock);
+  while (!nvdec->stopping) {
+    if (nvdec->paused || !nvdec->finished_queue_len) {
+      nvdec->push_paused = nvdec->paused;
+      g_cond_broadcast (&nvdec->queue_cond);
+      g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
+      continue;
+    }
+    nvdec->push_paused = FALSE;
+
+    frame = nvdec->finished_queue[nvdec->finished_queue_head];
+    nvdec->finished_queue_head =
+        (nvdec->finished_queue_head + 1) % FINISHED_QUEUE_SIZE;
+    nvdec->finished_queue_len--;
+    // The workers may have stopped for us
+    if (nvdec->input_queue_len || nvdec->num_downloads)
+      schedule_task (nvdec);
+
+    if (!frame) {
+      nvdec->drains_done++;
+      g_cond_broadcast (&nvdec->queue_cond);
+      continue;
+    }
+    g_mutex_unlock (&nvdec->queue_lock);
+
+    ret = push_frame (nvdec, frame);
+
+    g_mutex_lock (&nvdec->queue_lock);
+    if (ret != GST_FLOW_OK && nvdec->output_flow == GST_FLOW_OK) {
+      GST_DEBUG_OBJECT (nvdec, "output flow %s", gst_flow_get_name (ret));
+      nvdec->output_flow = ret;
+    }
+  }
+  nvdec->push_paused = TRUE;
+  g_cond_broadcast (&nvdec->queue_cond);
+  g_mutex_unlock (&nvdec->queue_lock);
+
+  return NULL;
+}
+
+// Called with queue_lock held after queueing input
+static void
+schedule_task (GstNvDec * nvdec)
+{
+  if (!nvdec->scheduler || nvdec->task_queued || nvdec->paused
+      || nvdec->stopping || nvdec->finished_queue_len >= FINISHED_QUEUE_LIMIT)
+    return;
+
+  nvdec->task_queued = TRUE;
+  nvdec->parse_paused = FALSE;
+  nvdec->output_paused = FALSE;
+  if (!gst_nvdec_scheduler_push (nvdec->scheduler, &nvdec->task)) {
+    // Nothing will clear it, stop_threads() would wait forever
+    nvdec->task_queued = FALSE;
+    nvdec->parse_paused = TRUE;
+    nvdec->output_paused = TRUE;
+    g_cond_broadcast (&nvdec->queue_cond);
+  }
+}
+
+static void
+start_threads (GstNvDec * nvdec)
+{
+  nvdec->input_queue = g_new0 (GstVideoCodecFrame *, INPUT_QUEUE_SIZE);
+  nvdec->input_queue_head = 0;
+  nvdec->input_queue_len = 0;
+  nvdec->num_pending_displays = 0;
+  nvdec->drains_requested = 0;
+  nvdec->drains_done = 0;
+  nvdec->paused = FALSE;
+  nvdec->parse_paused = FALSE;
+  nvdec->output_paused = FALSE;
+  nvdec->output_idle = FALSE;
+  nvdec->stopping = FALSE;
+  nvdec->output_flow = GST_FLOW_OK;
+
+  if (nvdec->scheduler) {
+    nvdec->task.func = task_func;
+    nvdec->task.data = nvdec;
+    nvdec->task_queued = FALSE;
+    nvdec->parse_paused = TRUE;
+    nvdec->output_paused = TRUE;
+    nvdec->finished_queue = g_new0 (GstVideoCodecFrame *,
+        FINISHED_QUEUE_SIZE);
+    nvdec->finished_queue_head = 0;
+    nvdec->finished_queue_len = 0;
+    nvdec->push_paused = FALSE;
+    nvdec->push_thread =
+        g_thread_new ("nvdec-push", push_thread_func, nvdec);
+    return;
+  }
 
-        // If we didn't find the frame in the dropping display list, check
-        // pending_frames
-        for (pending_frame = NULL, tmp = list; !pending_frame && tmp;
-            tmp = tmp->next) {
-            frame_number =
-                GPOINTER_TO_UINT (gst_video_codec_frame_get_user_data
-                (tmp->data));
-            if (frame_number == dispinfo->picture_index + 1)
-                pending_frame = tmp->data;
-        }
+  nvdec->parse_thread = g_thread_new ("nvdec-parse", parse_thread_func, nvdec);
+  nvdec->output_thread =
+      g_thread_new ("nvdec-output", output_thread_func, nvdec);
+}
 
-        // If we still did not find the frame, then an error has likely occurred
-        if (!pending_frame) {
-            GST_WARNING_OBJECT (nvdec, "no frame with number %u",
-                dispinfo->picture_index + 1);
-            break;
-        }
+static void
+clear_input_queue (GstNvDec * nvdec)
+{
+  GstVideoCodecFrame *frame;
+
+  while (nvdec->input_queue_len) {
+    frame = nvdec->input_queue[nvdec->input_queue_head];
+    if (frame)
+      gst_video_codec_frame_unref (frame);
+    nvdec->input_queue_head = (nvdec->input_queue_head + 1) % INPUT_QUEUE_SIZE;
+    nvdec->input_queue_len--;
+  }
+}
 
-        // Make sure the timestamps are the same
-        if (dispinfo->timestamp != pending_frame->pts) {
-            GST_WARNING_OBJECT (nvdec,
-                "timestamp mismatch, frame: %" GST_TIME_FORMAT
-                " nvdisp: %" GST_TIME_FORMAT,
-                GST_TIME_ARGS (pending_frame->pts),
-                GST_TIME_ARGS (dispinfo->timestamp));
-          //pending_frame->pts = dispinfo->timestamp;
-        }
-          GST_DEBUG_OBJECT (nvdec,
-              "displaying ts: %" GST_TIME_FORMAT,
-              GST_TIME_ARGS (pending_frame->pts));
+// Frames the push thread didn't get to, the base class forgets them
+static void
+clear_finished_queue (GstNvDec * nvdec)
+{
+  GstVideoCodecFrame *frame;
+
+  while (nvdec->finished_queue_len) {
+    frame = nvdec->finished_queue[nvdec->finished_queue_head];
+    if (frame)
+      gst_video_decoder_release_frame (GST_VIDEO_DECODER (nvdec), frame);
+    nvdec->finished_queue_head =
+        (nvdec->finished_queue_head + 1) % FINISHED_QUEUE_SIZE;
+    nvdec->finished_queue_len--;
+  }
+}
 
-        if (latency > nvdec->min_latency) {
-          nvdec->min_latency = latency;
-          gst_video_decoder_set_latency (decoder, nvdec->min_latency,
-              nvdec->min_latency);
-          GST_DEBUG_OBJECT (nvdec, "latency: %" GST_TIME_FORMAT,
-              GST_TIME_ARGS (latency));
-        }
-        latency -= pending_frame->duration;
+static void
+stop_threads (GstNvDec * nvdec)
+{
+  if (!nvdec->input_queue)
+    return;
 
-        ret = gst_video_decoder_allocate_output_frame (decoder, pending_frame);
-        if (ret != GST_FLOW_OK) {
-          GST_WARNING_OBJECT (nvdec, "failed to allocate output frame");
-          break;
-        }
+  g_mutex_lock (&nvdec->queue_lock);
+  nvdec->stopping = TRUE;
+  g_cond_broadcast (&nvdec->queue_cond);
+  // A task still queued on the scheduler returns right away
+  while (nvdec->scheduler && nvdec->task_queued)
+    g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
+  g_mutex_unlock (&nvdec->queue_lock);
+
+  if (nvdec->parse_thread) {
+    g_thread_join (nvdec->parse_thread);
+    g_thread_join (nvdec->output_thread);
+    nvdec->parse_thread = NULL;
+    nvdec->output_thread = NULL;
+  }
+  if (nvdec->push_thread) {
+    g_thread_join (nvdec->push_thread);
+    nvdec->push_thread = NULL;
+    clear_finished_queue (nvdec);
+    g_free (nvdec->finished_queue);
+    nvdec->finished_queue = NULL;
+  }
 
-#if USE_GL
-        num_resources = gst_buffer_n_memory (pending_frame->output_buffer);
-        resources = g_new (CUgraphicsResource, num_resources);
+  clear_input_queue (nvdec);
+  g_free (nvdec->input_queue);
+  nvdec->input_queue = NULL;
+}
 
-        for (i = 0; i < num_resources; i++) {
-          mem = gst_buffer_get_memory (pending_frame->output_buffer, i);
-          resources[i] =
-              ensure_cuda_graphics_resource (mem, nvdec->cuda_context);
-          GST_MINI_OBJECT_FLAG_SET (mem,
-              GST_GL_BASE_MEMORY_TRANSFER_NEED_DOWNLOAD);
-          gst_memory_unref (mem);
-        }
+// Tells the threads to stop at the next chance without waiting for
+// them, anything blocked on the queues returns right away
+static void
+request_pause (GstNvDec * nvdec)
+{
+  if (!nvdec->input_queue)
+    return;
 
-        args[0] = nvdec;
-        args[1] = dispinfo;
-        args[2] = resources;
-        args[3] = GUINT_TO_POINTER (num_resources);
-        gst_gl_context_thread_add (nvdec->gl_context,
-            (GstGLContextThreadFunc) copy_video_frame_to_gl_textures, args);
-        g_free (resources);
-#endif
-        GstMapInfo map = GST_MAP_INFO_INIT;
-        if (!gst_buffer_map (pending_frame->output_buffer, &map, GST_MAP_WRITE)) {
-            GST_WARNING_OBJECT (nvdec, "Failed to map for display!");
-            break;
-        }
-        GST_DEBUG ("Copying %d bytes to system", (int)map.size);
-        copy_video_frame_to_system (nvdec, dispinfo, map.data);
-        gst_buffer_unmap (pending_frame->output_buffer, &map);
+  g_mutex_lock (&nvdec->queue_lock);
+  nvdec->paused = TRUE;
+  g_cond_broadcast (&nvdec->queue_cond);
+  g_mutex_unlock (&nvdec->queue_lock);
+}
 
-        if (!dispinfo->progressive_frame) {
-          GST_BUFFER_FLAG_SET (pending_frame->output_buffer,
-              GST_VIDEO_BUFFER_FLAG_INTERLACED);
+// Waits until both threads are outside the parser and the queues, called
+// with the stream lock held the output thread may need it to get there
+static void
+pause_threads (GstNvDec * nvdec, gboolean stream_locked)
+{
+  GstVideoDecoder *decoder = GST_VIDEO_DECODER (nvdec);
 
-          if (dispinfo->top_field_first) {
-            GST_BUFFER_FLAG_SET (pending_frame->output_buffer,
-                GST_VIDEO_BUFFER_FLAG_TFF);
-          }
-          if (dispinfo->repeat_first_field == -1) {
-            GST_BUFFER_FLAG_SET (pending_frame->output_buffer,
-                GST_VIDEO_BUFFER_FLAG_ONEFIELD);
-          } else {
-            GST_BUFFER_FLAG_SET (pending_frame->output_buffer,
-                GST_VIDEO_BUFFER_FLAG_RFF);
-          }
-        }
-        list = g_list_remove (list, pending_frame);
-        ret = gst_video_decoder_finish_frame (decoder, pending_frame);
-        if (ret != GST_FLOW_OK)
-          GST_INFO_OBJECT (nvdec, "failed to finish frame");
+  if (!nvdec->input_queue)
+    return;
 
-        break;
+  if (stream_locked)
+    GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
 
-      default:
-        g_assert_not_reached ();
-    }
+  g_mutex_lock (&nvdec->queue_lock);
+  nvdec->paused = TRUE;
+  g_cond_broadcast (&nvdec->queue_cond);
+  while (!nvdec->parse_paused || !nvdec->output_paused
+      || (nvdec->push_thread && !nvdec->push_paused))
+    g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
+  g_mutex_unlock (&nvdec->queue_lock);
 
-    g_free (item->data);
-    g_slice_free (GstNvDecQueueItem, item);
-  }
+  if (stream_locked)
+    GST_VIDEO_DECODER_STREAM_LOCK (decoder);
+}
 
-  // getting the pending frames from the base class refs them,
-  // so we unref everything here
-  g_list_free_full (list, (GDestroyNotify) gst_video_codec_frame_unref);
+static void
+resume_threads (GstNvDec * nvdec)
+{
+  if (!nvdec->input_queue)
+    return;
 
-  //g_print("Done handling frame %s\n", gst_flow_get_name(ret));
-  GST_DEBUG ("pending frames done");
-  return ret;
+  g_mutex_lock (&nvdec->queue_lock);
+  nvdec->paused = FALSE;
+  g_cond_broadcast (&nvdec->queue_cond);
+  if (nvdec->input_queue_len || nvdec->num_downloads)
+    schedule_task (nvdec);
+  g_mutex_unlock (&nvdec->queue_lock);
 }
 
+// Upstream only queues the frame, the stream lock is released while
+// the queue is full so the output thread can keep finishing frames
 static GstFlowReturn
-gst_nvdec_handle_frame (GstVideoDecoder * decoder, GstVideoCodecFrame * frame)
+queue_input_frame (GstNvDec * nvdec, GstVideoCodecFrame * frame)
 {
-  GstNvDec *nvdec = GST_NVDEC (decoder);
-  GstMapInfo map_info = GST_MAP_INFO_INIT;
-  CUVIDSOURCEDATAPACKET packet = { 0, };
-
-  GST_LOG_OBJECT (nvdec,
-      "handling frame ts: %" GST_TIME_FORMAT,
-      GST_TIME_ARGS (frame->pts));
-
-  gst_video_codec_frame_set_user_data (frame, GUINT_TO_POINTER (0), NULL);
+  GstVideoDecoder *decoder = GST_VIDEO_DECODER (nvdec);
+  GstFlowReturn ret;
+
+  GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
+  g_mutex_lock (&nvdec->queue_lock);
+  while (nvdec->input_queue_len == INPUT_QUEUE_SIZE && !nvdec->paused)
+    g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
+
+  ret = nvdec->paused ? GST_FLOW_FLUSHING : nvdec->output_flow;
+  if (ret == GST_FLOW_OK) {
+    nvdec->input_queue[(nvdec->input_queue_head + nvdec->input_queue_len)
+        % INPUT_QUEUE_SIZE] = frame;
+    nvdec->input_queue_len++;
+    g_cond_broadcast (&nvdec->queue_cond);
+    schedule_task (nvdec);
+  }
+  g_mutex_unlock (&nvdec->queue_lock);
+  GST_VIDEO_DECODER_STREAM_LOCK (decoder);
 
-  if (!gst_buffer_map (frame->input_buffer, &map_info, GST_MAP_READ)) {
-    GST_ERROR_OBJECT (nvdec, "failed to map input buffer");
+  if (ret != GST_FLOW_OK)
     gst_video_codec_frame_unref (frame);
-    return GST_FLOW_ERROR;
-  }
 
-  packet.payload_size = (gulong) map_info.size;
-  packet.payload = map_info.data;
-  packet.timestamp = frame->pts;
-  packet.flags = CUVID_PKT_TIMESTAMP;
+  return ret;
+}
 
-  if (GST_BUFFER_IS_DISCONT (frame->input_buffer)) {
-      GST_DEBUG_OBJECT (nvdec, "Adding discontinuity");
-      packet.flags |= CUVID_PKT_DISCONTINUITY;
+// Queues a drain behind the frames already queued and waits until
+// the output thread has handled everything in front of it
+static GstFlowReturn
+drain_threads (GstNvDec * nvdec)
+{
+  GstVideoDecoder *decoder = GST_VIDEO_DECODER (nvdec);
+  GstFlowReturn ret;
+  guint drain;
+
+  GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
+  g_mutex_lock (&nvdec->queue_lock);
+  while (nvdec->input_queue_len == INPUT_QUEUE_SIZE && !nvdec->paused)
+    g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
+
+  if (!nvdec->paused) {
+    nvdec->input_queue[(nvdec->input_queue_head + nvdec->input_queue_len)
+        % INPUT_QUEUE_SIZE] = NULL;
+    nvdec->input_queue_len++;
+    drain = ++nvdec->drains_requested;
+    g_cond_broadcast (&nvdec->queue_cond);
+    schedule_task (nvdec);
+
+    while (nvdec->drains_done != drain && !nvdec->paused)
+      g_cond_wait (&nvdec->queue_cond, &nvdec->queue_lock);
   }
 
-  if (!cuda_OK (cuvidParseVideoData (nvdec->parser, &packet)))
-    GST_WARNING_OBJECT (nvdec, "parser failed");
-
-  gst_buffer_unmap (frame->input_buffer, &map_info);
-  gst_video_codec_frame_unref (frame);
+  ret = nvdec->paused ? GST_FLOW_FLUSHING : nvdec->output_flow;
+  g_mutex_unlock (&nvdec->queue_lock);
+  GST_VIDEO_DECODER_STREAM_LOCK (decoder);
 
-  return handle_pending_frames (nvdec);
+  return ret;
 }
 
 static gboolean
 gst_nvdec_flush (GstVideoDecoder * decoder)
 {
   GstNvDec *nvdec = GST_NVDEC (decoder);
+  GstNvDecFrameSlot slot;
+  guint i;
   GST_DEBUG_OBJECT (nvdec, "flush");
 
-  // Nvidia doesn't let us drop frames that are "in-flight"
-  // So to flush we just note the frames that are currently in flight
-  // and we drop them once they've been fully decoded
-  // we also notify the base class that we're done with the
-  // current pending frames
-
-  GList* pending_frames = gst_video_decoder_get_frames (decoder);
-  GList* list = pending_frames;
-  for (; pending_frames != NULL; pending_frames = pending_frames->next) {
-      // Keep track of the frames that are being dropped
-      GstVideoCodecFrame* frame = pending_frames->data;
-      guint frame_number =
-          GPOINTER_TO_UINT (gst_video_codec_frame_get_user_data (frame));
-
-      // If the frame number is 0, this frame is pending decode
-      // if it has a frame number, it's pending display
-      if (frame_number == 0) {
-          nvdec->decode_frames_pending_drop = g_list_append (nvdec->decode_frames_pending_drop, frame);
-          GST_DEBUG_OBJECT (nvdec, "Adding to decode drop: %" GST_TIME_FORMAT,
-              GST_TIME_ARGS(frame->pts));
-      }
-      else {
-          nvdec->display_frames_pending_drop = g_list_append (nvdec->display_frames_pending_drop, frame);
-          GST_DEBUG_OBJECT (nvdec, "Adding to display drop: %" G_GUINT32_FORMAT
-              " %" GST_TIME_FORMAT,
-              frame_number,
-              GST_TIME_ARGS(frame->pts));
-      }
+  // Requested on flush-start, the output thread may only have got out
+  // of a push once downstream was flushing too
+  pause_threads (nvdec, TRUE);
 
-      // drop the frame, but keep a ref for until it's fully decoded
-      gst_video_codec_frame_ref (frame);
-      gst_video_decoder_release_frame (decoder, frame);
-  }
-  // Clear out our list (GstVideoDecoder gives us a ref'd copy)
-  g_list_free (list);
+  if (nvdec->input_queue)
+    clear_input_queue (nvdec);
+  if (nvdec->finished_queue)
+    clear_finished_queue (nvdec);
+
+  // Frames being downloaded are no longer wanted
+  drop_downloads (nvdec);
+
+  // Everything queued or held from here on belongs to the old
+  // stream. The base class drops its references to those frames
+  // after this, what's queued is thrown away when it comes up
+  nvdec->generation++;
+  nvdec->latency = 0;
+
+  // The parser hands back what it held without it being decoded,
+  // frames it never got to or decoded already are released here
+  reset_parser (nvdec);
+  while (decode_fifo_pop (nvdec, &slot))
+    release_frame_slot (nvdec, &slot);
+  for (i = 0; i < nvdec->display_table_size; i++)
+    release_frame_slot (nvdec, &nvdec->display_table[i]);
+
+  nvdec->drains_done = nvdec->drains_requested;
+  nvdec->output_flow = GST_FLOW_OK;
+  resume_threads (nvdec);
 
   GST_DEBUG_OBJECT (nvdec, "flushed");
   return TRUE;
 }
 
+static gboolean
+gst_nvdec_sink_event (GstVideoDecoder * decoder, GstEvent * event)
+{
+  GstNvDec *nvdec = GST_NVDEC (decoder);
+
+  // Gets the threads out of the way before the base class waits for
+  // the stream lock, flush waits for them and resumes them. Waiting
+  // here could hang, the output thread may be blocked downstream
+  // until this event gets there
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_START)
+    request_pause (nvdec);
+
+  return GST_VIDEO_DECODER_CLASS (gst_nvdec_parent_class)->sink_event
+      (decoder, event);
+}
+
 static GstFlowReturn
 gst_nvdec_drain (GstVideoDecoder * decoder)
 {
   GstNvDec *nvdec = GST_NVDEC (decoder);
-  //CUVIDSOURCEDATAPACKET packet = { 0, };
+  GstFlowReturn ret;
+
   GST_DEBUG_OBJECT (nvdec, "draining decoder");
-  //packet.payload_size = 0;
-  //packet.payload = NULL;
-  //packet.flags = CUVID_PKT_ENDOFSTREAM;
 
-  //if (nvdec->parser && !cuda_OK (cuvidParseVideoData (nvdec->parser, &packet)))
-    //GST_WARNING_OBJECT (nvdec, "parser failed");
+  if (nvdec->input_queue)
+    return drain_threads (nvdec);
+
+  drain_parser (nvdec);
 
-  GstFlowReturn ret = handle_pending_frames (nvdec);
+  ret = handle_pending_frames (nvdec);
+  if (ret == GST_FLOW_OK)
+    ret = finish_downloads (nvdec, TRUE);
   GST_DEBUG_OBJECT (nvdec, "decoder drained");
   return ret;
 }
 
+// The base class only calls drain before a flush or renegotiation,
+// this is what it calls at EOS
+static GstFlowReturn
+gst_nvdec_finish (GstVideoDecoder * decoder)
+{
+  GST_DEBUG_OBJECT (decoder, "finish");
+
+  return gst_nvdec_drain (decoder);
+}
+
 void gst_nvdec_set_property (GObject * object, guint prop_id, const GValue * value, GParamSpec * pspec)
 {
     GstNvDec *nvdec = GST_NVDEC (object);
     switch (prop_id) {
     case PROP_CTX:
-        nvdec->did_make_context = FALSE;
         uint64_t ctx_uint = g_value_get_uint64 (value);
-        nvdec->context = (CUcontext)ctx_uint; //TODO this looks real fucking dangerous...
+        nvdec->user_context = (CUcontext)ctx_uint; //TODO this looks real fucking dangerous...
         break;
     case PROP_LOCK:
-        nvdec->did_make_lock = FALSE;
         uint64_t lock_uint = g_value_get_uint64 (value);
-        nvdec->lock = (CUvideoctxlock)lock_uint; //TODO this looks real fucking dangerous...
+        nvdec->user_lock = (CUvideoctxlock)lock_uint; //TODO this looks real fucking dangerous...
+        break;
+    case PROP_NUMA_NODE:
+        nvdec->numa_node = g_value_get_int (value);
+        break;
+    case PROP_NUM_OUTPUT_SURFACES:
+        // The download ring is sized when the element starts
+        if (nvdec->downloads) {
+            GST_WARNING_OBJECT (nvdec, "can't change the number of output "
+                "surfaces while running");
+            break;
+        }
+        nvdec->num_output_surfaces = g_value_get_uint (value);
+        break;
+    case PROP_MAX_WIDTH:
+        nvdec->max_width = g_value_get_uint (value);
+        break;
+    case PROP_MAX_HEIGHT:
+        nvdec->max_height = g_value_get_uint (value);
+        break;
+    case PROP_SURFACE_HEADROOM:
+        nvdec->surface_headroom = g_value_get_uint (value);
+        break;
+    case PROP_CUDA_DEVICE_ID:
+        nvdec->cuda_device_id = g_value_get_int (value);
+        break;
+    case PROP_DEVICE_POLICY:
+        nvdec->device_policy = g_value_get_enum (value);
+        break;
+    case PROP_LOW_LATENCY:
+        nvdec->low_latency = g_value_get_boolean (value);
+        break;
+    case PROP_MAX_DISPLAY_DELAY:
+        nvdec->max_display_delay = g_value_get_uint (value);
+        break;
+    case PROP_SKIP_FRAMES:
+        nvdec->skip_frames = g_value_get_enum (value);
+        break;
+    case PROP_PIPELINED:
+        nvdec->pipelined = g_value_get_boolean (value);
         break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -1315,18 +3744,84 @@ void gst_nvdec_set_property (GObject * object, guint prop_id, const GValue * val
     }
 }
 
+static GstStructure *
+gst_nvdec_create_stats (GstNvDec * nvdec)
+{
+  guint64 num_displayed = nvdec->num_displayed;
+
+  return gst_structure_new ("application/x-nvdec-stats",
+      "cuda-device-id", G_TYPE_INT, nvdec->device,
+      "device-sessions", G_TYPE_UINT,
+      gst_cuda_device_get_num_sessions (nvdec->device),
+      "displayed", G_TYPE_UINT64, num_displayed,
+      "skipped", G_TYPE_UINT64, nvdec->num_skipped,
+      "qos-skipped", G_TYPE_UINT64, nvdec->num_qos_skipped,
+      "dropped", G_TYPE_UINT64, nvdec->num_dropped,
+      "decode-latency-last", G_TYPE_UINT64, nvdec->decode_latency_last,
+      "decode-latency-max", G_TYPE_UINT64, nvdec->decode_latency_max,
+      "decode-latency-average", G_TYPE_UINT64, num_displayed
+      ? nvdec->decode_latency_total / num_displayed : 0,
+      "locks", G_TYPE_UINT64, nvdec->num_locks,
+      "lock-wait-time", G_TYPE_UINT64, nvdec->lock_wait_time,
+      "lock-hold-time", G_TYPE_UINT64, nvdec->lock_hold_time, NULL);
+}
+
 void gst_nvdec_get_property (GObject * object, guint prop_id, GValue * value, GParamSpec * pspec)
 {
     GstNvDec *nvdec = GST_NVDEC (object);
     switch (prop_id) {
     case PROP_CTX:
-        g_value_set_uint64 (value, (guint64)nvdec->context);
+        g_value_set_uint64 (value, (guint64)(nvdec->context
+                ? nvdec->context : nvdec->user_context));
         //TODO this looks real fucking dangerous...
         break;
     case PROP_LOCK:
-        g_value_set_uint64 (value, (guint64)nvdec->lock);
+        g_value_set_uint64 (value, (guint64)(nvdec->lock
+                ? nvdec->lock : nvdec->user_lock));
         //TODO this looks real fucking dangerous...
         break;
+    case PROP_NUMA_NODE:
+        g_value_set_int (value, nvdec->numa_node);
+        break;
+    case PROP_NUM_OUTPUT_SURFACES:
+        g_value_set_uint (value, nvdec->num_output_surfaces);
+        break;
+    case PROP_ALLOCATIONS:
+        g_value_set_uint (value, g_atomic_int_get (&nvdec->num_allocations));
+        break;
+    case PROP_MAX_WIDTH:
+        g_value_set_uint (value, nvdec->max_width);
+        break;
+    case PROP_MAX_HEIGHT:
+        g_value_set_uint (value, nvdec->max_height);
+        break;
+    case PROP_SURFACE_HEADROOM:
+        g_value_set_uint (value, nvdec->surface_headroom);
+        break;
+    case PROP_SURFACE_MEMORY:
+        g_value_set_uint64 (value, nvdec->surface_memory);
+        break;
+    case PROP_CUDA_DEVICE_ID:
+        g_value_set_int (value, nvdec->cuda_device_id);
+        break;
+    case PROP_DEVICE_POLICY:
+        g_value_set_enum (value, nvdec->device_policy);
+        break;
+    case PROP_LOW_LATENCY:
+        g_value_set_boolean (value, nvdec->low_latency);
+        break;
+    case PROP_MAX_DISPLAY_DELAY:
+        g_value_set_uint (value, nvdec->max_display_delay);
+        break;
+    case PROP_SKIP_FRAMES:
+        g_value_set_enum (value, nvdec->skip_frames);
+        break;
+    case PROP_PIPELINED:
+        g_value_set_boolean (value, nvdec->pipelined);
+        break;
+    case PROP_STATS:
+        g_value_take_boxed (value, gst_nvdec_create_stats (nvdec));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
         break;
@@ -1408,9 +3903,67 @@ gst_nvdec_decide_allocation (GstVideoDecoder * decoder, GstQuery * query)
   return GST_VIDEO_DECODER_CLASS (gst_nvdec_parent_class)->decide_allocation
       (decoder, query);
 }
+#else
+static gboolean
+gst_nvdec_decide_allocation (GstVideoDecoder * decoder, GstQuery * query)
+{
+  GstNvDec *nvdec = GST_NVDEC (decoder);
+  GstCaps *outcaps;
+  GstBufferPool *pool = NULL;
+  GstAllocator *allocator;
+  GstAllocationParams params;
+  guint size, min, max;
+  GstVideoInfo vinfo = { 0, };
+
+  gint numa_node;
+
+  GST_DEBUG_OBJECT (nvdec, "decide allocation");
+
+  gst_query_parse_allocation (query, &outcaps, NULL);
+  if (!outcaps || !gst_video_info_from_caps (&vinfo, outcaps)) {
+    GST_ERROR_OBJECT (nvdec, "invalid output caps");
+    return FALSE;
+  }
+
+  if (nvdec->use_cuda_output) {
+    // Replace whatever downstream proposed with a pool of device memory,
+    // the base class then configures it with our allocator
+    allocator = gst_nvdec_cuda_allocator_new (nvdec->cuda_context);
+    gst_allocation_params_init (&params);
+    if (gst_query_get_n_allocation_params (query) > 0)
+      gst_query_set_nth_allocation_param (query, 0, allocator, &params);
+    else
+      gst_query_add_allocation_param (query, allocator, &params);
+    gst_object_unref (allocator);
+    pool = gst_video_buffer_pool_new ();
+  } else {
+    // Downloads into pageable memory get staged by the driver,
+    // so always download into pinned memory on the GPU's node
+    numa_node = nvdec->numa_node >= 0 ? nvdec->numa_node
+        : gst_cuda_device_get_numa_node (nvdec->device);
+    pool = gst_cuda_host_buffer_pool_new (nvdec->cuda_context, numa_node);
+  }
+
+  size = (guint) vinfo.size;
+  min = max = 0;
+  if (gst_query_get_n_allocation_pools (query) > 0) {
+    GstBufferPool *downstream_pool = NULL;
+
+    gst_query_parse_nth_allocation_pool (query, 0, &downstream_pool, NULL,
+        &min, &max);
+    if (downstream_pool)
+      gst_object_unref (downstream_pool);
+    gst_query_set_nth_allocation_pool (query, 0, pool, size, min, max);
+  } else {
+    gst_query_add_allocation_pool (query, pool, size, min, max);
+  }
+  gst_object_unref (pool);
+
+  return GST_VIDEO_DECODER_CLASS (gst_nvdec_parent_class)->decide_allocation
+      (decoder, query);
+}
 #endif
 
-#if USE_GL
 static gboolean
 gst_nvdec_src_query (GstVideoDecoder * decoder, GstQuery * query)
 {
@@ -1418,9 +3971,14 @@ gst_nvdec_src_query (GstVideoDecoder * decoder, GstQuery * query)
 
   switch (GST_QUERY_TYPE (query)) {
     case GST_QUERY_CONTEXT:
+      if (gst_nvdec_cuda_context_handle_context_query (GST_ELEMENT (decoder),
+              query, nvdec->cuda_context))
+        return TRUE;
+#if USE_GL
       if (gst_gl_handle_context_query (GST_ELEMENT (decoder), query,
               nvdec->gl_display, nvdec->gl_context, nvdec->other_gl_context))
         return TRUE;
+#endif
       break;
     default:
       break;
@@ -1429,36 +3987,114 @@ gst_nvdec_src_query (GstVideoDecoder * decoder, GstQuery * query)
   return GST_VIDEO_DECODER_CLASS (gst_nvdec_parent_class)->src_query (decoder,
       query);
 }
-#endif
 
-#if USE_GL
+static gboolean
+gst_nvdec_sink_query (GstVideoDecoder * decoder, GstQuery * query)
+{
+  GstNvDec *nvdec = GST_NVDEC (decoder);
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CONTEXT:
+      if (gst_nvdec_cuda_context_handle_context_query (GST_ELEMENT (decoder),
+              query, nvdec->cuda_context))
+        return TRUE;
+      break;
+    default:
+      break;
+  }
+
+  return GST_VIDEO_DECODER_CLASS (gst_nvdec_parent_class)->sink_query (decoder,
+      query);
+}
+
+static GstCaps *
+gst_nvdec_getcaps (GstVideoDecoder * decoder, GstCaps * filter)
+{
+  return gst_video_decoder_proxy_getcaps (decoder, gst_nvdec_get_sink_caps (),
+      filter);
+}
+
 static void
 gst_nvdec_set_context (GstElement * element, GstContext * context)
 {
   GstNvDec *nvdec = GST_NVDEC (element);
   GST_DEBUG_OBJECT (nvdec, "set context");
 
+  // Only taken between runs, and only for the device we were told
+  // to use, with automatic placement we pick the device ourselves.
+  // Handles from the properties win over anything shared
+  if (!nvdec->context && !nvdec->user_context && !nvdec->scheduler
+      && nvdec->cuda_device_id >= 0)
+    gst_nvdec_cuda_context_handle_set_context (element, context,
+        nvdec->cuda_device_id, &nvdec->cuda_context);
+
+#if USE_GL
   gst_gl_handle_set_context (element, context, &nvdec->gl_display,
       &nvdec->other_gl_context);
+#endif
 
   GST_ELEMENT_CLASS (gst_nvdec_parent_class)->set_context (element, context);
 }
-#endif
+
+// Makes the element run on the scheduler's workers and download streams,
+// in its context. Takes effect when the element starts
+void
+gst_nvdec_set_scheduler (GstNvDec * nvdec, GstNvDecScheduler * scheduler)
+{
+  g_return_if_fail (GST_IS_NVDEC (nvdec));
+
+  if (nvdec->downloads) {
+    GST_WARNING_OBJECT (nvdec, "can't change the scheduler while running");
+    return;
+  }
+
+  if (scheduler)
+    g_object_ref (scheduler);
+  if (nvdec->scheduler)
+    g_object_unref (nvdec->scheduler);
+  nvdec->scheduler = scheduler;
+}
+
+static void
+gst_nvdec_finalize (GObject * object)
+{
+  GstNvDec *nvdec = GST_NVDEC (object);
+
+  if (nvdec->cuda_context)
+    g_object_unref (nvdec->cuda_context);
+  if (nvdec->scheduler)
+    g_object_unref (nvdec->scheduler);
+
+  g_mutex_clear (&nvdec->queue_lock);
+  g_cond_clear (&nvdec->queue_cond);
+
+  G_OBJECT_CLASS (gst_nvdec_parent_class)->finalize (object);
+}
 
 static gboolean
 plugin_init(GstPlugin * plugin)
 {
-    //TODO check if NVDEC is supported before registering
   GST_DEBUG_CATEGORY_INIT(gst_nvdec_debug_category, "nvdec",
     0, "Template nvdec");
+  gst_nvdec_trace_init ();
 
-  // Don't register this device if the user doesn't have an nvidia gpu
+  // Don't register the element if the user doesn't have an nvidia gpu,
   // nvcuvid is included in the display driver and is the dll for nvdec
-  //if (LoadLibraryA ("nvcuvid.dll") == NULL)
-      //return TRUE;
+  if (!gst_nvdec_loader_probe ()) {
+    GST_INFO ("no CUDA driver, not registering nvdec");
+    return TRUE;
+  }
+
+  if (!gst_element_register(plugin, "nvdec", GST_RANK_PRIMARY + 1,
+    GST_TYPE_NVDEC))
+    return FALSE;
+
+  if (!gst_element_register(plugin, "nvmultidec", GST_RANK_NONE,
+    GST_TYPE_NVMULTIDEC))
+    return FALSE;
 
-  return gst_element_register(plugin, "nvdec", GST_RANK_PRIMARY + 1,
-    GST_TYPE_NVDEC);
+  return gst_element_register(plugin, "nvtensorbatch", GST_RANK_NONE,
+    GST_TYPE_NVTENSORBATCH);
 }
 
 #ifndef PACKAGE
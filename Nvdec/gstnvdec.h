@@ -30,6 +30,12 @@
 
 #include <gst/gl/gl.h>
 #include <nvcuvid.h>
+#include "gstnvdecloader.h"
+#include "gstcudadevice.h"
+#include "gstcudacontext.h"
+#include "gstnvdecconvert.h"
+#include "gstnvdectrace.h"
+#include "gstnvdecscheduler.h"
 
 G_BEGIN_DECLS
 #define USE_GL 0
@@ -40,20 +46,49 @@ G_BEGIN_DECLS
 #define GST_IS_NVDEC(obj)       (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_NVDEC))
 #define GST_IS_NVDEC_CLASS(obj) (G_TYPE_CHECK_CLASS_TYPE((klass), GST_TYPE_NVDEC))
 
+// Pictures that aren't decoded at all
+typedef enum
+{
+  GST_NVDEC_SKIP_FRAMES_NONE,
+  GST_NVDEC_SKIP_FRAMES_NON_REF,
+  GST_NVDEC_SKIP_FRAMES_NON_KEY
+} GstNvDecSkipFrames;
+
+#define GST_TYPE_NVDEC_SKIP_FRAMES (gst_nvdec_skip_frames_get_type())
+GType gst_nvdec_skip_frames_get_type (void);
+
 typedef struct _GstNvDec GstNvDec;
 typedef struct _GstNvDecClass GstNvDecClass;
+typedef struct _GstNvDecDisplay GstNvDecDisplay;
+typedef struct _GstNvDecDownload GstNvDecDownload;
+typedef struct _GstNvDecFrameSlot GstNvDecFrameSlot;
+typedef struct _GstNvDecQueueItem GstNvDecQueueItem;
 
 struct _GstNvDec
 {
   GstVideoDecoder parent;
 
-  gboolean did_make_context;
-  gboolean did_make_lock;
+  // Shared with every element on the device, context
+  // and lock below are borrowed from it while running
+  GstNvDecCudaContext *cuda_context;
+  // Set through the deprecated context/lock properties
+  CUcontext user_context;
+  CUvideoctxlock user_lock;
+  // Device we count a session on, -1 before start
+  CUdevice device;
+  gint cuda_device_id;
+  GstCudaDevicePolicy device_policy;
   CUcontext context;
   CUvideoctxlock lock;
   CUstream cudaStream;
+  // Recorded after each copy with a single output surface,
+  // the stream may be the scheduler's and shared
+  CUevent copy_event;
 
   gboolean use_gl_output;
+  // Downstream negotiated memory:NvDecCUDAMemory, so
+  // frames are copied device to device
+  gboolean use_cuda_output;
 #if USE_GL
   GstGLDisplay *gl_display;
   GstGLContext *gl_context;
@@ -62,23 +97,161 @@ struct _GstNvDec
 
   CUvideoparser parser;
   CUvideodecoder decoder;
-  GAsyncQueue *decode_queue;
+  // What the decoder was created for, resolution changes
+  // within the maximum size reconfigure it in place
+  cudaVideoCodec decoder_codec;
+  cudaVideoChromaFormat decoder_chroma_format;
+  guint decoder_bit_depth_minus8;
+  // Display size, the coded size is what NVDEC sizes surfaces by
+  guint decoder_width;
+  guint decoder_height;
+  guint decoder_coded_width;
+  guint decoder_coded_height;
+  guint decoder_max_width;
+  guint decoder_max_height;
+  guint decoder_max_decode_surfaces;
+  // Size the scaler produces, what downstream asked for
+  guint decoder_target_width;
+  guint decoder_target_height;
+  guint max_width;
+  guint max_height;
+  // Single producer, single consumer ring of parser callback items,
+  // lock-free unless one side has to wait for the other
+  GstNvDecQueueItem *decode_queue;
+  gint decode_queue_head;
+  gint decode_queue_tail;
+  // Bumped by every flush, only while the threads are paused
+  guint generation;
+  // The parser is fed the packet that resets it on a flush,
+  // its callbacks drop whatever it hands back
+  gboolean resetting_parser;
+  // Heap allocations made while decoding, should stay flat
+  gint num_allocations;
+
+  // All the frames that are waiting to be decoded, oldest first
+  GstNvDecFrameSlot *decode_fifo;
+  guint decode_fifo_head;
+  guint decode_fifo_len;
+  guint decode_fifo_size;
+  // All the frames that are waiting to be displayed,
+  // indexed by the picture index they were decoded to
+  GstNvDecFrameSlot *display_table;
+  guint display_table_size;
+
+  // NUMA node of the pinned download buffers, -1 for auto
+  gint numa_node;
+
+  // Displays right behind each other in the decode queue, copied
+  // with a single lock when there's only one output surface
+  GstNvDecDisplay *display_batch;
+  guint display_batch_len;
 
-  // All the frames that are waiting to be decoded
-  // that need to be dropped
-  GList* decode_frames_pending_drop;
-  // All the frames that are waiting to be displayed
-  // that need to be dropped
-  GList* display_frames_pending_drop;
+  // Ring of in-flight downloads, one per output surface
+  guint num_output_surfaces;
+  GstNvDecDownload *downloads;
+  guint download_head;
+  guint num_downloads;
 
+  // Decode surfaces in use, what the stream needs plus the headroom
   guint num_decode_surfaces;
+  guint surface_headroom;
+  guint64 surface_memory;
   guint width;
   guint height;
   guint fps_n;
   guint fps_d;
+  gint par_n;
+  gint par_d;
   guint stride;
+  // Negotiated output, frames are converted from
+  // NV12 on the GPU when it's something else
+  GstVideoInfo output_info;
+  GstNvDecColorMatrix color_matrix;
+  CUdeviceptr convert_buffer;
+  gsize convert_buffer_size;
+  // Duration of the frames decoded but not displayed yet
+  GstClockTime latency;
   GstClockTime min_latency;
+
+  // avc/hvc1 input: size of the NAL length prefixes, 0 for
+  // byte-stream, and the parameter sets from codec_data with start
+  // codes. Frames are rewritten into scratch for the parser
+  guint nal_length_size;
+  guint8 *codec_header;
+  gsize codec_header_size;
+  gboolean need_codec_header;
+  guint8 *scratch;
+  gsize scratch_size;
+
+  // Mark every buffer as a complete picture, end_of_picture is
+  // whether the current input allows it
+  gboolean low_latency;
+  gboolean end_of_picture;
+  guint max_display_delay;
+  GstNvDecSkipFrames skip_frames;
+  // Frames not decoded because of skip-frames or trick mode
+  guint64 num_skipped;
+  // Frames that were already late, not decoded when nothing
+  // refers to them, otherwise decoded but not downloaded
+  guint64 num_qos_skipped;
+  guint64 num_dropped;
+  // Wall clock time frames spent in the parser and decoder
+  guint64 num_displayed;
+  GstClockTime decode_latency_last;
+  GstClockTime decode_latency_max;
+  GstClockTime decode_latency_total;
+  // Time spent waiting for the shared lock and holding it. Only
+  // updated with the lock held, lock_time is when it was taken
+  guint64 num_locks;
+  GstClockTime lock_wait_time;
+  GstClockTime lock_hold_time;
+  GstClockTime lock_time;
   GstVideoCodecState *input_state;
+
+  // With pipelined set the parse thread owns the parser and submits
+  // pictures while the output thread downloads and finishes frames,
+  // handle_frame only queues. Everything below is under queue_lock
+  gboolean pipelined;
+  GThread *parse_thread;
+  GThread *output_thread;
+  GMutex queue_lock;
+  GCond queue_cond;
+  // Frames for the parse thread, NULL asks for a drain
+  GstVideoCodecFrame **input_queue;
+  guint input_queue_head;
+  guint input_queue_len;
+  // Displayed pictures the output thread hasn't copied yet, atomic
+  // like the ring's head and tail
+  gint num_pending_displays;
+  // Threads waiting on queue_cond for the ring to change. A push or
+  // pop only takes queue_lock to wake them when there are any
+  gint ring_waiters;
+  guint drains_requested;
+  guint drains_done;
+  // Set while flushing or reconfiguring, the threads wait
+  // and nothing blocks on a full queue
+  gboolean paused;
+  gboolean parse_paused;
+  gboolean output_paused;
+  // Nothing queued for the output thread and no downloads in flight,
+  // the sequence callback waits for it before changing the decoder
+  gboolean output_idle;
+  gboolean stopping;
+  GstFlowReturn output_flow;
+
+  // With a scheduler a task on its shared workers does the work of
+  // both threads, parse_paused and output_paused are set while no
+  // task is queued or running. Set with gst_nvdec_set_scheduler()
+  GstNvDecScheduler *scheduler;
+  GstNvDecSchedulerTask task;
+  gboolean task_queued;
+  // The workers never push, frames they finish are queued for a push
+  // thread of our own. NULL entries complete a drain
+  GThread *push_thread;
+  GstVideoCodecFrame **finished_queue;
+  guint finished_queue_head;
+  guint finished_queue_len;
+  gboolean push_paused;
 };
 
 struct _GstNvDecClass
@@ -88,6 +261,8 @@ struct _GstNvDecClass
 
 GType gst_nvdec_get_type (void);
 
+void gst_nvdec_set_scheduler (GstNvDec * nvdec, GstNvDecScheduler * scheduler);
+
 G_END_DECLS
 
 #endif /* __GST_NVDEC_H__ */
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstnvdecconvert.h"
+
+#include <string.h>
+
+
+// Kr and Kb of the ISO/IEC 23001-8 matrix coefficients, streams that
+// don't say are assumed to be BT.709 for HD and BT.601 for SD
+static void
+get_kr_kb (guint matrix_coefficients, guint height, float *kr, float *kb)
+{
+  switch (matrix_coefficients) {
+    case 1:
+      *kr = 0.2126f;
+      *kb = 0.0722f;
+      break;
+    case 4:
+      *kr = 0.30f;
+      *kb = 0.11f;
+      break;
+    case 5:
+    case 6:
+      *kr = 0.299f;
+      *kb = 0.114f;
+      break;
+    case 7:
+      *kr = 0.212f;
+      *kb = 0.087f;
+      break;
+    case 9:
+    case 10:
+      *kr = 0.2627f;
+      *kb = 0.0593f;
+      break;
+    default:
+      if (height >= 720) {
+        *kr = 0.2126f;
+        *kb = 0.0722f;
+      } else {
+        *kr = 0.299f;
+        *kb = 0.114f;
+      }
+      break;
+  }
+}
+
+void
+gst_nvdec_color_matrix_init (GstNvDecColorMatrix * matrix,
+    guint matrix_coefficients, gboolean full_range, guint height)
+{
+  float kr, kb, kg, y_scale, y_offset, c_scale;
+  int i;
+
+  get_kr_kb (matrix_coefficients, height, &kr, &kb);
+  kg = 1.0f - kr - kb;
+
+  // Limited range is 16-235 for luma and 16-240 for chroma
+  y_scale = full_range ? 1.0f : 255.0f / 219.0f;
+  y_offset = full_range ? 0.0f : 16.0f;
+  c_scale = full_range ? 1.0f : 255.0f / 224.0f;
+
+  matrix->coeff[0][0] = y_scale;
+  matrix->coeff[0][1] = 0.0f;
+  matrix->coeff[0][2] = c_scale * 2.0f * (1.0f - kr);
+  matrix->coeff[1][0] = y_scale;
+  matrix->coeff[1][1] = -c_scale * 2.0f * kb * (1.0f - kb) / kg;
+  matrix->coeff[1][2] = -c_scale * 2.0f * kr * (1.0f - kr) / kg;
+  matrix->coeff[2][0] = y_scale;
+  matrix->coeff[2][1] = c_scale * 2.0f * (1.0f - kb);
+  matrix->coeff[2][2] = 0.0f;
+
+  for (i = 0; i < 3; i++)
+    matrix->offset[i] = -y_scale * y_offset
+        - 128.0f * (matrix->coeff[i][1] + matrix->coeff[i][2]);
+}
+
+// Runs on the given stream with the context current, the caller
+// synchronizes. The chroma plane of the surface starts src_height
+// rows after the luma plane
+gboolean
+gst_nvdec_convert_nv12 (GstNvDecCudaContext * cuda_context,
+    GstNvDecConvertFormat format, CUdeviceptr src, guint src_pitch,
+    guint src_height, guint width, guint height, CUdeviceptr dst,
+    const gsize dst_offset[3], const gint dst_stride[3],
+    const GstNvDecColorMatrix * matrix, CUstream stream)
+{
+  GstNvDecConvertArgs args;
+  void *params[] = { &args };
+  CUfunction kernel;
+  int i;
+
+  if (format > GST_NVDEC_CONVERT_GBR
+      || !gst_nvdec_cuda_context_get_kernel (cuda_context,
+          GST_NVDEC_KERNEL_CONVERT_I420 + format, &kernel))
+    return FALSE;
+
+  args.y = src;
+  args.uv = src + (gsize) src_pitch * src_height;
+  args.pitch = src_pitch;
+  args.width = width;
+  args.height = height;
+  for (i = 0; i < 3; i++) {
+    args.dst[i] = dst + dst_offset[i];
+    args.dst_stride[i] = dst_stride[i];
+  }
+  args.matrix = *matrix;
+
+  return cuda_OK (CuLaunchKernel (kernel,
+          ((width + 1) / 2 + GST_NVDEC_CONVERT_BLOCK_WIDTH - 1)
+          / GST_NVDEC_CONVERT_BLOCK_WIDTH,
+          ((height + 1) / 2 + GST_NVDEC_CONVERT_BLOCK_HEIGHT - 1)
+          / GST_NVDEC_CONVERT_BLOCK_HEIGHT, 1,
+          GST_NVDEC_CONVERT_BLOCK_WIDTH, GST_NVDEC_CONVERT_BLOCK_HEIGHT, 1,
+          0, stream, params, NULL));
+}
+
+// Resizes and converts num_sources pictures into the first slots of a
+// batch_size tensor at dst, the rest of it is zeroed. So are the slots
+// of sources with a width or height of 0. Takes one launch
+// per GST_NVDEC_TENSOR_SOURCES_PER_LAUNCH slots on the given stream
+// with the context current, the caller synchronizes
+gboolean
+gst_nvdec_convert_tensor (GstNvDecCudaContext * cuda_context,
+    const GstNvDecTensorSource * sources, guint num_sources,
+    guint batch_size, const GstNvDecTensorParams * params, CUdeviceptr dst,
+    CUstream stream)
+{
+  GstNvDecTensorArgs args;
+  void *kernel_params[] = { &args };
+  CUfunction kernel;
+  guint first, count;
+  gboolean ret;
+  int c;
+
+  ret = gst_nvdec_cuda_context_get_kernel (cuda_context,
+      GST_NVDEC_KERNEL_TENSOR_NCHW_FLOAT32 + params->layout * 2
+      + params->type, &kernel);
+
+  args.dst = dst;
+  args.width = params->width;
+  args.height = params->height;
+  for (c = 0; c < 3; c++) {
+    args.scale[c] = 1.0f / (255.0f * params->std[c]);
+    args.bias[c] = -params->mean[c] / params->std[c];
+  }
+
+  // The arguments are copied when the launch is queued
+  for (first = 0; ret && first < batch_size; first += count) {
+    count = MIN (batch_size - first, GST_NVDEC_TENSOR_SOURCES_PER_LAUNCH);
+    args.first = first;
+    args.num_sources = first < num_sources
+        ? MIN (num_sources - first, count) : 0;
+    if (args.num_sources)
+      memcpy (args.sources, sources + first,
+          args.num_sources * sizeof (GstNvDecTensorSource));
+
+    ret = cuda_OK (CuLaunchKernel (kernel,
+            (params->width + GST_NVDEC_TENSOR_BLOCK_WIDTH - 1)
+            / GST_NVDEC_TENSOR_BLOCK_WIDTH,
+            (params->height + GST_NVDEC_TENSOR_BLOCK_HEIGHT - 1)
+            / GST_NVDEC_TENSOR_BLOCK_HEIGHT, count,
+            GST_NVDEC_TENSOR_BLOCK_WIDTH, GST_NVDEC_TENSOR_BLOCK_HEIGHT, 1,
+            0, stream, kernel_params, NULL));
+  }
+
+  return ret;
+}
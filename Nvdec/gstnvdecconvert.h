@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_NVDEC_CONVERT_H__
+#define __GST_NVDEC_CONVERT_H__
+
+#include <gst/gst.h>
+#include <cuda.h>
+#include "gstcudacontext.h"
+#include "gstnvdeckernels.h"
+
+G_BEGIN_DECLS
+
+void gst_nvdec_color_matrix_init (GstNvDecColorMatrix * matrix,
+    guint matrix_coefficients, gboolean full_range, guint height);
+
+// Batches of pictures are packed into one tensor for inference, see
+// gst_nvdec_convert_tensor(). Each channel is written as
+// (value / 255 - mean) / std, in RGB order
+typedef struct _GstNvDecTensorParams
+{
+  GstNvDecTensorLayout layout;
+  GstNvDecTensorType type;
+  guint width;
+  guint height;
+  float mean[3];
+  float std[3];
+} GstNvDecTensorParams;
+
+gboolean gst_nvdec_convert_nv12 (GstNvDecCudaContext * cuda_context,
+    GstNvDecConvertFormat format, CUdeviceptr src, guint src_pitch,
+    guint src_height, guint width, guint height, CUdeviceptr dst,
+    const gsize dst_offset[3], const gint dst_stride[3],
+    const GstNvDecColorMatrix * matrix, CUstream stream);
+
+gboolean gst_nvdec_convert_tensor (GstNvDecCudaContext * cuda_context,
+    const GstNvDecTensorSource * sources, guint num_sources,
+    guint batch_size, const GstNvDecTensorParams * params, CUdeviceptr dst,
+    CUstream stream);
+
+G_END_DECLS
+
+#endif /* __GST_NVDEC_CONVERT_H__ */
@@ -0,0 +1,1317 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstnvdecfake.h"
+#include "gstnvdeckernels.h"
+
+#include <gst/gst.h>
+#include <string.h>
+#include <cuda.h>
+#include <nvcuvid.h>
+
+GST_DEBUG_CATEGORY_STATIC (gst_nvdec_fake_debug_category);
+#define GST_CAT_DEFAULT gst_nvdec_fake_debug_category
+
+// Reported for every device, roughly what a mid-range card has
+#define FAKE_NUM_DEVICES 1
+#define FAKE_TOTAL_MEMORY (G_GUINT64_CONSTANT (8) << 30)
+#define FAKE_API_VERSION 3020
+// Largest picture the decoder caps allow, 8K and then some
+#define FAKE_MAX_SIZE 8192
+// Reference frames the parser keeps, enough for IBBP
+#define FAKE_NUM_REF_FRAMES 2
+#define FAKE_MAX_SURFACES 32
+// Used by codecs the parser doesn't look into
+#define FAKE_DEFAULT_WIDTH 1920
+#define FAKE_DEFAULT_HEIGHT 1080
+// Bytes of a NAL unit that are unescaped for parsing, more than the
+// slice header or SPS fields read below ever take
+#define FAKE_RBSP_SIZE 256
+
+typedef struct
+{
+  GRecMutex mutex;
+} FakeLock;
+
+typedef struct
+{
+  guint width;
+  guint height;
+  guint pitch;
+  guint bit_depth_minus8;
+  // All surfaces map to the same memory, a pattern
+  // tests can find again in the output buffers
+  guint8 *surface;
+  guint mapped;
+} FakeDecoder;
+
+typedef struct
+{
+  gboolean intra;
+  gboolean ref;
+  CUvideotimestamp timestamp;
+} FakePicture;
+
+typedef struct
+{
+  guint coded_width;
+  guint coded_height;
+  guint display_width;
+  guint display_height;
+  guint bit_depth_minus8;
+} FakeSequence;
+
+typedef struct
+{
+  gboolean used;
+  gboolean displayed;
+  // Serial of the reference picture in it, 0 for non-reference ones
+  guint64 ref_serial;
+} FakeSurface;
+
+typedef struct
+{
+  CUVIDPARSERPARAMS params;
+
+  // Only reported when it changes, streams
+  // repeat their headers at every key frame
+  gboolean have_sequence;
+  FakeSequence sequence;
+  guint num_surfaces;
+  FakeSurface surfaces[FAKE_MAX_SURFACES];
+  guint next_surface;
+  guint64 ref_serial;
+
+  // Without CUVID_PKT_ENDOFPICTURE a picture is only
+  // known to be complete when the next one starts
+  gboolean pending;
+  FakePicture pending_picture;
+
+  // The last reference picture, displayed once the next one is
+  // decoded as the pictures in between come before it
+  gboolean held;
+  gint held_index;
+  CUvideotimestamp held_timestamp;
+
+  guint8 rbsp[FAKE_RBSP_SIZE];
+} FakeParser;
+
+typedef struct
+{
+  const guint8 *data;
+  guint size;
+  guint pos;
+} FakeBitReader;
+
+static gboolean copy_frames = TRUE;
+static gint lock_count;
+static gint dummy_handle;
+// Function handles point into it, see fake_cuLaunchKernel()
+static const gchar *kernel_names[] = { GST_NVDEC_KERNEL_NAMES };
+
+static void
+init_debug_category (void)
+{
+  static gsize done = 0;
+
+  if (g_once_init_enter (&done)) {
+    GST_DEBUG_CATEGORY_INIT (gst_nvdec_fake_debug_category, "nvdecfake",
+        0, "Debug category for the fake CUDA/NVCUVID implementation");
+    g_once_init_leave (&done, 1);
+  }
+}
+
+void
+gst_nvdec_fake_set_copy_frames (gboolean copy)
+{
+  copy_frames = copy;
+}
+
+guint
+gst_nvdec_fake_get_lock_count (void)
+{
+  return (guint) g_atomic_int_get (&lock_count);
+}
+
+// Device pointers are host pointers
+static inline guint8 *
+device_ptr (CUdeviceptr ptr)
+{
+  return (guint8 *) (guintptr) ptr;
+}
+
+static CUresult CUDAAPI
+fake_cuInit (unsigned int flags)
+{
+  init_debug_category ();
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuGetErrorName (CUresult error, const char **str)
+{
+  switch (error) {
+    case CUDA_SUCCESS:
+      *str = "CUDA_SUCCESS";
+      break;
+    case CUDA_ERROR_INVALID_VALUE:
+      *str = "CUDA_ERROR_INVALID_VALUE";
+      break;
+    case CUDA_ERROR_OUT_OF_MEMORY:
+      *str = "CUDA_ERROR_OUT_OF_MEMORY";
+      break;
+    case CUDA_ERROR_NOT_SUPPORTED:
+      *str = "CUDA_ERROR_NOT_SUPPORTED";
+      break;
+    default:
+      *str = "CUDA_ERROR_UNKNOWN";
+      break;
+  }
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuGetErrorString (CUresult error, const char **str)
+{
+  *str = error == CUDA_SUCCESS ? "no error" : "fake CUDA error";
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuDeviceGetCount (int *count)
+{
+  *count = FAKE_NUM_DEVICES;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuDeviceGet (CUdevice * device, int ordinal)
+{
+  if (ordinal < 0 || ordinal >= FAKE_NUM_DEVICES)
+    return CUDA_ERROR_INVALID_VALUE;
+  *device = ordinal;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuDeviceGetPCIBusId (char *bus_id, int len, CUdevice device)
+{
+  g_snprintf (bus_id, len, "0000:%02x:00.0", device + 1);
+  return CUDA_SUCCESS;
+}
+
+// Contexts are never dereferenced, every one is the same dummy
+static CUresult CUDAAPI
+fake_cuDevicePrimaryCtxRetain (CUcontext * context, CUdevice device)
+{
+  *context = (CUcontext) & dummy_handle;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuDevicePrimaryCtxRelease (CUdevice device)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuDeviceTotalMem (size_t * bytes, CUdevice device)
+{
+  *bytes = FAKE_TOTAL_MEMORY;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuCtxCreate (CUcontext * context, unsigned int flags, CUdevice device)
+{
+  *context = (CUcontext) & dummy_handle;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuCtxDestroy (CUcontext context)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuCtxPushCurrent (CUcontext context)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuCtxPopCurrent (CUcontext * context)
+{
+  if (context)
+    *context = (CUcontext) & dummy_handle;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuCtxSetCurrent (CUcontext context)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuCtxGetDevice (CUdevice * device)
+{
+  *device = 0;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuCtxGetApiVersion (CUcontext context, unsigned int *version)
+{
+  *version = FAKE_API_VERSION;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemGetInfo (size_t * free_bytes, size_t * total_bytes)
+{
+  *free_bytes = FAKE_TOTAL_MEMORY / 2;
+  *total_bytes = FAKE_TOTAL_MEMORY;
+  return CUDA_SUCCESS;
+}
+
+static GstNvmlReturn
+fake_nvmlInit (void)
+{
+  return GST_NVML_SUCCESS;
+}
+
+// The handle is the bus number fake_cuDeviceGetPCIBusId made up
+static GstNvmlReturn
+fake_nvmlDeviceGetHandleByPciBusId (const char *bus_id,
+    GstNvmlDevice * device)
+{
+  const gchar *bus = strchr (bus_id, ':');
+  guint64 number = bus ? g_ascii_strtoull (bus + 1, NULL, 16) : 0;
+
+  if (number < 1 || number > FAKE_NUM_DEVICES)
+    return GST_NVML_ERROR_NOT_FOUND;
+  *device = (GstNvmlDevice) GUINT_TO_POINTER (number);
+  return GST_NVML_SUCCESS;
+}
+
+static GstNvmlReturn
+fake_nvmlDeviceGetMemoryInfo (GstNvmlDevice device, GstNvmlMemory * memory)
+{
+  memory->total = FAKE_TOTAL_MEMORY;
+  memory->free = FAKE_TOTAL_MEMORY / 2;
+  memory->used = memory->total - memory->free;
+  return GST_NVML_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemAlloc (CUdeviceptr * ptr, size_t size)
+{
+  gpointer mem = g_try_malloc (size);
+
+  if (!mem)
+    return CUDA_ERROR_OUT_OF_MEMORY;
+  *ptr = (CUdeviceptr) (guintptr) mem;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemFree (CUdeviceptr ptr)
+{
+  g_free (device_ptr (ptr));
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemHostAlloc (void **ptr, size_t size, unsigned int flags)
+{
+  *ptr = g_try_malloc (size);
+  return *ptr ? CUDA_SUCCESS : CUDA_ERROR_OUT_OF_MEMORY;
+}
+
+static CUresult CUDAAPI
+fake_cuMemFreeHost (void *ptr)
+{
+  g_free (ptr);
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemHostRegister (void *ptr, size_t size, unsigned int flags)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemHostUnregister (void *ptr)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemcpyDtoH (void *dst, CUdeviceptr src, size_t size)
+{
+  if (copy_frames)
+    memcpy (dst, device_ptr (src), size);
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemcpyDtoHAsync (void *dst, CUdeviceptr src, size_t size, CUstream stream)
+{
+  return fake_cuMemcpyDtoH (dst, src, size);
+}
+
+static CUresult CUDAAPI
+fake_cuMemcpyHtoD (CUdeviceptr dst, const void *src, size_t size)
+{
+  if (copy_frames)
+    memcpy (device_ptr (dst), src, size);
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemcpy2D (const CUDA_MEMCPY2D * copy)
+{
+  const guint8 *src;
+  guint8 *dst;
+  size_t y;
+
+  if (copy->srcMemoryType == CU_MEMORYTYPE_ARRAY
+      || copy->dstMemoryType == CU_MEMORYTYPE_ARRAY)
+    return CUDA_ERROR_NOT_SUPPORTED;
+
+  if (!copy_frames)
+    return CUDA_SUCCESS;
+
+  src = copy->srcMemoryType == CU_MEMORYTYPE_HOST
+      ? (const guint8 *) copy->srcHost : device_ptr (copy->srcDevice);
+  dst = copy->dstMemoryType == CU_MEMORYTYPE_HOST
+      ? (guint8 *) copy->dstHost : device_ptr (copy->dstDevice);
+  src += copy->srcY * copy->srcPitch + copy->srcXInBytes;
+  dst += copy->dstY * copy->dstPitch + copy->dstXInBytes;
+
+  for (y = 0; y < copy->Height; y++)
+    memcpy (dst + y * copy->dstPitch, src + y * copy->srcPitch,
+        copy->WidthInBytes);
+
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuMemcpy2DAsync (const CUDA_MEMCPY2D * copy, CUstream stream)
+{
+  return fake_cuMemcpy2D (copy);
+}
+
+// Everything completes before the call returns,
+// so streams and events have nothing to wait for
+static CUresult CUDAAPI
+fake_cuStreamCreate (CUstream * stream, unsigned int flags)
+{
+  *stream = (CUstream) & dummy_handle;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuStreamDestroy (CUstream stream)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuStreamSynchronize (CUstream stream)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuEventCreate (CUevent * event, unsigned int flags)
+{
+  *event = (CUevent) & dummy_handle;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuEventDestroy (CUevent event)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuEventRecord (CUevent event, CUstream stream)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuEventQuery (CUevent event)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuEventSynchronize (CUevent event)
+{
+  return CUDA_SUCCESS;
+}
+
+// Modules are only checked for names, the kernels themselves
+// are the C build of gstnvdeckernels.h
+static CUresult CUDAAPI
+fake_cuModuleLoadData (CUmodule * module, const void *image)
+{
+  *module = (CUmodule) & dummy_handle;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuModuleUnload (CUmodule module)
+{
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuModuleGetFunction (CUfunction * function, CUmodule module,
+    const char *name)
+{
+  guint i;
+
+  for (i = 0; i < G_N_ELEMENTS (kernel_names); i++) {
+    if (!strcmp (name, kernel_names[i])) {
+      *function = (CUfunction) & kernel_names[i];
+      return CUDA_SUCCESS;
+    }
+  }
+
+  return CUDA_ERROR_NOT_FOUND;
+}
+
+// Device memory is host memory, so the kernels run right here,
+// one call per thread of the grid
+static CUresult CUDAAPI
+fake_cuLaunchKernel (CUfunction function, unsigned int grid_x,
+    unsigned int grid_y, unsigned int grid_z, unsigned int block_x,
+    unsigned int block_y, unsigned int block_z,
+    unsigned int shared_mem_bytes, CUstream stream, void **params,
+    void **extra)
+{
+  gint kernel = (const gchar **) function - kernel_names;
+  guint width = grid_x * block_x, height = grid_y * block_y;
+  guint x, y, z, tensor;
+
+  if (kernel < 0 || kernel >= GST_NVDEC_KERNEL_COUNT || !params)
+    return CUDA_ERROR_INVALID_VALUE;
+
+  if (kernel <= GST_NVDEC_KERNEL_CONVERT_GBR) {
+    for (y = 0; y < height; y++)
+      for (x = 0; x < width; x++)
+        gst_nvdec_kernel_convert (kernel - GST_NVDEC_KERNEL_CONVERT_I420,
+            params[0], x, y);
+    return CUDA_SUCCESS;
+  }
+
+  tensor = kernel - GST_NVDEC_KERNEL_TENSOR_NCHW_FLOAT32;
+  for (z = 0; z < grid_z; z++)
+    for (y = 0; y < height; y++)
+      for (x = 0; x < width; x++)
+        gst_nvdec_kernel_tensor (tensor / 2, tensor % 2, params[0], z, x, y);
+
+  return CUDA_SUCCESS;
+}
+
+// There's no GL interop, the element only uses it with USE_GL
+static CUresult CUDAAPI
+fake_cuGraphicsGLRegisterImage (CUgraphicsResource * resource,
+    unsigned int image, unsigned int target, unsigned int flags)
+{
+  return CUDA_ERROR_NOT_SUPPORTED;
+}
+
+static CUresult CUDAAPI
+fake_cuGraphicsUnregisterResource (CUgraphicsResource resource)
+{
+  return CUDA_ERROR_NOT_SUPPORTED;
+}
+
+static CUresult CUDAAPI
+fake_cuGraphicsMapResources (unsigned int count,
+    CUgraphicsResource * resources, CUstream stream)
+{
+  return CUDA_ERROR_NOT_SUPPORTED;
+}
+
+static CUresult CUDAAPI
+fake_cuGraphicsSubResourceGetMappedArray (CUarray * array,
+    CUgraphicsResource resource, unsigned int index, unsigned int level)
+{
+  return CUDA_ERROR_NOT_SUPPORTED;
+}
+
+static CUresult CUDAAPI
+fake_cuvidCtxLockCreate (CUvideoctxlock * lock, CUcontext context)
+{
+  FakeLock *fake = g_new0 (FakeLock, 1);
+
+  g_rec_mutex_init (&fake->mutex);
+  *lock = (CUvideoctxlock) fake;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidCtxLockDestroy (CUvideoctxlock lock)
+{
+  FakeLock *fake = (FakeLock *) lock;
+
+  g_rec_mutex_clear (&fake->mutex);
+  g_free (fake);
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidCtxLock (CUvideoctxlock lock, unsigned int flags)
+{
+  g_rec_mutex_lock (&((FakeLock *) lock)->mutex);
+  g_atomic_int_inc (&lock_count);
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidCtxUnlock (CUvideoctxlock lock, unsigned int flags)
+{
+  g_rec_mutex_unlock (&((FakeLock *) lock)->mutex);
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidGetDecoderCaps (CUVIDDECODECAPS * caps)
+{
+  caps->bIsSupported = caps->eChromaFormat == cudaVideoChromaFormat_420
+      && caps->nBitDepthMinus8 <= 4;
+  if (!caps->bIsSupported)
+    return CUDA_SUCCESS;
+
+  caps->nMinWidth = 48;
+  caps->nMinHeight = 16;
+  caps->nMaxWidth = FAKE_MAX_SIZE;
+  caps->nMaxHeight = FAKE_MAX_SIZE;
+  caps->nMaxMBCount = (FAKE_MAX_SIZE / 16) * (FAKE_MAX_SIZE / 16);
+  caps->nOutputFormatMask = 1 << (caps->nBitDepthMinus8
+      ? cudaVideoSurfaceFormat_P016 : cudaVideoSurfaceFormat_NV12);
+  return CUDA_SUCCESS;
+}
+
+// Byte x of row y is x + y in the luma plane and has the top bit
+// flipped in the chroma plane, 16-bit surfaces get the same bytes
+static CUresult
+fake_decoder_resize (FakeDecoder * decoder, guint width, guint height)
+{
+  guint8 *surface;
+  guint pitch, x, y;
+
+  pitch = GST_ROUND_UP_128 (width * (decoder->bit_depth_minus8 ? 2 : 1));
+  surface = g_try_malloc ((gsize) pitch * height * 3 / 2);
+  if (!surface)
+    return CUDA_ERROR_OUT_OF_MEMORY;
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < pitch; x++)
+      surface[(gsize) y * pitch + x] = x + y;
+  for (y = 0; y < height / 2; y++)
+    for (x = 0; x < pitch; x++)
+      surface[(gsize) (height + y) * pitch + x] = (x + y) ^ 0x80;
+
+  g_free (decoder->surface);
+  decoder->surface = surface;
+  decoder->width = width;
+  decoder->height = height;
+  decoder->pitch = pitch;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidCreateDecoder (CUvideodecoder * decoder, CUVIDDECODECREATEINFO * info)
+{
+  FakeDecoder *fake = g_new0 (FakeDecoder, 1);
+  CUresult result;
+
+  fake->bit_depth_minus8 = info->bitDepthMinus8;
+  result = fake_decoder_resize (fake, info->ulTargetWidth,
+      info->ulTargetHeight);
+  if (result != CUDA_SUCCESS) {
+    g_free (fake);
+    return result;
+  }
+
+  *decoder = (CUvideodecoder) fake;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidReconfigureDecoder (CUvideodecoder decoder,
+    CUVIDRECONFIGUREDECODERINFO * info)
+{
+  FakeDecoder *fake = (FakeDecoder *) decoder;
+
+  if (fake->mapped)
+    return CUDA_ERROR_INVALID_VALUE;
+  return fake_decoder_resize (fake, info->ulTargetWidth,
+      info->ulTargetHeight);
+}
+
+static CUresult CUDAAPI
+fake_cuvidDestroyDecoder (CUvideodecoder decoder)
+{
+  FakeDecoder *fake = (FakeDecoder *) decoder;
+
+  if (fake->mapped)
+    GST_WARNING ("destroying decoder with %u mapped frames", fake->mapped);
+  g_free (fake->surface);
+  g_free (fake);
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidDecodePicture (CUvideodecoder decoder, CUVIDPICPARAMS * params)
+{
+  if (params->CurrPicIdx < 0 || params->CurrPicIdx >= FAKE_MAX_SURFACES)
+    return CUDA_ERROR_INVALID_VALUE;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidMapVideoFrame (CUvideodecoder decoder, int picture_index,
+    CUdeviceptr * ptr, unsigned int *pitch, CUVIDPROCPARAMS * params)
+{
+  FakeDecoder *fake = (FakeDecoder *) decoder;
+
+  fake->mapped++;
+  *ptr = (CUdeviceptr) (guintptr) fake->surface;
+  *pitch = fake->pitch;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidUnmapVideoFrame (CUvideodecoder decoder, CUdeviceptr ptr)
+{
+  FakeDecoder *fake = (FakeDecoder *) decoder;
+
+  if (!fake->mapped)
+    return CUDA_ERROR_INVALID_VALUE;
+  fake->mapped--;
+  return CUDA_SUCCESS;
+}
+
+// Strips the emulation prevention bytes of
+// the start of a NAL unit into the scratch buffer
+static guint
+unescape_nal (FakeParser * parser, const guint8 * data, guint size)
+{
+  guint i, len = 0, zeros = 0;
+
+  for (i = 0; i < size && len < FAKE_RBSP_SIZE; i++) {
+    if (zeros >= 2 && data[i] == 3) {
+      zeros = 0;
+      continue;
+    }
+    zeros = data[i] ? 0 : zeros + 1;
+    parser->rbsp[len++] = data[i];
+  }
+
+  return len;
+}
+
+// Reads past the end give zeros, which makes
+// truncated headers come out as small values
+static guint
+read_bits (FakeBitReader * reader, guint n)
+{
+  guint value = 0;
+
+  while (n--) {
+    value <<= 1;
+    if (reader->pos < reader->size * 8)
+      value |= (reader->data[reader->pos / 8] >> (7 - reader->pos % 8)) & 1;
+    reader->pos++;
+  }
+
+  return value;
+}
+
+static guint
+read_ue (FakeBitReader * reader)
+{
+  guint zeros = 0;
+
+  while (zeros < 31 && reader->pos < reader->size * 8
+      && !read_bits (reader, 1))
+    zeros++;
+  return (1u << zeros) - 1 + read_bits (reader, zeros);
+}
+
+static gint
+read_se (FakeBitReader * reader)
+{
+  guint value = read_ue (reader);
+
+  return value & 1 ? (gint) ((value + 1) / 2) : -(gint) (value / 2);
+}
+
+static void
+skip_scaling_list (FakeBitReader * reader, guint size)
+{
+  gint last = 8, next = 8;
+  guint i;
+
+  for (i = 0; i < size; i++) {
+    if (next)
+      next = (last + read_se (reader) + 256) % 256;
+    last = next ? next : last;
+  }
+}
+
+static void
+parse_h264_sps (FakeBitReader * reader, FakeSequence * sequence)
+{
+  guint profile, chroma_format = 1, poc_type, width_mbs, height_units;
+  guint frame_mbs_only, crop_x = 2, crop_y, i, n;
+  guint crop[4] = { 0, };
+
+  profile = read_bits (reader, 8);
+  read_bits (reader, 16);
+  read_ue (reader);
+  sequence->bit_depth_minus8 = 0;
+  switch (profile) {
+    case 100: case 110: case 122: case 244: case 44: case 83: case 86:
+    case 118: case 128: case 138: case 139: case 134: case 135:
+      chroma_format = read_ue (reader);
+      if (chroma_format == 3)
+        read_bits (reader, 1);
+      sequence->bit_depth_minus8 = read_ue (reader);
+      read_ue (reader);
+      read_bits (reader, 1);
+      if (read_bits (reader, 1)) {
+        for (i = 0; i < (chroma_format != 3 ? 8u : 12u); i++)
+          if (read_bits (reader, 1))
+            skip_scaling_list (reader, i < 6 ? 16 : 64);
+      }
+      break;
+    default:
+      break;
+  }
+
+  read_ue (reader);
+  poc_type = read_ue (reader);
+  if (poc_type == 0)
+    read_ue (reader);
+  else if (poc_type == 1) {
+    read_bits (reader, 1);
+    read_se (reader);
+    read_se (reader);
+    n = read_ue (reader);
+    for (i = 0; i < n && i < 256; i++)
+      read_se (reader);
+  }
+  read_ue (reader);
+  read_bits (reader, 1);
+  width_mbs = read_ue (reader) + 1;
+  height_units = read_ue (reader) + 1;
+  frame_mbs_only = read_bits (reader, 1);
+  if (!frame_mbs_only)
+    read_bits (reader, 1);
+  read_bits (reader, 1);
+  if (read_bits (reader, 1))
+    for (i = 0; i < 4; i++)
+      crop[i] = read_ue (reader);
+
+  if (chroma_format == 0 || chroma_format == 3)
+    crop_x = 1;
+  crop_y = (chroma_format == 1 ? 2 : 1) * (2 - frame_mbs_only);
+
+  sequence->coded_width = width_mbs * 16;
+  sequence->coded_height = height_units * 16 * (2 - frame_mbs_only);
+  sequence->display_width = sequence->coded_width
+      - (crop[0] + crop[1]) * crop_x;
+  sequence->display_height = sequence->coded_height
+      - (crop[2] + crop[3]) * crop_y;
+}
+
+static void
+skip_profile_tier_level (FakeBitReader * reader, guint max_sub_layers_minus1)
+{
+  gboolean profile_present[8], level_present[8];
+  guint i;
+
+  // General profile space up to and including the general level
+  read_bits (reader, 32);
+  read_bits (reader, 32);
+  read_bits (reader, 32);
+  for (i = 0; i < max_sub_layers_minus1; i++) {
+    profile_present[i] = read_bits (reader, 1);
+    level_present[i] = read_bits (reader, 1);
+  }
+  if (max_sub_layers_minus1)
+    for (i = max_sub_layers_minus1; i < 8; i++)
+      read_bits (reader, 2);
+  for (i = 0; i < max_sub_layers_minus1; i++) {
+    if (profile_present[i]) {
+      read_bits (reader, 32);
+      read_bits (reader, 32);
+      read_bits (reader, 24);
+    }
+    if (level_present[i])
+      read_bits (reader, 8);
+  }
+}
+
+static void
+parse_hevc_sps (FakeBitReader * reader, FakeSequence * sequence)
+{
+  guint max_sub_layers_minus1, chroma_format, sub_width, sub_height, i;
+  guint crop[4] = { 0, };
+
+  read_bits (reader, 4);
+  max_sub_layers_minus1 = MIN (read_bits (reader, 3), 6);
+  read_bits (reader, 1);
+  skip_profile_tier_level (reader, max_sub_layers_minus1);
+  read_ue (reader);
+  chroma_format = read_ue (reader);
+  if (chroma_format == 3)
+    read_bits (reader, 1);
+  sequence->coded_width = read_ue (reader);
+  sequence->coded_height = read_ue (reader);
+  if (read_bits (reader, 1))
+    for (i = 0; i < 4; i++)
+      crop[i] = read_ue (reader);
+  sequence->bit_depth_minus8 = read_ue (reader);
+
+  sub_width = chroma_format == 1 || chroma_format == 2 ? 2 : 1;
+  sub_height = chroma_format == 1 ? 2 : 1;
+  sequence->display_width = sequence->coded_width
+      - (crop[0] + crop[1]) * sub_width;
+  sequence->display_height = sequence->coded_height
+      - (crop[2] + crop[3]) * sub_height;
+}
+
+static gboolean
+display_picture (FakeParser * parser, gint index,
+    CUvideotimestamp timestamp)
+{
+  CUVIDPARSERDISPINFO dispinfo = { 0, };
+
+  dispinfo.picture_index = index;
+  dispinfo.progressive_frame = 1;
+  dispinfo.timestamp = timestamp;
+  parser->surfaces[index].displayed = TRUE;
+
+  return parser->params.pfnDisplayPicture (parser->params.pUserData,
+      &dispinfo) != 0;
+}
+
+// Like the real parser surfaces are handed out in turn,
+// skipping those still needed for reference or display
+static gint
+find_free_surface (FakeParser * parser)
+{
+  FakeSurface *surface;
+  guint i, index;
+
+  for (i = 0; i < parser->num_surfaces; i++) {
+    index = (parser->next_surface + i) % parser->num_surfaces;
+    surface = &parser->surfaces[index];
+    if (!surface->used || (surface->displayed && (!surface->ref_serial
+                || surface->ref_serial + FAKE_NUM_REF_FRAMES
+                <= parser->ref_serial)))
+      return index;
+  }
+
+  GST_WARNING ("out of surfaces, reusing one");
+  return parser->next_surface % parser->num_surfaces;
+}
+
+static gboolean
+complete_picture (FakeParser * parser)
+{
+  FakePicture *picture = &parser->pending_picture;
+  CUVIDPICPARAMS params = { 0, };
+  FakeSurface *surface;
+  gint index;
+
+  if (!parser->pending)
+    return TRUE;
+  parser->pending = FALSE;
+
+  if (!parser->have_sequence) {
+    GST_DEBUG ("dropping picture before the first sequence");
+    return TRUE;
+  }
+
+  index = find_free_surface (parser);
+  parser->next_surface = (index + 1) % parser->num_surfaces;
+  surface = &parser->surfaces[index];
+  surface->used = TRUE;
+  surface->displayed = FALSE;
+  surface->ref_serial = picture->ref ? ++parser->ref_serial : 0;
+
+  params.PicWidthInMbs = (parser->sequence.coded_width + 15) / 16;
+  params.FrameHeightInMbs = (parser->sequence.coded_height + 15) / 16;
+  params.CurrPicIdx = index;
+  params.intra_pic_flag = picture->intra;
+  params.ref_pic_flag = picture->ref;
+  if (!parser->params.pfnDecodePicture (parser->params.pUserData, &params))
+    return FALSE;
+
+  if (!picture->ref)
+    return display_picture (parser, index, picture->timestamp);
+
+  if (parser->held && !display_picture (parser, parser->held_index,
+          parser->held_timestamp)) {
+    parser->held = FALSE;
+    return FALSE;
+  }
+  parser->held = TRUE;
+  parser->held_index = index;
+  parser->held_timestamp = picture->timestamp;
+  return TRUE;
+}
+
+// Everything is output before a new sequence or at the end of the stream
+static gboolean
+flush_pictures (FakeParser * parser)
+{
+  if (!complete_picture (parser))
+    return FALSE;
+
+  if (!parser->held)
+    return TRUE;
+  parser->held = FALSE;
+  return display_picture (parser, parser->held_index, parser->held_timestamp);
+}
+
+static gboolean
+report_sequence (FakeParser * parser, const FakeSequence * sequence)
+{
+  CUVIDEOFORMAT format = { 0, };
+  gint ret;
+
+  if (parser->have_sequence
+      && !memcmp (sequence, &parser->sequence, sizeof (FakeSequence)))
+    return TRUE;
+
+  if (!sequence->coded_width || !sequence->coded_height
+      || sequence->coded_width > FAKE_MAX_SIZE
+      || sequence->coded_height > FAKE_MAX_SIZE
+      || sequence->display_width > sequence->coded_width
+      || sequence->display_height > sequence->coded_height) {
+    GST_WARNING ("bad sequence %ux%u", sequence->coded_width,
+        sequence->coded_height);
+    return FALSE;
+  }
+
+  if (parser->have_sequence && !flush_pictures (parser))
+    return FALSE;
+  parser->sequence = *sequence;
+  memset (parser->surfaces, 0, sizeof (parser->surfaces));
+  parser->next_surface = 0;
+
+  format.codec = parser->params.CodecType;
+  format.frame_rate.numerator = 30;
+  format.frame_rate.denominator = 1;
+  format.progressive_sequence = 1;
+  format.bit_depth_luma_minus8 = sequence->bit_depth_minus8;
+  format.bit_depth_chroma_minus8 = sequence->bit_depth_minus8;
+  format.min_num_decode_surfaces = FAKE_NUM_REF_FRAMES + 2;
+  format.coded_width = sequence->coded_width;
+  format.coded_height = sequence->coded_height;
+  format.display_area.right = sequence->display_width;
+  format.display_area.bottom = sequence->display_height;
+  format.chroma_format = cudaVideoChromaFormat_420;
+  format.display_aspect_ratio.x = sequence->display_width;
+  format.display_aspect_ratio.y = sequence->display_height;
+  format.video_signal_description.matrix_coefficients = 1;
+
+  GST_DEBUG ("sequence %ux%u", sequence->display_width,
+      sequence->display_height);
+  ret = parser->params.pfnSequenceCallback (parser->params.pUserData,
+      &format);
+  if (!ret)
+    return FALSE;
+
+  parser->num_surfaces = ret > 1 ? (guint) ret
+      : parser->params.ulMaxNumDecodeSurfaces;
+  parser->num_surfaces = CLAMP (parser->num_surfaces, 1, FAKE_MAX_SURFACES);
+  parser->have_sequence = TRUE;
+  return TRUE;
+}
+
+static gboolean
+start_picture (FakeParser * parser, gboolean intra, gboolean ref,
+    CUvideotimestamp timestamp)
+{
+  if (!complete_picture (parser))
+    return FALSE;
+
+  parser->pending = TRUE;
+  parser->pending_picture.intra = intra;
+  parser->pending_picture.ref = ref;
+  parser->pending_picture.timestamp = timestamp;
+  return TRUE;
+}
+
+static gboolean
+parse_h264_nal (FakeParser * parser, const guint8 * data, guint size,
+    CUvideotimestamp timestamp)
+{
+  FakeBitReader reader = { parser->rbsp, 0, 8 };
+  FakeSequence sequence = { 0, };
+  guint type, slice_type;
+
+  if (!size)
+    return TRUE;
+
+  type = data[0] & 0x1f;
+  reader.size = unescape_nal (parser, data, size);
+  switch (type) {
+    case 7:
+      parse_h264_sps (&reader, &sequence);
+      return report_sequence (parser, &sequence);
+    case 1:
+    case 5:
+      // Only the first slice starts a picture
+      if (read_ue (&reader) != 0)
+        return TRUE;
+      slice_type = read_ue (&reader) % 5;
+      return start_picture (parser, slice_type == 2 || slice_type == 4,
+          (data[0] & 0x60) != 0, timestamp);
+    default:
+      return TRUE;
+  }
+}
+
+static gboolean
+parse_hevc_nal (FakeParser * parser, const guint8 * data, guint size,
+    CUvideotimestamp timestamp)
+{
+  FakeBitReader reader = { parser->rbsp, 0, 16 };
+  FakeSequence sequence = { 0, };
+  guint type;
+
+  if (size < 3)
+    return TRUE;
+
+  type = (data[0] >> 1) & 0x3f;
+  reader.size = unescape_nal (parser, data, size);
+  if (type == 33) {
+    parse_hevc_sps (&reader, &sequence);
+    return report_sequence (parser, &sequence);
+  }
+
+  // Slices of IRAP pictures are intra, even types below 16
+  // are sub-layer non-reference pictures
+  if (type <= 21 && (type < 10 || type >= 16) && read_bits (&reader, 1))
+    return start_picture (parser, type >= 16, type >= 16 || type % 2,
+        timestamp);
+
+  return TRUE;
+}
+
+// Other codecs aren't looked into, every packet is taken
+// to be a reference picture of the default size
+static gboolean
+parse_other (FakeParser * parser, CUvideotimestamp timestamp)
+{
+  FakeSequence sequence = { FAKE_DEFAULT_WIDTH, FAKE_DEFAULT_HEIGHT,
+    FAKE_DEFAULT_WIDTH, FAKE_DEFAULT_HEIGHT, 0
+  };
+
+  if (!report_sequence (parser, &sequence))
+    return FALSE;
+
+  return start_picture (parser, TRUE, TRUE, timestamp);
+}
+
+// Start codes split the packet into NAL units, trailing
+// zero bytes before a start code aren't part of the NAL
+static gboolean
+parse_byte_stream (FakeParser * parser, const guint8 * data, guint size,
+    CUvideotimestamp timestamp)
+{
+  guint i, start = 0, end;
+  gboolean found = FALSE, ret = TRUE;
+
+  for (i = 0; i + 2 < size && ret; i++) {
+    if (data[i] || data[i + 1] || data[i + 2] != 1)
+      continue;
+
+    if (found) {
+      end = i;
+      while (end > start && !data[end - 1])
+        end--;
+      ret = parser->params.CodecType == cudaVideoCodec_H264
+          ? parse_h264_nal (parser, data + start, end - start, timestamp)
+          : parse_hevc_nal (parser, data + start, end - start, timestamp);
+    }
+    found = TRUE;
+    start = i + 3;
+    i += 2;
+  }
+
+  if (found && ret && start < size)
+    ret = parser->params.CodecType == cudaVideoCodec_H264
+        ? parse_h264_nal (parser, data + start, size - start, timestamp)
+        : parse_hevc_nal (parser, data + start, size - start, timestamp);
+
+  return ret;
+}
+
+static CUresult CUDAAPI
+fake_cuvidCreateVideoParser (CUvideoparser * parser, CUVIDPARSERPARAMS * params)
+{
+  FakeParser *fake;
+
+  init_debug_category ();
+
+  if (!params->pfnSequenceCallback || !params->pfnDecodePicture
+      || !params->pfnDisplayPicture)
+    return CUDA_ERROR_INVALID_VALUE;
+
+  fake = g_new0 (FakeParser, 1);
+  fake->params = *params;
+  *parser = (CUvideoparser) fake;
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidDestroyVideoParser (CUvideoparser parser)
+{
+  g_free (parser);
+  return CUDA_SUCCESS;
+}
+
+static CUresult CUDAAPI
+fake_cuvidParseVideoData (CUvideoparser parser, CUVIDSOURCEDATAPACKET * packet)
+{
+  FakeParser *fake = (FakeParser *) parser;
+  CUvideotimestamp timestamp = 0;
+  gboolean ret = TRUE;
+
+  if (packet->flags & CUVID_PKT_TIMESTAMP)
+    timestamp = packet->timestamp;
+
+  if (packet->payload && packet->payload_size) {
+    switch (fake->params.CodecType) {
+      case cudaVideoCodec_H264:
+      case cudaVideoCodec_HEVC:
+        ret = parse_byte_stream (fake, packet->payload, packet->payload_size,
+            timestamp);
+        break;
+      default:
+        ret = parse_other (fake, timestamp);
+        break;
+    }
+  }
+
+  if (ret && (packet->flags & CUVID_PKT_ENDOFSTREAM))
+    ret = flush_pictures (fake);
+  else if (ret && (packet->flags & CUVID_PKT_ENDOFPICTURE))
+    ret = complete_picture (fake);
+
+  return ret ? CUDA_SUCCESS : CUDA_ERROR_UNKNOWN;
+}
+
+void
+gst_nvdec_fake_get_funcs (GstNvDecFuncs * funcs)
+{
+  funcs->CuInit = fake_cuInit;
+  funcs->CuGetErrorName = fake_cuGetErrorName;
+  funcs->CuGetErrorString = fake_cuGetErrorString;
+  funcs->CuDeviceGetCount = fake_cuDeviceGetCount;
+  funcs->CuDeviceGet = fake_cuDeviceGet;
+  funcs->CuDeviceGetPCIBusId = fake_cuDeviceGetPCIBusId;
+  funcs->CuDevicePrimaryCtxRetain = fake_cuDevicePrimaryCtxRetain;
+  funcs->CuDevicePrimaryCtxRelease = fake_cuDevicePrimaryCtxRelease;
+  funcs->CuDeviceTotalMem = fake_cuDeviceTotalMem;
+  funcs->CuCtxCreate = fake_cuCtxCreate;
+  funcs->CuCtxDestroy = fake_cuCtxDestroy;
+  funcs->CuCtxPushCurrent = fake_cuCtxPushCurrent;
+  funcs->CuCtxPopCurrent = fake_cuCtxPopCurrent;
+  funcs->CuCtxSetCurrent = fake_cuCtxSetCurrent;
+  funcs->CuCtxGetDevice = fake_cuCtxGetDevice;
+  funcs->CuCtxGetApiVersion = fake_cuCtxGetApiVersion;
+  funcs->CuMemGetInfo = fake_cuMemGetInfo;
+  funcs->CuMemAlloc = fake_cuMemAlloc;
+  funcs->CuMemFree = fake_cuMemFree;
+  funcs->CuMemHostAlloc = fake_cuMemHostAlloc;
+  funcs->CuMemFreeHost = fake_cuMemFreeHost;
+  funcs->CuMemHostRegister = fake_cuMemHostRegister;
+  funcs->CuMemHostUnregister = fake_cuMemHostUnregister;
+  funcs->CuMemcpyDtoH = fake_cuMemcpyDtoH;
+  funcs->CuMemcpyDtoHAsync = fake_cuMemcpyDtoHAsync;
+  funcs->CuMemcpyHtoD = fake_cuMemcpyHtoD;
+  funcs->CuMemcpy2D = fake_cuMemcpy2D;
+  funcs->CuMemcpy2DAsync = fake_cuMemcpy2DAsync;
+  funcs->CuStreamCreate = fake_cuStreamCreate;
+  funcs->CuStreamDestroy = fake_cuStreamDestroy;
+  funcs->CuStreamSynchronize = fake_cuStreamSynchronize;
+  funcs->CuEventCreate = fake_cuEventCreate;
+  funcs->CuEventDestroy = fake_cuEventDestroy;
+  funcs->CuEventRecord = fake_cuEventRecord;
+  funcs->CuEventQuery = fake_cuEventQuery;
+  funcs->CuEventSynchronize = fake_cuEventSynchronize;
+  funcs->CuModuleLoadData = fake_cuModuleLoadData;
+  funcs->CuModuleUnload = fake_cuModuleUnload;
+  funcs->CuModuleGetFunction = fake_cuModuleGetFunction;
+  funcs->CuLaunchKernel = fake_cuLaunchKernel;
+  funcs->CuvidCtxLockCreate = fake_cuvidCtxLockCreate;
+  funcs->CuvidCtxLockDestroy = fake_cuvidCtxLockDestroy;
+  funcs->CuvidCtxLock = fake_cuvidCtxLock;
+  funcs->CuvidCtxUnlock = fake_cuvidCtxUnlock;
+  funcs->CuvidGetDecoderCaps = fake_cuvidGetDecoderCaps;
+  funcs->CuvidCreateDecoder = fake_cuvidCreateDecoder;
+  funcs->CuvidReconfigureDecoder = fake_cuvidReconfigureDecoder;
+  funcs->CuvidDestroyDecoder = fake_cuvidDestroyDecoder;
+  funcs->CuvidDecodePicture = fake_cuvidDecodePicture;
+  funcs->CuvidMapVideoFrame = fake_cuvidMapVideoFrame;
+  funcs->CuvidUnmapVideoFrame = fake_cuvidUnmapVideoFrame;
+  funcs->CuvidCreateVideoParser = fake_cuvidCreateVideoParser;
+  funcs->CuvidDestroyVideoParser = fake_cuvidDestroyVideoParser;
+  funcs->CuvidParseVideoData = fake_cuvidParseVideoData;
+  funcs->CuGraphicsGLRegisterImage = fake_cuGraphicsGLRegisterImage;
+  funcs->CuGraphicsUnregisterResource = fake_cuGraphicsUnregisterResource;
+  funcs->CuGraphicsMapResources = fake_cuGraphicsMapResources;
+  funcs->CuGraphicsUnmapResources = fake_cuGraphicsMapResources;
+  funcs->CuGraphicsSubResourceGetMappedArray =
+      fake_cuGraphicsSubResourceGetMappedArray;
+  funcs->NvmlInit = fake_nvmlInit;
+  funcs->NvmlDeviceGetHandleByPciBusId = fake_nvmlDeviceGetHandleByPciBusId;
+  funcs->NvmlDeviceGetMemoryInfo = fake_nvmlDeviceGetMemoryInfo;
+}
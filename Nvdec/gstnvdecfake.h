@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_NVDEC_FAKE_H__
+#define __GST_NVDEC_FAKE_H__
+
+#include "gstnvdecloader.h"
+
+G_BEGIN_DECLS
+
+// A stand-in for the CUDA driver and NVCUVID, used instead of them with
+// GST_NVDEC_BACKEND=fake so the element runs on hosts without a GPU.
+// Nothing is decoded, the parser only reads enough of H.264 and HEVC
+// streams to report the sequence and to reorder pictures the way the
+// real one does
+void gst_nvdec_fake_get_funcs (GstNvDecFuncs * funcs);
+
+// Whether downloads copy the (uninitialized) surface, on by default so
+// the copies cost what they cost on the host side of a real download
+void gst_nvdec_fake_set_copy_frames (gboolean copy);
+
+// Context lock acquisitions since the process started
+guint gst_nvdec_fake_get_lock_count (void);
+
+G_END_DECLS
+
+#endif /* __GST_NVDEC_FAKE_H__ */
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Built with nvcc --fatbin and loaded through the driver API by
+// gstcudacontext.c, so the plugin doesn't link to the CUDA runtime.
+// The names must match GST_NVDEC_KERNEL_NAMES
+
+#include "gstnvdeckernels.h"
+
+#define CONVERT_KERNEL(name, format) \
+  extern "C" __global__ void \
+  name (GstNvDecConvertArgs args) \
+  { \
+    gst_nvdec_kernel_convert (format, &args, \
+        blockIdx.x * blockDim.x + threadIdx.x, \
+        blockIdx.y * blockDim.y + threadIdx.y); \
+  }
+
+#define TENSOR_KERNEL(name, layout, type) \
+  extern "C" __global__ void \
+  name (GstNvDecTensorArgs args) \
+  { \
+    gst_nvdec_kernel_tensor (layout, type, &args, blockIdx.z, \
+        blockIdx.x * blockDim.x + threadIdx.x, \
+        blockIdx.y * blockDim.y + threadIdx.y); \
+  }
+
+CONVERT_KERNEL (gst_nvdec_convert_i420, GST_NVDEC_CONVERT_I420)
+CONVERT_KERNEL (gst_nvdec_convert_bgrx, GST_NVDEC_CONVERT_BGRX)
+CONVERT_KERNEL (gst_nvdec_convert_rgba, GST_NVDEC_CONVERT_RGBA)
+CONVERT_KERNEL (gst_nvdec_convert_gbr, GST_NVDEC_CONVERT_GBR)
+
+TENSOR_KERNEL (gst_nvdec_tensor_nchw_float32, GST_NVDEC_TENSOR_LAYOUT_NCHW,
+    GST_NVDEC_TENSOR_TYPE_FLOAT32)
+TENSOR_KERNEL (gst_nvdec_tensor_nchw_float16, GST_NVDEC_TENSOR_LAYOUT_NCHW,
+    GST_NVDEC_TENSOR_TYPE_FLOAT16)
+TENSOR_KERNEL (gst_nvdec_tensor_nhwc_float32, GST_NVDEC_TENSOR_LAYOUT_NHWC,
+    GST_NVDEC_TENSOR_TYPE_FLOAT32)
+TENSOR_KERNEL (gst_nvdec_tensor_nhwc_float16, GST_NVDEC_TENSOR_LAYOUT_NHWC,
+    GST_NVDEC_TENSOR_TYPE_FLOAT16)
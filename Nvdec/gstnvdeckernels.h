@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// The conversion kernels' per-thread code. It's built into the fatbin
+// by nvcc from gstnvdeckernels.cu and compiled as plain C into the
+// stand-in backend, which runs the kernels on the CPU, so only C and
+// the CUDA driver types can be used here
+
+#ifndef __GST_NVDEC_KERNELS_H__
+#define __GST_NVDEC_KERNELS_H__
+
+#include <cuda.h>
+
+#ifdef __CUDACC__
+#include <cuda_fp16.h>
+#define GST_NVDEC_KERNEL_FUNC static __device__ __forceinline__
+#else
+#include <math.h>
+#define GST_NVDEC_KERNEL_FUNC static inline
+#endif
+
+// Formats the NV12 surfaces can be converted to before download
+typedef enum
+{
+  GST_NVDEC_CONVERT_I420,
+  GST_NVDEC_CONVERT_BGRX,
+  GST_NVDEC_CONVERT_RGBA,
+  // Planar RGB, in GStreamer's GBR plane order
+  GST_NVDEC_CONVERT_GBR
+} GstNvDecConvertFormat;
+
+// Y'CbCr to R'G'B', each output channel is coeff . (Y, U, V) + offset
+// with all values in the 0-255 range, so range expansion is folded in
+typedef struct _GstNvDecColorMatrix
+{
+  float coeff[3][3];
+  float offset[3];
+} GstNvDecColorMatrix;
+
+typedef enum
+{
+  GST_NVDEC_TENSOR_LAYOUT_NCHW,
+  GST_NVDEC_TENSOR_LAYOUT_NHWC
+} GstNvDecTensorLayout;
+
+typedef enum
+{
+  GST_NVDEC_TENSOR_TYPE_FLOAT32,
+  GST_NVDEC_TENSOR_TYPE_FLOAT16
+} GstNvDecTensorType;
+
+// Frames with more sources than this take more than one launch,
+// the sources are passed as a kernel argument
+#define GST_NVDEC_TENSOR_SOURCES_PER_LAUNCH 32
+
+// An NV12 picture of the batch
+typedef struct _GstNvDecTensorSource
+{
+  CUdeviceptr y;
+  CUdeviceptr uv;
+  unsigned int y_pitch;
+  unsigned int uv_pitch;
+  unsigned int width;
+  unsigned int height;
+  GstNvDecColorMatrix matrix;
+} GstNvDecTensorSource;
+
+// Every kernel of the fatbin. The conversions are in
+// GstNvDecConvertFormat order, the tensors by layout then type
+typedef enum
+{
+  GST_NVDEC_KERNEL_CONVERT_I420,
+  GST_NVDEC_KERNEL_CONVERT_BGRX,
+  GST_NVDEC_KERNEL_CONVERT_RGBA,
+  GST_NVDEC_KERNEL_CONVERT_GBR,
+  GST_NVDEC_KERNEL_TENSOR_NCHW_FLOAT32,
+  GST_NVDEC_KERNEL_TENSOR_NCHW_FLOAT16,
+  GST_NVDEC_KERNEL_TENSOR_NHWC_FLOAT32,
+  GST_NVDEC_KERNEL_TENSOR_NHWC_FLOAT16,
+  GST_NVDEC_KERNEL_COUNT
+} GstNvDecKernel;
+
+// What gstnvdeckernels.cu exports them as, in GstNvDecKernel order
+#define GST_NVDEC_KERNEL_NAMES \
+    "gst_nvdec_convert_i420", "gst_nvdec_convert_bgrx", \
+    "gst_nvdec_convert_rgba", "gst_nvdec_convert_gbr", \
+    "gst_nvdec_tensor_nchw_float32", "gst_nvdec_tensor_nchw_float16", \
+    "gst_nvdec_tensor_nhwc_float32", "gst_nvdec_tensor_nhwc_float16"
+
+// Each thread handles a 2x2 block of pixels, which share one chroma sample
+#define GST_NVDEC_CONVERT_BLOCK_WIDTH 32
+#define GST_NVDEC_CONVERT_BLOCK_HEIGHT 8
+
+// The only argument of the conversion kernels
+typedef struct _GstNvDecConvertArgs
+{
+  CUdeviceptr y;
+  CUdeviceptr uv;
+  int pitch;
+  int width;
+  int height;
+  CUdeviceptr dst[3];
+  int dst_stride[3];
+  GstNvDecColorMatrix matrix;
+} GstNvDecConvertArgs;
+
+// Tensor output, one thread per output pixel of a picture and
+// one grid layer per picture of the launch
+#define GST_NVDEC_TENSOR_BLOCK_WIDTH 32
+#define GST_NVDEC_TENSOR_BLOCK_HEIGHT 8
+
+// The only argument of the tensor kernels
+typedef struct _GstNvDecTensorArgs
+{
+  GstNvDecTensorSource sources[GST_NVDEC_TENSOR_SOURCES_PER_LAUNCH];
+  // Layers past num_sources are padding and, like sources
+  // with no width, written as zero
+  int num_sources;
+  int first;
+  CUdeviceptr dst;
+  int width;
+  int height;
+  float scale[3];
+  float bias[3];
+} GstNvDecTensorArgs;
+
+GST_NVDEC_KERNEL_FUNC unsigned char
+gst_nvdec_kernel_clamp_u8 (float v)
+{
+  return (unsigned char) fminf (fmaxf (v + 0.5f, 0.0f), 255.0f);
+}
+
+GST_NVDEC_KERNEL_FUNC void
+gst_nvdec_kernel_write_pixel (GstNvDecConvertFormat format,
+    const GstNvDecConvertArgs * args, int x, int y, unsigned char yv,
+    unsigned char u, unsigned char v)
+{
+  const GstNvDecColorMatrix *m = &args->matrix;
+  unsigned char r, g, b;
+  unsigned char *p;
+
+  r = gst_nvdec_kernel_clamp_u8 (m->coeff[0][0] * yv + m->coeff[0][1] * u
+      + m->coeff[0][2] * v + m->offset[0]);
+  g = gst_nvdec_kernel_clamp_u8 (m->coeff[1][0] * yv + m->coeff[1][1] * u
+      + m->coeff[1][2] * v + m->offset[1]);
+  b = gst_nvdec_kernel_clamp_u8 (m->coeff[2][0] * yv + m->coeff[2][1] * u
+      + m->coeff[2][2] * v + m->offset[2]);
+
+  switch (format) {
+    case GST_NVDEC_CONVERT_BGRX:
+      p = (unsigned char *) args->dst[0] + y * args->dst_stride[0] + x * 4;
+      p[0] = b;
+      p[1] = g;
+      p[2] = r;
+      p[3] = 255;
+      break;
+    case GST_NVDEC_CONVERT_RGBA:
+      p = (unsigned char *) args->dst[0] + y * args->dst_stride[0] + x * 4;
+      p[0] = r;
+      p[1] = g;
+      p[2] = b;
+      p[3] = 255;
+      break;
+    case GST_NVDEC_CONVERT_GBR:
+      ((unsigned char *) args->dst[0])[y * args->dst_stride[0] + x] = g;
+      ((unsigned char *) args->dst[1])[y * args->dst_stride[1] + x] = b;
+      ((unsigned char *) args->dst[2])[y * args->dst_stride[2] + x] = r;
+      break;
+    default:
+      break;
+  }
+}
+
+// Thread (tx, ty) of the grid converts the block at (2 * tx, 2 * ty),
+// format is a constant in every kernel so the switches fold away
+GST_NVDEC_KERNEL_FUNC void
+gst_nvdec_kernel_convert (GstNvDecConvertFormat format,
+    const GstNvDecConvertArgs * args, int tx, int ty)
+{
+  const unsigned char *y_plane = (const unsigned char *) args->y;
+  const unsigned char *uv_plane = (const unsigned char *) args->uv;
+  int x = tx * 2, y = ty * 2, pitch = args->pitch, dx, dy;
+  unsigned char u, v;
+
+  if (x >= args->width || y >= args->height)
+    return;
+
+  u = uv_plane[(y / 2) * pitch + x];
+  v = uv_plane[(y / 2) * pitch + x + 1];
+
+  if (format == GST_NVDEC_CONVERT_I420) {
+    for (dy = 0; dy < 2 && y + dy < args->height; dy++)
+      for (dx = 0; dx < 2 && x + dx < args->width; dx++)
+        ((unsigned char *) args->dst[0])[(y + dy) * args->dst_stride[0]
+            + x + dx] = y_plane[(y + dy) * pitch + x + dx];
+    ((unsigned char *) args->dst[1])[(y / 2) * args->dst_stride[1] + x / 2] =
+        u;
+    ((unsigned char *) args->dst[2])[(y / 2) * args->dst_stride[2] + x / 2] =
+        v;
+    return;
+  }
+
+  for (dy = 0; dy < 2 && y + dy < args->height; dy++)
+    for (dx = 0; dx < 2 && x + dx < args->width; dx++)
+      gst_nvdec_kernel_write_pixel (format, args, x + dx, y + dy,
+          y_plane[(y + dy) * pitch + x + dx], u, v);
+}
+
+GST_NVDEC_KERNEL_FUNC unsigned short
+gst_nvdec_kernel_float_to_half (float f)
+{
+#ifdef __CUDA_ARCH__
+  return __half_as_ushort (__float2half_rn (f));
+#else
+  union
+  {
+    float f;
+    unsigned int u;
+  } v;
+  unsigned int sign, mant, half;
+  int exp, shift;
+
+  v.f = f;
+  sign = (v.u >> 16) & 0x8000;
+  exp = (int) ((v.u >> 23) & 0xff) - 127 + 15;
+  mant = v.u & 0x7fffff;
+
+  // Normalized values never get this far from 0,
+  // ties are rounded up rather than to even
+  if (exp <= 0) {
+    if (exp < -10)
+      return sign;
+    mant |= 0x800000;
+    shift = 14 - exp;
+    half = mant >> shift;
+    if ((mant >> (shift - 1)) & 1)
+      half++;
+    return sign | half;
+  }
+  if (exp >= 31)
+    return sign | 0x7c00;
+
+  half = sign | (exp << 10) | (mant >> 13);
+  if (mant & 0x1000)
+    half++;
+  return half;
+#endif
+}
+
+// Bilinear, x and y are in samples of the plane with 0.5 at
+// the center of the first one, step is the bytes per sample
+GST_NVDEC_KERNEL_FUNC float
+gst_nvdec_kernel_sample (const unsigned char *plane, int pitch, int width,
+    int height, int step, float x, float y)
+{
+  int x0, y0, x1, y1;
+  float ax, ay, top, bottom;
+
+  x = fminf (fmaxf (x - 0.5f, 0.0f), (float) (width - 1));
+  y = fminf (fmaxf (y - 0.5f, 0.0f), (float) (height - 1));
+  x0 = (int) x;
+  y0 = (int) y;
+  x1 = x0 + 1 < width ? x0 + 1 : width - 1;
+  y1 = y0 + 1 < height ? y0 + 1 : height - 1;
+  ax = x - x0;
+  ay = y - y0;
+
+  top = plane[y0 * pitch + x0 * step] * (1.0f - ax)
+      + plane[y0 * pitch + x1 * step] * ax;
+  bottom = plane[y1 * pitch + x0 * step] * (1.0f - ax)
+      + plane[y1 * pitch + x1 * step] * ax;
+
+  return top * (1.0f - ay) + bottom * ay;
+}
+
+GST_NVDEC_KERNEL_FUNC void
+gst_nvdec_kernel_write_tensor (GstNvDecTensorLayout layout,
+    GstNvDecTensorType type, const GstNvDecTensorArgs * args, int n, int c,
+    int x, int y, float v)
+{
+  size_t index;
+
+  if (layout == GST_NVDEC_TENSOR_LAYOUT_NCHW)
+    index = (((size_t) n * 3 + c) * args->height + y) * args->width + x;
+  else
+    index = (((size_t) n * args->height + y) * args->width + x) * 3 + c;
+
+  if (type == GST_NVDEC_TENSOR_TYPE_FLOAT16)
+    ((unsigned short *) args->dst)[index] =
+        gst_nvdec_kernel_float_to_half (v);
+  else
+    ((float *) args->dst)[index] = v;
+}
+
+// Thread (x, y) of grid layer writes pixel (x, y) of picture layer,
+// layout and type are constants in every kernel
+GST_NVDEC_KERNEL_FUNC void
+gst_nvdec_kernel_tensor (GstNvDecTensorLayout layout,
+    GstNvDecTensorType type, const GstNvDecTensorArgs * args, int layer,
+    int x, int y)
+{
+  const GstNvDecTensorSource *src = &args->sources[layer];
+  int n = args->first + layer;
+  int chroma_width, chroma_height, c;
+  float sx, sy, yv, u, v, rgb;
+
+  if (x >= args->width || y >= args->height)
+    return;
+
+  if (layer >= args->num_sources || !src->width || !src->height) {
+    for (c = 0; c < 3; c++)
+      gst_nvdec_kernel_write_tensor (layout, type, args, n, c, x, y, 0.0f);
+    return;
+  }
+
+  sx = (x + 0.5f) * src->width / args->width;
+  sy = (y + 0.5f) * src->height / args->height;
+  chroma_width = (src->width + 1) / 2;
+  chroma_height = (src->height + 1) / 2;
+
+  yv = gst_nvdec_kernel_sample ((const unsigned char *) src->y, src->y_pitch,
+      src->width, src->height, 1, sx, sy);
+  u = gst_nvdec_kernel_sample ((const unsigned char *) src->uv,
+      src->uv_pitch, chroma_width, chroma_height, 2, sx / 2, sy / 2);
+  v = gst_nvdec_kernel_sample ((const unsigned char *) src->uv + 1,
+      src->uv_pitch, chroma_width, chroma_height, 2, sx / 2, sy / 2);
+
+  for (c = 0; c < 3; c++) {
+    rgb = src->matrix.coeff[c][0] * yv + src->matrix.coeff[c][1] * u
+        + src->matrix.coeff[c][2] * v + src->matrix.offset[c];
+    rgb = fminf (fmaxf (rgb, 0.0f), 255.0f);
+    gst_nvdec_kernel_write_tensor (layout, type, args, n, c, x, y,
+        rgb * args->scale[c] + args->bias[c]);
+  }
+}
+
+#endif /* __GST_NVDEC_KERNELS_H__ */
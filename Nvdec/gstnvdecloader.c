@@ -0,0 +1,750 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstnvdecloader.h"
+#include "gstnvdecfake.h"
+
+#include <gst/gst.h>
+#include <gmodule.h>
+#include <string.h>
+
+GST_DEBUG_CATEGORY_STATIC (gst_nvdec_loader_debug_category);
+#define GST_CAT_DEFAULT gst_nvdec_loader_debug_category
+
+#ifdef G_OS_WIN32
+#define CUDA_LIBNAME "nvcuda.dll"
+#define NVCUVID_LIBNAME "nvcuvid.dll"
+#define NVML_LIBNAME "nvml.dll"
+#else
+#define CUDA_LIBNAME "libcuda.so.1"
+#define NVCUVID_LIBNAME "libnvcuvid.so.1"
+#define NVML_LIBNAME "libnvidia-ml.so.1"
+#endif
+
+// Set to "fake" to run on the stand-in instead of the driver
+#define BACKEND_ENV "GST_NVDEC_BACKEND"
+
+#define ENSURE_LOADED() G_STMT_START { \
+    if (G_UNLIKELY (!gst_nvdec_loader_load ())) \
+      return CUDA_ERROR_NOT_INITIALIZED; \
+  } G_STMT_END
+
+typedef struct
+{
+  // cuda.h maps most calls to their _v2 versions,
+  // those are the ones the driver has to export
+  const gchar *name;
+  // Tried when the driver doesn't have name
+  const gchar *fallback;
+  gsize offset;
+  gboolean optional;
+} GstNvDecSymbol;
+
+#define SYMBOL(member, name) \
+    { name, NULL, G_STRUCT_OFFSET (GstNvDecFuncs, member), FALSE }
+#define SYMBOL_FALLBACK(member, name, fallback) \
+    { name, fallback, G_STRUCT_OFFSET (GstNvDecFuncs, member), FALSE }
+#define SYMBOL_OPTIONAL(member, name) \
+    { name, NULL, G_STRUCT_OFFSET (GstNvDecFuncs, member), TRUE }
+
+static const GstNvDecSymbol cuda_symbols[] = {
+  SYMBOL (CuInit, "cuInit"),
+  SYMBOL (CuGetErrorName, "cuGetErrorName"),
+  SYMBOL (CuGetErrorString, "cuGetErrorString"),
+  SYMBOL (CuDeviceGet, "cuDeviceGet"),
+  SYMBOL (CuDeviceGetCount, "cuDeviceGetCount"),
+  SYMBOL (CuDeviceGetPCIBusId, "cuDeviceGetPCIBusId"),
+  SYMBOL (CuDevicePrimaryCtxRetain, "cuDevicePrimaryCtxRetain"),
+  // Only CUDA 11 headers map it to _v2
+  SYMBOL_FALLBACK (CuDevicePrimaryCtxRelease, "cuDevicePrimaryCtxRelease_v2",
+      "cuDevicePrimaryCtxRelease"),
+  SYMBOL (CuDeviceTotalMem, "cuDeviceTotalMem_v2"),
+  SYMBOL (CuCtxCreate, "cuCtxCreate_v2"),
+  SYMBOL (CuCtxDestroy, "cuCtxDestroy_v2"),
+  SYMBOL (CuCtxPushCurrent, "cuCtxPushCurrent_v2"),
+  SYMBOL (CuCtxPopCurrent, "cuCtxPopCurrent_v2"),
+  SYMBOL (CuCtxSetCurrent, "cuCtxSetCurrent"),
+  SYMBOL (CuCtxGetDevice, "cuCtxGetDevice"),
+  SYMBOL (CuCtxGetApiVersion, "cuCtxGetApiVersion"),
+  SYMBOL (CuMemGetInfo, "cuMemGetInfo_v2"),
+  SYMBOL (CuMemAlloc, "cuMemAlloc_v2"),
+  SYMBOL (CuMemFree, "cuMemFree_v2"),
+  SYMBOL (CuMemHostAlloc, "cuMemHostAlloc"),
+  SYMBOL (CuMemFreeHost, "cuMemFreeHost"),
+  SYMBOL (CuMemHostRegister, "cuMemHostRegister_v2"),
+  SYMBOL (CuMemHostUnregister, "cuMemHostUnregister"),
+  SYMBOL (CuMemcpy2D, "cuMemcpy2D_v2"),
+  SYMBOL (CuMemcpy2DAsync, "cuMemcpy2DAsync_v2"),
+  SYMBOL (CuMemcpyDtoH, "cuMemcpyDtoH_v2"),
+  SYMBOL (CuMemcpyDtoHAsync, "cuMemcpyDtoHAsync_v2"),
+  SYMBOL (CuMemcpyHtoD, "cuMemcpyHtoD_v2"),
+  SYMBOL (CuStreamCreate, "cuStreamCreate"),
+  SYMBOL (CuStreamDestroy, "cuStreamDestroy_v2"),
+  SYMBOL (CuStreamSynchronize, "cuStreamSynchronize"),
+  SYMBOL (CuEventCreate, "cuEventCreate"),
+  SYMBOL (CuEventDestroy, "cuEventDestroy_v2"),
+  SYMBOL (CuEventRecord, "cuEventRecord"),
+  SYMBOL (CuEventQuery, "cuEventQuery"),
+  SYMBOL (CuEventSynchronize, "cuEventSynchronize"),
+  SYMBOL (CuModuleLoadData, "cuModuleLoadData"),
+  SYMBOL (CuModuleUnload, "cuModuleUnload"),
+  SYMBOL (CuModuleGetFunction, "cuModuleGetFunction"),
+  SYMBOL (CuLaunchKernel, "cuLaunchKernel"),
+  SYMBOL (CuGraphicsGLRegisterImage, "cuGraphicsGLRegisterImage"),
+  SYMBOL (CuGraphicsUnregisterResource, "cuGraphicsUnregisterResource"),
+  SYMBOL (CuGraphicsMapResources, "cuGraphicsMapResources"),
+  SYMBOL (CuGraphicsUnmapResources, "cuGraphicsUnmapResources"),
+  SYMBOL (CuGraphicsSubResourceGetMappedArray,
+      "cuGraphicsSubResourceGetMappedArray"),
+};
+
+// Only 64-bit builds are supported, cuvidMapVideoFrame
+// is the 64-bit version in their headers
+static const GstNvDecSymbol cuvid_symbols[] = {
+  SYMBOL (CuvidGetDecoderCaps, "cuvidGetDecoderCaps"),
+  SYMBOL (CuvidCreateDecoder, "cuvidCreateDecoder"),
+  SYMBOL_OPTIONAL (CuvidReconfigureDecoder, "cuvidReconfigureDecoder"),
+  SYMBOL (CuvidDestroyDecoder, "cuvidDestroyDecoder"),
+  SYMBOL (CuvidDecodePicture, "cuvidDecodePicture"),
+  SYMBOL (CuvidMapVideoFrame, "cuvidMapVideoFrame64"),
+  SYMBOL (CuvidUnmapVideoFrame, "cuvidUnmapVideoFrame64"),
+  SYMBOL (CuvidCtxLockCreate, "cuvidCtxLockCreate"),
+  SYMBOL (CuvidCtxLockDestroy, "cuvidCtxLockDestroy"),
+  SYMBOL (CuvidCtxLock, "cuvidCtxLock"),
+  SYMBOL (CuvidCtxUnlock, "cuvidCtxUnlock"),
+  SYMBOL (CuvidCreateVideoParser, "cuvidCreateVideoParser"),
+  SYMBOL (CuvidParseVideoData, "cuvidParseVideoData"),
+  SYMBOL (CuvidDestroyVideoParser, "cuvidDestroyVideoParser"),
+};
+
+// Only used to pick a device, it's fine to go without
+static const GstNvDecSymbol nvml_symbols[] = {
+  SYMBOL_OPTIONAL (NvmlInit, "nvmlInit_v2"),
+  SYMBOL_OPTIONAL (NvmlDeviceGetHandleByPciBusId,
+      "nvmlDeviceGetHandleByPciBusId_v2"),
+  SYMBOL_OPTIONAL (NvmlDeviceGetMemoryInfo, "nvmlDeviceGetMemoryInfo"),
+};
+
+static GstNvDecFuncs funcs;
+static gboolean loaded;
+static gboolean use_fake;
+// Opened by the probe and kept open, never closed
+static GModule *cuda_module;
+static GModule *cuvid_module;
+static GModule *nvml_module;
+
+static void
+init (void)
+{
+  static gsize done = 0;
+  const gchar *backend;
+
+  if (g_once_init_enter (&done)) {
+    GST_DEBUG_CATEGORY_INIT (gst_nvdec_loader_debug_category, "nvdecloader",
+        0, "Debug category for loading CUDA and NVCUVID");
+    backend = g_getenv (BACKEND_ENV);
+    use_fake = backend && !g_ascii_strcasecmp (backend, "fake");
+    if (use_fake)
+      GST_INFO ("using the stand-in backend");
+    g_once_init_leave (&done, 1);
+  }
+}
+
+static gboolean
+open_modules (void)
+{
+  static GMutex lock;
+  gboolean ret;
+
+  g_mutex_lock (&lock);
+  if (!cuda_module)
+    cuda_module = g_module_open (CUDA_LIBNAME, G_MODULE_BIND_LAZY);
+  if (cuda_module && !cuvid_module)
+    cuvid_module = g_module_open (NVCUVID_LIBNAME, G_MODULE_BIND_LAZY);
+  ret = cuda_module && cuvid_module;
+  if (!ret)
+    GST_INFO ("failed to open %s: %s", cuda_module ? NVCUVID_LIBNAME
+        : CUDA_LIBNAME, g_module_error ());
+  g_mutex_unlock (&lock);
+
+  return ret;
+}
+
+static gboolean
+load_symbols (GModule * module, const GstNvDecSymbol * symbols,
+    guint num_symbols)
+{
+  gpointer func;
+  guint i;
+
+  for (i = 0; i < num_symbols; i++) {
+    if (!g_module_symbol (module, symbols[i].name, &func)
+        && !(symbols[i].fallback
+            && g_module_symbol (module, symbols[i].fallback, &func)))
+      func = NULL;
+
+    if (!func && !symbols[i].optional) {
+      GST_ERROR ("%s has no %s", g_module_name (module), symbols[i].name);
+      return FALSE;
+    }
+    if (!func)
+      GST_INFO ("%s has no %s", g_module_name (module), symbols[i].name);
+
+    G_STRUCT_MEMBER (gpointer, &funcs, symbols[i].offset) = func;
+  }
+
+  return TRUE;
+}
+
+// Never shut down again, like the libraries are never closed
+static void
+load_nvml (void)
+{
+  if (!use_fake) {
+    nvml_module = g_module_open (NVML_LIBNAME, G_MODULE_BIND_LAZY);
+    if (!nvml_module) {
+      GST_INFO ("failed to open %s: %s", NVML_LIBNAME, g_module_error ());
+      return;
+    }
+    load_symbols (nvml_module, nvml_symbols, G_N_ELEMENTS (nvml_symbols));
+  }
+
+  if (!funcs.NvmlInit || !funcs.NvmlDeviceGetHandleByPciBusId
+      || !funcs.NvmlDeviceGetMemoryInfo
+      || funcs.NvmlInit () != GST_NVML_SUCCESS) {
+    GST_INFO ("NVML can't be used");
+    funcs.NvmlInit = NULL;
+    funcs.NvmlDeviceGetHandleByPciBusId = NULL;
+    funcs.NvmlDeviceGetMemoryInfo = NULL;
+  }
+}
+
+gboolean
+gst_nvdec_loader_probe (void)
+{
+  init ();
+  return use_fake || open_modules ();
+}
+
+gboolean
+gst_nvdec_loader_load (void)
+{
+  static gsize done = 0;
+
+  if (g_once_init_enter (&done)) {
+    init ();
+    if (use_fake) {
+      gst_nvdec_fake_get_funcs (&funcs);
+      loaded = TRUE;
+    } else {
+      loaded = open_modules ()
+          && load_symbols (cuda_module, cuda_symbols,
+          G_N_ELEMENTS (cuda_symbols))
+          && load_symbols (cuvid_module, cuvid_symbols,
+          G_N_ELEMENTS (cuvid_symbols));
+    }
+    if (loaded)
+      load_nvml ();
+    GST_INFO ("%s CUDA", loaded ? "loaded" : "failed to load");
+    g_once_init_leave (&done, 1);
+  }
+
+  return loaded;
+}
+
+gboolean
+gst_nvdec_loader_is_fake (void)
+{
+  init ();
+  return use_fake;
+}
+
+void
+gst_nvdec_loader_warn_error (CUresult result)
+{
+  const gchar *error_name, *error_text;
+
+  CuGetErrorName (result, &error_name);
+  CuGetErrorString (result, &error_text);
+  GST_WARNING ("CUDA call failed: %s, %s", error_name, error_text);
+}
+
+CUresult CUDAAPI
+CuInit (unsigned int flags)
+{
+  ENSURE_LOADED ();
+  return funcs.CuInit (flags);
+}
+
+CUresult CUDAAPI
+CuGetErrorName (CUresult error, const char **str)
+{
+  if (G_UNLIKELY (!gst_nvdec_loader_load ())) {
+    *str = "CUDA not loaded";
+    return CUDA_ERROR_NOT_INITIALIZED;
+  }
+  return funcs.CuGetErrorName (error, str);
+}
+
+CUresult CUDAAPI
+CuGetErrorString (CUresult error, const char **str)
+{
+  if (G_UNLIKELY (!gst_nvdec_loader_load ())) {
+    *str = "CUDA not loaded";
+    return CUDA_ERROR_NOT_INITIALIZED;
+  }
+  return funcs.CuGetErrorString (error, str);
+}
+
+CUresult CUDAAPI
+CuDeviceGet (CUdevice * device, int ordinal)
+{
+  ENSURE_LOADED ();
+  return funcs.CuDeviceGet (device, ordinal);
+}
+
+CUresult CUDAAPI
+CuDeviceGetCount (int *count)
+{
+  ENSURE_LOADED ();
+  return funcs.CuDeviceGetCount (count);
+}
+
+CUresult CUDAAPI
+CuDeviceGetPCIBusId (char *bus_id, int len, CUdevice device)
+{
+  ENSURE_LOADED ();
+  return funcs.CuDeviceGetPCIBusId (bus_id, len, device);
+}
+
+CUresult CUDAAPI
+CuDevicePrimaryCtxRetain (CUcontext * context, CUdevice device)
+{
+  ENSURE_LOADED ();
+  return funcs.CuDevicePrimaryCtxRetain (context, device);
+}
+
+CUresult CUDAAPI
+CuDevicePrimaryCtxRelease (CUdevice device)
+{
+  ENSURE_LOADED ();
+  return funcs.CuDevicePrimaryCtxRelease (device);
+}
+
+CUresult CUDAAPI
+CuDeviceTotalMem (size_t * bytes, CUdevice device)
+{
+  ENSURE_LOADED ();
+  return funcs.CuDeviceTotalMem (bytes, device);
+}
+
+CUresult CUDAAPI
+CuCtxCreate (CUcontext * context, unsigned int flags, CUdevice device)
+{
+  ENSURE_LOADED ();
+  return funcs.CuCtxCreate (context, flags, device);
+}
+
+CUresult CUDAAPI
+CuCtxDestroy (CUcontext context)
+{
+  ENSURE_LOADED ();
+  return funcs.CuCtxDestroy (context);
+}
+
+CUresult CUDAAPI
+CuCtxPushCurrent (CUcontext context)
+{
+  ENSURE_LOADED ();
+  return funcs.CuCtxPushCurrent (context);
+}
+
+CUresult CUDAAPI
+CuCtxPopCurrent (CUcontext * context)
+{
+  ENSURE_LOADED ();
+  return funcs.CuCtxPopCurrent (context);
+}
+
+CUresult CUDAAPI
+CuCtxSetCurrent (CUcontext context)
+{
+  ENSURE_LOADED ();
+  return funcs.CuCtxSetCurrent (context);
+}
+
+CUresult CUDAAPI
+CuCtxGetDevice (CUdevice * device)
+{
+  ENSURE_LOADED ();
+  return funcs.CuCtxGetDevice (device);
+}
+
+CUresult CUDAAPI
+CuCtxGetApiVersion (CUcontext context, unsigned int *version)
+{
+  ENSURE_LOADED ();
+  return funcs.CuCtxGetApiVersion (context, version);
+}
+
+CUresult CUDAAPI
+CuMemGetInfo (size_t * free_bytes, size_t * total_bytes)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemGetInfo (free_bytes, total_bytes);
+}
+
+CUresult CUDAAPI
+CuMemAlloc (CUdeviceptr * ptr, size_t size)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemAlloc (ptr, size);
+}
+
+CUresult CUDAAPI
+CuMemFree (CUdeviceptr ptr)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemFree (ptr);
+}
+
+CUresult CUDAAPI
+CuMemHostAlloc (void **ptr, size_t size, unsigned int flags)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemHostAlloc (ptr, size, flags);
+}
+
+CUresult CUDAAPI
+CuMemFreeHost (void *ptr)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemFreeHost (ptr);
+}
+
+CUresult CUDAAPI
+CuMemHostRegister (void *ptr, size_t size, unsigned int flags)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemHostRegister (ptr, size, flags);
+}
+
+CUresult CUDAAPI
+CuMemHostUnregister (void *ptr)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemHostUnregister (ptr);
+}
+
+CUresult CUDAAPI
+CuMemcpy2D (const CUDA_MEMCPY2D * copy)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemcpy2D (copy);
+}
+
+CUresult CUDAAPI
+CuMemcpy2DAsync (const CUDA_MEMCPY2D * copy, CUstream stream)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemcpy2DAsync (copy, stream);
+}
+
+CUresult CUDAAPI
+CuMemcpyDtoH (void *dst, CUdeviceptr src, size_t size)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemcpyDtoH (dst, src, size);
+}
+
+CUresult CUDAAPI
+CuMemcpyDtoHAsync (void *dst, CUdeviceptr src, size_t size, CUstream stream)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemcpyDtoHAsync (dst, src, size, stream);
+}
+
+CUresult CUDAAPI
+CuMemcpyHtoD (CUdeviceptr dst, const void *src, size_t size)
+{
+  ENSURE_LOADED ();
+  return funcs.CuMemcpyHtoD (dst, src, size);
+}
+
+CUresult CUDAAPI
+CuStreamCreate (CUstream * stream, unsigned int flags)
+{
+  ENSURE_LOADED ();
+  return funcs.CuStreamCreate (stream, flags);
+}
+
+CUresult CUDAAPI
+CuStreamDestroy (CUstream stream)
+{
+  ENSURE_LOADED ();
+  return funcs.CuStreamDestroy (stream);
+}
+
+CUresult CUDAAPI
+CuStreamSynchronize (CUstream stream)
+{
+  ENSURE_LOADED ();
+  return funcs.CuStreamSynchronize (stream);
+}
+
+CUresult CUDAAPI
+CuEventCreate (CUevent * event, unsigned int flags)
+{
+  ENSURE_LOADED ();
+  return funcs.CuEventCreate (event, flags);
+}
+
+CUresult CUDAAPI
+CuEventDestroy (CUevent event)
+{
+  ENSURE_LOADED ();
+  return funcs.CuEventDestroy (event);
+}
+
+CUresult CUDAAPI
+CuEventRecord (CUevent event, CUstream stream)
+{
+  ENSURE_LOADED ();
+  return funcs.CuEventRecord (event, stream);
+}
+
+CUresult CUDAAPI
+CuEventQuery (CUevent event)
+{
+  ENSURE_LOADED ();
+  return funcs.CuEventQuery (event);
+}
+
+CUresult CUDAAPI
+CuEventSynchronize (CUevent event)
+{
+  ENSURE_LOADED ();
+  return funcs.CuEventSynchronize (event);
+}
+
+CUresult CUDAAPI
+CuModuleLoadData (CUmodule * module, const void *image)
+{
+  ENSURE_LOADED ();
+  return funcs.CuModuleLoadData (module, image);
+}
+
+CUresult CUDAAPI
+CuModuleUnload (CUmodule module)
+{
+  ENSURE_LOADED ();
+  return funcs.CuModuleUnload (module);
+}
+
+CUresult CUDAAPI
+CuModuleGetFunction (CUfunction * function, CUmodule module,
+    const char *name)
+{
+  ENSURE_LOADED ();
+  return funcs.CuModuleGetFunction (function, module, name);
+}
+
+CUresult CUDAAPI
+CuLaunchKernel (CUfunction function, unsigned int grid_x,
+    unsigned int grid_y, unsigned int grid_z, unsigned int block_x,
+    unsigned int block_y, unsigned int block_z,
+    unsigned int shared_mem_bytes, CUstream stream, void **params,
+    void **extra)
+{
+  ENSURE_LOADED ();
+  return funcs.CuLaunchKernel (function, grid_x, grid_y, grid_z, block_x,
+      block_y, block_z, shared_mem_bytes, stream, params, extra);
+}
+
+CUresult CUDAAPI
+CuGraphicsGLRegisterImage (CUgraphicsResource * resource, unsigned int image,
+    unsigned int target, unsigned int flags)
+{
+  ENSURE_LOADED ();
+  return funcs.CuGraphicsGLRegisterImage (resource, image, target, flags);
+}
+
+CUresult CUDAAPI
+CuGraphicsUnregisterResource (CUgraphicsResource resource)
+{
+  ENSURE_LOADED ();
+  return funcs.CuGraphicsUnregisterResource (resource);
+}
+
+CUresult CUDAAPI
+CuGraphicsMapResources (unsigned int count, CUgraphicsResource * resources,
+    CUstream stream)
+{
+  ENSURE_LOADED ();
+  return funcs.CuGraphicsMapResources (count, resources, stream);
+}
+
+CUresult CUDAAPI
+CuGraphicsUnmapResources (unsigned int count, CUgraphicsResource * resources,
+    CUstream stream)
+{
+  ENSURE_LOADED ();
+  return funcs.CuGraphicsUnmapResources (count, resources, stream);
+}
+
+CUresult CUDAAPI
+CuGraphicsSubResourceGetMappedArray (CUarray * array,
+    CUgraphicsResource resource, unsigned int index, unsigned int level)
+{
+  ENSURE_LOADED ();
+  return funcs.CuGraphicsSubResourceGetMappedArray (array, resource, index,
+      level);
+}
+
+CUresult CUDAAPI
+CuvidGetDecoderCaps (CUVIDDECODECAPS * caps)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidGetDecoderCaps (caps);
+}
+
+CUresult CUDAAPI
+CuvidCreateDecoder (CUvideodecoder * decoder, CUVIDDECODECREATEINFO * info)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidCreateDecoder (decoder, info);
+}
+
+CUresult CUDAAPI
+CuvidReconfigureDecoder (CUvideodecoder decoder,
+    CUVIDRECONFIGUREDECODERINFO * info)
+{
+  ENSURE_LOADED ();
+  if (!funcs.CuvidReconfigureDecoder)
+    return CUDA_ERROR_NOT_SUPPORTED;
+  return funcs.CuvidReconfigureDecoder (decoder, info);
+}
+
+CUresult CUDAAPI
+CuvidDestroyDecoder (CUvideodecoder decoder)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidDestroyDecoder (decoder);
+}
+
+CUresult CUDAAPI
+CuvidDecodePicture (CUvideodecoder decoder, CUVIDPICPARAMS * params)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidDecodePicture (decoder, params);
+}
+
+CUresult CUDAAPI
+CuvidMapVideoFrame (CUvideodecoder decoder, int picture_index,
+    CUdeviceptr * ptr, unsigned int *pitch, CUVIDPROCPARAMS * params)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidMapVideoFrame (decoder, picture_index, ptr, pitch, params);
+}
+
+CUresult CUDAAPI
+CuvidUnmapVideoFrame (CUvideodecoder decoder, CUdeviceptr ptr)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidUnmapVideoFrame (decoder, ptr);
+}
+
+CUresult CUDAAPI
+CuvidCtxLockCreate (CUvideoctxlock * lock, CUcontext context)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidCtxLockCreate (lock, context);
+}
+
+CUresult CUDAAPI
+CuvidCtxLockDestroy (CUvideoctxlock lock)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidCtxLockDestroy (lock);
+}
+
+CUresult CUDAAPI
+CuvidCtxLock (CUvideoctxlock lock, unsigned int flags)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidCtxLock (lock, flags);
+}
+
+CUresult CUDAAPI
+CuvidCtxUnlock (CUvideoctxlock lock, unsigned int flags)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidCtxUnlock (lock, flags);
+}
+
+CUresult CUDAAPI
+CuvidCreateVideoParser (CUvideoparser * parser, CUVIDPARSERPARAMS * params)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidCreateVideoParser (parser, params);
+}
+
+CUresult CUDAAPI
+CuvidParseVideoData (CUvideoparser parser, CUVIDSOURCEDATAPACKET * packet)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidParseVideoData (parser, packet);
+}
+
+CUresult CUDAAPI
+CuvidDestroyVideoParser (CUvideoparser parser)
+{
+  ENSURE_LOADED ();
+  return funcs.CuvidDestroyVideoParser (parser);
+}
+
+GstNvmlReturn
+NvmlDeviceGetHandleByPciBusId (const char *bus_id, GstNvmlDevice * device)
+{
+  if (G_UNLIKELY (!gst_nvdec_loader_load ())
+      || !funcs.NvmlDeviceGetHandleByPciBusId)
+    return GST_NVML_ERROR_LIBRARY_NOT_FOUND;
+  return funcs.NvmlDeviceGetHandleByPciBusId (bus_id, device);
+}
+
+GstNvmlReturn
+NvmlDeviceGetMemoryInfo (GstNvmlDevice device, GstNvmlMemory * memory)
+{
+  if (G_UNLIKELY (!gst_nvdec_loader_load ())
+      || !funcs.NvmlDeviceGetMemoryInfo)
+    return GST_NVML_ERROR_LIBRARY_NOT_FOUND;
+  return funcs.NvmlDeviceGetMemoryInfo (device, memory);
+}
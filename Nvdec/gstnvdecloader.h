@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_NVDEC_LOADER_H__
+#define __GST_NVDEC_LOADER_H__
+
+#include <glib.h>
+#include <cuda.h>
+#include <nvcuvid.h>
+
+G_BEGIN_DECLS
+
+// The little of NVML that's used, declared here so nvml.h isn't
+// needed to build. The layouts are the ones of the NVML ABI
+typedef int GstNvmlReturn;
+typedef struct _GstNvmlDevice *GstNvmlDevice;
+typedef struct
+{
+  unsigned long long total;
+  unsigned long long free;
+  unsigned long long used;
+} GstNvmlMemory;
+
+#define GST_NVML_SUCCESS 0
+#define GST_NVML_ERROR_NOT_FOUND 6
+#define GST_NVML_ERROR_LIBRARY_NOT_FOUND 12
+
+// Every CUDA driver, NVCUVID and NVML entry point the plugin uses. They're
+// filled from the driver libraries when the first call is made, or
+// from the stand-in of gstnvdecfake.c when GST_NVDEC_BACKEND=fake
+typedef struct _GstNvDecFuncs
+{
+  CUresult (CUDAAPI * CuInit) (unsigned int flags);
+  CUresult (CUDAAPI * CuGetErrorName) (CUresult error, const char **str);
+  CUresult (CUDAAPI * CuGetErrorString) (CUresult error, const char **str);
+
+  CUresult (CUDAAPI * CuDeviceGet) (CUdevice * device, int ordinal);
+  CUresult (CUDAAPI * CuDeviceGetCount) (int *count);
+  CUresult (CUDAAPI * CuDeviceGetPCIBusId) (char *bus_id, int len,
+      CUdevice device);
+  CUresult (CUDAAPI * CuDevicePrimaryCtxRetain) (CUcontext * context,
+      CUdevice device);
+  CUresult (CUDAAPI * CuDevicePrimaryCtxRelease) (CUdevice device);
+  CUresult (CUDAAPI * CuDeviceTotalMem) (size_t * bytes, CUdevice device);
+
+  CUresult (CUDAAPI * CuCtxCreate) (CUcontext * context, unsigned int flags,
+      CUdevice device);
+  CUresult (CUDAAPI * CuCtxDestroy) (CUcontext context);
+  CUresult (CUDAAPI * CuCtxPushCurrent) (CUcontext context);
+  CUresult (CUDAAPI * CuCtxPopCurrent) (CUcontext * context);
+  CUresult (CUDAAPI * CuCtxSetCurrent) (CUcontext context);
+  CUresult (CUDAAPI * CuCtxGetDevice) (CUdevice * device);
+  CUresult (CUDAAPI * CuCtxGetApiVersion) (CUcontext context,
+      unsigned int *version);
+
+  CUresult (CUDAAPI * CuMemGetInfo) (size_t * free_bytes,
+      size_t * total_bytes);
+  CUresult (CUDAAPI * CuMemAlloc) (CUdeviceptr * ptr, size_t size);
+  CUresult (CUDAAPI * CuMemFree) (CUdeviceptr ptr);
+  CUresult (CUDAAPI * CuMemHostAlloc) (void **ptr, size_t size,
+      unsigned int flags);
+  CUresult (CUDAAPI * CuMemFreeHost) (void *ptr);
+  CUresult (CUDAAPI * CuMemHostRegister) (void *ptr, size_t size,
+      unsigned int flags);
+  CUresult (CUDAAPI * CuMemHostUnregister) (void *ptr);
+  CUresult (CUDAAPI * CuMemcpy2D) (const CUDA_MEMCPY2D * copy);
+  CUresult (CUDAAPI * CuMemcpy2DAsync) (const CUDA_MEMCPY2D * copy,
+      CUstream stream);
+  CUresult (CUDAAPI * CuMemcpyDtoH) (void *dst, CUdeviceptr src,
+      size_t size);
+  CUresult (CUDAAPI * CuMemcpyDtoHAsync) (void *dst, CUdeviceptr src,
+      size_t size, CUstream stream);
+  CUresult (CUDAAPI * CuMemcpyHtoD) (CUdeviceptr dst, const void *src,
+      size_t size);
+
+  CUresult (CUDAAPI * CuStreamCreate) (CUstream * stream, unsigned int flags);
+  CUresult (CUDAAPI * CuStreamDestroy) (CUstream stream);
+  CUresult (CUDAAPI * CuStreamSynchronize) (CUstream stream);
+  CUresult (CUDAAPI * CuEventCreate) (CUevent * event, unsigned int flags);
+  CUresult (CUDAAPI * CuEventDestroy) (CUevent event);
+  CUresult (CUDAAPI * CuEventRecord) (CUevent event, CUstream stream);
+  CUresult (CUDAAPI * CuEventQuery) (CUevent event);
+  CUresult (CUDAAPI * CuEventSynchronize) (CUevent event);
+
+  CUresult (CUDAAPI * CuModuleLoadData) (CUmodule * module,
+      const void *image);
+  CUresult (CUDAAPI * CuModuleUnload) (CUmodule module);
+  CUresult (CUDAAPI * CuModuleGetFunction) (CUfunction * function,
+      CUmodule module, const char *name);
+  CUresult (CUDAAPI * CuLaunchKernel) (CUfunction function,
+      unsigned int grid_x, unsigned int grid_y, unsigned int grid_z,
+      unsigned int block_x, unsigned int block_y, unsigned int block_z,
+      unsigned int shared_mem_bytes, CUstream stream, void **params,
+      void **extra);
+
+  // GL interop, the GL types are unsigned ints
+  CUresult (CUDAAPI * CuGraphicsGLRegisterImage) (CUgraphicsResource *
+      resource, unsigned int image, unsigned int target, unsigned int flags);
+  CUresult (CUDAAPI * CuGraphicsUnregisterResource) (CUgraphicsResource
+      resource);
+  CUresult (CUDAAPI * CuGraphicsMapResources) (unsigned int count,
+      CUgraphicsResource * resources, CUstream stream);
+  CUresult (CUDAAPI * CuGraphicsUnmapResources) (unsigned int count,
+      CUgraphicsResource * resources, CUstream stream);
+  CUresult (CUDAAPI * CuGraphicsSubResourceGetMappedArray) (CUarray * array,
+      CUgraphicsResource resource, unsigned int index, unsigned int level);
+
+  CUresult (CUDAAPI * CuvidGetDecoderCaps) (CUVIDDECODECAPS * caps);
+  CUresult (CUDAAPI * CuvidCreateDecoder) (CUvideodecoder * decoder,
+      CUVIDDECODECREATEINFO * info);
+  // Older drivers don't have it
+  CUresult (CUDAAPI * CuvidReconfigureDecoder) (CUvideodecoder decoder,
+      CUVIDRECONFIGUREDECODERINFO * info);
+  CUresult (CUDAAPI * CuvidDestroyDecoder) (CUvideodecoder decoder);
+  CUresult (CUDAAPI * CuvidDecodePicture) (CUvideodecoder decoder,
+      CUVIDPICPARAMS * params);
+  CUresult (CUDAAPI * CuvidMapVideoFrame) (CUvideodecoder decoder,
+      int picture_index, CUdeviceptr * ptr, unsigned int *pitch,
+      CUVIDPROCPARAMS * params);
+  CUresult (CUDAAPI * CuvidUnmapVideoFrame) (CUvideodecoder decoder,
+      CUdeviceptr ptr);
+  CUresult (CUDAAPI * CuvidCtxLockCreate) (CUvideoctxlock * lock,
+      CUcontext context);
+  CUresult (CUDAAPI * CuvidCtxLockDestroy) (CUvideoctxlock lock);
+  CUresult (CUDAAPI * CuvidCtxLock) (CUvideoctxlock lock, unsigned int flags);
+  CUresult (CUDAAPI * CuvidCtxUnlock) (CUvideoctxlock lock,
+      unsigned int flags);
+  CUresult (CUDAAPI * CuvidCreateVideoParser) (CUvideoparser * parser,
+      CUVIDPARSERPARAMS * params);
+  CUresult (CUDAAPI * CuvidParseVideoData) (CUvideoparser parser,
+      CUVIDSOURCEDATAPACKET * packet);
+  CUresult (CUDAAPI * CuvidDestroyVideoParser) (CUvideoparser parser);
+
+  // NVML is optional, these are all NULL when it's missing
+  GstNvmlReturn (*NvmlInit) (void);
+  GstNvmlReturn (*NvmlDeviceGetHandleByPciBusId) (const char *bus_id,
+      GstNvmlDevice * device);
+  GstNvmlReturn (*NvmlDeviceGetMemoryInfo) (GstNvmlDevice device,
+      GstNvmlMemory * memory);
+} GstNvDecFuncs;
+
+// Cheap enough for plugin_init: only checks the libraries can be
+// opened, nothing is initialized and no device is touched
+gboolean gst_nvdec_loader_probe (void);
+// Resolves the entry points, done once, by the first call
+gboolean gst_nvdec_loader_load (void);
+// TRUE when running on the stand-in
+gboolean gst_nvdec_loader_is_fake (void);
+
+CUresult CUDAAPI CuInit (unsigned int flags);
+CUresult CUDAAPI CuGetErrorName (CUresult error, const char **str);
+CUresult CUDAAPI CuGetErrorString (CUresult error, const char **str);
+CUresult CUDAAPI CuDeviceGet (CUdevice * device, int ordinal);
+CUresult CUDAAPI CuDeviceGetCount (int *count);
+CUresult CUDAAPI CuDeviceGetPCIBusId (char *bus_id, int len,
+    CUdevice device);
+CUresult CUDAAPI CuDevicePrimaryCtxRetain (CUcontext * context,
+    CUdevice device);
+CUresult CUDAAPI CuDevicePrimaryCtxRelease (CUdevice device);
+CUresult CUDAAPI CuDeviceTotalMem (size_t * bytes, CUdevice device);
+CUresult CUDAAPI CuCtxCreate (CUcontext * context, unsigned int flags,
+    CUdevice device);
+CUresult CUDAAPI CuCtxDestroy (CUcontext context);
+CUresult CUDAAPI CuCtxPushCurrent (CUcontext context);
+CUresult CUDAAPI CuCtxPopCurrent (CUcontext * context);
+CUresult CUDAAPI CuCtxSetCurrent (CUcontext context);
+CUresult CUDAAPI CuCtxGetDevice (CUdevice * device);
+CUresult CUDAAPI CuCtxGetApiVersion (CUcontext context,
+    unsigned int *version);
+CUresult CUDAAPI CuMemGetInfo (size_t * free_bytes, size_t * total_bytes);
+CUresult CUDAAPI CuMemAlloc (CUdeviceptr * ptr, size_t size);
+CUresult CUDAAPI CuMemFree (CUdeviceptr ptr);
+CUresult CUDAAPI CuMemHostAlloc (void **ptr, size_t size,
+    unsigned int flags);
+CUresult CUDAAPI CuMemFreeHost (void *ptr);
+CUresult CUDAAPI CuMemHostRegister (void *ptr, size_t size,
+    unsigned int flags);
+CUresult CUDAAPI CuMemHostUnregister (void *ptr);
+CUresult CUDAAPI CuMemcpy2D (const CUDA_MEMCPY2D * copy);
+CUresult CUDAAPI CuMemcpy2DAsync (const CUDA_MEMCPY2D * copy,
+    CUstream stream);
+CUresult CUDAAPI CuMemcpyDtoH (void *dst, CUdeviceptr src, size_t size);
+CUresult CUDAAPI CuMemcpyDtoHAsync (void *dst, CUdeviceptr src,
+    size_t size, CUstream stream);
+CUresult CUDAAPI CuMemcpyHtoD (CUdeviceptr dst, const void *src,
+    size_t size);
+CUresult CUDAAPI CuStreamCreate (CUstream * stream, unsigned int flags);
+CUresult CUDAAPI CuStreamDestroy (CUstream stream);
+CUresult CUDAAPI CuStreamSynchronize (CUstream stream);
+CUresult CUDAAPI CuEventCreate (CUevent * event, unsigned int flags);
+CUresult CUDAAPI CuEventDestroy (CUevent event);
+CUresult CUDAAPI CuEventRecord (CUevent event, CUstream stream);
+CUresult CUDAAPI CuEventQuery (CUevent event);
+CUresult CUDAAPI CuEventSynchronize (CUevent event);
+CUresult CUDAAPI CuModuleLoadData (CUmodule * module, const void *image);
+CUresult CUDAAPI CuModuleUnload (CUmodule module);
+CUresult CUDAAPI CuModuleGetFunction (CUfunction * function,
+    CUmodule module, const char *name);
+CUresult CUDAAPI CuLaunchKernel (CUfunction function, unsigned int grid_x,
+    unsigned int grid_y, unsigned int grid_z, unsigned int block_x,
+    unsigned int block_y, unsigned int block_z,
+    unsigned int shared_mem_bytes, CUstream stream, void **params,
+    void **extra);
+CUresult CUDAAPI CuGraphicsGLRegisterImage (CUgraphicsResource * resource,
+    unsigned int image, unsigned int target, unsigned int flags);
+CUresult CUDAAPI CuGraphicsUnregisterResource (CUgraphicsResource resource);
+CUresult CUDAAPI CuGraphicsMapResources (unsigned int count,
+    CUgraphicsResource * resources, CUstream stream);
+CUresult CUDAAPI CuGraphicsUnmapResources (unsigned int count,
+    CUgraphicsResource * resources, CUstream stream);
+CUresult CUDAAPI CuGraphicsSubResourceGetMappedArray (CUarray * array,
+    CUgraphicsResource resource, unsigned int index, unsigned int level);
+CUresult CUDAAPI CuvidGetDecoderCaps (CUVIDDECODECAPS * caps);
+CUresult CUDAAPI CuvidCreateDecoder (CUvideodecoder * decoder,
+    CUVIDDECODECREATEINFO * info);
+CUresult CUDAAPI CuvidReconfigureDecoder (CUvideodecoder decoder,
+    CUVIDRECONFIGUREDECODERINFO * info);
+CUresult CUDAAPI CuvidDestroyDecoder (CUvideodecoder decoder);
+CUresult CUDAAPI CuvidDecodePicture (CUvideodecoder decoder,
+    CUVIDPICPARAMS * params);
+CUresult CUDAAPI CuvidMapVideoFrame (CUvideodecoder decoder,
+    int picture_index, CUdeviceptr * ptr, unsigned int *pitch,
+    CUVIDPROCPARAMS * params);
+CUresult CUDAAPI CuvidUnmapVideoFrame (CUvideodecoder decoder,
+    CUdeviceptr ptr);
+CUresult CUDAAPI CuvidCtxLockCreate (CUvideoctxlock * lock,
+    CUcontext context);
+CUresult CUDAAPI CuvidCtxLockDestroy (CUvideoctxlock lock);
+CUresult CUDAAPI CuvidCtxLock (CUvideoctxlock lock, unsigned int flags);
+CUresult CUDAAPI CuvidCtxUnlock (CUvideoctxlock lock, unsigned int flags);
+CUresult CUDAAPI CuvidCreateVideoParser (CUvideoparser * parser,
+    CUVIDPARSERPARAMS * params);
+CUresult CUDAAPI CuvidParseVideoData (CUvideoparser parser,
+    CUVIDSOURCEDATAPACKET * packet);
+CUresult CUDAAPI CuvidDestroyVideoParser (CUvideoparser parser);
+
+// Fail with GST_NVML_ERROR_LIBRARY_NOT_FOUND without NVML
+GstNvmlReturn NvmlDeviceGetHandleByPciBusId (const char *bus_id,
+    GstNvmlDevice * device);
+GstNvmlReturn NvmlDeviceGetMemoryInfo (GstNvmlDevice device,
+    GstNvmlMemory * memory);
+
+// Logs why a call failed, to the nvdecloader category
+void gst_nvdec_loader_warn_error (CUresult result);
+
+static inline gboolean
+cuda_OK (CUresult result)
+{
+  if (G_LIKELY (result == CUDA_SUCCESS))
+    return TRUE;
+
+  gst_nvdec_loader_warn_error (result);
+  return FALSE;
+}
+
+G_END_DECLS
+
+#endif /* __GST_NVDEC_LOADER_H__ */
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstnvdecscheduler.h"
+
+GST_DEBUG_CATEGORY_STATIC (gst_nvdec_scheduler_debug_category);
+#define GST_CAT_DEFAULT gst_nvdec_scheduler_debug_category
+
+G_DEFINE_TYPE_WITH_CODE (GstNvDecScheduler, gst_nvdec_scheduler,
+    G_TYPE_OBJECT,
+    GST_DEBUG_CATEGORY_INIT (gst_nvdec_scheduler_debug_category,
+        "nvdecscheduler", 0, "Debug category for the shared decode scheduler"));
+
+static void gst_nvdec_scheduler_finalize (GObject * object);
+
+static void
+gst_nvdec_scheduler_class_init (GstNvDecSchedulerClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = gst_nvdec_scheduler_finalize;
+}
+
+static void
+gst_nvdec_scheduler_init (GstNvDecScheduler * scheduler)
+{
+  g_mutex_init (&scheduler->lock);
+}
+
+static void
+gst_nvdec_scheduler_finalize (GObject * object)
+{
+  GstNvDecScheduler *scheduler = GST_NVDEC_SCHEDULER (object);
+  guint i;
+
+  // Lets the tasks already pushed finish first
+  if (scheduler->pool)
+    g_thread_pool_free (scheduler->pool, FALSE, TRUE);
+
+  if (scheduler->streams) {
+    CuCtxPushCurrent (scheduler->cuda_context->context);
+    for (i = 0; i < scheduler->num_streams; i++) {
+      if (scheduler->streams[i]
+          && !cuda_OK (CuStreamDestroy (scheduler->streams[i])))
+        GST_ERROR ("failed to destroy download stream");
+    }
+    CuCtxPopCurrent (NULL);
+    g_free (scheduler->streams);
+    g_free (scheduler->stream_users);
+  }
+
+  if (scheduler->cuda_context)
+    g_object_unref (scheduler->cuda_context);
+  g_mutex_clear (&scheduler->lock);
+
+  G_OBJECT_CLASS (gst_nvdec_scheduler_parent_class)->finalize (object);
+}
+
+static void
+worker_func (gpointer data, gpointer user_data)
+{
+  GstNvDecSchedulerTask *task = data;
+
+  task->func (task->data);
+}
+
+// A num_workers of 0 is one worker per CPU
+GstNvDecScheduler *
+gst_nvdec_scheduler_new (GstNvDecCudaContext * cuda_context,
+    guint num_workers, guint num_streams)
+{
+  GstNvDecScheduler *scheduler;
+  GError *error = NULL;
+  guint i;
+
+  g_return_val_if_fail (cuda_context != NULL, NULL);
+  g_return_val_if_fail (num_streams > 0, NULL);
+
+  if (!num_workers)
+    num_workers = g_get_num_processors ();
+
+  scheduler = g_object_new (GST_TYPE_NVDEC_SCHEDULER, NULL);
+  scheduler->cuda_context = g_object_ref (cuda_context);
+
+  scheduler->pool = g_thread_pool_new (worker_func, NULL, num_workers, TRUE,
+      &error);
+  if (!scheduler->pool) {
+    GST_ERROR ("failed to start %u workers: %s", num_workers, error->message);
+    g_error_free (error);
+    g_object_unref (scheduler);
+    return NULL;
+  }
+
+  scheduler->streams = g_new0 (CUstream, num_streams);
+  scheduler->stream_users = g_new0 (guint, num_streams);
+  scheduler->num_streams = num_streams;
+
+  if (!cuda_OK (CuCtxPushCurrent (cuda_context->context))) {
+    GST_ERROR ("failed to push CUDA context");
+    g_object_unref (scheduler);
+    return NULL;
+  }
+  for (i = 0; i < num_streams; i++) {
+    if (!cuda_OK (CuStreamCreate (&scheduler->streams[i],
+                CU_STREAM_DEFAULT))) {
+      GST_ERROR ("failed to create download stream");
+      CuCtxPopCurrent (NULL);
+      g_object_unref (scheduler);
+      return NULL;
+    }
+  }
+  CuCtxPopCurrent (NULL);
+
+  GST_INFO ("%u workers and %u download streams on device %d", num_workers,
+      num_streams, cuda_context->device);
+
+  return scheduler;
+}
+
+// Runs task->func on the first free worker, FALSE if
+// it won't run because no worker could be started
+gboolean
+gst_nvdec_scheduler_push (GstNvDecScheduler * scheduler,
+    GstNvDecSchedulerTask * task)
+{
+  GError *error = NULL;
+
+  if (!g_thread_pool_push (scheduler->pool, task, &error)) {
+    GST_ERROR ("failed to push task: %s", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+// Downloads are tracked with events, so decoders sharing a
+// stream only wait on their own copies
+CUstream
+gst_nvdec_scheduler_acquire_stream (GstNvDecScheduler * scheduler)
+{
+  guint i, best = 0;
+
+  g_mutex_lock (&scheduler->lock);
+  for (i = 1; i < scheduler->num_streams; i++) {
+    if (scheduler->stream_users[i] < scheduler->stream_users[best])
+      best = i;
+  }
+  scheduler->stream_users[best]++;
+  g_mutex_unlock (&scheduler->lock);
+
+  return scheduler->streams[best];
+}
+
+void
+gst_nvdec_scheduler_release_stream (GstNvDecScheduler * scheduler,
+    CUstream stream)
+{
+  guint i;
+
+  g_mutex_lock (&scheduler->lock);
+  for (i = 0; i < scheduler->num_streams; i++) {
+    if (scheduler->streams[i] == stream) {
+      scheduler->stream_users[i]--;
+      break;
+    }
+  }
+  g_mutex_unlock (&scheduler->lock);
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_NVDEC_SCHEDULER_H__
+#define __GST_NVDEC_SCHEDULER_H__
+
+#include <gst/gst.h>
+#include "gstnvdecloader.h"
+#include "gstcudacontext.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_NVDEC_SCHEDULER         (gst_nvdec_scheduler_get_type())
+#define GST_NVDEC_SCHEDULER(obj)         (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_NVDEC_SCHEDULER, GstNvDecScheduler))
+#define GST_IS_NVDEC_SCHEDULER(obj)      (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_NVDEC_SCHEDULER))
+
+typedef struct _GstNvDecScheduler GstNvDecScheduler;
+typedef struct _GstNvDecSchedulerClass GstNvDecSchedulerClass;
+typedef struct _GstNvDecSchedulerTask GstNvDecSchedulerTask;
+
+typedef void (*GstNvDecSchedulerFunc) (gpointer data);
+
+// Owned by whoever pushes it, must stay alive until func has run
+struct _GstNvDecSchedulerTask
+{
+  GstNvDecSchedulerFunc func;
+  gpointer data;
+};
+
+// Shared by decoders that run their parse and output work on one
+// pool of worker threads instead of two threads each, and copy
+// their frames out on a few download streams instead of one each
+struct _GstNvDecScheduler
+{
+  GObject parent;
+
+  GstNvDecCudaContext *cuda_context;
+  GThreadPool *pool;
+
+  // Handed out to the decoder with the fewest users,
+  // everything below is under lock
+  GMutex lock;
+  guint num_streams;
+  CUstream *streams;
+  guint *stream_users;
+};
+
+struct _GstNvDecSchedulerClass
+{
+  GObjectClass parent_class;
+};
+
+GType gst_nvdec_scheduler_get_type (void);
+
+GstNvDecScheduler * gst_nvdec_scheduler_new (GstNvDecCudaContext *
+    cuda_context, guint num_workers, guint num_streams);
+gboolean gst_nvdec_scheduler_push (GstNvDecScheduler * scheduler,
+    GstNvDecSchedulerTask * task);
+CUstream gst_nvdec_scheduler_acquire_stream (GstNvDecScheduler * scheduler);
+void gst_nvdec_scheduler_release_stream (GstNvDecScheduler * scheduler,
+    CUstream stream);
+
+G_END_DECLS
+
+#endif /* __GST_NVDEC_SCHEDULER_H__ */
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+// Tracer records are still unstable API
+#define GST_USE_UNSTABLE_API
+
+#include "gstnvdectrace.h"
+
+#include <gst/gsttracerrecord.h>
+
+#ifdef HAVE_NVTX
+#include <nvToolsExt.h>
+#endif
+
+gboolean gst_nvdec_nvtx_enabled = FALSE;
+
+static GstTracerRecord *stage_record;
+
+static const gchar *stage_names[GST_NVDEC_NUM_STAGES] = {
+  "parse",
+  "decode",
+  "lock-wait",
+  "map",
+  "download",
+  "finish"
+};
+
+// Called from plugin_init before any element exists
+void
+gst_nvdec_trace_init (void)
+{
+#ifdef HAVE_NVTX
+  gst_nvdec_nvtx_enabled = !g_strcmp0 (g_getenv ("GST_NVDEC_NVTX"), "1");
+#endif
+
+  stage_record = gst_tracer_record_new ("nvdec-stage.class",
+      "thread-id", GST_TYPE_STRUCTURE, gst_structure_new ("scope",
+          "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+          "related-to", GST_TYPE_TRACER_VALUE_SCOPE,
+          GST_TRACER_VALUE_SCOPE_THREAD, NULL),
+      "element", GST_TYPE_STRUCTURE, gst_structure_new ("scope",
+          "type", G_TYPE_GTYPE, G_TYPE_STRING,
+          "related-to", GST_TYPE_TRACER_VALUE_SCOPE,
+          GST_TRACER_VALUE_SCOPE_ELEMENT, NULL),
+      "stage", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+          "type", G_TYPE_GTYPE, G_TYPE_STRING,
+          "description", G_TYPE_STRING, "Part of the decode path", NULL),
+      "ts", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+          "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+          "description", G_TYPE_STRING, "When the stage started", NULL),
+      "time", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+          "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+          "description", G_TYPE_STRING, "Time spent in the stage",
+          "flags", GST_TYPE_TRACER_VALUE_FLAGS,
+          GST_TRACER_VALUE_FLAGS_AGGREGATED,
+          "min", G_TYPE_UINT64, G_GUINT64_CONSTANT (0),
+          "max", G_TYPE_UINT64, G_MAXUINT64, NULL), NULL);
+  GST_OBJECT_FLAG_SET (stage_record, GST_OBJECT_FLAG_MAY_BE_LEAKED);
+}
+
+GstClockTime
+gst_nvdec_trace_begin (GstNvDecStage stage)
+{
+#ifdef HAVE_NVTX
+  if (gst_nvdec_nvtx_enabled)
+    nvtxRangePushA (stage_names[stage]);
+#endif
+
+  return gst_util_get_timestamp ();
+}
+
+void
+gst_nvdec_trace_end (GstObject * object, GstNvDecStage stage,
+    GstClockTime start)
+{
+  GstClockTime now = gst_util_get_timestamp ();
+
+#ifdef HAVE_NVTX
+  if (gst_nvdec_nvtx_enabled)
+    nvtxRangePop ();
+#endif
+
+  if (stage_record)
+    gst_tracer_record_log (stage_record, (guint64) (guintptr) g_thread_self (),
+        GST_OBJECT_NAME (object), stage_names[stage], start, now - start);
+}
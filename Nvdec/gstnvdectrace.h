@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_NVDEC_TRACE_H__
+#define __GST_NVDEC_TRACE_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+// Where the time of a frame goes, each logged as an
+// "nvdec-stage" tracer record with its duration
+typedef enum
+{
+  GST_NVDEC_STAGE_PARSE,
+  GST_NVDEC_STAGE_DECODE,
+  GST_NVDEC_STAGE_LOCK_WAIT,
+  GST_NVDEC_STAGE_MAP,
+  GST_NVDEC_STAGE_DOWNLOAD,
+  GST_NVDEC_STAGE_FINISH,
+  GST_NVDEC_NUM_STAGES
+} GstNvDecStage;
+
+// Set once when the plugin loads, NVTX ranges are pushed
+// when built with HAVE_NVTX and GST_NVDEC_NVTX=1
+extern gboolean gst_nvdec_nvtx_enabled;
+
+void gst_nvdec_trace_init (void);
+GstClockTime gst_nvdec_trace_begin (GstNvDecStage stage);
+void gst_nvdec_trace_end (GstObject * object, GstNvDecStage stage,
+    GstClockTime start);
+
+// Tracer records go to the GST_TRACER category at trace level, when
+// nothing logs that much and NVTX is off this is a load and a branch
+#ifndef GST_DISABLE_GST_DEBUG
+#define GST_NVDEC_TRACE_ACTIVE() \
+    G_UNLIKELY (gst_nvdec_nvtx_enabled || GST_LEVEL_TRACE <= _gst_debug_min)
+#else
+#define GST_NVDEC_TRACE_ACTIVE() G_UNLIKELY (gst_nvdec_nvtx_enabled)
+#endif
+
+#define GST_NVDEC_TRACE_BEGIN(stage) \
+    (GST_NVDEC_TRACE_ACTIVE () ? gst_nvdec_trace_begin (stage) \
+        : GST_CLOCK_TIME_NONE)
+
+#define GST_NVDEC_TRACE_END(object, stage, start) G_STMT_START { \
+    if (G_UNLIKELY (GST_CLOCK_TIME_IS_VALID (start))) \
+      gst_nvdec_trace_end (GST_OBJECT (object), stage, start); \
+  } G_STMT_END
+
+G_END_DECLS
+
+#endif /* __GST_NVDEC_TRACE_H__ */
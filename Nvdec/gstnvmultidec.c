@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "gstnvmultidec.h"
+
+#define DEFAULT_CUDA_DEVICE_ID 0
+#define DEFAULT_NUM_WORKERS 0
+// Enough to keep both copy engines busy
+#define DEFAULT_NUM_DOWNLOAD_STREAMS 2
+#define MAX_DOWNLOAD_STREAMS 32
+
+enum
+{
+    PROP_0,
+    PROP_CUDA_DEVICE_ID,
+    PROP_NUM_WORKERS,
+    PROP_NUM_DOWNLOAD_STREAMS
+};
+
+GST_DEBUG_CATEGORY_STATIC (gst_nvmultidec_debug_category);
+#define GST_CAT_DEFAULT gst_nvmultidec_debug_category
+
+G_DEFINE_TYPE_WITH_CODE (GstNvMultiDec, gst_nvmultidec, GST_TYPE_BIN,
+    GST_DEBUG_CATEGORY_INIT (gst_nvmultidec_debug_category, "nvmultidec", 0,
+        "Debug category for the nvmultidec element"));
+
+static GstPad *gst_nvmultidec_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * name, const GstCaps * caps);
+static void gst_nvmultidec_release_pad (GstElement * element, GstPad * pad);
+static GstStateChangeReturn gst_nvmultidec_change_state (GstElement *
+    element, GstStateChange transition);
+static void gst_nvmultidec_set_context (GstElement * element,
+    GstContext * context);
+static void gst_nvmultidec_set_property (GObject * object,
+    guint prop_id, const GValue * value, GParamSpec * pspec);
+static void gst_nvmultidec_get_property (GObject * object,
+    guint prop_id, GValue * value, GParamSpec * pspec);
+static void gst_nvmultidec_finalize (GObject * object);
+
+// The pads take the caps of nvdec's, so they follow what it probed
+static void
+add_pad_template (GstElementClass * element_class,
+    GstElementClass * nvdec_class, const gchar * nvdec_name,
+    const gchar * name, GstPadDirection direction, GstPadPresence presence)
+{
+  GstPadTemplate *templ;
+  GstCaps *caps;
+
+  templ = gst_element_class_get_pad_template (nvdec_class, nvdec_name);
+  caps = gst_pad_template_get_caps (templ);
+  gst_element_class_add_pad_template (element_class,
+      gst_pad_template_new (name, direction, presence, caps));
+  gst_caps_unref (caps);
+}
+
+static void
+gst_nvmultidec_class_init (GstNvMultiDecClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+  GstElementClass *nvdec_class = g_type_class_ref (GST_TYPE_NVDEC);
+
+  add_pad_template (element_class, nvdec_class, "sink", "sink_%u",
+      GST_PAD_SINK, GST_PAD_REQUEST);
+  add_pad_template (element_class, nvdec_class, "src", "src_%u",
+      GST_PAD_SRC, GST_PAD_SOMETIMES);
+  g_type_class_unref (nvdec_class);
+
+  gst_element_class_set_static_metadata (element_class,
+      "NVDEC multi-stream video decoder", "Decoder/Video",
+      "Decodes several streams on one GPU with shared workers",
+      "Ericsson AB, http://www.ericsson.com");
+
+  gobject_class->set_property = gst_nvmultidec_set_property;
+  gobject_class->get_property = gst_nvmultidec_get_property;
+  gobject_class->finalize = gst_nvmultidec_finalize;
+  element_class->request_new_pad =
+      GST_DEBUG_FUNCPTR (gst_nvmultidec_request_new_pad);
+  element_class->release_pad = GST_DEBUG_FUNCPTR (gst_nvmultidec_release_pad);
+  element_class->change_state =
+      GST_DEBUG_FUNCPTR (gst_nvmultidec_change_state);
+  element_class->set_context = GST_DEBUG_FUNCPTR (gst_nvmultidec_set_context);
+
+  g_object_class_install_property (gobject_class, PROP_CUDA_DEVICE_ID,
+      g_param_spec_int ("cuda-device-id", "CUDA device ID",
+          "Device every stream is decoded on when no context is set",
+          0, G_MAXINT, DEFAULT_CUDA_DEVICE_ID,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_NUM_WORKERS,
+      g_param_spec_uint ("num-workers", "Number of workers",
+          "Threads parsing, submitting and downloading for all the streams "
+          "(0 = one per CPU). Applies when the element goes to READY",
+          0, G_MAXUINT, DEFAULT_NUM_WORKERS,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_NUM_DOWNLOAD_STREAMS,
+      g_param_spec_uint ("num-download-streams", "Number of download streams",
+          "CUDA streams the streams' frames are copied out on. Applies when "
+          "the element goes to READY",
+          1, MAX_DOWNLOAD_STREAMS, DEFAULT_NUM_DOWNLOAD_STREAMS,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+}
+
+static void
+gst_nvmultidec_init (GstNvMultiDec * self)
+{
+  self->cuda_device_id = DEFAULT_CUDA_DEVICE_ID;
+  self->num_workers = DEFAULT_NUM_WORKERS;
+  self->num_download_streams = DEFAULT_NUM_DOWNLOAD_STREAMS;
+}
+
+// A context shared with the rest of the pipeline if there is
+// one on our device, otherwise the process-wide one
+static gboolean
+gst_nvmultidec_start (GstNvMultiDec * self)
+{
+  GstElement *element = GST_ELEMENT (self);
+  GstNvDecScheduler *scheduler;
+  CUdevice device;
+  GList *l;
+
+  if (!gst_nvdec_cuda_context_find (element, self->cuda_device_id,
+          &self->cuda_context)) {
+    if (!cuda_OK (CuInit (0))
+        || !cuda_OK (CuDeviceGet (&device, self->cuda_device_id))) {
+      GST_ERROR_OBJECT (self, "failed to get device %d",
+          self->cuda_device_id);
+      return FALSE;
+    }
+
+    self->cuda_context = gst_nvdec_cuda_context_get (device);
+    if (!self->cuda_context) {
+      GST_ERROR_OBJECT (self, "failed to get a CUDA context for device %d",
+          device);
+      return FALSE;
+    }
+    gst_nvdec_cuda_context_propagate (element, self->cuda_context);
+  }
+
+  scheduler = gst_nvdec_scheduler_new (self->cuda_context, self->num_workers,
+      self->num_download_streams);
+  if (!scheduler)
+    return FALSE;
+
+  GST_OBJECT_LOCK (self);
+  self->scheduler = scheduler;
+  for (l = GST_BIN_CHILDREN (self); l; l = l->next) {
+    if (GST_IS_NVDEC (l->data))
+      gst_nvdec_set_scheduler (GST_NVDEC (l->data), scheduler);
+  }
+  GST_OBJECT_UNLOCK (self);
+
+  return TRUE;
+}
+
+// The decoders are stopped by now, the workers go away
+// with the last of them
+static void
+gst_nvmultidec_stop (GstNvMultiDec * self)
+{
+  GstNvDecScheduler *scheduler;
+  GstNvDecCudaContext *cuda_context;
+  GList *l;
+
+  GST_OBJECT_LOCK (self);
+  for (l = GST_BIN_CHILDREN (self); l; l = l->next) {
+    if (GST_IS_NVDEC (l->data))
+      gst_nvdec_set_scheduler (GST_NVDEC (l->data), NULL);
+  }
+  scheduler = self->scheduler;
+  self->scheduler = NULL;
+  cuda_context = self->cuda_context;
+  self->cuda_context = NULL;
+  GST_OBJECT_UNLOCK (self);
+
+  if (scheduler)
+    g_object_unref (scheduler);
+  if (cuda_context)
+    g_object_unref (cuda_context);
+}
+
+static GstStateChangeReturn
+gst_nvmultidec_change_state (GstElement * element, GstStateChange transition)
+{
+  GstNvMultiDec *self = GST_NVMULTIDEC (element);
+  GstStateChangeReturn ret;
+
+  // Before the decoders go to READY so they start on the scheduler
+  if (transition == GST_STATE_CHANGE_NULL_TO_READY
+      && !gst_nvmultidec_start (self))
+    return GST_STATE_CHANGE_FAILURE;
+
+  ret = GST_ELEMENT_CLASS (gst_nvmultidec_parent_class)->change_state
+      (element, transition);
+
+  if (transition == GST_STATE_CHANGE_READY_TO_NULL
+      || (transition == GST_STATE_CHANGE_NULL_TO_READY
+          && ret == GST_STATE_CHANGE_FAILURE))
+    gst_nvmultidec_stop (self);
+
+  return ret;
+}
+
+static GstPad *
+gst_nvmultidec_request_new_pad (GstElement * element, GstPadTemplate * templ,
+    const gchar * name, const GstCaps * caps)
+{
+  GstNvMultiDec *self = GST_NVMULTIDEC (element);
+  GstElement *decoder;
+  GstPad *target, *sinkpad, *srcpad;
+  gchar *pad_name;
+  guint id;
+
+  GST_OBJECT_LOCK (self);
+  if (!name || sscanf (name, "sink_%u", &id) != 1)
+    id = self->next_pad_id;
+  self->next_pad_id = MAX (self->next_pad_id, id + 1);
+  GST_OBJECT_UNLOCK (self);
+
+  pad_name = g_strdup_printf ("nvdec_%u", id);
+  decoder = g_object_new (GST_TYPE_NVDEC, "name", pad_name,
+      "cuda-device-id", self->cuda_device_id, NULL);
+  g_free (pad_name);
+
+  // Takes care of the floating reference when it fails
+  if (!gst_bin_add (GST_BIN (self), decoder)) {
+    GST_WARNING_OBJECT (self, "pad sink_%u already exists", id);
+    return NULL;
+  }
+
+  // Pads requested while running join the scheduler right away
+  GST_OBJECT_LOCK (self);
+  if (self->scheduler)
+    gst_nvdec_set_scheduler (GST_NVDEC (decoder), self->scheduler);
+  GST_OBJECT_UNLOCK (self);
+
+  pad_name = g_strdup_printf ("src_%u", id);
+  target = gst_element_get_static_pad (decoder, "src");
+  srcpad = gst_ghost_pad_new_from_template (pad_name, target,
+      gst_element_class_get_pad_template (GST_ELEMENT_GET_CLASS (self),
+          "src_%u"));
+  gst_object_unref (target);
+  g_free (pad_name);
+
+  pad_name = g_strdup_printf ("sink_%u", id);
+  target = gst_element_get_static_pad (decoder, "sink");
+  sinkpad = gst_ghost_pad_new_from_template (pad_name, target, templ);
+  gst_object_unref (target);
+  g_free (pad_name);
+
+  // Downstream gets to link the src pad before anything flows
+  gst_element_add_pad (element, srcpad);
+  gst_element_add_pad (element, sinkpad);
+  gst_element_sync_state_with_parent (decoder);
+
+  GST_DEBUG_OBJECT (self, "added stream %u", id);
+
+  return sinkpad;
+}
+
+static void
+gst_nvmultidec_release_pad (GstElement * element, GstPad * pad)
+{
+  GstNvMultiDec *self = GST_NVMULTIDEC (element);
+  GstElement *decoder = NULL;
+  GstPad *target, *srcpad = NULL;
+  gchar *pad_name;
+  guint id;
+
+  // The pad goes away with the element's reference
+  GST_DEBUG_OBJECT (self, "releasing stream of %s", GST_PAD_NAME (pad));
+
+  target = gst_ghost_pad_get_target (GST_GHOST_PAD (pad));
+  if (target) {
+    decoder = gst_pad_get_parent_element (target);
+    gst_object_unref (target);
+  }
+
+  if (sscanf (GST_PAD_NAME (pad), "sink_%u", &id) == 1) {
+    pad_name = g_strdup_printf ("src_%u", id);
+    srcpad = gst_element_get_static_pad (element, pad_name);
+    g_free (pad_name);
+  }
+
+  if (decoder) {
+    gst_element_set_locked_state (decoder, TRUE);
+    gst_element_set_state (decoder, GST_STATE_NULL);
+  }
+
+  if (srcpad) {
+    gst_element_remove_pad (element, srcpad);
+    gst_object_unref (srcpad);
+  }
+  gst_element_remove_pad (element, pad);
+
+  if (decoder) {
+    gst_bin_remove (GST_BIN (self), decoder);
+    gst_object_unref (decoder);
+  }
+}
+
+static void
+gst_nvmultidec_set_context (GstElement * element, GstContext * context)
+{
+  GstNvMultiDec *self = GST_NVMULTIDEC (element);
+
+  // Only taken between runs, the decoders use the
+  // scheduler's whatever they're given
+  if (!self->scheduler)
+    gst_nvdec_cuda_context_handle_set_context (element, context,
+        self->cuda_device_id, &self->cuda_context);
+
+  GST_ELEMENT_CLASS (gst_nvmultidec_parent_class)->set_context (element,
+      context);
+}
+
+static void
+gst_nvmultidec_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+    GstNvMultiDec *self = GST_NVMULTIDEC (object);
+
+    switch (prop_id) {
+    case PROP_CUDA_DEVICE_ID:
+        self->cuda_device_id = g_value_get_int (value);
+        break;
+    case PROP_NUM_WORKERS:
+        self->num_workers = g_value_get_uint (value);
+        break;
+    case PROP_NUM_DOWNLOAD_STREAMS:
+        self->num_download_streams = g_value_get_uint (value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+gst_nvmultidec_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+    GstNvMultiDec *self = GST_NVMULTIDEC (object);
+
+    switch (prop_id) {
+    case PROP_CUDA_DEVICE_ID:
+        g_value_set_int (value, self->cuda_device_id);
+        break;
+    case PROP_NUM_WORKERS:
+        g_value_set_uint (value, self->num_workers);
+        break;
+    case PROP_NUM_DOWNLOAD_STREAMS:
+        g_value_set_uint (value, self->num_download_streams);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+gst_nvmultidec_finalize (GObject * object)
+{
+  GstNvMultiDec *self = GST_NVMULTIDEC (object);
+
+  gst_nvmultidec_stop (self);
+
+  G_OBJECT_CLASS (gst_nvmultidec_parent_class)->finalize (object);
+}
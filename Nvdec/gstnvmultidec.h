@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_NVMULTIDEC_H__
+#define __GST_NVMULTIDEC_H__
+
+#include <gst/gst.h>
+#include "gstnvdec.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_NVMULTIDEC          (gst_nvmultidec_get_type())
+#define GST_NVMULTIDEC(obj)          (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_NVMULTIDEC, GstNvMultiDec))
+#define GST_NVMULTIDEC_CLASS(klass)  (G_TYPE_CHECK_CLASS_CAST((klass), GST_TYPE_NVMULTIDEC, GstNvMultiDecClass))
+#define GST_IS_NVMULTIDEC(obj)       (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_NVMULTIDEC))
+
+typedef struct _GstNvMultiDec GstNvMultiDec;
+typedef struct _GstNvMultiDecClass GstNvMultiDecClass;
+
+// A bin with an nvdec per sink_%u pad, decoded frames come out of
+// the src_%u pad with the same number. The decoders share one CUDA
+// context, one pool of workers and a few download streams through
+// a GstNvDecScheduler. Each pushes on a thread of its own, a stream
+// whose downstream blocks doesn't hold up the others. They can be
+// configured as nvdec_%u children
+struct _GstNvMultiDec
+{
+  GstBin parent;
+
+  gint cuda_device_id;
+  guint num_workers;
+  guint num_download_streams;
+
+  // Made when going to READY, everything below is
+  // under the object lock
+  GstNvDecCudaContext *cuda_context;
+  GstNvDecScheduler *scheduler;
+  guint next_pad_id;
+};
+
+struct _GstNvMultiDecClass
+{
+  GstBinClass parent_class;
+};
+
+GType gst_nvmultidec_get_type (void);
+
+G_END_DECLS
+
+#endif /* __GST_NVMULTIDEC_H__ */
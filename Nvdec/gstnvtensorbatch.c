@@ -0,0 +1,1179 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+
+#include "gstnvtensorbatch.h"
+#include "gstcudamemory.h"
+
+#define DEFAULT_CUDA_DEVICE_ID 0
+#define DEFAULT_BATCH_SIZE 8
+#define MAX_BATCH_SIZE 256
+#define DEFAULT_WIDTH 224
+#define DEFAULT_HEIGHT 224
+#define MAX_SIZE 8192
+#define DEFAULT_LAYOUT GST_NVDEC_TENSOR_LAYOUT_NCHW
+#define DEFAULT_TYPE GST_NVDEC_TENSOR_TYPE_FLOAT32
+#define DEFAULT_MEAN "0,0,0"
+#define DEFAULT_STD "1,1,1"
+
+enum
+{
+    PROP_0,
+    PROP_CUDA_DEVICE_ID,
+    PROP_BATCH_SIZE,
+    PROP_WIDTH,
+    PROP_HEIGHT,
+    PROP_LAYOUT,
+    PROP_DATA_TYPE,
+    PROP_MEAN,
+    PROP_STD
+};
+
+GST_DEBUG_CATEGORY_STATIC (gst_nvtensorbatch_debug_category);
+#define GST_CAT_DEFAULT gst_nvtensorbatch_debug_category
+
+static GstStaticPadTemplate gst_nvtensorbatch_sink_template =
+GST_STATIC_PAD_TEMPLATE ("sink_%u",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS (GST_VIDEO_CAPS_MAKE_WITH_FEATURES
+        (GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY, "NV12"))
+    );
+
+static GstStaticPadTemplate gst_nvtensorbatch_src_template =
+GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS (GST_NVDEC_TENSOR_CAPS_NAME "("
+        GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY "), "
+        "format = (string) { F32, F16 }, layout = (string) { NCHW, NHWC }, "
+        "batch = (int) [ 1, 256 ], channels = (int) 3, "
+        "width = (int) [ 1, 8192 ], height = (int) [ 1, 8192 ]")
+    );
+
+G_DEFINE_TYPE (GstNvTensorBatchPad, gst_nvtensorbatch_pad, GST_TYPE_PAD);
+
+G_DEFINE_TYPE_WITH_CODE (GstNvTensorBatch, gst_nvtensorbatch,
+    GST_TYPE_ELEMENT,
+    GST_DEBUG_CATEGORY_INIT (gst_nvtensorbatch_debug_category,
+        "nvtensorbatch", 0, "Debug category for the nvtensorbatch element"));
+
+static GstPad *gst_nvtensorbatch_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * name, const GstCaps * caps);
+static void gst_nvtensorbatch_release_pad (GstElement * element,
+    GstPad * pad);
+static GstStateChangeReturn gst_nvtensorbatch_change_state (GstElement *
+    element, GstStateChange transition);
+static void gst_nvtensorbatch_set_context (GstElement * element,
+    GstContext * context);
+static GstFlowReturn gst_nvtensorbatch_chain (GstPad * pad,
+    GstObject * parent, GstBuffer * buffer);
+static gboolean gst_nvtensorbatch_sink_event (GstPad * pad,
+    GstObject * parent, GstEvent * event);
+static gboolean gst_nvtensorbatch_sink_query (GstPad * pad,
+    GstObject * parent, GstQuery * query);
+static gboolean gst_nvtensorbatch_src_query (GstPad * pad,
+    GstObject * parent, GstQuery * query);
+static void gst_nvtensorbatch_set_property (GObject * object,
+    guint prop_id, const GValue * value, GParamSpec * pspec);
+static void gst_nvtensorbatch_get_property (GObject * object,
+    guint prop_id, GValue * value, GParamSpec * pspec);
+static void gst_nvtensorbatch_finalize (GObject * object);
+
+GType
+gst_nvdec_tensor_layout_get_type (void)
+{
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    {GST_NVDEC_TENSOR_LAYOUT_NCHW, "Batch, channel, row, column", "nchw"},
+    {GST_NVDEC_TENSOR_LAYOUT_NHWC, "Batch, row, column, channel", "nhwc"},
+    {0, NULL, NULL}
+  };
+
+  if (g_once_init_enter (&type)) {
+    GType tmp = g_enum_register_static ("GstNvDecTensorLayout", values);
+    g_once_init_leave (&type, tmp);
+  }
+
+  return (GType) type;
+}
+
+GType
+gst_nvdec_tensor_type_get_type (void)
+{
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    {GST_NVDEC_TENSOR_TYPE_FLOAT32, "32-bit float", "float32"},
+    {GST_NVDEC_TENSOR_TYPE_FLOAT16, "16-bit float", "float16"},
+    {0, NULL, NULL}
+  };
+
+  if (g_once_init_enter (&type)) {
+    GType tmp = g_enum_register_static ("GstNvDecTensorType", values);
+    g_once_init_leave (&type, tmp);
+  }
+
+  return (GType) type;
+}
+
+GType
+gst_nvdec_tensor_meta_api_get_type (void)
+{
+  static gsize type = 0;
+  static const gchar *tags[] = { NULL };
+
+  if (g_once_init_enter (&type)) {
+    GType tmp = gst_meta_api_type_register ("GstNvDecTensorMetaAPI", tags);
+    g_once_init_leave (&type, tmp);
+  }
+
+  return (GType) type;
+}
+
+static gboolean
+gst_nvdec_tensor_meta_init (GstMeta * meta, gpointer params,
+    GstBuffer * buffer)
+{
+  GstNvDecTensorMeta *tensor_meta = (GstNvDecTensorMeta *) meta;
+
+  tensor_meta->num_frames = 0;
+  tensor_meta->frames = NULL;
+
+  return TRUE;
+}
+
+static void
+gst_nvdec_tensor_meta_free (GstMeta * meta, GstBuffer * buffer)
+{
+  GstNvDecTensorMeta *tensor_meta = (GstNvDecTensorMeta *) meta;
+
+  g_free (tensor_meta->frames);
+}
+
+static gboolean
+gst_nvdec_tensor_meta_transform (GstBuffer * dest, GstMeta * meta,
+    GstBuffer * buffer, GQuark type, gpointer data)
+{
+  GstNvDecTensorMeta *tensor_meta = (GstNvDecTensorMeta *) meta;
+  GstNvDecTensorMeta *copy;
+
+  if (!GST_META_TRANSFORM_IS_COPY (type))
+    return FALSE;
+
+  copy = (GstNvDecTensorMeta *) gst_buffer_add_meta (dest,
+      gst_nvdec_tensor_meta_get_info (), NULL);
+  copy->num_frames = tensor_meta->num_frames;
+  copy->frames = g_memdup (tensor_meta->frames,
+      tensor_meta->num_frames * sizeof (GstNvDecTensorFrame));
+
+  return TRUE;
+}
+
+const GstMetaInfo *
+gst_nvdec_tensor_meta_get_info (void)
+{
+  static gsize info = 0;
+
+  if (g_once_init_enter (&info)) {
+    const GstMetaInfo *tmp = gst_meta_register (
+        GST_NVDEC_TENSOR_META_API_TYPE, "GstNvDecTensorMeta",
+        sizeof (GstNvDecTensorMeta), gst_nvdec_tensor_meta_init,
+        gst_nvdec_tensor_meta_free, gst_nvdec_tensor_meta_transform);
+    g_once_init_leave (&info, (gsize) tmp);
+  }
+
+  return (const GstMetaInfo *) info;
+}
+
+static void
+gst_nvtensorbatch_pad_class_init (GstNvTensorBatchPadClass * klass)
+{
+}
+
+static void
+gst_nvtensorbatch_pad_init (GstNvTensorBatchPad * pad)
+{
+  gst_video_info_init (&pad->info);
+  gst_segment_init (&pad->segment, GST_FORMAT_TIME);
+}
+
+static void
+gst_nvtensorbatch_class_init (GstNvTensorBatchClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
+
+  gst_element_class_add_static_pad_template_with_gtype (element_class,
+      &gst_nvtensorbatch_sink_template, GST_TYPE_NVTENSORBATCH_PAD);
+  gst_element_class_add_static_pad_template (element_class,
+      &gst_nvtensorbatch_src_template);
+
+  gst_element_class_set_static_metadata (element_class,
+      "NVDEC tensor batcher", "Filter/Converter/Video/Scaler",
+      "Resizes, converts and normalizes decoded frames of several streams "
+      "into batched tensors on the GPU",
+      "Ericsson AB, http://www.ericsson.com");
+
+  gobject_class->set_property = gst_nvtensorbatch_set_property;
+  gobject_class->get_property = gst_nvtensorbatch_get_property;
+  gobject_class->finalize = gst_nvtensorbatch_finalize;
+  element_class->request_new_pad =
+      GST_DEBUG_FUNCPTR (gst_nvtensorbatch_request_new_pad);
+  element_class->release_pad =
+      GST_DEBUG_FUNCPTR (gst_nvtensorbatch_release_pad);
+  element_class->change_state =
+      GST_DEBUG_FUNCPTR (gst_nvtensorbatch_change_state);
+  element_class->set_context =
+      GST_DEBUG_FUNCPTR (gst_nvtensorbatch_set_context);
+
+  g_object_class_install_property (gobject_class, PROP_CUDA_DEVICE_ID,
+      g_param_spec_int ("cuda-device-id", "CUDA device ID",
+          "Device the batches are made on when no context is set",
+          0, G_MAXINT, DEFAULT_CUDA_DEVICE_ID,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_BATCH_SIZE,
+      g_param_spec_uint ("batch-size", "Batch size",
+          "Frames in each tensor, taken from all streams in the order they "
+          "arrive. Applies when the element goes to READY",
+          1, MAX_BATCH_SIZE, DEFAULT_BATCH_SIZE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_WIDTH,
+      g_param_spec_uint ("width", "Width",
+          "Width every frame is resized to", 1, MAX_SIZE, DEFAULT_WIDTH,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_HEIGHT,
+      g_param_spec_uint ("height", "Height",
+          "Height every frame is resized to", 1, MAX_SIZE, DEFAULT_HEIGHT,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_LAYOUT,
+      g_param_spec_enum ("layout", "Layout", "Order of the tensor's axes",
+          GST_TYPE_NVDEC_TENSOR_LAYOUT, DEFAULT_LAYOUT,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_DATA_TYPE,
+      g_param_spec_enum ("data-type", "Data type",
+          "Type of the tensor's elements",
+          GST_TYPE_NVDEC_TENSOR_TYPE, DEFAULT_TYPE,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_MEAN,
+      g_param_spec_string ("mean", "Mean",
+          "Subtracted from the R,G,B values scaled to 0-1, before they are "
+          "divided by std. Either one value for all channels or three, "
+          "comma separated, for R, G and B", DEFAULT_MEAN,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobject_class, PROP_STD,
+      g_param_spec_string ("std", "Standard deviation",
+          "What the R,G,B values are divided by after the mean is "
+          "subtracted. Either one value for all channels or three, comma "
+          "separated, for R, G and B", DEFAULT_STD,
+          (GParamFlags)(G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+}
+
+static void
+gst_nvtensorbatch_init (GstNvTensorBatch * self)
+{
+  guint i;
+
+  self->srcpad = gst_pad_new_from_static_template
+      (&gst_nvtensorbatch_src_template, "src");
+  gst_pad_set_query_function (self->srcpad,
+      GST_DEBUG_FUNCPTR (gst_nvtensorbatch_src_query));
+  gst_element_add_pad (GST_ELEMENT (self), self->srcpad);
+
+  self->cuda_device_id = DEFAULT_CUDA_DEVICE_ID;
+  self->batch_size = DEFAULT_BATCH_SIZE;
+  self->params.layout = DEFAULT_LAYOUT;
+  self->params.type = DEFAULT_TYPE;
+  self->params.width = DEFAULT_WIDTH;
+  self->params.height = DEFAULT_HEIGHT;
+  for (i = 0; i < 3; i++) {
+    self->params.mean[i] = 0.0f;
+    self->params.std[i] = 1.0f;
+  }
+
+  g_mutex_init (&self->batch_lock);
+  g_mutex_init (&self->push_lock);
+  g_cond_init (&self->flush_cond);
+}
+
+// One value for all channels or one each, std must not be zero
+static gboolean
+parse_channel_values (const gchar * str, float values[3], gboolean nonzero)
+{
+  gchar **tokens = g_strsplit (str ? str : "", ",", -1);
+  guint n = g_strv_length (tokens), i;
+  gdouble value[3];
+  gchar *end;
+  gboolean ret = n == 1 || n == 3;
+
+  for (i = 0; ret && i < n; i++) {
+    value[i] = g_ascii_strtod (tokens[i], &end);
+    ret = end != tokens[i] && (!nonzero || value[i] != 0.0);
+  }
+  g_strfreev (tokens);
+
+  if (ret) {
+    for (i = 0; i < 3; i++)
+      values[i] = (float) value[n == 3 ? i : 0];
+  }
+
+  return ret;
+}
+
+static gchar *
+format_channel_values (const float values[3])
+{
+  return g_strdup_printf ("%g,%g,%g", values[0], values[1], values[2]);
+}
+
+static GstCaps *
+make_src_caps (GstNvTensorBatch * self)
+{
+  GstCaps *caps;
+
+  caps = gst_caps_new_simple (GST_NVDEC_TENSOR_CAPS_NAME,
+      "format", G_TYPE_STRING,
+      self->params.type == GST_NVDEC_TENSOR_TYPE_FLOAT16 ? "F16" : "F32",
+      "layout", G_TYPE_STRING,
+      self->params.layout == GST_NVDEC_TENSOR_LAYOUT_NHWC ? "NHWC" : "NCHW",
+      "batch", G_TYPE_INT, (gint) self->batch_size,
+      "channels", G_TYPE_INT, 3,
+      "width", G_TYPE_INT, (gint) self->params.width,
+      "height", G_TYPE_INT, (gint) self->params.height, NULL);
+  gst_caps_set_features (caps, 0,
+      gst_caps_features_new (GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY, NULL));
+
+  return caps;
+}
+
+static gsize
+get_tensor_size (GstNvTensorBatch * self)
+{
+  return (gsize) self->batch_size * 3 * self->params.width
+      * self->params.height
+      * (self->params.type == GST_NVDEC_TENSOR_TYPE_FLOAT16 ? 2 : 4);
+}
+
+// Same codes the parser reports, so the matrix
+// is the one nvdec would use for this stream
+static guint
+get_matrix_coefficients (GstVideoColorMatrix matrix)
+{
+  switch (matrix) {
+    case GST_VIDEO_COLOR_MATRIX_RGB:
+      return 0;
+    case GST_VIDEO_COLOR_MATRIX_BT709:
+      return 1;
+    case GST_VIDEO_COLOR_MATRIX_FCC:
+      return 4;
+    case GST_VIDEO_COLOR_MATRIX_BT601:
+      return 6;
+    case GST_VIDEO_COLOR_MATRIX_SMPTE240M:
+      return 7;
+    case GST_VIDEO_COLOR_MATRIX_BT2020:
+      return 9;
+    default:
+      return 2;
+  }
+}
+
+// A context shared with the rest of the pipeline if there is one on
+// our device, otherwise the process-wide one. Upstream nvdecs get
+// it through the context query so their frames are in it
+static gboolean
+gst_nvtensorbatch_start (GstNvTensorBatch * self)
+{
+  GstElement *element = GST_ELEMENT (self);
+  GstAllocator *allocator;
+  GstAllocationParams params;
+  GstStructure *config;
+  GstCaps *caps;
+  CUdevice device;
+
+  if (!gst_nvdec_cuda_context_find (element, self->cuda_device_id,
+          &self->cuda_context)) {
+    if (!cuda_OK (CuInit (0))
+        || !cuda_OK (CuDeviceGet (&device, self->cuda_device_id))) {
+      GST_ERROR_OBJECT (self, "failed to get device %d",
+          self->cuda_device_id);
+      return FALSE;
+    }
+
+    self->cuda_context = gst_nvdec_cuda_context_get (device);
+    if (!self->cuda_context) {
+      GST_ERROR_OBJECT (self, "failed to get a CUDA context for device %d",
+          device);
+      return FALSE;
+    }
+    gst_nvdec_cuda_context_propagate (element, self->cuda_context);
+  }
+
+  if (!cuda_OK (CuCtxPushCurrent (self->cuda_context->context))) {
+    GST_ERROR_OBJECT (self, "failed to push CUDA context");
+    return FALSE;
+  }
+  if (!cuda_OK (CuStreamCreate (&self->stream, CU_STREAM_DEFAULT)))
+    GST_ERROR_OBJECT (self, "failed to create the CUDA stream");
+  CuCtxPopCurrent (NULL);
+  if (!self->stream)
+    return FALSE;
+
+  // Batches are handed out of device memory and come back once
+  // downstream is done with them, so steady state doesn't allocate
+  self->pool = gst_buffer_pool_new ();
+  config = gst_buffer_pool_get_config (self->pool);
+  caps = make_src_caps (self);
+  gst_buffer_pool_config_set_params (config, caps, get_tensor_size (self),
+      0, 0);
+  gst_caps_unref (caps);
+  allocator = gst_nvdec_cuda_allocator_new (self->cuda_context);
+  gst_allocation_params_init (&params);
+  gst_buffer_pool_config_set_allocator (config, allocator, &params);
+  gst_object_unref (allocator);
+  if (!gst_buffer_pool_set_config (self->pool, config)
+      || !gst_buffer_pool_set_active (self->pool, TRUE)) {
+    GST_ERROR_OBJECT (self, "failed to set up the tensor pool");
+    return FALSE;
+  }
+
+  self->frames = g_new0 (GstBuffer *, self->batch_size);
+  self->frame_pads = g_new0 (GstNvTensorBatchPad *, self->batch_size);
+  self->frame_sources = g_new0 (GstNvDecTensorSource, self->batch_size);
+  self->sources = g_new0 (GstNvDecTensorSource, self->batch_size);
+  self->num_frames = 0;
+
+  GST_INFO_OBJECT (self, "batches of %u %ux%u frames on device %d",
+      self->batch_size, self->params.width, self->params.height,
+      self->cuda_context->device);
+
+  return TRUE;
+}
+
+static void
+clear_frames (GstNvTensorBatch * self)
+{
+  guint i;
+
+  for (i = 0; i < self->num_frames; i++) {
+    gst_buffer_unref (self->frames[i]);
+    gst_object_unref (self->frame_pads[i]);
+  }
+  self->num_frames = 0;
+}
+
+static void
+gst_nvtensorbatch_stop (GstNvTensorBatch * self)
+{
+  GstNvDecCudaContext *cuda_context;
+
+  g_mutex_lock (&self->batch_lock);
+  if (self->frames)
+    clear_frames (self);
+  g_clear_pointer (&self->frames, g_free);
+  g_clear_pointer (&self->frame_pads, g_free);
+  g_clear_pointer (&self->frame_sources, g_free);
+  g_clear_pointer (&self->sources, g_free);
+  g_mutex_unlock (&self->batch_lock);
+
+  if (self->pool) {
+    gst_buffer_pool_set_active (self->pool, FALSE);
+    gst_object_unref (self->pool);
+    self->pool = NULL;
+  }
+
+  if (self->stream) {
+    CuCtxPushCurrent (self->cuda_context->context);
+    if (!cuda_OK (CuStreamDestroy (self->stream)))
+      GST_ERROR_OBJECT (self, "failed to destroy the CUDA stream");
+    CuCtxPopCurrent (NULL);
+    self->stream = NULL;
+  }
+
+  GST_OBJECT_LOCK (self);
+  cuda_context = self->cuda_context;
+  self->cuda_context = NULL;
+  GST_OBJECT_UNLOCK (self);
+  if (cuda_context)
+    g_object_unref (cuda_context);
+}
+
+static GstStateChangeReturn
+gst_nvtensorbatch_change_state (GstElement * element,
+    GstStateChange transition)
+{
+  GstNvTensorBatch *self = GST_NVTENSORBATCH (element);
+  GstStateChangeReturn ret;
+  GList *l;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_NULL_TO_READY:
+      if (!gst_nvtensorbatch_start (self)) {
+        gst_nvtensorbatch_stop (self);
+        return GST_STATE_CHANGE_FAILURE;
+      }
+      break;
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      self->need_stream_start = TRUE;
+      self->need_caps = TRUE;
+      self->need_segment = TRUE;
+      self->sent_eos = FALSE;
+      break;
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      // Deactivating the sink pads takes their stream locks,
+      // streams waiting for the others to flush have to go on
+      g_mutex_lock (&self->batch_lock);
+      GST_OBJECT_LOCK (self);
+      for (l = element->sinkpads; l; l = l->next)
+        GST_NVTENSORBATCH_PAD (l->data)->flushing = FALSE;
+      GST_OBJECT_UNLOCK (self);
+      self->flushing = FALSE;
+      g_cond_broadcast (&self->flush_cond);
+      g_mutex_unlock (&self->batch_lock);
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (gst_nvtensorbatch_parent_class)->change_state
+      (element, transition);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      g_mutex_lock (&self->batch_lock);
+      clear_frames (self);
+      g_mutex_unlock (&self->batch_lock);
+      break;
+    case GST_STATE_CHANGE_READY_TO_NULL:
+      gst_nvtensorbatch_stop (self);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
+// Called with push_lock held
+static void
+push_sticky_events (GstNvTensorBatch * self)
+{
+  GstSegment segment;
+  gchar *stream_id;
+
+  if (self->need_stream_start) {
+    stream_id = gst_pad_create_stream_id (self->srcpad, GST_ELEMENT (self),
+        NULL);
+    gst_pad_push_event (self->srcpad, gst_event_new_stream_start (stream_id));
+    g_free (stream_id);
+    self->need_stream_start = FALSE;
+  }
+
+  if (self->need_caps) {
+    gst_pad_push_event (self->srcpad, gst_event_new_caps (make_src_caps
+            (self)));
+    self->need_caps = FALSE;
+  }
+
+  // Timestamps are running times, the streams' segments differ
+  if (self->need_segment) {
+    gst_segment_init (&segment, GST_FORMAT_TIME);
+    gst_pad_push_event (self->srcpad, gst_event_new_segment (&segment));
+    self->need_segment = FALSE;
+  }
+}
+
+// Where the picture is in the frame's device memory, FALSE if it
+// isn't there. Called with batch_lock held when the frame is queued,
+// the pad's info may have changed by the time the batch goes out
+static gboolean
+get_source (GstNvTensorBatchPad * pad, GstBuffer * buffer,
+    GstNvDecTensorSource * source)
+{
+  GstMemory *mem = gst_buffer_peek_memory (buffer, 0);
+  GstVideoMeta *vmeta = gst_buffer_get_video_meta (buffer);
+  CUdeviceptr data;
+
+  if (gst_buffer_n_memory (buffer) != 1 || !gst_is_nvdec_cuda_memory (mem))
+    return FALSE;
+
+  data = ((GstNvDecCudaMemory *) mem)->data + mem->offset;
+  source->width = GST_VIDEO_INFO_WIDTH (&pad->info);
+  source->height = GST_VIDEO_INFO_HEIGHT (&pad->info);
+  if (vmeta) {
+    source->y = data + vmeta->offset[0];
+    source->uv = data + vmeta->offset[1];
+    source->y_pitch = vmeta->stride[0];
+    source->uv_pitch = vmeta->stride[1];
+  } else {
+    source->y = data + GST_VIDEO_INFO_PLANE_OFFSET (&pad->info, 0);
+    source->uv = data + GST_VIDEO_INFO_PLANE_OFFSET (&pad->info, 1);
+    source->y_pitch = GST_VIDEO_INFO_PLANE_STRIDE (&pad->info, 0);
+    source->uv_pitch = GST_VIDEO_INFO_PLANE_STRIDE (&pad->info, 1);
+  }
+  source->matrix = pad->matrix;
+
+  return TRUE;
+}
+
+// Called with batch_lock held, which is released once the frames are
+// taken. The next batch fills while this one is converted, only the
+// next push waits for this one
+static GstFlowReturn
+push_batch (GstNvTensorBatch * self, gboolean eos)
+{
+  GstBuffer *frames[MAX_BATCH_SIZE];
+  GstNvDecTensorFrame *meta_frames = NULL;
+  GstNvDecTensorMeta *meta;
+  GstNvTensorBatchPad *pad;
+  GstBuffer *outbuf = NULL;
+  GstMemory *mem;
+  GstClockTime first_pts = GST_CLOCK_TIME_NONE;
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint num_frames, i;
+
+  g_mutex_lock (&self->push_lock);
+
+  num_frames = self->num_frames;
+  if (num_frames)
+    meta_frames = g_new (GstNvDecTensorFrame, num_frames);
+  for (i = 0; i < num_frames; i++) {
+    pad = self->frame_pads[i];
+    frames[i] = self->frames[i];
+    meta_frames[i].stream_id = pad->stream_id;
+    meta_frames[i].pts = GST_BUFFER_PTS (frames[i]);
+    meta_frames[i].duration = GST_BUFFER_DURATION (frames[i]);
+    if (i == 0)
+      first_pts = gst_segment_to_running_time (&pad->segment,
+          GST_FORMAT_TIME, GST_BUFFER_PTS (frames[i]));
+
+    // Slot i is frame i, a picture that can't be read
+    // has a width of 0 and leaves its slot zero
+    self->sources[i] = self->frame_sources[i];
+    meta_frames[i].width = self->frame_sources[i].width;
+    meta_frames[i].height = self->frame_sources[i].height;
+    gst_object_unref (pad);
+  }
+  self->num_frames = 0;
+  g_mutex_unlock (&self->batch_lock);
+
+  if (num_frames) {
+    ret = gst_buffer_pool_acquire_buffer (self->pool, &outbuf, NULL);
+    if (ret != GST_FLOW_OK) {
+      GST_DEBUG_OBJECT (self, "no tensor buffer: %s",
+          gst_flow_get_name (ret));
+      goto done;
+    }
+
+    mem = gst_buffer_peek_memory (outbuf, 0);
+    if (!cuda_OK (CuCtxPushCurrent (self->cuda_context->context))) {
+      ret = GST_FLOW_ERROR;
+      goto done;
+    }
+    if (!gst_nvdec_convert_tensor (self->cuda_context, self->sources,
+            num_frames, self->batch_size, &self->params,
+            ((GstNvDecCudaMemory *) mem)->data, self->stream)
+        || !cuda_OK (CuStreamSynchronize (self->stream))) {
+      GST_ELEMENT_ERROR (self, STREAM, FAILED, (NULL),
+          ("failed to convert the batch"));
+      ret = GST_FLOW_ERROR;
+    }
+    CuCtxPopCurrent (NULL);
+    if (ret != GST_FLOW_OK)
+      goto done;
+
+    // The frames' surfaces go back to the decoders now
+    for (i = 0; i < num_frames; i++) {
+      gst_buffer_unref (frames[i]);
+      frames[i] = NULL;
+    }
+
+    meta = (GstNvDecTensorMeta *) gst_buffer_add_meta (outbuf,
+        gst_nvdec_tensor_meta_get_info (), NULL);
+    meta->num_frames = num_frames;
+    meta->frames = meta_frames;
+    meta_frames = NULL;
+    GST_BUFFER_PTS (outbuf) = first_pts;
+
+    push_sticky_events (self);
+    GST_LOG_OBJECT (self, "pushing batch of %u at %" GST_TIME_FORMAT,
+        num_frames, GST_TIME_ARGS (first_pts));
+    ret = gst_pad_push (self->srcpad, outbuf);
+    outbuf = NULL;
+  }
+
+  if (eos && !self->sent_eos) {
+    push_sticky_events (self);
+    gst_pad_push_event (self->srcpad, gst_event_new_eos ());
+    self->sent_eos = TRUE;
+  }
+
+done:
+  for (i = 0; i < num_frames; i++) {
+    if (frames[i])
+      gst_buffer_unref (frames[i]);
+  }
+  if (outbuf)
+    gst_buffer_unref (outbuf);
+  g_free (meta_frames);
+  g_mutex_unlock (&self->push_lock);
+
+  return ret;
+}
+
+// Called with batch_lock held
+static gboolean
+all_pads_eos (GstNvTensorBatch * self)
+{
+  GList *l;
+  gboolean ret = TRUE, any = FALSE;
+
+  GST_OBJECT_LOCK (self);
+  for (l = GST_ELEMENT (self)->sinkpads; l && ret; l = l->next) {
+    any = TRUE;
+    ret = GST_NVTENSORBATCH_PAD (l->data)->eos;
+  }
+  GST_OBJECT_UNLOCK (self);
+
+  return any && ret;
+}
+
+// Called with batch_lock held
+static gboolean
+all_pads_flushing (GstNvTensorBatch * self)
+{
+  GList *l;
+  gboolean ret = TRUE, any = FALSE;
+
+  GST_OBJECT_LOCK (self);
+  for (l = GST_ELEMENT (self)->sinkpads; l && ret; l = l->next) {
+    any = TRUE;
+    ret = GST_NVTENSORBATCH_PAD (l->data)->flushing;
+  }
+  GST_OBJECT_UNLOCK (self);
+
+  return any && ret;
+}
+
+// Called with batch_lock held
+static gboolean
+any_pad_flushing (GstNvTensorBatch * self)
+{
+  GList *l;
+  gboolean ret = FALSE;
+
+  GST_OBJECT_LOCK (self);
+  for (l = GST_ELEMENT (self)->sinkpads; l && !ret; l = l->next)
+    ret = GST_NVTENSORBATCH_PAD (l->data)->flushing;
+  GST_OBJECT_UNLOCK (self);
+
+  return ret;
+}
+
+// Drops what a flushed stream has in the next batch
+static void
+drop_pad_frames (GstNvTensorBatch * self, GstNvTensorBatchPad * pad)
+{
+  guint i, n = 0;
+
+  for (i = 0; i < self->num_frames; i++) {
+    if (self->frame_pads[i] == pad) {
+      gst_buffer_unref (self->frames[i]);
+      gst_object_unref (self->frame_pads[i]);
+    } else {
+      self->frames[n] = self->frames[i];
+      self->frame_pads[n] = self->frame_pads[i];
+      self->frame_sources[n] = self->frame_sources[i];
+      n++;
+    }
+  }
+  self->num_frames = n;
+}
+
+static GstFlowReturn
+gst_nvtensorbatch_chain (GstPad * pad, GstObject * parent, GstBuffer * buffer)
+{
+  GstNvTensorBatch *self = GST_NVTENSORBATCH (parent);
+  GstNvTensorBatchPad *bpad = GST_NVTENSORBATCH_PAD (pad);
+
+  g_mutex_lock (&self->batch_lock);
+  // Downstream is flushing until the other streams are done too
+  while (self->flushing && !bpad->flushing)
+    g_cond_wait (&self->flush_cond, &self->batch_lock);
+  if (bpad->flushing) {
+    g_mutex_unlock (&self->batch_lock);
+    gst_buffer_unref (buffer);
+    return GST_FLOW_FLUSHING;
+  }
+  if (!bpad->have_info || !self->frames) {
+    g_mutex_unlock (&self->batch_lock);
+    gst_buffer_unref (buffer);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+
+  self->frames[self->num_frames] = buffer;
+  self->frame_pads[self->num_frames] = gst_object_ref (bpad);
+  if (!get_source (bpad, buffer, &self->frame_sources[self->num_frames])) {
+    GST_WARNING_OBJECT (bpad, "frame isn't in CUDA memory, left out");
+    self->frame_sources[self->num_frames].width = 0;
+    self->frame_sources[self->num_frames].height = 0;
+  }
+  self->num_frames++;
+  if (self->num_frames < self->batch_size) {
+    g_mutex_unlock (&self->batch_lock);
+    return GST_FLOW_OK;
+  }
+
+  return push_batch (self, FALSE);
+}
+
+static gboolean
+gst_nvtensorbatch_sink_event (GstPad * pad, GstObject * parent,
+    GstEvent * event)
+{
+  GstNvTensorBatch *self = GST_NVTENSORBATCH (parent);
+  GstNvTensorBatchPad *bpad = GST_NVTENSORBATCH_PAD (pad);
+  GstVideoInfo info;
+  GstCaps *caps;
+  gboolean ret = TRUE, forward;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_CAPS:
+      gst_event_parse_caps (event, &caps);
+      ret = gst_video_info_from_caps (&info, caps);
+      if (ret) {
+        g_mutex_lock (&self->batch_lock);
+        bpad->info = info;
+        bpad->have_info = TRUE;
+        gst_nvdec_color_matrix_init (&bpad->matrix,
+            get_matrix_coefficients (info.colorimetry.matrix),
+            info.colorimetry.range == GST_VIDEO_COLOR_RANGE_0_255,
+            GST_VIDEO_INFO_HEIGHT (&info));
+        g_mutex_unlock (&self->batch_lock);
+      }
+      break;
+    case GST_EVENT_SEGMENT:
+      g_mutex_lock (&self->batch_lock);
+      gst_event_copy_segment (event, &bpad->segment);
+      g_mutex_unlock (&self->batch_lock);
+      ret = bpad->segment.format == GST_FORMAT_TIME;
+      break;
+    case GST_EVENT_EOS:
+      // The last batch goes out once every stream has ended
+      g_mutex_lock (&self->batch_lock);
+      bpad->eos = TRUE;
+      if (all_pads_eos (self))
+        push_batch (self, TRUE);
+      else
+        g_mutex_unlock (&self->batch_lock);
+      break;
+    case GST_EVENT_FLUSH_START:
+      // Like aggregator, downstream is flushed once every stream is.
+      // That's what returns a push waiting in a paused sink's
+      // preroll, which holds push_lock until then
+      g_mutex_lock (&self->batch_lock);
+      bpad->flushing = TRUE;
+      forward = !self->flushing && all_pads_flushing (self);
+      if (forward)
+        self->flushing = TRUE;
+      g_cond_broadcast (&self->flush_cond);
+      g_mutex_unlock (&self->batch_lock);
+      if (forward)
+        gst_pad_push_event (self->srcpad, gst_event_ref (event));
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      // Only this stream starts over, downstream only once
+      // the last of the flushed streams is done
+      g_mutex_lock (&self->batch_lock);
+      drop_pad_frames (self, bpad);
+      bpad->eos = FALSE;
+      bpad->flushing = FALSE;
+      gst_segment_init (&bpad->segment, GST_FORMAT_TIME);
+      forward = self->flushing && !any_pad_flushing (self);
+      g_mutex_unlock (&self->batch_lock);
+      if (forward) {
+        g_mutex_lock (&self->push_lock);
+        gst_pad_push_event (self->srcpad, gst_event_ref (event));
+        self->need_segment = TRUE;
+        self->sent_eos = FALSE;
+        g_mutex_unlock (&self->push_lock);
+
+        g_mutex_lock (&self->batch_lock);
+        self->flushing = FALSE;
+        g_cond_broadcast (&self->flush_cond);
+        g_mutex_unlock (&self->batch_lock);
+      }
+      break;
+    case GST_EVENT_STREAM_START:
+    case GST_EVENT_TAG:
+    case GST_EVENT_GAP:
+      break;
+    default:
+      return gst_pad_event_default (pad, parent, event);
+  }
+
+  gst_event_unref (event);
+  return ret;
+}
+
+static gboolean
+gst_nvtensorbatch_sink_query (GstPad * pad, GstObject * parent,
+    GstQuery * query)
+{
+  GstNvTensorBatch *self = GST_NVTENSORBATCH (parent);
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CONTEXT:
+      if (gst_nvdec_cuda_context_handle_context_query (GST_ELEMENT (self),
+              query, self->cuda_context))
+        return TRUE;
+      break;
+    // The decoders allocate their own device memory
+    case GST_QUERY_ALLOCATION:
+      return FALSE;
+    default:
+      break;
+  }
+
+  return gst_pad_query_default (pad, parent, query);
+}
+
+static gboolean
+gst_nvtensorbatch_src_query (GstPad * pad, GstObject * parent,
+    GstQuery * query)
+{
+  GstNvTensorBatch *self = GST_NVTENSORBATCH (parent);
+  GstCaps *caps, *filter;
+
+  switch (GST_QUERY_TYPE (query)) {
+    case GST_QUERY_CONTEXT:
+      if (gst_nvdec_cuda_context_handle_context_query (GST_ELEMENT (self),
+              query, self->cuda_context))
+        return TRUE;
+      break;
+    case GST_QUERY_CAPS:
+      gst_query_parse_caps (query, &filter);
+      caps = make_src_caps (self);
+      if (filter) {
+        GstCaps *tmp = gst_caps_intersect_full (filter, caps,
+            GST_CAPS_INTERSECT_FIRST);
+        gst_caps_unref (caps);
+        caps = tmp;
+      }
+      gst_query_set_caps_result (query, caps);
+      gst_caps_unref (caps);
+      return TRUE;
+    default:
+      break;
+  }
+
+  return gst_pad_query_default (pad, parent, query);
+}
+
+static GstPad *
+gst_nvtensorbatch_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * name, const GstCaps * caps)
+{
+  GstNvTensorBatch *self = GST_NVTENSORBATCH (element);
+  GstNvTensorBatchPad *pad;
+  gchar *pad_name;
+  guint id;
+
+  GST_OBJECT_LOCK (self);
+  if (!name || sscanf (name, "sink_%u", &id) != 1)
+    id = self->next_pad_id;
+  self->next_pad_id = MAX (self->next_pad_id, id + 1);
+  GST_OBJECT_UNLOCK (self);
+
+  pad_name = g_strdup_printf ("sink_%u", id);
+  pad = g_object_new (GST_TYPE_NVTENSORBATCH_PAD, "name", pad_name,
+      "direction", GST_PAD_SINK, "template", templ, NULL);
+  g_free (pad_name);
+  pad->stream_id = id;
+
+  gst_pad_set_chain_function (GST_PAD (pad),
+      GST_DEBUG_FUNCPTR (gst_nvtensorbatch_chain));
+  gst_pad_set_event_function (GST_PAD (pad),
+      GST_DEBUG_FUNCPTR (gst_nvtensorbatch_sink_event));
+  gst_pad_set_query_function (GST_PAD (pad),
+      GST_DEBUG_FUNCPTR (gst_nvtensorbatch_sink_query));
+
+  if (!gst_element_add_pad (element, GST_PAD (pad))) {
+    GST_WARNING_OBJECT (self, "pad sink_%u already exists", id);
+    return NULL;
+  }
+
+  return GST_PAD (pad);
+}
+
+static void
+gst_nvtensorbatch_release_pad (GstElement * element, GstPad * pad)
+{
+  GstNvTensorBatch *self = GST_NVTENSORBATCH (element);
+
+  g_mutex_lock (&self->batch_lock);
+  drop_pad_frames (self, GST_NVTENSORBATCH_PAD (pad));
+  g_mutex_unlock (&self->batch_lock);
+
+  gst_element_remove_pad (element, pad);
+
+  // The streams left may all have ended already
+  g_mutex_lock (&self->batch_lock);
+  if (self->frames && all_pads_eos (self))
+    push_batch (self, TRUE);
+  else
+    g_mutex_unlock (&self->batch_lock);
+}
+
+static void
+gst_nvtensorbatch_set_context (GstElement * element, GstContext * context)
+{
+  GstNvTensorBatch *self = GST_NVTENSORBATCH (element);
+
+  // Only taken between runs
+  if (!self->stream)
+    gst_nvdec_cuda_context_handle_set_context (element, context,
+        self->cuda_device_id, &self->cuda_context);
+
+  GST_ELEMENT_CLASS (gst_nvtensorbatch_parent_class)->set_context (element,
+      context);
+}
+
+static void
+gst_nvtensorbatch_set_property (GObject * object, guint prop_id,
+    const GValue * value, GParamSpec * pspec)
+{
+    GstNvTensorBatch *self = GST_NVTENSORBATCH (object);
+
+    // The pool and caps are made for these when the element starts
+    if (self->pool && prop_id != PROP_MEAN && prop_id != PROP_STD) {
+        GST_WARNING_OBJECT (self, "can't change %s while running",
+            pspec->name);
+        return;
+    }
+
+    switch (prop_id) {
+    case PROP_CUDA_DEVICE_ID:
+        self->cuda_device_id = g_value_get_int (value);
+        break;
+    case PROP_BATCH_SIZE:
+        self->batch_size = g_value_get_uint (value);
+        break;
+    case PROP_WIDTH:
+        self->params.width = g_value_get_uint (value);
+        break;
+    case PROP_HEIGHT:
+        self->params.height = g_value_get_uint (value);
+        break;
+    case PROP_LAYOUT:
+        self->params.layout = g_value_get_enum (value);
+        break;
+    case PROP_DATA_TYPE:
+        self->params.type = g_value_get_enum (value);
+        break;
+    // Taken by the next batch
+    case PROP_MEAN:
+        g_mutex_lock (&self->push_lock);
+        if (!parse_channel_values (g_value_get_string (value),
+                self->params.mean, FALSE))
+            GST_WARNING_OBJECT (self, "invalid mean %s",
+                g_value_get_string (value));
+        g_mutex_unlock (&self->push_lock);
+        break;
+    case PROP_STD:
+        g_mutex_lock (&self->push_lock);
+        if (!parse_channel_values (g_value_get_string (value),
+                self->params.std, TRUE))
+            GST_WARNING_OBJECT (self, "invalid std %s",
+                g_value_get_string (value));
+        g_mutex_unlock (&self->push_lock);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+gst_nvtensorbatch_get_property (GObject * object, guint prop_id,
+    GValue * value, GParamSpec * pspec)
+{
+    GstNvTensorBatch *self = GST_NVTENSORBATCH (object);
+
+    switch (prop_id) {
+    case PROP_CUDA_DEVICE_ID:
+        g_value_set_int (value, self->cuda_device_id);
+        break;
+    case PROP_BATCH_SIZE:
+        g_value_set_uint (value, self->batch_size);
+        break;
+    case PROP_WIDTH:
+        g_value_set_uint (value, self->params.width);
+        break;
+    case PROP_HEIGHT:
+        g_value_set_uint (value, self->params.height);
+        break;
+    case PROP_LAYOUT:
+        g_value_set_enum (value, self->params.layout);
+        break;
+    case PROP_DATA_TYPE:
+        g_value_set_enum (value, self->params.type);
+        break;
+    case PROP_MEAN:
+        g_value_take_string (value, format_channel_values (self->params.mean));
+        break;
+    case PROP_STD:
+        g_value_take_string (value, format_channel_values (self->params.std));
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+        break;
+    }
+}
+
+static void
+gst_nvtensorbatch_finalize (GObject * object)
+{
+  GstNvTensorBatch *self = GST_NVTENSORBATCH (object);
+
+  gst_nvtensorbatch_stop (self);
+  g_mutex_clear (&self->batch_lock);
+  g_mutex_clear (&self->push_lock);
+  g_cond_clear (&self->flush_cond);
+
+  G_OBJECT_CLASS (gst_nvtensorbatch_parent_class)->finalize (object);
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GST_NVTENSORBATCH_H__
+#define __GST_NVTENSORBATCH_H__
+
+#include <gst/gst.h>
+#include <gst/video/video.h>
+#include "gstnvdecloader.h"
+#include "gstcudacontext.h"
+#include "gstnvdecconvert.h"
+
+G_BEGIN_DECLS
+
+#define GST_TYPE_NVTENSORBATCH          (gst_nvtensorbatch_get_type())
+#define GST_NVTENSORBATCH(obj)          (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_NVTENSORBATCH, GstNvTensorBatch))
+#define GST_NVTENSORBATCH_CLASS(klass)  (G_TYPE_CHECK_CLASS_CAST((klass), GST_TYPE_NVTENSORBATCH, GstNvTensorBatchClass))
+#define GST_IS_NVTENSORBATCH(obj)       (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_NVTENSORBATCH))
+
+#define GST_TYPE_NVTENSORBATCH_PAD      (gst_nvtensorbatch_pad_get_type())
+#define GST_NVTENSORBATCH_PAD(obj)      (G_TYPE_CHECK_INSTANCE_CAST((obj), GST_TYPE_NVTENSORBATCH_PAD, GstNvTensorBatchPad))
+
+#define GST_TYPE_NVDEC_TENSOR_LAYOUT (gst_nvdec_tensor_layout_get_type())
+GType gst_nvdec_tensor_layout_get_type (void);
+#define GST_TYPE_NVDEC_TENSOR_TYPE (gst_nvdec_tensor_type_get_type())
+GType gst_nvdec_tensor_type_get_type (void);
+
+// Caps of the batches, the buffers hold device memory
+#define GST_NVDEC_TENSOR_CAPS_NAME "application/x-nvdec-tensor"
+
+typedef struct _GstNvTensorBatch GstNvTensorBatch;
+typedef struct _GstNvTensorBatchClass GstNvTensorBatchClass;
+typedef struct _GstNvTensorBatchPad GstNvTensorBatchPad;
+typedef struct _GstNvTensorBatchPadClass GstNvTensorBatchPadClass;
+typedef struct _GstNvDecTensorFrame GstNvDecTensorFrame;
+typedef struct _GstNvDecTensorMeta GstNvDecTensorMeta;
+
+// Where a picture of the batch came from
+struct _GstNvDecTensorFrame
+{
+  // Number of the sink pad
+  guint stream_id;
+  GstClockTime pts;
+  GstClockTime duration;
+  // Of the picture before it was resized
+  guint width;
+  guint height;
+};
+
+// On every batch, frames[i] is what's in slot i of the tensor.
+// Slots from num_frames on are zero, only the last batch
+// before EOS can be partial
+struct _GstNvDecTensorMeta
+{
+  GstMeta meta;
+
+  guint num_frames;
+  GstNvDecTensorFrame *frames;
+};
+
+GType gst_nvdec_tensor_meta_api_get_type (void);
+const GstMetaInfo * gst_nvdec_tensor_meta_get_info (void);
+#define GST_NVDEC_TENSOR_META_API_TYPE (gst_nvdec_tensor_meta_api_get_type())
+#define gst_buffer_get_nvdec_tensor_meta(b) \
+    ((GstNvDecTensorMeta *) gst_buffer_get_meta ((b), GST_NVDEC_TENSOR_META_API_TYPE))
+
+// A stream feeding the batches, NV12 in device memory
+struct _GstNvTensorBatchPad
+{
+  GstPad parent;
+
+  guint stream_id;
+  // Everything below is under the element's batch_lock
+  GstVideoInfo info;
+  gboolean have_info;
+  GstNvDecColorMatrix matrix;
+  GstSegment segment;
+  gboolean eos;
+  // Between FLUSH_START and FLUSH_STOP
+  gboolean flushing;
+};
+
+struct _GstNvTensorBatchPadClass
+{
+  GstPadClass parent_class;
+};
+
+// Collects frames from any number of sink_%u pads, in the order
+// they arrive, and converts each batch into one tensor with a
+// single pass on the GPU
+struct _GstNvTensorBatch
+{
+  GstElement parent;
+
+  GstPad *srcpad;
+
+  gint cuda_device_id;
+  guint batch_size;
+  GstNvDecTensorParams params;
+
+  GstNvDecCudaContext *cuda_context;
+  CUstream stream;
+  GstBufferPool *pool;
+
+  // Frames of the next batch, their pads and where their pictures
+  // are, taken with the caps they came with. Under batch_lock
+  GMutex batch_lock;
+  GstBuffer **frames;
+  GstNvTensorBatchPad **frame_pads;
+  GstNvDecTensorSource *frame_sources;
+  guint num_frames;
+  guint next_pad_id;
+  // Every stream started flushing and downstream was flushed with
+  // them. Streams done flushing wait on flush_cond until the
+  // rest are, so nothing is pushed into a flushing src pad
+  gboolean flushing;
+  GCond flush_cond;
+  // Reused for every batch, only used with push_lock held
+  GstNvDecTensorSource *sources;
+
+  // Batches are converted and pushed one at a time, in order
+  GMutex push_lock;
+  gboolean need_stream_start;
+  gboolean need_caps;
+  gboolean need_segment;
+  gboolean sent_eos;
+};
+
+struct _GstNvTensorBatchClass
+{
+  GstElementClass parent_class;
+};
+
+GType gst_nvtensorbatch_get_type (void);
+GType gst_nvtensorbatch_pad_get_type (void);
+
+G_END_DECLS
+
+#endif /* __GST_NVTENSORBATCH_H__ */
@@ -0,0 +1,644 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Decodes the same streams as byte-stream and as avc or hvc1, with the
+// parameter sets in codec_data and NAL lengths in front of the NALs,
+// and checks the frames come out the same. Truncated codec_data has
+// to fail negotiation. A NAL length running past the end of its
+// frame drops only what's past it, like a byte-stream frame without
+// those bytes. Runs on the stand-in backend
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <gst/app/gstapp.h>
+#include <string.h>
+
+#define WIDTH 320
+#define HEIGHT 180
+#define NUM_FRAMES 8
+#define FRAME_DURATION (GST_SECOND / 30)
+// Filler standing in for the coded picture, 0x55
+// never makes a start code
+#define SLICE_SIZE 64
+// Frames that get a truncated NAL after their slice
+#define TRUNCATED_LENGTH_FRAME 3
+#define TRUNCATED_PREFIX_FRAME 5
+
+GST_PLUGIN_STATIC_DECLARE (nvidia);
+
+typedef enum
+{
+  CODEC_H264,
+  CODEC_H265
+} Codec;
+
+typedef struct
+{
+  GByteArray *bytes;
+  guint value;
+  guint num_bits;
+} BitWriter;
+
+// The NALs without start codes or lengths
+typedef struct
+{
+  Codec codec;
+  // VPS, SPS and PPS, or SPS and PPS
+  GPtrArray *parameter_sets;
+  GPtrArray *slices;
+} Stream;
+
+typedef struct
+{
+  const gchar *name;
+  Codec codec;
+  guint nal_length_size;
+} Case;
+
+static void
+put_bits (BitWriter * writer, guint value, guint n)
+{
+  while (n--) {
+    writer->value = (writer->value << 1) | ((value >> n) & 1);
+    if (++writer->num_bits == 8) {
+      guint8 byte = writer->value;
+
+      g_byte_array_append (writer->bytes, &byte, 1);
+      writer->value = 0;
+      writer->num_bits = 0;
+    }
+  }
+}
+
+static void
+put_ue (BitWriter * writer, guint value)
+{
+  guint len = g_bit_storage (value + 1);
+
+  put_bits (writer, 0, len - 1);
+  put_bits (writer, value + 1, len);
+}
+
+// Adds the trailing bits and the emulation prevention bytes, then
+// filler bytes of the slice data
+static GBytes *
+finish_nal (BitWriter * writer, gsize filler)
+{
+  static const guint8 escape = 3;
+  GByteArray *nal = g_byte_array_new ();
+  guint i, zeros = 0;
+  gsize start;
+
+  put_bits (writer, 1, 1);
+  if (writer->num_bits)
+    put_bits (writer, 0, 8 - writer->num_bits);
+  for (i = 0; i < writer->bytes->len; i++) {
+    if (zeros >= 2 && writer->bytes->data[i] <= 3) {
+      g_byte_array_append (nal, &escape, 1);
+      zeros = 0;
+    }
+    zeros = writer->bytes->data[i] ? 0 : zeros + 1;
+    g_byte_array_append (nal, &writer->bytes->data[i], 1);
+  }
+  g_byte_array_set_size (writer->bytes, 0);
+
+  start = nal->len;
+  g_byte_array_set_size (nal, start + filler);
+  memset (nal->data + start, 0x55, filler);
+
+  return g_byte_array_free_to_bytes (nal);
+}
+
+// Only as much of the SPS as the stand-in's parser reads,
+// High profile at level 4.1 with the height cropped
+static GBytes *
+make_h264_sps (BitWriter * w)
+{
+  guint padded_height = GST_ROUND_UP_16 (HEIGHT);
+
+  put_bits (w, 0x67, 8);
+  put_bits (w, 100, 8);
+  put_bits (w, 0, 8);
+  put_bits (w, 41, 8);
+  put_ue (w, 0);
+  put_ue (w, 1);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_bits (w, 0, 2);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_ue (w, 2);
+  put_ue (w, 2);
+  put_bits (w, 0, 1);
+  put_ue (w, WIDTH / 16 - 1);
+  put_ue (w, padded_height / 16 - 1);
+  put_bits (w, 1, 1);
+  put_bits (w, 1, 1);
+  put_bits (w, 1, 1);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_ue (w, (padded_height - HEIGHT) / 2);
+  put_bits (w, 0, 1);
+
+  return finish_nal (w, 0);
+}
+
+// Main profile at level 4.1, with the height cropped
+static GBytes *
+make_h265_sps (BitWriter * w)
+{
+  guint padded_height = GST_ROUND_UP_8 (HEIGHT);
+
+  put_bits (w, 33 << 1, 8);
+  put_bits (w, 1, 8);
+  put_bits (w, 0, 4);
+  put_bits (w, 0, 3);
+  put_bits (w, 1, 1);
+  put_bits (w, 1, 8);
+  put_bits (w, 0x60000000, 32);
+  put_bits (w, 0x9, 4);
+  put_bits (w, 0, 32);
+  put_bits (w, 0, 12);
+  put_bits (w, 123, 8);
+  put_ue (w, 0);
+  put_ue (w, 1);
+  put_ue (w, GST_ROUND_UP_8 (WIDTH));
+  put_ue (w, padded_height);
+  put_bits (w, padded_height != HEIGHT, 1);
+  if (padded_height != HEIGHT) {
+    put_ue (w, 0);
+    put_ue (w, 0);
+    put_ue (w, 0);
+    put_ue (w, (padded_height - HEIGHT) / 2);
+  }
+  put_ue (w, 0);
+  put_ue (w, 0);
+
+  return finish_nal (w, 0);
+}
+
+// The stand-in only looks at the type of the VPS and
+// PPS, they're here for the layout of codec_data
+static GBytes *
+make_parameter_set (BitWriter * w, Codec codec, guint type)
+{
+  if (codec == CODEC_H264) {
+    put_bits (w, 0x60 | type, 8);
+  } else {
+    put_bits (w, type << 1, 8);
+    put_bits (w, 1, 8);
+  }
+  put_ue (w, 0);
+  put_ue (w, 0);
+
+  return finish_nal (w, 0);
+}
+
+// An IDR picture and then P pictures, so nothing is reordered
+static GBytes *
+make_slice (BitWriter * w, Codec codec, guint index)
+{
+  if (codec == CODEC_H264) {
+    put_bits (w, 0x60 | (index == 0 ? 5 : 1), 8);
+    put_ue (w, 0);
+    put_ue (w, index == 0 ? 7 : 5);
+    put_ue (w, 0);
+  } else {
+    // IDR_W_RADL or TRAIL_R
+    put_bits (w, (index == 0 ? 19 : 1) << 1, 8);
+    put_bits (w, 1, 8);
+    put_bits (w, 1, 1);
+    put_ue (w, 0);
+  }
+
+  return finish_nal (w, SLICE_SIZE);
+}
+
+static Stream *
+make_stream (Codec codec)
+{
+  Stream *stream = g_new0 (Stream, 1);
+  BitWriter writer = { g_byte_array_new (), 0, 0 };
+  guint i;
+
+  stream->codec = codec;
+  stream->parameter_sets =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+  stream->slices =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+
+  if (codec == CODEC_H264) {
+    g_ptr_array_add (stream->parameter_sets, make_h264_sps (&writer));
+    g_ptr_array_add (stream->parameter_sets,
+        make_parameter_set (&writer, codec, 8));
+  } else {
+    g_ptr_array_add (stream->parameter_sets,
+        make_parameter_set (&writer, codec, 32));
+    g_ptr_array_add (stream->parameter_sets, make_h265_sps (&writer));
+    g_ptr_array_add (stream->parameter_sets,
+        make_parameter_set (&writer, codec, 34));
+  }
+
+  for (i = 0; i < NUM_FRAMES; i++)
+    g_ptr_array_add (stream->slices, make_slice (&writer, codec, i));
+
+  g_byte_array_free (writer.bytes, TRUE);
+
+  return stream;
+}
+
+static void
+free_stream (Stream * stream)
+{
+  g_ptr_array_unref (stream->parameter_sets);
+  g_ptr_array_unref (stream->slices);
+  g_free (stream);
+}
+
+static void
+append_nal (GByteArray * au, GBytes * nal, guint nal_length_size)
+{
+  static const guint8 start_code[] = { 0, 0, 0, 1 };
+  gsize size = g_bytes_get_size (nal);
+  guint8 length[4];
+  guint i;
+
+  if (!nal_length_size) {
+    g_byte_array_append (au, start_code, sizeof (start_code));
+  } else {
+    for (i = 0; i < nal_length_size; i++)
+      length[i] = size >> (8 * (nal_length_size - 1 - i));
+    g_byte_array_append (au, length, nal_length_size);
+  }
+  g_byte_array_append (au, g_bytes_get_data (nal, NULL), size);
+}
+
+static GstBuffer *
+wrap_access_unit (GByteArray * au, guint index)
+{
+  GstBuffer *buffer;
+
+  buffer = gst_buffer_new_wrapped (au->data, au->len);
+  g_byte_array_free (au, FALSE);
+  GST_BUFFER_PTS (buffer) = index * FRAME_DURATION;
+  GST_BUFFER_DURATION (buffer) = FRAME_DURATION;
+  if (index)
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  return buffer;
+}
+
+// Byte-stream with the parameter sets in band, or length prefixed
+// without them. With truncate, two frames end in a NAL whose length
+// runs past the end of the frame or is itself cut short
+static GPtrArray *
+make_access_units (const Stream * stream, guint nal_length_size,
+    gboolean truncate)
+{
+  static const guint8 short_nal[10] = { 0x55, };
+  GPtrArray *buffers =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+  GByteArray *au;
+  guint8 length[4];
+  guint i, j;
+
+  for (i = 0; i < NUM_FRAMES; i++) {
+    au = g_byte_array_new ();
+    if (i == 0 && !nal_length_size) {
+      for (j = 0; j < stream->parameter_sets->len; j++)
+        append_nal (au, g_ptr_array_index (stream->parameter_sets, j), 0);
+    }
+    append_nal (au, g_ptr_array_index (stream->slices, i), nal_length_size);
+
+    if (truncate && i == TRUNCATED_LENGTH_FRAME) {
+      for (j = 0; j < nal_length_size; j++)
+        length[j] = j == nal_length_size - 1 ? 0xff : 0;
+      g_byte_array_append (au, length, nal_length_size);
+      g_byte_array_append (au, short_nal, sizeof (short_nal));
+    } else if (truncate && i == TRUNCATED_PREFIX_FRAME) {
+      memset (length, 0, sizeof (length));
+      g_byte_array_append (au, length, nal_length_size - 1);
+    }
+
+    g_ptr_array_add (buffers, wrap_access_unit (au, i));
+  }
+
+  return buffers;
+}
+
+static void
+append_uint16 (GByteArray * data, guint value)
+{
+  guint8 bytes[2] = { value >> 8, value & 0xff };
+
+  g_byte_array_append (data, bytes, sizeof (bytes));
+}
+
+static void
+append_parameter_set (GByteArray * data, GBytes * nal)
+{
+  gsize size;
+  gconstpointer bytes = g_bytes_get_data (nal, &size);
+
+  append_uint16 (data, size);
+  g_byte_array_append (data, bytes, size);
+}
+
+// AVCDecoderConfigurationRecord or HEVCDecoderConfigurationRecord,
+// cut short by truncate bytes
+static GstBuffer *
+make_codec_data (const Stream * stream, guint nal_length_size,
+    guint truncate)
+{
+  GByteArray *data = g_byte_array_new ();
+  guint8 header[23] = { 1, };
+  guint i, size;
+
+  if (stream->codec == CODEC_H264) {
+    header[1] = 100;
+    header[3] = 41;
+    header[4] = 0xfc | (nal_length_size - 1);
+    header[5] = 0xe0 | 1;
+    g_byte_array_append (data, header, 6);
+    append_parameter_set (data, g_ptr_array_index (stream->parameter_sets,
+            0));
+    // One PPS
+    g_byte_array_append (data, header, 1);
+    append_parameter_set (data, g_ptr_array_index (stream->parameter_sets,
+            1));
+  } else {
+    header[1] = 1;
+    header[12] = 123;
+    header[21] = 0x0c | (nal_length_size - 1);
+    header[22] = stream->parameter_sets->len;
+    g_byte_array_append (data, header, sizeof (header));
+    for (i = 0; i < stream->parameter_sets->len; i++) {
+      GBytes *nal = g_ptr_array_index (stream->parameter_sets, i);
+      guint8 type = 0x80 | ((((const guint8 *) g_bytes_get_data (nal,
+                      NULL))[0] >> 1) & 0x3f);
+
+      g_byte_array_append (data, &type, 1);
+      append_uint16 (data, 1);
+      append_parameter_set (data, nal);
+    }
+  }
+
+  size = data->len - truncate;
+
+  return gst_buffer_new_wrapped (g_byte_array_free (data, FALSE), size);
+}
+
+static GstCaps *
+make_caps (Codec codec, GstBuffer * codec_data)
+{
+  GstCaps *caps;
+
+  caps = gst_caps_new_simple (codec == CODEC_H264 ? "video/x-h264"
+      : "video/x-h265", "alignment", G_TYPE_STRING, "au", "width",
+      G_TYPE_INT, WIDTH, "height", G_TYPE_INT, HEIGHT, "framerate",
+      GST_TYPE_FRACTION, 30, 1, NULL);
+
+  if (!codec_data) {
+    gst_caps_set_simple (caps, "stream-format", G_TYPE_STRING, "byte-stream",
+        NULL);
+  } else {
+    gst_caps_set_simple (caps, "stream-format", G_TYPE_STRING,
+        codec == CODEC_H264 ? "avc" : "hvc1", "codec_data", GST_TYPE_BUFFER,
+        codec_data, NULL);
+  }
+
+  return caps;
+}
+
+// The samples that came out, or NULL if the pipeline failed
+static GPtrArray *
+decode (GstCaps * caps, GPtrArray * buffers)
+{
+  GstElement *pipeline, *src, *sink;
+  GPtrArray *samples = NULL;
+  GstSample *sample;
+  GstMessage *message;
+  GError *error = NULL;
+  GstBus *bus;
+  guint i;
+
+  pipeline = gst_parse_launch ("appsrc name=src format=time ! nvdec ! "
+      "video/x-raw,format=NV12 ! appsink name=sink sync=false", &error);
+  g_assert_no_error (error);
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+
+  gst_app_src_set_caps (GST_APP_SRC (src), caps);
+  for (i = 0; i < buffers->len; i++)
+    g_assert_cmpint (gst_app_src_push_buffer (GST_APP_SRC (src),
+            gst_buffer_ref (g_ptr_array_index (buffers, i))), ==,
+        GST_FLOW_OK);
+  gst_app_src_end_of_stream (GST_APP_SRC (src));
+
+  g_assert_cmpint (gst_element_set_state (pipeline, GST_STATE_PLAYING), !=,
+      GST_STATE_CHANGE_FAILURE);
+
+  bus = gst_element_get_bus (pipeline);
+  message = gst_bus_timed_pop_filtered (bus, 10 * GST_SECOND,
+      GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
+  g_assert_nonnull (message);
+
+  if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS) {
+    samples = g_ptr_array_new_with_free_func ((GDestroyNotify)
+        gst_sample_unref);
+    while ((sample = gst_app_sink_try_pull_sample (GST_APP_SINK (sink), 0)))
+      g_ptr_array_add (samples, sample);
+  }
+  gst_message_unref (message);
+  gst_object_unref (bus);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (src);
+  gst_object_unref (pipeline);
+
+  return samples;
+}
+
+static void
+compare_samples (GPtrArray * samples, GPtrArray * expected)
+{
+  GstBuffer *buffer, *expected_buffer;
+  GstMapInfo map, expected_map;
+  guint i;
+
+  g_assert_nonnull (samples);
+  g_assert_cmpuint (samples->len, ==, expected->len);
+
+  for (i = 0; i < samples->len; i++) {
+    g_assert_true (gst_caps_is_equal (gst_sample_get_caps
+            (g_ptr_array_index (samples, i)),
+            gst_sample_get_caps (g_ptr_array_index (expected, i))));
+
+    buffer = gst_sample_get_buffer (g_ptr_array_index (samples, i));
+    expected_buffer = gst_sample_get_buffer (g_ptr_array_index (expected, i));
+    g_assert_cmpuint (GST_BUFFER_PTS (buffer), ==,
+        GST_BUFFER_PTS (expected_buffer));
+
+    g_assert_true (gst_buffer_map (buffer, &map, GST_MAP_READ));
+    g_assert_true (gst_buffer_map (expected_buffer, &expected_map,
+            GST_MAP_READ));
+    g_assert_cmpmem (map.data, map.size, expected_map.data,
+        expected_map.size);
+    gst_buffer_unmap (expected_buffer, &expected_map);
+    gst_buffer_unmap (buffer, &map);
+  }
+}
+
+static GPtrArray *
+decode_byte_stream (const Stream * stream)
+{
+  GPtrArray *buffers = make_access_units (stream, 0, FALSE);
+  GstCaps *caps = make_caps (stream->codec, NULL);
+  GPtrArray *samples = decode (caps, buffers);
+
+  gst_caps_unref (caps);
+  g_ptr_array_unref (buffers);
+  g_assert_nonnull (samples);
+  g_assert_cmpuint (samples->len, ==, NUM_FRAMES);
+
+  return samples;
+}
+
+static GPtrArray *
+decode_length_prefixed (const Stream * stream, guint nal_length_size,
+    guint truncate_codec_data, gboolean truncate_frames)
+{
+  GPtrArray *buffers = make_access_units (stream, nal_length_size,
+      truncate_frames);
+  GstBuffer *codec_data = make_codec_data (stream, nal_length_size,
+      truncate_codec_data);
+  GstCaps *caps = make_caps (stream->codec, codec_data);
+  GPtrArray *samples = decode (caps, buffers);
+
+  gst_caps_unref (caps);
+  gst_buffer_unref (codec_data);
+  g_ptr_array_unref (buffers);
+
+  return samples;
+}
+
+static void
+test_length_prefixed (gconstpointer data)
+{
+  const Case *c = data;
+  Stream *stream = make_stream (c->codec);
+  GPtrArray *expected = decode_byte_stream (stream);
+  GPtrArray *samples;
+
+  samples = decode_length_prefixed (stream, c->nal_length_size, 0, FALSE);
+  compare_samples (samples, expected);
+  g_ptr_array_unref (samples);
+
+  g_ptr_array_unref (expected);
+  free_stream (stream);
+}
+
+static void
+test_truncated_nal_length (gconstpointer data)
+{
+  const Case *c = data;
+  Stream *stream = make_stream (c->codec);
+  GPtrArray *expected = decode_byte_stream (stream);
+  GPtrArray *samples;
+
+  samples = decode_length_prefixed (stream, c->nal_length_size, 0, TRUE);
+  compare_samples (samples, expected);
+  g_ptr_array_unref (samples);
+
+  g_ptr_array_unref (expected);
+  free_stream (stream);
+}
+
+static void
+test_truncated_codec_data (gconstpointer data)
+{
+  const Case *c = data;
+  Stream *stream = make_stream (c->codec);
+  GPtrArray *samples;
+  guint truncate;
+
+  // Into the PPS and then into its length
+  for (truncate = 1; truncate <= 4; truncate++) {
+    samples = decode_length_prefixed (stream, c->nal_length_size, truncate,
+        FALSE);
+    g_assert_null (samples);
+  }
+
+  free_stream (stream);
+}
+
+static const Case cases[] = {
+  {"avc/1", CODEC_H264, 1},
+  {"avc/2", CODEC_H264, 2},
+  {"avc/4", CODEC_H264, 4},
+  {"hvc1/1", CODEC_H265, 1},
+  {"hvc1/2", CODEC_H265, 2},
+  {"hvc1/4", CODEC_H265, 4},
+};
+
+int
+main (int argc, char *argv[])
+{
+  gchar *path;
+  guint i;
+
+  // Read when the first CUDA call is made
+  g_setenv ("GST_NVDEC_BACKEND", "fake", TRUE);
+
+  gst_init (&argc, &argv);
+  g_test_init (&argc, &argv, NULL);
+  GST_PLUGIN_STATIC_REGISTER (nvidia);
+
+  for (i = 0; i < G_N_ELEMENTS (cases); i++) {
+    path = g_strdup_printf ("/codec-data/%s", cases[i].name);
+    g_test_add_data_func (path, &cases[i], test_length_prefixed);
+    g_free (path);
+
+    path = g_strdup_printf ("/codec-data/%s/truncated-nal-length",
+        cases[i].name);
+    g_test_add_data_func (path, &cases[i], test_truncated_nal_length);
+    g_free (path);
+
+    path = g_strdup_printf ("/codec-data/%s/truncated-codec-data",
+        cases[i].name);
+    g_test_add_data_func (path, &cases[i], test_truncated_codec_data);
+    g_free (path);
+  }
+
+  return g_test_run ();
+}
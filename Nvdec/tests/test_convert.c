@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Checks the NV12 conversions against a per-pixel reference written
+// straight from the BT.601 and BT.709 equations, I420 is a copy so
+// it has to come out the same whatever the matrix. Runs on the stand-in
+// backend, which runs the conversion kernels on the CPU, so the
+// "device" buffers here are host memory
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <string.h>
+
+#include "gstnvdecconvert.h"
+#include "gstnvdecloader.h"
+
+// Odd sizes so the last column and row have no neighbour in their
+// chroma sample, both pitches with padding the kernels must skip
+#define WIDTH 35
+#define HEIGHT 21
+#define SRC_PITCH 64
+#define SRC_HEIGHT 24
+#define DST_PADDING 8
+#define FILL 0xa5
+
+typedef struct
+{
+  const gchar *name;
+  guint matrix_coefficients;
+  gfloat kr, kb;
+  gboolean full_range;
+} Matrix;
+
+typedef struct
+{
+  const gchar *name;
+  GstNvDecConvertFormat format;
+  guint num_planes;
+  // Bytes per pixel of the first plane
+  guint step;
+} Format;
+
+typedef struct
+{
+  const Matrix *matrix;
+  const Format *format;
+} Case;
+
+static const Matrix matrices[] = {
+  {"bt601-limited", 6, 0.299f, 0.114f, FALSE},
+  {"bt601-full", 6, 0.299f, 0.114f, TRUE},
+  {"bt709-limited", 1, 0.2126f, 0.0722f, FALSE},
+  {"bt709-full", 1, 0.2126f, 0.0722f, TRUE},
+};
+
+static const Format formats[] = {
+  {"i420", GST_NVDEC_CONVERT_I420, 3, 1},
+  {"bgrx", GST_NVDEC_CONVERT_BGRX, 1, 4},
+  {"rgba", GST_NVDEC_CONVERT_RGBA, 1, 4},
+  {"gbr", GST_NVDEC_CONVERT_GBR, 3, 1},
+};
+
+static guint8
+to_u8 (gdouble v)
+{
+  return (guint8) CLAMP (v + 0.5, 0.0, 255.0);
+}
+
+// R'G'B' of one pixel, chroma is shared by each 2x2 block
+static void
+reference_rgb (const Matrix * m, const guint8 * src, guint x, guint y,
+    guint8 rgb[3])
+{
+  const guint8 *uv = src + SRC_PITCH * SRC_HEIGHT + (y / 2) * SRC_PITCH
+      + (x / 2) * 2;
+  gdouble luma, cb, cr, r, g, b;
+
+  if (m->full_range) {
+    luma = src[y * SRC_PITCH + x];
+    cb = uv[0] - 128.0;
+    cr = uv[1] - 128.0;
+  } else {
+    luma = (src[y * SRC_PITCH + x] - 16.0) * 255.0 / 219.0;
+    cb = (uv[0] - 128.0) * 255.0 / 224.0;
+    cr = (uv[1] - 128.0) * 255.0 / 224.0;
+  }
+
+  r = luma + 2.0 * (1.0 - m->kr) * cr;
+  b = luma + 2.0 * (1.0 - m->kb) * cb;
+  g = (luma - m->kr * r - m->kb * b) / (1.0 - m->kr - m->kb);
+
+  rgb[0] = to_u8 (r);
+  rgb[1] = to_u8 (g);
+  rgb[2] = to_u8 (b);
+}
+
+static void
+layout (const Format * format, gsize offset[3], gint stride[3], gsize * size)
+{
+  guint i;
+
+  *size = 0;
+  for (i = 0; i < 3; i++) {
+    offset[i] = *size;
+    stride[i] = 0;
+    if (i >= format->num_planes)
+      continue;
+    if (format->format == GST_NVDEC_CONVERT_I420 && i > 0) {
+      stride[i] = (WIDTH + 1) / 2 + DST_PADDING;
+      *size += stride[i] * ((HEIGHT + 1) / 2);
+    } else {
+      stride[i] = WIDTH * format->step + DST_PADDING;
+      *size += stride[i] * HEIGHT;
+    }
+  }
+}
+
+// Padding is left as filled, like everything outside the picture
+static void
+reference (const Case * c, const guint8 * src, guint8 * dst,
+    const gsize offset[3], const gint stride[3])
+{
+  const guint8 *uv = src + SRC_PITCH * SRC_HEIGHT;
+  guint8 rgb[3], *p;
+  guint x, y;
+
+  for (y = 0; y < HEIGHT; y++) {
+    for (x = 0; x < WIDTH; x++) {
+      if (c->format->format == GST_NVDEC_CONVERT_I420) {
+        dst[offset[0] + y * stride[0] + x] = src[y * SRC_PITCH + x];
+        dst[offset[1] + (y / 2) * stride[1] + x / 2] =
+            uv[(y / 2) * SRC_PITCH + (x / 2) * 2];
+        dst[offset[2] + (y / 2) * stride[2] + x / 2] =
+            uv[(y / 2) * SRC_PITCH + (x / 2) * 2 + 1];
+        continue;
+      }
+
+      reference_rgb (c->matrix, src, x, y, rgb);
+      switch (c->format->format) {
+        case GST_NVDEC_CONVERT_BGRX:
+          p = dst + y * stride[0] + x * 4;
+          p[0] = rgb[2];
+          p[1] = rgb[1];
+          p[2] = rgb[0];
+          p[3] = 255;
+          break;
+        case GST_NVDEC_CONVERT_RGBA:
+          p = dst + y * stride[0] + x * 4;
+          p[0] = rgb[0];
+          p[1] = rgb[1];
+          p[2] = rgb[2];
+          p[3] = 255;
+          break;
+        default:
+          dst[offset[0] + y * stride[0] + x] = rgb[1];
+          dst[offset[1] + y * stride[1] + x] = rgb[2];
+          dst[offset[2] + y * stride[2] + x] = rgb[0];
+          break;
+      }
+    }
+  }
+}
+
+static void
+test_convert (gconstpointer data)
+{
+  const Case *c = data;
+  GstNvDecCudaContext *cuda_context;
+  GstNvDecColorMatrix matrix;
+  GRand *rand = g_rand_new_with_seed (c->format->format * 16
+      + c->matrix->matrix_coefficients * 2 + c->matrix->full_range);
+  gsize offset[3], size, i;
+  gint stride[3], tolerance;
+  guint8 *src, *dst, *expected;
+
+  // Random samples, and the extremes limited range streams
+  // aren't supposed to have but do
+  src = g_malloc (SRC_PITCH * SRC_HEIGHT * 3 / 2);
+  for (i = 0; i < SRC_PITCH * SRC_HEIGHT * 3 / 2; i++)
+    src[i] = g_rand_int_range (rand, 0, 256);
+  memset (src, 0, WIDTH);
+  memset (src + SRC_PITCH, 255, WIDTH);
+  memset (src + SRC_PITCH * SRC_HEIGHT, 0, WIDTH);
+  memset (src + SRC_PITCH * (SRC_HEIGHT + 1), 255, WIDTH);
+  g_rand_free (rand);
+
+  layout (c->format, offset, stride, &size);
+  dst = g_malloc (size);
+  expected = g_malloc (size);
+  memset (dst, FILL, size);
+  memset (expected, FILL, size);
+
+  gst_nvdec_color_matrix_init (&matrix, c->matrix->matrix_coefficients,
+      c->matrix->full_range, HEIGHT);
+  cuda_context = gst_nvdec_cuda_context_get (0);
+  g_assert_nonnull (cuda_context);
+  g_assert_true (cuda_OK (CuCtxPushCurrent (cuda_context->context)));
+  g_assert_true (gst_nvdec_convert_nv12 (cuda_context, c->format->format,
+          (CUdeviceptr) (guintptr) src, SRC_PITCH, SRC_HEIGHT, WIDTH, HEIGHT,
+          (CUdeviceptr) (guintptr) dst, offset, stride, &matrix, NULL));
+  CuCtxPopCurrent (NULL);
+  g_object_unref (cuda_context);
+  reference (c, src, expected, offset, stride);
+
+  // The kernels work in single precision, copies are exact
+  tolerance = c->format->format == GST_NVDEC_CONVERT_I420 ? 0 : 1;
+  for (i = 0; i < size; i++) {
+    if (ABS (dst[i] - expected[i]) > tolerance)
+      g_error ("byte %" G_GSIZE_FORMAT " is %u, expected %u", i, dst[i],
+          expected[i]);
+  }
+
+  g_free (expected);
+  g_free (dst);
+  g_free (src);
+}
+
+int
+main (int argc, char *argv[])
+{
+  Case *c;
+  gchar *path;
+  guint f, m;
+
+  // Read when the first CUDA call is made
+  g_setenv ("GST_NVDEC_BACKEND", "fake", TRUE);
+
+  gst_init (&argc, &argv);
+  g_test_init (&argc, &argv, NULL);
+  g_assert_true (gst_nvdec_loader_is_fake ());
+
+  for (f = 0; f < G_N_ELEMENTS (formats); f++) {
+    for (m = 0; m < G_N_ELEMENTS (matrices); m++) {
+      c = g_new (Case, 1);
+      c->format = &formats[f];
+      c->matrix = &matrices[m];
+      path = g_strdup_printf ("/convert/%s/%s", formats[f].name,
+          matrices[m].name);
+      g_test_add_data_func_full (path, c, test_convert, g_free);
+      g_free (path);
+    }
+  }
+
+  return g_test_run ();
+}
@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2017 Ericsson AB. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer
+ *    in the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Decodes to memory:NvDecCUDAMemory on the stand-in backend and checks the
+// output buffers are device memory laid out like the negotiated caps
+// say. The stand-in fills its surfaces with a pattern, the frames are
+// downloaded through the memory's host mapping to compare against it
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <gst/app/gstapp.h>
+#include <gst/video/video.h>
+#include <string.h>
+
+#include "gstcudamemory.h"
+
+// Not a multiple of 16, so the decoder crops the coded picture
+#define WIDTH 320
+#define HEIGHT 180
+#define NUM_FRAMES 8
+#define FRAME_DURATION (GST_SECOND / 30)
+
+GST_PLUGIN_STATIC_DECLARE (nvidia);
+
+typedef struct
+{
+  GByteArray *bytes;
+  guint value;
+  guint num_bits;
+} BitWriter;
+
+static void
+put_bits (BitWriter * writer, guint value, guint n)
+{
+  while (n--) {
+    writer->value = (writer->value << 1) | ((value >> n) & 1);
+    if (++writer->num_bits == 8) {
+      guint8 byte = writer->value;
+
+      g_byte_array_append (writer->bytes, &byte, 1);
+      writer->value = 0;
+      writer->num_bits = 0;
+    }
+  }
+}
+
+static void
+put_ue (BitWriter * writer, guint value)
+{
+  guint len = g_bit_storage (value + 1);
+
+  put_bits (writer, 0, len - 1);
+  put_bits (writer, value + 1, len);
+}
+
+// Adds the trailing bits and the start code, nothing written
+// here needs emulation prevention
+static void
+append_nal (GByteArray * au, BitWriter * writer)
+{
+  static const guint8 start_code[] = { 0, 0, 0, 1 };
+
+  put_bits (writer, 1, 1);
+  if (writer->num_bits)
+    put_bits (writer, 0, 8 - writer->num_bits);
+  g_byte_array_append (au, start_code, sizeof (start_code));
+  g_byte_array_append (au, writer->bytes->data, writer->bytes->len);
+  g_byte_array_set_size (writer->bytes, 0);
+}
+
+// Only as much of the SPS as the stand-in's parser reads,
+// High profile at level 4.1 with the height cropped
+static void
+append_sps (GByteArray * au, BitWriter * w)
+{
+  guint padded_height = GST_ROUND_UP_16 (HEIGHT);
+
+  put_bits (w, 0x67, 8);
+  put_bits (w, 100, 8);
+  put_bits (w, 0, 8);
+  put_bits (w, 41, 8);
+  put_ue (w, 0);
+  put_ue (w, 1);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_bits (w, 0, 2);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_ue (w, 2);
+  put_ue (w, 2);
+  put_bits (w, 0, 1);
+  put_ue (w, WIDTH / 16 - 1);
+  put_ue (w, padded_height / 16 - 1);
+  put_bits (w, 1, 1);
+  put_bits (w, 1, 1);
+  put_bits (w, 1, 1);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_ue (w, 0);
+  put_ue (w, (padded_height - HEIGHT) / 2);
+  put_bits (w, 0, 1);
+  append_nal (au, w);
+}
+
+// An IDR picture and then P pictures, so nothing is reordered
+static GstBuffer *
+make_access_unit (guint index, BitWriter * w)
+{
+  GByteArray *au = g_byte_array_new ();
+  GstBuffer *buffer;
+  gsize start;
+
+  if (index == 0)
+    append_sps (au, w);
+
+  put_bits (w, 0x60 | (index == 0 ? 5 : 1), 8);
+  put_ue (w, 0);
+  put_ue (w, index == 0 ? 7 : 5);
+  put_ue (w, 0);
+  append_nal (au, w);
+
+  // Filler standing in for the coded picture
+  start = au->len;
+  g_byte_array_set_size (au, start + 64);
+  memset (au->data + start, 0x55, 64);
+
+  buffer = gst_buffer_new_wrapped (au->data, au->len);
+  g_byte_array_free (au, FALSE);
+  GST_BUFFER_PTS (buffer) = index * FRAME_DURATION;
+  GST_BUFFER_DURATION (buffer) = FRAME_DURATION;
+  if (index)
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  return buffer;
+}
+
+static void
+check_frame (GstBuffer * buffer, GstVideoInfo * info)
+{
+  GstVideoMeta *meta = gst_buffer_get_video_meta (buffer);
+  GstMemory *mem;
+  GstVideoFrame frame;
+  const guint8 *data;
+  guint x, y, i;
+  gint stride;
+
+  g_assert_cmpuint (gst_buffer_n_memory (buffer), ==, 1);
+  mem = gst_buffer_peek_memory (buffer, 0);
+  g_assert_true (gst_is_nvdec_cuda_memory (mem));
+  g_assert_cmpuint (((GstNvDecCudaMemory *) mem)->data, !=, 0);
+  g_assert_cmpuint (gst_buffer_get_size (buffer), >=, info->size);
+
+  // Downstream didn't ask for the meta, so if it's
+  // there it has to describe the default layout
+  if (meta) {
+    g_assert_cmpuint (meta->n_planes, ==, GST_VIDEO_INFO_N_PLANES (info));
+    for (i = 0; i < meta->n_planes; i++) {
+      g_assert_cmpuint (meta->offset[i], ==,
+          GST_VIDEO_INFO_PLANE_OFFSET (info, i));
+      g_assert_cmpint (meta->stride[i], ==,
+          GST_VIDEO_INFO_PLANE_STRIDE (info, i));
+    }
+  }
+
+  g_assert_true (gst_video_frame_map (&frame, info, buffer, GST_MAP_READ));
+
+  data = GST_VIDEO_FRAME_PLANE_DATA (&frame, 0);
+  stride = GST_VIDEO_FRAME_PLANE_STRIDE (&frame, 0);
+  for (y = 0; y < HEIGHT; y++)
+    for (x = 0; x < WIDTH; x++)
+      g_assert_cmpuint (data[y * stride + x], ==, (guint8) (x + y));
+
+  data = GST_VIDEO_FRAME_PLANE_DATA (&frame, 1);
+  stride = GST_VIDEO_FRAME_PLANE_STRIDE (&frame, 1);
+  for (y = 0; y < HEIGHT / 2; y++)
+    for (x = 0; x < WIDTH; x++)
+      g_assert_cmpuint (data[y * stride + x], ==, (guint8) ((x + y) ^ 0x80));
+
+  gst_video_frame_unmap (&frame);
+}
+
+static void
+test_cuda_output (void)
+{
+  GstElement *pipeline, *src, *sink;
+  GstCapsFeatures *features;
+  GstSample *sample;
+  GstVideoInfo info;
+  BitWriter writer = { g_byte_array_new (), 0, 0 };
+  GError *error = NULL;
+  GstCaps *caps;
+  guint i;
+
+  pipeline = gst_parse_launch ("appsrc name=src format=time ! nvdec ! "
+      "video/x-raw(" GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY "),format=NV12 ! "
+      "appsink name=sink sync=false", &error);
+  g_assert_no_error (error);
+  src = gst_bin_get_by_name (GST_BIN (pipeline), "src");
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+
+  caps = gst_caps_new_simple ("video/x-h264", "stream-format", G_TYPE_STRING,
+      "byte-stream", "alignment", G_TYPE_STRING, "au", "width", G_TYPE_INT,
+      WIDTH, "height", G_TYPE_INT, HEIGHT, "framerate", GST_TYPE_FRACTION, 30,
+      1, NULL);
+  gst_app_src_set_caps (GST_APP_SRC (src), caps);
+  gst_caps_unref (caps);
+
+  for (i = 0; i < NUM_FRAMES; i++)
+    g_assert_cmpint (gst_app_src_push_buffer (GST_APP_SRC (src),
+            make_access_unit (i, &writer)), ==, GST_FLOW_OK);
+  gst_app_src_end_of_stream (GST_APP_SRC (src));
+  g_byte_array_free (writer.bytes, TRUE);
+
+  g_assert_cmpint (gst_element_set_state (pipeline, GST_STATE_PLAYING), !=,
+      GST_STATE_CHANGE_FAILURE);
+
+  for (i = 0; (sample = gst_app_sink_pull_sample (GST_APP_SINK (sink))); i++) {
+    caps = gst_sample_get_caps (sample);
+    features = gst_caps_get_features (caps, 0);
+    g_assert_true (gst_caps_features_contains (features,
+            GST_CAPS_FEATURE_MEMORY_NVDEC_CUDA_MEMORY));
+    g_assert_true (gst_video_info_from_caps (&info, caps));
+    g_assert_cmpint (GST_VIDEO_INFO_FORMAT (&info), ==, GST_VIDEO_FORMAT_NV12);
+    g_assert_cmpint (GST_VIDEO_INFO_WIDTH (&info), ==, WIDTH);
+    g_assert_cmpint (GST_VIDEO_INFO_HEIGHT (&info), ==, HEIGHT);
+
+    check_frame (gst_sample_get_buffer (sample), &info);
+    gst_sample_unref (sample);
+  }
+  g_assert_true (gst_app_sink_is_eos (GST_APP_SINK (sink)));
+  g_assert_cmpuint (i, ==, NUM_FRAMES);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (sink);
+  gst_object_unref (src);
+  gst_object_unref (pipeline);
+}
+
+int
+main (int argc, char *argv[])
+{
+  // Read when the first CUDA call is made
+  g_setenv ("GST_NVDEC_BACKEND", "fake", TRUE);
+
+  gst_init (&argc, &argv);
+  g_test_init (&argc, &argv, NULL);
+  GST_PLUGIN_STATIC_REGISTER (nvidia);
+
+  g_test_add_func ("/nvdec/cuda-output", test_cuda_output);
+
+  return g_test_run ();
+}